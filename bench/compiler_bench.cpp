@@ -0,0 +1,265 @@
+// hydro_bench: throughput of each compiler phase and the runtime of the executables it produces, on synthetic programs of every shape in
+// program_generator.hpp. Built with -DHYDRO_BUILD_BENCHMARKS=ON (needs Google Benchmark).
+//   hydro_bench [--shapes=deep,lets,...] [--size=N] [--depth=N] [Google Benchmark flags, e.g. --benchmark_filter=Parse]
+// Every benchmark is named <Phase>/<shape>[/O<level>]. Bytes per second is source bytes, the tokens and nodes counters are per second too,
+// so numbers stay comparable when --size changes. Lexing is measured on its own with Tokenizer::tokenize, the Parse numbers include it
+// because the parser pulls its tokens from the tokenizer as it goes.
+
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../src/driver.hpp"
+#include "./program_generator.hpp"
+
+extern char** environ;
+
+namespace {
+
+struct BenchProgram {
+  std::string name;
+  std::string source;
+  std::string path; // the source written out, for the benchmarks that go through compile_file
+};
+
+std::filesystem::path g_work_dir;
+
+void set_rates(benchmark::State& state, const BenchProgram& program, size_t tokens, size_t nodes)
+{
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * program.source.size()));
+  if (tokens != 0) {
+    state.counters["tokens"] = benchmark::Counter(static_cast<double>(tokens), benchmark::Counter::kIsIterationInvariantRate);
+  }
+  if (nodes != 0) {
+    state.counters["nodes"] = benchmark::Counter(static_cast<double>(nodes), benchmark::Counter::kIsIterationInvariantRate);
+  }
+}
+
+void bench_tokenize(benchmark::State& state, const BenchProgram& program)
+{
+  size_t tokens = 0;
+  for (auto _ : state) {
+    Interner interner;
+    std::vector<Token> result = Tokenizer(program.source, interner).tokenize();
+    tokens = result.size();
+    benchmark::DoNotOptimize(result.data());
+  }
+  set_rates(state, program, tokens, 0);
+}
+
+void bench_parse(benchmark::State& state, const BenchProgram& program)
+{
+  size_t tokens = 0;
+  size_t nodes = 0;
+  for (auto _ : state) {
+    Interner interner;
+    Tokenizer tokenizer(program.source, interner);
+    Parser parser { TokenStream(tokenizer) };
+    std::optional<NodeProg> prog = parser.parse_prog();
+    tokens = parser.token_count();
+    nodes = prog->nodes.size();
+    benchmark::DoNotOptimize(prog->nodes.data());
+  }
+  set_rates(state, program, tokens, nodes);
+}
+
+// Code generation from the inlined, folded and pruned AST, -O0 / -O1 straight from the tree, -O2 through the IR pipeline
+void bench_codegen(benchmark::State& state, const BenchProgram& program, int opt_level)
+{
+  Interner interner;
+  Tokenizer tokenizer(program.source, interner);
+  Parser parser { TokenStream(tokenizer) };
+  std::optional<NodeProg> prog = parser.parse_prog();
+  Inliner(prog.value(), interner).run();
+  ConstantFolder(prog.value()).run();
+  DeadCodeEliminator(prog.value(), interner).run();
+  for (auto _ : state) {
+    AsmBuffer assembly;
+    if (opt_level >= 2) {
+      IrModule module = IrLowering(prog.value(), interner).lower();
+      for (IrFunction& function : module.functions) {
+        build_ssa(function);
+        simplify_ssa(function);
+        if (optimize_loops(function) > 0) {
+          simplify_ssa(function);
+        }
+        destruct_ssa(function);
+      }
+      assembly = IrEmitter(module, interner).emit();
+    }
+    else {
+      assembly = Generator(prog.value(), interner, { .opt_level = opt_level }).gen_prog();
+    }
+    benchmark::DoNotOptimize(assembly.view().data());
+  }
+  set_rates(state, program, 0, prog->nodes.size());
+}
+
+void bench_assemble(benchmark::State& state, const BenchProgram& program)
+{
+  Interner interner;
+  Tokenizer tokenizer(program.source, interner);
+  Parser parser { TokenStream(tokenizer) };
+  std::optional<NodeProg> prog = parser.parse_prog();
+  Inliner(prog.value(), interner).run();
+  ConstantFolder(prog.value()).run();
+  DeadCodeEliminator(prog.value(), interner).run();
+  AsmBuffer assembly = Generator(prog.value(), interner).gen_prog();
+  for (auto _ : state) {
+    Assembler assembler(assembly.view());
+    assembler.assemble();
+    ElfLayout layout = elf_layout(assembler);
+    assembler.link(layout.text_address, layout.rodata_address, layout.data_address, layout.bss_address);
+    benchmark::DoNotOptimize(assembler.text().data());
+  }
+  set_rates(state, program, 0, 0);
+}
+
+// The whole of compile_file: read, parse, inline, fold, generate, assemble and write the executable
+void bench_compile(benchmark::State& state, const BenchProgram& program, int opt_level)
+{
+  std::string output = (g_work_dir / (program.name + "-compile")).string();
+  CompileOptions options;
+  options.codegen.opt_level = opt_level;
+  for (auto _ : state) {
+    compile_file(program.path, output, options);
+  }
+  set_rates(state, program, 0, 0);
+}
+
+// Run the executable built at `opt_level`, its output goes to /dev/null
+void bench_run(benchmark::State& state, const BenchProgram& program, int opt_level)
+{
+  std::string executable = (g_work_dir / (program.name + "-O" + std::to_string(opt_level))).string();
+  CompileOptions options;
+  options.codegen.opt_level = opt_level;
+  compile_file(program.path, executable, options);
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  char* argv[] = { executable.data(), nullptr };
+  for (auto _ : state) {
+    pid_t pid = 0;
+    int status = 0;
+    if (posix_spawn(&pid, executable.c_str(), &actions, nullptr, argv, environ) != 0 || waitpid(pid, &status, 0) != pid) {
+      state.SkipWithError("could not run the executable");
+      break;
+    }
+  }
+  posix_spawn_file_actions_destroy(&actions);
+}
+
+// Wrap a benchmark so a compile error in a generated program shows up as that benchmark's error instead of stopping the run
+template <typename F>
+auto guarded(F body)
+{
+  return [body](benchmark::State& state) {
+    try {
+      body(state);
+    }
+    catch (const std::exception& error) {
+      state.SkipWithError(error.what());
+    }
+  };
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  benchmark::Initialize(&argc, argv);
+
+  std::vector<ProgramShape> shapes;
+  for (const auto& [name, shape] : program_shapes) {
+    shapes.push_back(shape);
+  }
+  ProgramSpec spec { .size = 2000 };
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    auto number = [&](std::string_view text, uint32_t& value) {
+      auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+      return !text.empty() && ec == std::errc() && end == text.data() + text.size() && value > 0;
+    };
+    bool ok = true;
+    if (arg.starts_with("--shapes=")) {
+      shapes.clear();
+      std::string_view list = arg.substr(9);
+      while (ok && !list.empty()) {
+        std::string_view name = list.substr(0, list.find(','));
+        list.remove_prefix(std::min(list.size(), name.size() + 1));
+        std::optional<ProgramShape> shape = parse_program_shape(name);
+        ok = shape.has_value();
+        if (ok) {
+          shapes.push_back(shape.value());
+        }
+      }
+    }
+    else if (arg.starts_with("--size=")) {
+      ok = number(arg.substr(7), spec.size);
+    }
+    else if (arg.starts_with("--depth=")) {
+      ok = number(arg.substr(8), spec.depth);
+    }
+    else {
+      ok = false;
+    }
+    if (!ok) {
+      std::cerr << "Unknown or invalid argument " << arg << std::endl;
+      std::cerr << "hydro_bench [--shapes=deep,lets,functions,ifs,strings,loops,mixed] [--size=N] [--depth=N] [benchmark flags]"
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  g_work_dir = std::filesystem::temp_directory_path() / ("hydro_bench." + std::to_string(getpid()));
+  std::filesystem::create_directories(g_work_dir);
+
+  std::vector<std::unique_ptr<BenchProgram>> programs;
+  for (ProgramShape shape : shapes) {
+    spec.shape = shape;
+    auto program = std::make_unique<BenchProgram>();
+    program->name = std::string(program_shape_name(shape));
+    program->source = generate_program(spec);
+    program->path = (g_work_dir / (program->name + ".hy")).string();
+    std::ofstream(program->path) << program->source;
+    const BenchProgram& p = *program;
+    programs.push_back(std::move(program));
+
+    benchmark::RegisterBenchmark(("Tokenize/" + p.name).c_str(), guarded([&p](auto& state) { bench_tokenize(state, p); }));
+    benchmark::RegisterBenchmark(("Parse/" + p.name).c_str(), guarded([&p](auto& state) { bench_parse(state, p); }));
+    for (int level = 0; level <= 2; level++) {
+      std::string suffix = "/" + p.name + "/O" + std::to_string(level);
+      benchmark::RegisterBenchmark(
+        ("Codegen" + suffix).c_str(), guarded([&p, level](auto& state) { bench_codegen(state, p, level); }));
+    }
+    benchmark::RegisterBenchmark(("Assemble/" + p.name).c_str(), guarded([&p](auto& state) { bench_assemble(state, p); }));
+    for (int level = 0; level <= 2; level++) {
+      std::string suffix = "/" + p.name + "/O" + std::to_string(level);
+      benchmark::RegisterBenchmark(
+        ("Compile" + suffix).c_str(), guarded([&p, level](auto& state) { bench_compile(state, p, level); }))
+        ->Unit(benchmark::kMillisecond);
+      // the time that matters is spent in the child process, which the CPU time of this one doesn't see
+      benchmark::RegisterBenchmark(("Run" + suffix).c_str(), guarded([&p, level](auto& state) { bench_run(state, p, level); }))
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime();
+    }
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  std::error_code error;
+  std::filesystem::remove_all(g_work_dir, error);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,46 @@
+// hydro_gen: write a synthetic program (see program_generator.hpp) to stdout, to look at it or to feed it to hydro by hand
+#include <charconv>
+#include <cstdlib>
+#include <iostream>
+#include <string_view>
+#include "./program_generator.hpp"
+
+static constexpr const char* usage = "hydro_gen <deep|lets|functions|ifs|strings|loops|mixed> <size> [--depth=N] [--seed=N]";
+
+template <typename T>
+static bool parse_number(std::string_view text, T& value)
+{
+  auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+  return !text.empty() && ec == std::errc() && end == text.data() + text.size();
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc < 3) {
+    std::cerr << usage << std::endl;
+    return EXIT_FAILURE;
+  }
+  ProgramSpec spec;
+  std::optional<ProgramShape> shape = parse_program_shape(argv[1]);
+  if (!shape.has_value() || !parse_number(argv[2], spec.size) || spec.size == 0) {
+    std::cerr << usage << std::endl;
+    return EXIT_FAILURE;
+  }
+  spec.shape = shape.value();
+  for (int i = 3; i < argc; i++) {
+    std::string_view arg = argv[i];
+    bool ok = false;
+    if (arg.starts_with("--depth=")) {
+      ok = parse_number(arg.substr(8), spec.depth);
+    }
+    else if (arg.starts_with("--seed=")) {
+      ok = parse_number(arg.substr(7), spec.seed);
+    }
+    if (!ok) {
+      std::cerr << usage << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  std::cout << generate_program(spec);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,237 @@
+// This file generates synthetic Hydro programs for the benchmarks, big enough to measure and shaped to stress one part of the compiler
+// at a time. Every program is valid, terminates and prints a few numbers, so the same text works for timing the compiler and for timing
+// the executable it produces. The output only depends on the spec (the random numbers come from a fixed splitmix64 sequence, not from
+// <random>, whose distributions differ between standard libraries), so a size means the same program on every machine.
+// Names are made of a per-shape letter and a number, so shapes can be concatenated (ProgramShape::mixed) without clashing.
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+enum class ProgramShape : uint8_t {
+  deep_expr, // `size` statements, each one expression nested `depth` parentheses deep
+  many_lets, // `size` lets, each built from a few earlier ones
+  many_functions, // `size` small functions, each called once
+  if_chain, // one `if / else if` chain of `size` branches, taken 16 times with different values
+  strings, // `size` distinct string literals, all printed
+  loops, // `size` outer iterations of an arithmetic inner loop, for timing the emitted code rather than the compiler
+  mixed, // all of the above, each at a share of `size`
+};
+
+struct ProgramSpec {
+  ProgramShape shape = ProgramShape::mixed;
+  uint32_t size = 1000;
+  uint32_t depth = 32; // deep_expr only
+  uint64_t seed = 1;
+};
+
+// Names as used on the command line of hydro_gen and hydro_bench
+inline constexpr std::pair<std::string_view, ProgramShape> program_shapes[] = {
+  { "deep", ProgramShape::deep_expr },
+  { "lets", ProgramShape::many_lets },
+  { "functions", ProgramShape::many_functions },
+  { "ifs", ProgramShape::if_chain },
+  { "strings", ProgramShape::strings },
+  { "loops", ProgramShape::loops },
+  { "mixed", ProgramShape::mixed },
+};
+
+inline std::optional<ProgramShape> parse_program_shape(std::string_view name)
+{
+  for (const auto& [shape_name, shape] : program_shapes) {
+    if (shape_name == name) {
+      return shape;
+    }
+  }
+  return {};
+}
+
+inline std::string_view program_shape_name(ProgramShape shape)
+{
+  for (const auto& [shape_name, value] : program_shapes) {
+    if (value == shape) {
+      return shape_name;
+    }
+  }
+  return "?";
+}
+
+class ProgramGenerator {
+public:
+  inline explicit ProgramGenerator(const ProgramSpec& spec)
+    : m_spec(spec)
+    , m_state(spec.seed)
+  {
+  }
+
+  inline std::string generate()
+  {
+    m_out.clear();
+    if (m_spec.shape == ProgramShape::mixed) {
+      // shares roughly balanced so no single shape dominates the source size
+      uint32_t part = std::max<uint32_t>(m_spec.size / 8, 1);
+      deep_expr(std::max<uint32_t>(part / 4, 1), m_spec.depth);
+      many_lets(part * 2);
+      many_functions(part);
+      if_chain(part);
+      strings(part);
+      loops(std::max<uint32_t>(part / 16, 1));
+    }
+    else {
+      switch (m_spec.shape) {
+      case ProgramShape::deep_expr:
+        deep_expr(m_spec.size, m_spec.depth);
+        break;
+      case ProgramShape::many_lets:
+        many_lets(m_spec.size);
+        break;
+      case ProgramShape::many_functions:
+        many_functions(m_spec.size);
+        break;
+      case ProgramShape::if_chain:
+        if_chain(m_spec.size);
+        break;
+      case ProgramShape::strings:
+        strings(m_spec.size);
+        break;
+      case ProgramShape::loops:
+        loops(m_spec.size);
+        break;
+      case ProgramShape::mixed:
+        break;
+      }
+    }
+    return std::move(m_out);
+  }
+
+private:
+  // splitmix64
+  inline uint64_t next()
+  {
+    uint64_t z = (m_state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+  }
+
+  // A number in [lo, hi]
+  inline uint32_t pick(uint32_t lo, uint32_t hi)
+  {
+    return lo + static_cast<uint32_t>(next() % (hi - lo + 1));
+  }
+
+  inline std::string_view op()
+  {
+    static constexpr std::string_view ops[] = { " + ", " - ", " * " };
+    return ops[next() % 3];
+  }
+
+  // (1 + (2 * (3 - ...))) nested `depth` deep. Every seventh level divides what is inside it by a constant instead, a divisor that is
+  // itself an expression could come out as 0
+  inline void nested(uint32_t depth)
+  {
+    if (depth == 0) {
+      m_out += std::to_string(pick(1, 99));
+      return;
+    }
+    m_out += "(";
+    if (depth % 7 == 0) {
+      nested(depth - 1);
+      m_out += " / " + std::to_string(pick(1, 99));
+    }
+    else {
+      m_out += std::to_string(pick(1, 99));
+      m_out += op();
+      nested(depth - 1);
+    }
+    m_out += ")";
+  }
+
+  inline void deep_expr(uint32_t count, uint32_t depth)
+  {
+    m_out += "let dsum = 0;\n";
+    for (uint32_t i = 0; i < count; i++) {
+      m_out += "let d" + std::to_string(i) + " = ";
+      nested(depth);
+      m_out += ";\ndsum = dsum + d" + std::to_string(i) + ";\n";
+    }
+    m_out += "print(dsum);\n";
+  }
+
+  inline void many_lets(uint32_t count)
+  {
+    for (uint32_t i = 0; i < count; i++) {
+      std::string name = "l" + std::to_string(i);
+      if (i < 2) {
+        m_out += "let " + name + " = " + std::to_string(pick(1, 1000)) + ";\n";
+        continue;
+      }
+      uint32_t a = pick(std::max<uint32_t>(i, 16) - 16, i - 1);
+      uint32_t b = pick(0, i - 1);
+      m_out += "let " + name + " = l" + std::to_string(a) + std::string(op()) + std::to_string(pick(1, 9)) + " * l"
+        + std::to_string(b) + " / " + std::to_string(pick(1, 9)) + ";\n";
+    }
+    m_out += "print(l" + std::to_string(count - 1) + ");\n";
+  }
+
+  inline void many_functions(uint32_t count)
+  {
+    for (uint32_t i = 0; i < count; i++) {
+      std::string c1 = std::to_string(pick(1, 50));
+      std::string c2 = std::to_string(pick(100, 5000));
+      m_out += "let f" + std::to_string(i) + " = function(a, b) {\n  let t = a * " + c1 + " + b;\n  if (t > " + c2
+        + ") {\n    return t - a * " + c1 + ";\n  }\n  return t + b;\n}\n";
+    }
+    m_out += "let r0 = 1;\n";
+    for (uint32_t i = 0; i < count; i++) {
+      std::string arg = std::to_string(pick(0, 100));
+      m_out += "let r" + std::to_string(i + 1) + " = f" + std::to_string(i) + "(r" + std::to_string(i) + " / 3, " + arg + ");\n";
+    }
+    m_out += "print(r" + std::to_string(count) + ");\n";
+  }
+
+  inline void if_chain(uint32_t count)
+  {
+    std::string n = std::to_string(count);
+    m_out += "let csum = 0;\nfor (let ci = 0; ci < 16; ci = ci + 1) {\n  let ck = ci * 7919 - ci * 7919 / " + n + " * " + n + ";\n";
+    for (uint32_t i = 0; i < count; i++) {
+      m_out += i == 0 ? "  if (ck == 0) {\n" : "  else if (ck == " + std::to_string(i) + ") {\n";
+      m_out += "    csum = csum + " + std::to_string(pick(1, 1000)) + ";\n  }\n";
+    }
+    m_out += "  else {\n    csum = csum - 1;\n  }\n}\nprint(csum);\n";
+  }
+
+  inline void strings(uint32_t count)
+  {
+    static constexpr std::string_view words[] = { "lorem", "ipsum", "dolor", "sit", "amet", "hydro", "compiler", "benchmark" };
+    for (uint32_t i = 0; i < count; i++) {
+      m_out += "print(\"s" + std::to_string(i);
+      for (uint32_t w = pick(2, 8); w > 0; w--) {
+        m_out += " ";
+        m_out += words[next() % std::size(words)];
+      }
+      m_out += "\");\n";
+    }
+  }
+
+  inline void loops(uint32_t count)
+  {
+    m_out += "let acc = 0;\nfor (let oi = 0; oi < " + std::to_string(count)
+      + "; oi = oi + 1) {\n  let oj = 0;\n  while (oj < 1000) {\n    acc = acc + oi * oj - acc / 7;\n    oj = oj + 1;\n  }\n}\n"
+        "print(acc);\n";
+  }
+
+  ProgramSpec m_spec;
+  uint64_t m_state;
+  std::string m_out {};
+};
+
+inline std::string generate_program(const ProgramSpec& spec)
+{
+  return ProgramGenerator(spec).generate();
+}
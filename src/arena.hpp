@@ -1,65 +1,205 @@
 // This code defines a custom memory allocator class named `ArenaAllocator`. Memory allocation is a critical operation in many programs, and custom memory allocators are often used in performance-sensitive or memory-constrained environments such as compilers. Here's a breakdown of the code:
 
-// 1. Class Definition:
-//     - `class ArenaAllocator`: This is the declaration of the `ArenaAllocator` class.
-
-// 2. Constructor:
-//     - `inline explicit ArenaAllocator(size_t bytes)`: The constructor initializes an instance of the `ArenaAllocator` with a specified size in bytes.
-//         - `m_size(bytes)`: Initializes `m_size` with the value of `bytes`.
-//         - `malloc(m_size)`: Allocates a block of memory of size `m_size`.
-//         - `static_cast<std::byte*>(malloc(m_size))`: Casts the returned pointer to `std::byte*`.
-//         - `m_buffer = static_cast<std::byte*>(malloc(m_size))`: Assigns the casted pointer to `m_buffer`.
-//         - `m_offset = m_buffer`: Initializes `m_offset` to point to the beginning of the allocated buffer.
-
-// 3. Allocation Method:
-//     - `template <typename T> inline T* alloc()`: This is a template method that allocates memory for an object of type `T`.
-//         - `void* offset = m_offset`: Stores the current offset.
-//         - `m_offset += sizeof(T)`: Advances `m_offset` by the size of `T`.
-//         - `static_cast<T*>(offset)`: Casts `offset` to `T*`.
-//         - `return static_cast<T*>(offset)`: Returns the casted pointer.
+// 1. Chunks:
+//     - The arena owns a singly linked list of chunks. Each chunk is one `malloc` with a small `Chunk` header followed by the usable bytes.
+//     - The first chunk is small (64 KB by default) so tiny programs don't pay for a big up-front allocation.
+//     - When a request does not fit in the current chunk a new one is started. Chunk sizes grow geometrically (doubling, capped at `max_chunk_size`)
+//       so a large AST needs only a handful of chunks. A request larger than the next chunk size gets a chunk of its own.
 
-// 4. Copy Constructor and Assignment Operator:
-//     - The copy constructor and the copy assignment operator are deleted to prevent copying of `ArenaAllocator` objects, which is a common practice with custom allocators to prevent issues like double-freeing memory.
+// 2. Allocation Methods:
+//     - `alloc_bytes(size, align)`: aligns the bump pointer up to `align`, checks it against the end of the chunk and moves it forward by `size`.
+//     - `alloc<T>()` / `emplace<T>(args...)`: allocate `sizeof(T)` bytes aligned to `alignof(T)` and construct a `T` in place with placement new.
+//     - `alloc_array<T>(n)`: allocates and default-constructs `n` contiguous objects of type `T`.
+//     - Objects that are not trivially destructible (nodes holding a `std::vector` or `std::string`) register a small finalizer record, itself
+//       allocated in the arena, so their destructors run when the arena is reset or destroyed.
 
-// 5. Destructor:
-//     - `inline ~ArenaAllocator()`: The destructor releases the allocated memory.
-//         - `free(m_buffer)`: Frees the memory block pointed to by `m_buffer`.
+// 3. Statistics:
+//     - `bytes_used()`: bytes handed out since the last reset, including alignment padding.
+//     - `bytes_reserved()`: total bytes obtained from `malloc` for the live chunks.
+//     - `chunk_count()`: number of live chunks.
+//     - `peak_bytes_used()`: high-water mark of `bytes_used()` over the arena's whole lifetime (across resets).
 
-// 6. Private Members:
-//     - `size_t m_size`: Stores the size of the buffer.
-//     - `std::byte* m_buffer`: Points to the beginning of the allocated buffer.
-//     - `std::byte* m_offset`: Points to the current offset within the buffer, where the next allocation will occur.
+// 4. Copy Constructor and Assignment Operator:
+//     - The copy constructor and the copy assignment operator are deleted to prevent copying of `ArenaAllocator` objects, which is a common practice with custom allocators to prevent issues like double-freeing memory.
 
-// This `ArenaAllocator` class implements a very simple form of arena (or stack) allocation, where memory is allocated in a single block (the "arena"), and individual allocations are made by simply moving a pointer (the "offset") within that block. This can be much faster than heap allocation, but it's more restrictive: there's no way to free individual objects, and the entire arena is freed at once when the `ArenaAllocator` is destroyed. This kind of allocator is often useful in compilers, where many temporary objects may be created during compilation, and all can be freed at once when compilation is finished.
+// 5. Reset and Destructor:
+//     - `reset()`: runs the finalizers, frees every chunk except the newest (largest) one and rewinds it, so the arena can be reused without going back to `malloc`.
+//     - `~ArenaAllocator()`: runs the finalizers and frees every chunk.
 
+// There is still no way to free individual objects: everything is released at once. This kind of allocator is often useful in compilers, where many temporary objects may be created during compilation, and all can be freed at once when compilation is finished.
 
 #pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 class ArenaAllocator {
 public:
-  inline explicit ArenaAllocator(size_t bytes) : m_size(bytes){
-    m_buffer = static_cast<std::byte*>(malloc(m_size));
-    m_offset = m_buffer;
+  static constexpr size_t default_chunk_size = 64 * 1024;
+  static constexpr size_t max_chunk_size = 64 * 1024 * 1024;
+
+  inline explicit ArenaAllocator(size_t first_chunk_size = default_chunk_size)
+    : m_next_chunk_size(std::max<size_t>(first_chunk_size, 256))
+  {
   }
 
-  // Tell it what type of object you want to allocate and it will determine the size of that object and allocate it for you
+  inline ArenaAllocator(const ArenaAllocator& other) = delete;
+
+  inline ArenaAllocator& operator=(const ArenaAllocator& other) = delete;
+
+  inline ~ArenaAllocator(){
+    run_finalizers();
+    while (m_chunk != nullptr) {
+      Chunk* prev = m_chunk->prev;
+      free(m_chunk);
+      m_chunk = prev;
+    }
+  }
+
+  // Raw allocation: `align` must be a power of two
+  inline void* alloc_bytes(size_t size, size_t align = alignof(std::max_align_t)){
+    std::byte* aligned = align_up(m_cursor, align);
+    if (m_cursor == nullptr || aligned + size > m_end) {
+      new_chunk(size + align);
+      aligned = align_up(m_cursor, align);
+    }
+    m_used += static_cast<size_t>(aligned - m_cursor) + size;
+    m_peak = std::max(m_peak, m_used);
+    m_cursor = aligned + size;
+    return aligned;
+  }
+
+  // Tell it what type of object you want to allocate and it will determine the size and alignment of that object, allocate it and construct it for you
   template <typename T>
   inline T* alloc(){
-    void* offset = m_offset;
-    m_offset += sizeof(T);
-    return static_cast<T*>(offset);
+    return emplace<T>();
   }
 
-  inline ArenaAllocator(const ArenaAllocator& other) = delete;
+  template <typename T, typename... Args>
+  inline T* emplace(Args&&... args){
+    void* mem = alloc_bytes(sizeof(T), alignof(T));
+    T* obj = new (mem) T(std::forward<Args>(args)...);
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      add_finalizer(obj, 1, [](void* ptr, size_t) { static_cast<T*>(ptr)->~T(); });
+    }
+    return obj;
+  }
 
-  inline ArenaAllocator operator=(const ArenaAllocator& other) = delete;
+  template <typename T>
+  inline T* alloc_array(size_t count){
+    if (count == 0) {
+      return nullptr;
+    }
+    void* mem = alloc_bytes(sizeof(T) * count, alignof(T));
+    T* first = static_cast<T*>(mem);
+    for (size_t i = 0; i < count; i++) {
+      new (first + i) T();
+    }
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      add_finalizer(first, count, [](void* ptr, size_t n) {
+        for (size_t i = n; i > 0; i--) {
+          static_cast<T*>(ptr)[i - 1].~T();
+        }
+      });
+    }
+    return first;
+  }
 
-  inline ~ArenaAllocator(){
-    free(m_buffer);
+  // Release everything allocated so far but keep the newest chunk around for reuse
+  inline void reset(){
+    run_finalizers();
+    if (m_chunk == nullptr) {
+      return;
+    }
+    while (m_chunk->prev != nullptr) {
+      Chunk* prev = m_chunk->prev;
+      m_reserved -= prev->size;
+      m_chunk->prev = prev->prev;
+      free(prev);
+      m_chunk_count--;
+    }
+    m_cursor = chunk_data(m_chunk);
+    m_used = 0;
+  }
+
+  [[nodiscard]] inline size_t bytes_used() const{
+    return m_used;
+  }
+
+  [[nodiscard]] inline size_t bytes_reserved() const{
+    return m_reserved;
+  }
+
+  [[nodiscard]] inline size_t chunk_count() const{
+    return m_chunk_count;
+  }
+
+  [[nodiscard]] inline size_t peak_bytes_used() const{
+    return m_peak;
   }
 
 private:
-  size_t m_size;
-  std::byte* m_buffer;
-  std::byte* m_offset;
-};
\ No newline at end of file
+  struct Chunk {
+    Chunk* prev; // the chunk allocated before this one
+    size_t size; // total size of the allocation including this header
+  };
+
+  struct Finalizer {
+    void (*destroy)(void*, size_t);
+    void* obj;
+    size_t count;
+    Finalizer* next;
+  };
+
+  static inline std::byte* align_up(std::byte* ptr, size_t align){
+    auto addr = reinterpret_cast<uintptr_t>(ptr);
+    return reinterpret_cast<std::byte*>((addr + align - 1) & ~(uintptr_t(align) - 1));
+  }
+
+  static inline std::byte* chunk_data(Chunk* chunk){
+    return reinterpret_cast<std::byte*>(chunk) + sizeof(Chunk);
+  }
+
+  inline void new_chunk(size_t min_bytes){
+    size_t size = std::max(m_next_chunk_size, min_bytes + sizeof(Chunk));
+    auto chunk = static_cast<Chunk*>(malloc(size));
+    if (chunk == nullptr) {
+      throw std::bad_alloc();
+    }
+    chunk->prev = m_chunk;
+    chunk->size = size;
+    m_chunk = chunk;
+    m_cursor = chunk_data(chunk);
+    m_end = reinterpret_cast<std::byte*>(chunk) + size;
+    m_reserved += size;
+    m_chunk_count++;
+    m_next_chunk_size = std::min(m_next_chunk_size * 2, max_chunk_size);
+  }
+
+  inline void add_finalizer(void* obj, size_t count, void (*destroy)(void*, size_t)){
+    void* mem = alloc_bytes(sizeof(Finalizer), alignof(Finalizer));
+    m_finalizers = new (mem) Finalizer { .destroy = destroy, .obj = obj, .count = count, .next = m_finalizers };
+  }
+
+  // destroy objects in the reverse order they were created in
+  inline void run_finalizers(){
+    for (Finalizer* f = m_finalizers; f != nullptr; f = f->next) {
+      f->destroy(f->obj, f->count);
+    }
+    m_finalizers = nullptr;
+  }
+
+  Chunk* m_chunk = nullptr;    // newest chunk, the one we are bumping into
+  std::byte* m_cursor = nullptr; // next free byte in the newest chunk
+  std::byte* m_end = nullptr;    // one past the last byte of the newest chunk
+  Finalizer* m_finalizers = nullptr;
+  size_t m_next_chunk_size;
+  size_t m_used = 0;
+  size_t m_peak = 0;
+  size_t m_reserved = 0;
+  size_t m_chunk_count = 0;
+};
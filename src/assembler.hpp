@@ -0,0 +1,1329 @@
+// This file turns the assembly the backends emit into x86-64 machine code in-process, so hydro doesn't have to write out.asm and run nasm
+// on it. It understands the subset of NASM syntax Generator and IrEmitter produce: `section .text` / `.rodata` / `.data` / `.bss`, `global`,
+// labels, `db` / `dq` data, `resb` / `resq` reservations and the instructions below with register, immediate and `[base + index*scale +/- disp]` or `[label +/- disp]` operands.
+// Anything else is an internal error: the backends and this file have to agree on what gets emitted.
+// The vector loops of -O2 (vectorize.hpp) add the few SSE2 and AVX2 instructions on xmm0-15 / ymm0-15 they are made of, see
+// assemble_vector_instruction. The SSE2 ones are in their legacy encoding, the v-prefixed ones in their VEX encoding, like nasm does.
+// Every jump and call is encoded with a 32-bit displacement, so the size of the code is known as soon as an instruction is read and one
+// pass is enough. References to labels are recorded as fixups and patched by `link` once elf.hpp has decided where the sections go.
+// Until then nothing depends on where a piece of code ends up, so the code of one function can be taken out as an Object, cached, and
+// appended to another assembler later: incremental builds link the functions they didn't have to regenerate that way.
+
+#pragma once
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "./error.hpp"
+
+class Assembler {
+public:
+  enum class Section : uint8_t {
+    text,
+    rodata, // read-only data, the string literals and the runtime's tables
+    data,
+    bss, // no bytes, only a size: the loader hands it out zeroed
+  };
+
+  inline explicit Assembler(std::string_view source)
+    : m_source(source)
+  {
+  }
+
+  // Encode the whole source, the code and data end up in text() and data() with label references still unresolved
+  inline void assemble()
+  {
+    size_t pos = 0;
+    while (pos < m_source.size()) {
+      size_t eol = m_source.find('\n', pos);
+      if (eol == std::string_view::npos) {
+        eol = m_source.size();
+      }
+      m_line = m_source.substr(pos, eol - pos);
+      assemble_line(m_line);
+      pos = eol + 1;
+    }
+  }
+
+  // Patch every label reference now that the sections have their addresses
+  inline void link(uint64_t text_address, uint64_t rodata_address, uint64_t data_address, uint64_t bss_address)
+  {
+    auto section_address = [&](Section section) {
+      switch (section) {
+      case Section::text:
+        return text_address;
+      case Section::rodata:
+        return rodata_address;
+      case Section::data:
+        return data_address;
+      case Section::bss:
+        break;
+      }
+      return bss_address;
+    };
+    for (const Fixup& fixup : m_fixups) {
+      auto symbol = m_symbols.find(fixup.label);
+      if (symbol == m_symbols.end()) {
+        compile_error("Assembler: undefined label `", fixup.label, "`");
+      }
+      // The displacement next to the label, `[label + 16]`, is already in the bytes being patched
+      std::vector<uint8_t>& bytes = section_bytes(fixup.section);
+      uint64_t target = section_address(symbol->second.section) + symbol->second.offset + addend(bytes, fixup.offset, fixup.kind);
+      switch (fixup.kind) {
+      case Fixup::Kind::rel32: {
+        uint64_t from = section_address(fixup.section) + fixup.end;
+        patch(bytes, fixup.offset, static_cast<uint64_t>(static_cast<int64_t>(target - from)), 4);
+        break;
+      }
+      case Fixup::Kind::abs32:
+        patch(bytes, fixup.offset, target, 4);
+        break;
+      case Fixup::Kind::abs64:
+        patch(bytes, fixup.offset, target, 8);
+        break;
+      }
+    }
+  }
+
+  [[nodiscard]] inline const std::vector<uint8_t>& text() const
+  {
+    return m_text;
+  }
+
+  [[nodiscard]] inline const std::vector<uint8_t>& rodata() const
+  {
+    return m_rodata;
+  }
+
+  [[nodiscard]] inline const std::vector<uint8_t>& data() const
+  {
+    return m_data;
+  }
+
+  [[nodiscard]] inline uint64_t bss_size() const
+  {
+    return m_bss_size;
+  }
+
+  struct Symbol {
+    Section section;
+    uint64_t offset;
+  };
+
+  // Every label defined in the source, for the entry point and the symbol table of the executable
+  [[nodiscard]] inline const std::unordered_map<std::string_view, Symbol>& symbols() const
+  {
+    return m_symbols;
+  }
+
+  // A reference to a label, patched by link
+  struct Fixup {
+    enum class Kind : uint8_t {
+      rel32, // 32-bit displacement from `end`, jumps, calls and [label]
+      abs32, // 32-bit sign-extended address, [label + reg]
+      abs64, // 64-bit address, dq label
+    };
+
+    Kind kind;
+    Section section;
+    size_t offset;
+    size_t end; // rel32: the end of the instruction the displacement is relative to
+    std::string_view label;
+  };
+
+  // The machine code of one piece of the program with its labels and the references to labels it has yet to be linked with, owning
+  // everything, so it can be kept (in the cache, see object_file.hpp) and linked with pieces assembled at other times. Offsets are from
+  // the start of the piece's own sections, names are ranges of `names`. The records have no padding so they can be written out as they are
+  struct Object {
+    struct Label {
+      uint64_t offset;
+      uint32_t name;
+      uint32_t name_size;
+      Section section;
+      uint8_t reserved[7] {};
+    };
+
+    struct Reference {
+      uint64_t offset;
+      uint64_t end;
+      uint32_t label;
+      uint32_t label_size;
+      Fixup::Kind kind;
+      Section section;
+      uint8_t reserved[6] {};
+    };
+
+    std::vector<uint8_t> text {};
+    std::vector<uint8_t> rodata {};
+    std::vector<uint8_t> data {};
+    uint64_t bss_size = 0;
+    std::vector<Label> labels {};
+    std::vector<Reference> references {};
+    std::string names {};
+
+    [[nodiscard]] inline std::string_view name(uint32_t offset, uint32_t size) const
+    {
+      return std::string_view(names).substr(offset, size);
+    }
+  };
+
+  // What assemble produced, as an Object. The sections are moved out, this assembler is empty afterwards
+  [[nodiscard]] inline Object take_object()
+  {
+    Object object;
+    object.text = std::move(m_text);
+    object.rodata = std::move(m_rodata);
+    object.data = std::move(m_data);
+    object.bss_size = m_bss_size;
+    // A label is usually referred to many times, its name is stored once
+    std::unordered_map<std::string_view, uint32_t> offsets;
+    auto add_name = [&](std::string_view name) {
+      auto [it, added] = offsets.emplace(name, static_cast<uint32_t>(object.names.size()));
+      if (added) {
+        object.names.append(name);
+      }
+      return it->second;
+    };
+    object.labels.reserve(m_symbols.size());
+    for (const auto& [name, symbol] : m_symbols) {
+      object.labels.push_back(
+        { .offset = symbol.offset, .name = add_name(name), .name_size = static_cast<uint32_t>(name.size()), .section = symbol.section });
+    }
+    object.references.reserve(m_fixups.size());
+    for (const Fixup& fixup : m_fixups) {
+      object.references.push_back({ .offset = fixup.offset,
+        .end = fixup.end,
+        .label = add_name(fixup.label),
+        .label_size = static_cast<uint32_t>(fixup.label.size()),
+        .kind = fixup.kind,
+        .section = fixup.section });
+    }
+    *this = Assembler(std::string_view());
+    return object;
+  }
+
+  // Add `object` after what is already here, as if its source had been assembled next. The labels keep pointing into the object's
+  // names, so it has to stay alive (and where it is) until linking is done
+  inline void append(const Object& object)
+  {
+    uint64_t starts[] = { m_text.size(), m_rodata.size(), m_data.size(), m_bss_size };
+    auto start = [&](Section section) { return starts[static_cast<size_t>(section)]; };
+    m_text.insert(m_text.end(), object.text.begin(), object.text.end());
+    m_rodata.insert(m_rodata.end(), object.rodata.begin(), object.rodata.end());
+    m_data.insert(m_data.end(), object.data.begin(), object.data.end());
+    m_bss_size += object.bss_size;
+    for (const Object::Label& label : object.labels) {
+      std::string_view name = object.name(label.name, label.name_size);
+      if (!m_symbols.emplace(name, Symbol { label.section, start(label.section) + label.offset }).second) {
+        compile_error("Assembler: label `", name, "` defined twice");
+      }
+    }
+    for (const Object::Reference& reference : object.references) {
+      uint64_t section_start = start(reference.section);
+      m_fixups.push_back({ .kind = reference.kind,
+        .section = reference.section,
+        .offset = section_start + reference.offset,
+        .end = section_start + reference.end,
+        .label = object.name(reference.label, reference.label_size) });
+    }
+  }
+
+private:
+  static constexpr uint8_t no_reg = 0xff;
+
+  struct Operand {
+    enum class Kind : uint8_t {
+      none,
+      reg,
+      imm,
+      mem,
+      label,
+    };
+
+    Kind kind = Kind::none;
+    uint8_t size = 0; // In bytes, 0 when the operand doesn't say (immediates, memory without QWORD / byte)
+    uint8_t reg = no_reg; // reg: the register, mem: the base register
+    uint8_t index = no_reg; // mem only
+    uint8_t scale = 0; // mem: log2 of the index scale
+    bool byte_rex = false; // spl, bpl, sil and dil can only be encoded with a REX prefix
+    int64_t value = 0; // imm: the value, mem: the displacement
+    std::string_view label {}; // label, or mem relative to a label
+  };
+
+  // The condition codes of jcc and setcc, in encoding order
+  static inline int condition_code(std::string_view cc)
+  {
+    static constexpr std::string_view names[][3] = {
+      { "o" }, { "no" }, { "b", "c", "nae" }, { "ae", "nb", "nc" }, { "e", "z" }, { "ne", "nz" }, { "be", "na" }, { "a", "nbe" },
+      { "s" }, { "ns" }, { "p", "pe" }, { "np", "po" }, { "l", "nge" }, { "ge", "nl" }, { "le", "ng" }, { "g", "nle" },
+    };
+    for (int code = 0; code < 16; code++) {
+      for (std::string_view name : names[code]) {
+        if (!name.empty() && name == cc) {
+          return code;
+        }
+      }
+    }
+    return -1;
+  }
+
+  // The register number for a register name, and its size through `size`: 16 for xmm0-15, 32 for ymm0-15
+  static inline uint8_t parse_register(std::string_view name, uint8_t& size, bool& byte_rex)
+  {
+    static constexpr std::string_view regs64[] = { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi" };
+    static constexpr std::string_view regs32[] = { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi" };
+    static constexpr std::string_view regs8[] = { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil" };
+    byte_rex = false;
+    for (uint8_t i = 0; i < 8; i++) {
+      if (name == regs64[i]) {
+        size = 8;
+        return i;
+      }
+      if (name == regs32[i]) {
+        size = 4;
+        return i;
+      }
+      if (name == regs8[i]) {
+        size = 1;
+        byte_rex = i >= 4;
+        return i;
+      }
+    }
+    // r8 to r15, with a d or b suffix for the 32 and 8-bit halves
+    if (name.size() >= 2 && name[0] == 'r' && name[1] >= '0' && name[1] <= '9') {
+      unsigned number = 0;
+      auto [end, ec] = std::from_chars(name.data() + 1, name.data() + name.size(), number);
+      std::string_view suffix(end, name.data() + name.size() - end);
+      if (ec == std::errc() && number >= 8 && number <= 15) {
+        if (suffix.empty()) {
+          size = 8;
+          return static_cast<uint8_t>(number);
+        }
+        if (suffix == "d") {
+          size = 4;
+          return static_cast<uint8_t>(number);
+        }
+        if (suffix == "b") {
+          size = 1;
+          return static_cast<uint8_t>(number);
+        }
+      }
+    }
+    if (name.size() >= 4 && (name.starts_with("xmm") || name.starts_with("ymm"))) {
+      unsigned number = 0;
+      auto [end, ec] = std::from_chars(name.data() + 3, name.data() + name.size(), number);
+      if (ec == std::errc() && end == name.data() + name.size() && number <= 15) {
+        size = name[0] == 'x' ? 16 : 32;
+        return static_cast<uint8_t>(number);
+      }
+    }
+    return no_reg;
+  }
+
+  static inline std::string_view trim(std::string_view text)
+  {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t' || text.front() == '\r')) {
+      text.remove_prefix(1);
+    }
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r')) {
+      text.remove_suffix(1);
+    }
+    return text;
+  }
+
+  // Split at the top-level commas, the ones outside of quotes
+  static inline std::vector<std::string_view> split_operands(std::string_view text)
+  {
+    std::vector<std::string_view> parts;
+    if (trim(text).empty()) {
+      return parts;
+    }
+    char quote = 0;
+    size_t start = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+      char c = text[i];
+      if (quote != 0) {
+        if (c == '\\' && quote == '`') {
+          i++;
+        }
+        else if (c == quote) {
+          quote = 0;
+        }
+      }
+      else if (c == '`' || c == '\'' || c == '"') {
+        quote = c;
+      }
+      else if (c == ',') {
+        parts.push_back(trim(text.substr(start, i - start)));
+        start = i + 1;
+      }
+    }
+    parts.push_back(trim(text.substr(start)));
+    return parts;
+  }
+
+  // Where the comment on a line starts, a ; inside a string or character literal doesn't count
+  static inline size_t comment_start(std::string_view line)
+  {
+    char quote = 0;
+    for (size_t i = 0; i < line.size(); i++) {
+      char c = line[i];
+      if (quote != 0) {
+        if (c == '\\' && quote == '`') {
+          i++;
+        }
+        else if (c == quote) {
+          quote = 0;
+        }
+      }
+      else if (c == '`' || c == '\'' || c == '"') {
+        quote = c;
+      }
+      else if (c == ';') {
+        return i;
+      }
+    }
+    return line.size();
+  }
+
+  // A decimal or 0x hexadecimal number, or a character literal like '0'
+  static inline bool parse_number(std::string_view text, int64_t& value)
+  {
+    if (text.size() == 3 && text.front() == '\'' && text.back() == '\'') {
+      value = static_cast<unsigned char>(text[1]);
+      return true;
+    }
+    bool negative = !text.empty() && text.front() == '-';
+    if (negative) {
+      text.remove_prefix(1);
+    }
+    int base = 10;
+    if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+      text.remove_prefix(2);
+      base = 16;
+    }
+    uint64_t magnitude = 0;
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), magnitude, base);
+    if (text.empty() || ec != std::errc() || end != text.data() + text.size()) {
+      return false;
+    }
+    value = static_cast<int64_t>(negative ? 0 - magnitude : magnitude);
+    return true;
+  }
+
+  static inline bool fits_int8(int64_t value)
+  {
+    return value >= std::numeric_limits<int8_t>::min() && value <= std::numeric_limits<int8_t>::max();
+  }
+
+  static inline bool fits_int32(int64_t value)
+  {
+    return value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max();
+  }
+
+  // What an unpatched fixup holds: the displacement to add to the label's address, sign-extended
+  static inline uint64_t addend(const std::vector<uint8_t>& bytes, size_t offset, Fixup::Kind kind)
+  {
+    int size = kind == Fixup::Kind::abs64 ? 8 : 4;
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++) {
+      value |= uint64_t { bytes[offset + i] } << (8 * i);
+    }
+    return size == 8 ? value : static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(value)));
+  }
+
+  static inline void patch(std::vector<uint8_t>& bytes, size_t offset, uint64_t value, int size)
+  {
+    for (int i = 0; i < size; i++) {
+      bytes[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+  }
+
+  [[noreturn]] inline void error(std::string_view message) const
+  {
+    compile_error("Assembler: ", message, " in `", trim(m_line), "`");
+  }
+
+  inline std::vector<uint8_t>& section_bytes(Section section)
+  {
+    return section == Section::text ? m_text : section == Section::rodata ? m_rodata : m_data;
+  }
+
+  inline std::vector<uint8_t>& current()
+  {
+    if (m_section == Section::bss) {
+      error("only resb / resq in .bss");
+    }
+    return section_bytes(m_section);
+  }
+
+  inline void emit8(uint8_t byte)
+  {
+    current().push_back(byte);
+  }
+
+  inline void emit_le(uint64_t value, int size)
+  {
+    for (int i = 0; i < size; i++) {
+      emit8(static_cast<uint8_t>(value >> (8 * i)));
+    }
+  }
+
+  inline void define_label(std::string_view name)
+  {
+    uint8_t size = 0;
+    bool byte_rex = false;
+    if (parse_register(name, size, byte_rex) != no_reg) {
+      error("register name used as a label"); // an operand naming it would mean the register
+    }
+    uint64_t offset = m_section == Section::bss ? m_bss_size : current().size();
+    if (!m_symbols.emplace(name, Symbol { m_section, offset }).second) {
+      error("label defined twice");
+    }
+  }
+
+  inline Operand parse_operand(std::string_view text)
+  {
+    Operand operand;
+    // An explicit size, `QWORD [rbp - 8]` or `byte [rsi]`
+    static constexpr std::pair<std::string_view, uint8_t> sizes[] = {
+      { "QWORD", 8 }, { "qword", 8 }, { "DWORD", 4 }, { "dword", 4 }, { "BYTE", 1 }, { "byte", 1 },
+    };
+    for (auto [keyword, size] : sizes) {
+      if (text.starts_with(keyword) && text.size() > keyword.size() && (text[keyword.size()] == ' ' || text[keyword.size()] == '[')) {
+        operand.size = size;
+        text = trim(text.substr(keyword.size()));
+        break;
+      }
+    }
+
+    if (!text.empty() && text.front() == '[') {
+      if (text.back() != ']') {
+        error("unterminated memory operand");
+      }
+      operand.kind = Operand::Kind::mem;
+      parse_address(trim(text.substr(1, text.size() - 2)), operand);
+      return operand;
+    }
+
+    uint8_t size = 0;
+    bool byte_rex = false;
+    uint8_t reg = parse_register(text, size, byte_rex);
+    if (reg != no_reg) {
+      operand.kind = Operand::Kind::reg;
+      operand.reg = reg;
+      operand.size = size;
+      operand.byte_rex = byte_rex;
+      return operand;
+    }
+    if (parse_number(text, operand.value)) {
+      operand.kind = Operand::Kind::imm;
+      return operand;
+    }
+    if (text.empty()) {
+      error("missing operand");
+    }
+    operand.kind = Operand::Kind::label;
+    operand.label = text;
+    return operand;
+  }
+
+  // The inside of [...]: terms joined by + and -, each a register, register*scale, number or label
+  inline void parse_address(std::string_view text, Operand& operand)
+  {
+    bool negative = false;
+    while (!text.empty()) {
+      size_t end = text.find_first_of("+-", 1);
+      std::string_view term = trim(text.substr(0, end));
+      if (!term.empty() && (term.front() == '+' || term.front() == '-')) {
+        negative = term.front() == '-';
+        term = trim(term.substr(1));
+      }
+      text = end == std::string_view::npos ? std::string_view {} : text.substr(end);
+
+      int64_t value = 0;
+      uint8_t size = 0;
+      bool byte_rex = false;
+      size_t star = term.find('*');
+      uint8_t reg = parse_register(trim(term.substr(0, star)), size, byte_rex);
+      if (reg != no_reg) {
+        if (size != 8 || negative) {
+          error("bad register in memory operand");
+        }
+        int64_t scale = 1;
+        if (star != std::string_view::npos && !parse_number(trim(term.substr(star + 1)), scale)) {
+          error("bad index scale");
+        }
+        if (star == std::string_view::npos && operand.reg == no_reg) {
+          operand.reg = reg;
+        }
+        else if (operand.index == no_reg && reg != 4 && (scale == 1 || scale == 2 || scale == 4 || scale == 8)) {
+          operand.index = reg;
+          operand.scale = static_cast<uint8_t>(scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0);
+        }
+        else {
+          error("bad memory operand");
+        }
+      }
+      else if (parse_number(term, value)) {
+        operand.value += negative ? -value : value;
+      }
+      else if (!term.empty() && operand.label.empty() && !negative) {
+        operand.label = term;
+      }
+      else {
+        error("bad memory operand");
+      }
+      negative = false;
+    }
+  }
+
+  // The REX prefix, opcode, ModRM byte, SIB byte and displacement of an instruction that takes a ModRM operand. `reg` goes in the
+  // reg field (a register or the /digit opcode extension), `rm` is the register or memory operand. `imm_size` is how many immediate
+  // bytes the caller emits afterwards, a rip-relative displacement is relative to the end of those.
+  inline void emit_modrm(std::initializer_list<uint8_t> opcode, uint8_t size, uint8_t reg, bool reg_byte_rex, const Operand& rm,
+                         int imm_size = 0)
+  {
+    uint8_t rex = 0;
+    if (size == 8) {
+      rex |= 0x48;
+    }
+    if ((reg & 8) != 0) {
+      rex |= 0x44;
+    }
+    if (reg_byte_rex || rm.byte_rex) {
+      rex |= 0x40;
+    }
+    if (rm.reg != no_reg && (rm.reg & 8) != 0) {
+      rex |= 0x41;
+    }
+    if (rm.kind == Operand::Kind::mem && rm.index != no_reg && (rm.index & 8) != 0) {
+      rex |= 0x42;
+    }
+    if (rex != 0) {
+      emit8(rex);
+    }
+    for (uint8_t byte : opcode) {
+      emit8(byte);
+    }
+    emit_address(reg, rm, imm_size);
+  }
+
+  // The VEX prefix, opcode, ModRM byte, SIB byte and displacement of a 66-prefixed instruction in opcode map `map` (1: 0F, 2: 0F38,
+  // 3: 0F3A). `l256` is for ymm operands, `vvvv` the register of the extra source operand (0 when there is none, it's stored inverted).
+  // The two byte form is used where it can say everything, the way nasm picks
+  inline void emit_vex(uint8_t map, bool wide, bool l256, uint8_t vvvv, uint8_t opcode, uint8_t reg, const Operand& rm,
+                       int imm_size = 0)
+  {
+    bool r = (reg & 8) != 0;
+    bool x = rm.kind == Operand::Kind::mem && rm.index != no_reg && (rm.index & 8) != 0;
+    bool b = rm.reg != no_reg && (rm.reg & 8) != 0;
+    uint8_t last = static_cast<uint8_t>((~vvvv & 15) << 3 | (l256 ? 0x04 : 0x00) | 0x01); // pp 01 is the 66 prefix
+    if (map == 1 && !wide && !x && !b) {
+      emit8(0xc5);
+      emit8(static_cast<uint8_t>((r ? 0x00 : 0x80) | last));
+    }
+    else {
+      emit8(0xc4);
+      emit8(static_cast<uint8_t>((r ? 0x00 : 0x80) | (x ? 0x00 : 0x40) | (b ? 0x00 : 0x20) | map));
+      emit8(static_cast<uint8_t>((wide ? 0x80 : 0x00) | last));
+    }
+    emit8(opcode);
+    emit_address(reg, rm, imm_size);
+  }
+
+  // The ModRM byte, SIB byte and displacement that follow the opcode, see emit_modrm
+  inline void emit_address(uint8_t reg, const Operand& rm, int imm_size)
+  {
+    uint8_t reg_field = static_cast<uint8_t>((reg & 7) << 3);
+    if (rm.kind == Operand::Kind::reg) {
+      emit8(0xc0 | reg_field | (rm.reg & 7));
+      return;
+    }
+    if (rm.kind != Operand::Kind::mem) {
+      error("expected a register or memory operand");
+    }
+
+    // [label]: rip-relative
+    if (rm.reg == no_reg && rm.index == no_reg) {
+      if (rm.label.empty()) {
+        error("absolute addresses aren't supported");
+      }
+      emit8(reg_field | 5);
+      add_fixup(Fixup::Kind::rel32, rm.label, current().size() + 4 + imm_size);
+      emit_le(static_cast<uint64_t>(rm.value), 4);
+      return;
+    }
+
+    // A label next to registers is an absolute 32-bit address, which works since the executable isn't position independent
+    bool disp32 = !rm.label.empty() || !fits_int8(rm.value);
+    if (!fits_int32(rm.value)) {
+      error("displacement out of range");
+    }
+    uint8_t mod = disp32 ? 0x80 : (rm.value != 0 || (rm.reg & 7) == 5) ? 0x40 : 0x00;
+    if (rm.reg == no_reg) {
+      // [index*scale + disp32] has no base, which is encoded as base 101 with mod 00
+      emit8(reg_field | 4);
+      emit8(static_cast<uint8_t>(rm.scale << 6 | (rm.index & 7) << 3 | 5));
+      mod = 0x80;
+    }
+    else if (rm.index != no_reg) {
+      emit8(mod | reg_field | 4);
+      emit8(static_cast<uint8_t>(rm.scale << 6 | (rm.index & 7) << 3 | (rm.reg & 7)));
+    }
+    else if ((rm.reg & 7) == 4) {
+      // rsp and r12 as a base need a SIB byte
+      emit8(mod | reg_field | 4);
+      emit8(0x24);
+    }
+    else {
+      emit8(mod | reg_field | (rm.reg & 7));
+    }
+    if (!rm.label.empty()) {
+      add_fixup(Fixup::Kind::abs32, rm.label, 0);
+      emit_le(static_cast<uint64_t>(rm.value), 4);
+    }
+    else if (mod == 0x40) {
+      emit8(static_cast<uint8_t>(rm.value));
+    }
+    else if (mod == 0x80) {
+      emit_le(static_cast<uint64_t>(rm.value), 4);
+    }
+  }
+
+  inline void add_fixup(Fixup::Kind kind, std::string_view label, size_t end)
+  {
+    m_fixups.push_back({ .kind = kind, .section = m_section, .offset = current().size(), .end = end, .label = label });
+  }
+
+  // The operand size of an instruction: the register's, or what the memory operand says
+  inline uint8_t operand_size(const Operand& dst)
+  {
+    return operand_size(dst, Operand {});
+  }
+
+  inline uint8_t operand_size(const Operand& dst, const Operand& src)
+  {
+    uint8_t size = dst.size != 0 ? dst.size : src.size;
+    if (size == 0) {
+      error("operation size not specified");
+    }
+    if (dst.size != 0 && src.kind == Operand::Kind::reg && src.size != dst.size) {
+      error("mismatched operand sizes");
+    }
+    return size;
+  }
+
+  inline void emit_imm(int64_t value, int size)
+  {
+    if ((size == 1 && !fits_int8(value) && (value < 0 || value > 0xff)) || (size == 4 && !fits_int32(value))) {
+      error("immediate out of range");
+    }
+    emit_le(static_cast<uint64_t>(value), size);
+  }
+
+  inline void assemble_line(std::string_view line)
+  {
+    line = trim(line.substr(0, comment_start(line)));
+    if (line.empty()) {
+      return;
+    }
+
+    // `name:` labels, possibly followed by a directive or instruction on the same line
+    size_t word_end = line.find_first_of(" \t");
+    std::string_view first = line.substr(0, word_end);
+    if (first.ends_with(':')) {
+      define_label(first.substr(0, first.size() - 1));
+      line = trim(word_end == std::string_view::npos ? std::string_view {} : line.substr(word_end));
+      if (line.empty()) {
+        return;
+      }
+      word_end = line.find_first_of(" \t");
+    }
+
+    std::string_view mnemonic = line.substr(0, word_end);
+    std::string_view rest = word_end == std::string_view::npos ? std::string_view {} : trim(line.substr(word_end));
+
+    if (mnemonic == "section") {
+      if (rest == ".text") {
+        m_section = Section::text;
+      }
+      else if (rest == ".rodata") {
+        m_section = Section::rodata;
+      }
+      else if (rest == ".data") {
+        m_section = Section::data;
+      }
+      else if (rest == ".bss") {
+        m_section = Section::bss;
+      }
+      else {
+        error("unknown section");
+      }
+      return;
+    }
+    if (mnemonic == "rep") {
+      // The only string instruction is movsb, its repeat prefix goes in front of it
+      if (rest != "movsb") {
+        error("rep only goes with movsb");
+      }
+      emit8(0xf3);
+      emit8(0xa4);
+      return;
+    }
+    if (mnemonic == "global") {
+      return; // The only global is _start, the ELF writer looks it up by name
+    }
+    if (mnemonic == "db" || mnemonic == "dq") {
+      assemble_data(mnemonic == "dq" ? 8 : 1, rest);
+      return;
+    }
+    if (mnemonic == "resb" || mnemonic == "resq") {
+      if (m_section != Section::bss) {
+        error("resb / resq outside of .bss");
+      }
+      int64_t count = 0;
+      if (!parse_number(rest, count) || count < 0) {
+        error("bad reservation size");
+      }
+      m_bss_size += static_cast<uint64_t>(count) * (mnemonic == "resq" ? 8 : 1);
+      return;
+    }
+
+    std::vector<std::string_view> texts = split_operands(rest);
+    if (texts.size() > 4) {
+      error("too many operands");
+    }
+    Operand ops[4];
+    for (size_t i = 0; i < texts.size(); i++) {
+      ops[i] = parse_operand(texts[i]);
+    }
+    assemble_instruction(mnemonic, texts.size(), ops);
+  }
+
+  // db / dq: numbers, backquoted NASM strings with C-style escapes, and (dq only) label addresses
+  inline void assemble_data(int size, std::string_view rest)
+  {
+    for (std::string_view item : split_operands(rest)) {
+      if (item.size() >= 2 && (item.front() == '`' || item.front() == '"' || item.front() == '\'') && item.back() == item.front()
+          && size == 1) {
+        assemble_string(item.substr(1, item.size() - 2), item.front() == '`');
+        continue;
+      }
+      int64_t value = 0;
+      if (parse_number(item, value)) {
+        emit_le(static_cast<uint64_t>(value), size);
+      }
+      else if (size == 8 && !item.empty()) {
+        add_fixup(Fixup::Kind::abs64, item, 0);
+        emit_le(0, 8);
+      }
+      else {
+        error("bad data item");
+      }
+    }
+  }
+
+  inline void assemble_string(std::string_view text, bool escapes)
+  {
+    for (size_t i = 0; i < text.size(); i++) {
+      char c = text[i];
+      if (!escapes || c != '\\' || i + 1 == text.size()) {
+        emit8(static_cast<uint8_t>(c));
+        continue;
+      }
+      c = text[++i];
+      switch (c) {
+      case 'n':
+        emit8('\n');
+        break;
+      case 't':
+        emit8('\t');
+        break;
+      case 'r':
+        emit8('\r');
+        break;
+      case 'a':
+        emit8('\a');
+        break;
+      case 'b':
+        emit8('\b');
+        break;
+      case 'f':
+        emit8('\f');
+        break;
+      case 'v':
+        emit8('\v');
+        break;
+      case 'e':
+        emit8(0x1b);
+        break;
+      case 'x': {
+        // Up to two hex digits
+        uint8_t value = 0;
+        size_t digits = 0;
+        while (digits < 2 && i + 1 < text.size() && std::isxdigit(static_cast<unsigned char>(text[i + 1]))) {
+          char d = text[++i];
+          value = static_cast<uint8_t>(value * 16 + (d <= '9' ? d - '0' : (d | 0x20) - 'a' + 10));
+          digits++;
+        }
+        emit8(value);
+        break;
+      }
+      default:
+        if (c >= '0' && c <= '7') {
+          // Up to three octal digits
+          uint8_t value = static_cast<uint8_t>(c - '0');
+          for (int digits = 1; digits < 3 && i + 1 < text.size() && text[i + 1] >= '0' && text[i + 1] <= '7'; digits++) {
+            value = static_cast<uint8_t>(value * 8 + (text[++i] - '0'));
+          }
+          emit8(value);
+        }
+        else {
+          emit8(static_cast<uint8_t>(c)); // \\, \`, \", \' and \? are the character itself
+        }
+        break;
+      }
+    }
+  }
+
+  // The legacy SSE encoding of a 66-prefixed instruction: 66, a REX prefix if it needs one (REX.W with `wide`), 0F and the opcode
+  inline void emit_sse(uint8_t opcode, bool wide, uint8_t reg, const Operand& rm, int imm_size = 0)
+  {
+    emit8(0x66);
+    emit_modrm({ 0x0f, opcode }, wide ? 8 : 0, reg, false, rm, imm_size);
+  }
+
+  // The SSE2 and AVX2 instructions on quadword lanes the vector loops use, false if `mnemonic` isn't one of them. The VEX forms of the
+  // arithmetic take a separate destination and work on xmm or ymm registers, the SSE2 ones only on xmm and overwrite their first operand
+  inline bool assemble_vector_instruction(std::string_view mnemonic, size_t count, const Operand* ops)
+  {
+    using Kind = Operand::Kind;
+    auto is_vector = [](const Operand& op, uint8_t size) { return op.kind == Kind::reg && op.size == size; };
+    auto is_vector_or_mem = [&](const Operand& op, uint8_t size) { return is_vector(op, size) || op.kind == Kind::mem; };
+    auto is_gpr_or_mem = [](const Operand& op) { return (op.kind == Kind::reg && op.size == 8) || op.kind == Kind::mem; };
+    auto expect = [&](size_t n, bool valid) {
+      if (count != n || !valid) {
+        error("bad operands");
+      }
+    };
+    auto imm8 = [&](const Operand& op) {
+      if (op.kind != Kind::imm) {
+        error("bad operands");
+      }
+      emit_imm(op.value, 1);
+    };
+    auto is_vex_form = [&](std::string_view name) {
+      return mnemonic.size() == name.size() + 1 && mnemonic[0] == 'v' && mnemonic.substr(1) == name;
+    };
+    bool vex = mnemonic.starts_with('v');
+    uint8_t size = ops[0].size;
+    bool xmm_or_ymm = size == 16 || size == 32;
+
+    // op xmm, xmm/m128 | vop x/ymm, x/ymm, x/ymm/m: the opcode after 66 0F
+    static constexpr std::pair<std::string_view, uint8_t> packed[] = {
+      { "paddq", 0xd4 }, { "psubq", 0xfb }, { "pmuludq", 0xf4 }, { "punpcklqdq", 0x6c },
+    };
+    for (auto [name, opcode] : packed) {
+      if (mnemonic == name) {
+        expect(2, is_vector(ops[0], 16) && is_vector_or_mem(ops[1], 16));
+        emit_sse(opcode, false, ops[0].reg, ops[1]);
+        return true;
+      }
+      if (is_vex_form(name)) {
+        expect(3, xmm_or_ymm && is_vector(ops[0], size) && is_vector(ops[1], size) && is_vector_or_mem(ops[2], size));
+        emit_vex(1, false, size == 32, ops[1].reg, opcode, ops[0].reg, ops[2]);
+        return true;
+      }
+    }
+
+    // Shifts of every quadword by an immediate, 66 0F 73 /digit ib. The VEX form has its destination in vvvv
+    static constexpr std::pair<std::string_view, uint8_t> shifts[] = { { "psrlq", 2 }, { "psllq", 6 } };
+    for (auto [name, digit] : shifts) {
+      if (mnemonic == name) {
+        expect(2, is_vector(ops[0], 16));
+        emit_sse(0x73, false, digit, ops[0], 1);
+        imm8(ops[1]);
+        return true;
+      }
+      if (is_vex_form(name)) {
+        expect(3, xmm_or_ymm && is_vector(ops[0], size) && is_vector(ops[1], size));
+        emit_vex(1, false, size == 32, ops[0].reg, 0x73, digit, ops[1], 1);
+        imm8(ops[2]);
+        return true;
+      }
+    }
+
+    if (mnemonic == "movdqa") {
+      expect(2, is_vector(ops[0], 16) && is_vector_or_mem(ops[1], 16));
+      emit_sse(0x6f, false, ops[0].reg, ops[1]);
+      return true;
+    }
+    if (mnemonic == "pshufd" || mnemonic == "vpshufd") {
+      expect(3, is_vector(ops[0], 16) && is_vector_or_mem(ops[1], 16));
+      if (vex) {
+        emit_vex(1, false, false, 0, 0x70, ops[0].reg, ops[1], 1);
+      }
+      else {
+        emit_sse(0x70, false, ops[0].reg, ops[1], 1);
+      }
+      imm8(ops[2]);
+      return true;
+    }
+    if (mnemonic == "movq" || mnemonic == "vmovq") {
+      // Between a general purpose register or memory and the low quadword of an xmm register, a load zeroes the rest of the register
+      expect(2, true);
+      bool load = is_vector(ops[0], 16) && is_gpr_or_mem(ops[1]);
+      if (!load && !(is_gpr_or_mem(ops[0]) && is_vector(ops[1], 16))) {
+        error("bad operands");
+      }
+      const Operand& xmm = load ? ops[0] : ops[1];
+      const Operand& rm = load ? ops[1] : ops[0];
+      uint8_t opcode = load ? 0x6e : 0x7e;
+      if (vex) {
+        emit_vex(1, true, false, 0, opcode, xmm.reg, rm);
+      }
+      else {
+        emit_sse(opcode, true, xmm.reg, rm);
+      }
+      return true;
+    }
+    if (mnemonic == "vpbroadcastq") {
+      expect(2, xmm_or_ymm && is_vector(ops[0], size) && is_vector_or_mem(ops[1], 16));
+      emit_vex(2, false, size == 32, 0, 0x59, ops[0].reg, ops[1]);
+      return true;
+    }
+    if (mnemonic == "vinserti128") {
+      expect(4, is_vector(ops[0], 32) && is_vector(ops[1], 32) && is_vector_or_mem(ops[2], 16));
+      emit_vex(3, false, true, ops[1].reg, 0x38, ops[0].reg, ops[2], 1);
+      imm8(ops[3]);
+      return true;
+    }
+    if (mnemonic == "vextracti128") {
+      expect(3, is_vector_or_mem(ops[0], 16) && is_vector(ops[1], 32));
+      emit_vex(3, false, true, 0, 0x39, ops[1].reg, ops[0], 1);
+      imm8(ops[2]);
+      return true;
+    }
+    return false;
+  }
+
+  inline void assemble_instruction(std::string_view mnemonic, size_t count, Operand* ops)
+  {
+    using Kind = Operand::Kind;
+    Operand& dst = ops[0];
+    Operand& src = ops[1];
+    auto expect = [&](size_t n) {
+      if (count != n) {
+        error("wrong number of operands");
+      }
+    };
+
+    if (assemble_vector_instruction(mnemonic, count, ops)) {
+      return;
+    }
+    // Everything below works on general purpose registers only
+    for (size_t i = 0; i < count; i++) {
+      if (ops[i].kind == Kind::reg && ops[i].size > 8) {
+        error("bad operands");
+      }
+    }
+
+    // No operands
+    struct Plain {
+      std::string_view name;
+      uint8_t bytes[3];
+      uint8_t length;
+    };
+    static constexpr Plain plain[] = {
+      { "ret", { 0xc3 }, 1 }, { "syscall", { 0x0f, 0x05 }, 2 }, { "cqo", { 0x48, 0x99 }, 2 }, { "nop", { 0x90 }, 1 },
+      { "rdtsc", { 0x0f, 0x31 }, 2 }, { "vzeroupper", { 0xc5, 0xf8, 0x77 }, 3 },
+    };
+    for (const Plain& op : plain) {
+      if (mnemonic == op.name) {
+        expect(0);
+        for (uint8_t i = 0; i < op.length; i++) {
+          emit8(op.bytes[i]);
+        }
+        return;
+      }
+    }
+
+    // add, or, and, sub, xor, cmp: the classic ALU group, named by its /digit
+    static constexpr std::pair<std::string_view, uint8_t> alu[] = {
+      { "add", 0 }, { "or", 1 }, { "adc", 2 }, { "sbb", 3 }, { "and", 4 }, { "sub", 5 }, { "xor", 6 }, { "cmp", 7 },
+    };
+    for (auto [name, digit] : alu) {
+      if (mnemonic != name) {
+        continue;
+      }
+      expect(2);
+      uint8_t size = operand_size(dst, src);
+      uint8_t base = static_cast<uint8_t>(digit << 3);
+      uint8_t wide = size == 1 ? 0 : 1;
+      if (src.kind == Kind::imm) {
+        if (size == 1) {
+          emit_modrm({ 0x80 }, size, digit, false, dst, 1);
+          emit_imm(src.value, 1);
+        }
+        else if (fits_int8(src.value)) {
+          emit_modrm({ 0x83 }, size, digit, false, dst, 1);
+          emit_imm(src.value, 1);
+        }
+        else {
+          emit_modrm({ 0x81 }, size, digit, false, dst, 4);
+          emit_imm(src.value, 4);
+        }
+      }
+      else if (src.kind == Kind::reg) {
+        emit_modrm({ static_cast<uint8_t>(base | wide) }, size, src.reg, src.byte_rex, dst);
+      }
+      else if (dst.kind == Kind::reg && src.kind == Kind::mem) {
+        emit_modrm({ static_cast<uint8_t>(base | 2 | wide) }, size, dst.reg, dst.byte_rex, src);
+      }
+      else {
+        error("bad operands");
+      }
+      return;
+    }
+
+    // Single r/m operand instructions: the opcode for 8-bit operands, the one for wider ones and the /digit
+    struct Unary {
+      std::string_view name;
+      uint8_t byte_opcode;
+      uint8_t opcode;
+      uint8_t digit;
+    };
+    static constexpr Unary unary[] = {
+      { "inc", 0xfe, 0xff, 0 }, { "dec", 0xfe, 0xff, 1 }, { "not", 0xf6, 0xf7, 2 }, { "neg", 0xf6, 0xf7, 3 },
+      { "mul", 0xf6, 0xf7, 4 }, { "div", 0xf6, 0xf7, 6 }, { "idiv", 0xf6, 0xf7, 7 },
+    };
+    for (const Unary& op : unary) {
+      if (mnemonic == op.name) {
+        expect(1);
+        uint8_t size = operand_size(dst);
+        emit_modrm({ size == 1 ? op.byte_opcode : op.opcode }, size, op.digit, false, dst);
+        return;
+      }
+    }
+
+    // Shifts by an immediate or by cl
+    static constexpr std::pair<std::string_view, uint8_t> shifts[] = {
+      { "shl", 4 }, { "sal", 4 }, { "shr", 5 }, { "sar", 7 },
+    };
+    for (auto [name, digit] : shifts) {
+      if (mnemonic != name) {
+        continue;
+      }
+      expect(2);
+      uint8_t size = operand_size(dst);
+      uint8_t wide = size == 1 ? 0 : 1;
+      if (src.kind == Kind::imm) {
+        emit_modrm({ static_cast<uint8_t>(0xc0 | wide) }, size, digit, false, dst, 1);
+        emit_imm(src.value & 0x3f, 1);
+      }
+      else if (src.kind == Kind::reg && src.reg == 1 && src.size == 1) {
+        emit_modrm({ static_cast<uint8_t>(0xd2 | wide) }, size, digit, false, dst);
+      }
+      else {
+        error("bad shift count");
+      }
+      return;
+    }
+
+    if (mnemonic.size() > 1 && mnemonic[0] == 'j' && mnemonic != "jmp") {
+      int cc = condition_code(mnemonic.substr(1));
+      if (cc < 0 || count != 1 || dst.kind != Kind::label) {
+        error("bad conditional jump");
+      }
+      emit8(0x0f);
+      emit8(static_cast<uint8_t>(0x80 | cc));
+      add_fixup(Fixup::Kind::rel32, dst.label, current().size() + 4);
+      emit_le(0, 4);
+      return;
+    }
+    if (mnemonic.starts_with("set")) {
+      int cc = condition_code(mnemonic.substr(3));
+      if (cc < 0 || count != 1 || operand_size(dst) != 1) {
+        error("bad setcc");
+      }
+      emit_modrm({ 0x0f, static_cast<uint8_t>(0x90 | cc) }, 1, 0, false, dst);
+      return;
+    }
+    if (mnemonic == "jmp" || mnemonic == "call") {
+      expect(1);
+      if (dst.kind == Kind::label) {
+        emit8(mnemonic == "jmp" ? 0xe9 : 0xe8);
+        add_fixup(Fixup::Kind::rel32, dst.label, current().size() + 4);
+        emit_le(0, 4);
+      }
+      else {
+        // Indirect through a register or memory, always 64 bits so no REX.W
+        emit_modrm({ 0xff }, 0, mnemonic == "jmp" ? 4 : 2, false, dst);
+      }
+      return;
+    }
+
+    if (mnemonic == "push" || mnemonic == "pop") {
+      expect(1);
+      bool push = mnemonic == "push";
+      if (dst.kind == Kind::reg) {
+        if (dst.size != 8) {
+          error("push and pop take 64-bit registers");
+        }
+        if ((dst.reg & 8) != 0) {
+          emit8(0x41);
+        }
+        emit8(static_cast<uint8_t>((push ? 0x50 : 0x58) | (dst.reg & 7)));
+      }
+      else if (dst.kind == Kind::mem) {
+        emit_modrm({ static_cast<uint8_t>(push ? 0xff : 0x8f) }, 0, push ? 6 : 0, false, dst);
+      }
+      else if (push && dst.kind == Kind::imm) {
+        // Sign extended to 64 bits
+        if (fits_int8(dst.value)) {
+          emit8(0x6a);
+          emit_imm(dst.value, 1);
+        }
+        else {
+          emit8(0x68);
+          emit_imm(dst.value, 4);
+        }
+      }
+      else {
+        error("bad operand");
+      }
+      return;
+    }
+
+    if (mnemonic == "mov") {
+      expect(2);
+      uint8_t size = operand_size(dst, src);
+      uint8_t wide = size == 1 ? 0 : 1;
+      if (src.kind == Kind::imm) {
+        if (dst.kind == Kind::reg && size == 8 && !fits_int32(src.value)) {
+          // The full 64-bit immediate, or the 32-bit form when the upper half is zero (writing a 32-bit register clears the rest)
+          bool zero_extends = static_cast<uint64_t>(src.value) <= std::numeric_limits<uint32_t>::max();
+          uint8_t rex = static_cast<uint8_t>((zero_extends ? 0x40 : 0x48) | ((dst.reg & 8) != 0 ? 0x01 : 0x00));
+          if (rex != 0x40) {
+            emit8(rex);
+          }
+          emit8(static_cast<uint8_t>(0xb8 | (dst.reg & 7)));
+          emit_le(static_cast<uint64_t>(src.value), zero_extends ? 4 : 8);
+        }
+        else if (dst.kind == Kind::reg && size == 8 && src.value >= 0) {
+          // mov r32, imm32 is a byte shorter than the sign extending form
+          if ((dst.reg & 8) != 0) {
+            emit8(0x41);
+          }
+          emit8(static_cast<uint8_t>(0xb8 | (dst.reg & 7)));
+          emit_le(static_cast<uint64_t>(src.value), 4);
+        }
+        else {
+          int imm_size = size == 1 ? 1 : 4;
+          emit_modrm({ static_cast<uint8_t>(0xc6 | wide) }, size, 0, false, dst, imm_size);
+          emit_imm(src.value, imm_size);
+        }
+      }
+      else if (src.kind == Kind::reg) {
+        emit_modrm({ static_cast<uint8_t>(0x88 | wide) }, size, src.reg, src.byte_rex, dst);
+      }
+      else if (dst.kind == Kind::reg && src.kind == Kind::mem) {
+        emit_modrm({ static_cast<uint8_t>(0x8a | wide) }, size, dst.reg, dst.byte_rex, src);
+      }
+      else {
+        error("bad operands");
+      }
+      return;
+    }
+
+    if (mnemonic == "movzx") {
+      expect(2);
+      if (dst.kind != Kind::reg || dst.size == 1 || src.size != 1) {
+        error("bad movzx");
+      }
+      emit_modrm({ 0x0f, 0xb6 }, dst.size, dst.reg, false, src);
+      return;
+    }
+
+    if (mnemonic == "lea") {
+      expect(2);
+      if (dst.kind != Kind::reg || dst.size == 1 || src.kind != Kind::mem) {
+        error("bad lea");
+      }
+      emit_modrm({ 0x8d }, dst.size, dst.reg, false, src);
+      return;
+    }
+
+    if (mnemonic == "test") {
+      expect(2);
+      uint8_t size = operand_size(dst, src);
+      uint8_t wide = size == 1 ? 0 : 1;
+      if (src.kind == Kind::reg) {
+        emit_modrm({ static_cast<uint8_t>(0x84 | wide) }, size, src.reg, src.byte_rex, dst);
+      }
+      else if (src.kind == Kind::imm) {
+        int imm_size = size == 1 ? 1 : 4;
+        emit_modrm({ static_cast<uint8_t>(0xf6 | wide) }, size, 0, false, dst, imm_size);
+        emit_imm(src.value, imm_size);
+      }
+      else {
+        error("bad operands");
+      }
+      return;
+    }
+
+    if (mnemonic == "imul") {
+      // imul r/m (rdx:rax = rax * r/m), imul r, r/m, or imul r, r/m, imm where the two-operand imul r, imm means imul r, r, imm
+      if (count == 1) {
+        uint8_t size = operand_size(dst);
+        emit_modrm({ static_cast<uint8_t>(size == 1 ? 0xf6 : 0xf7) }, size, 5, false, dst);
+        return;
+      }
+      if (dst.kind != Kind::reg || dst.size == 1) {
+        error("bad imul");
+      }
+      Operand rm = src;
+      Operand imm = ops[2];
+      if (count == 2 && src.kind == Kind::imm) {
+        rm = dst;
+        imm = src;
+      }
+      if (imm.kind == Kind::imm) {
+        if (fits_int8(imm.value)) {
+          emit_modrm({ 0x6b }, dst.size, dst.reg, false, rm, 1);
+          emit_imm(imm.value, 1);
+        }
+        else {
+          emit_modrm({ 0x69 }, dst.size, dst.reg, false, rm, 4);
+          emit_imm(imm.value, 4);
+        }
+      }
+      else if (count == 2) {
+        emit_modrm({ 0x0f, 0xaf }, operand_size(dst, src), dst.reg, false, src);
+      }
+      else {
+        error("bad imul");
+      }
+      return;
+    }
+
+    error("unsupported instruction");
+  }
+
+  std::string_view m_source;
+  std::string_view m_line {}; // The line being assembled, for error messages
+  Section m_section = Section::text;
+  std::vector<uint8_t> m_text {};
+  std::vector<uint8_t> m_rodata {};
+  std::vector<uint8_t> m_data {};
+  uint64_t m_bss_size = 0;
+  std::unordered_map<std::string_view, Symbol> m_symbols {};
+  std::vector<Fixup> m_fixups {};
+};
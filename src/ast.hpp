@@ -0,0 +1,189 @@
+// This file defines the Abstract Syntax Tree the parser builds and the generator reads.
+// The tree is stored flat: every node is a 16 byte `Node` in one contiguous array and children are referred to by their 32-bit index in
+// that array instead of by pointer. A node is a kind tag plus three 32-bit operands whose meaning depends on the kind (see `NodeKind`),
+// binary expressions carry an operator enum instead of there being one node type per operator.
+// Nodes with a variable number of children (scopes, call arguments, function parameters) point at a list in `lists`: one entry holding
+// the count followed by the entries themselves. String literal bytes are copied into `strings`.
+// Because there are no pointers the whole tree is three arrays, which keeps traversal cache friendly and makes it trivial to copy,
+// serialise or map back in from disk.
+
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "./interner.hpp"
+
+using NodeIndex = uint32_t;
+
+inline constexpr NodeIndex null_node = std::numeric_limits<NodeIndex>::max();
+
+// Operands of each kind of node (a, b, c are Node::a, Node::b, Node::c)
+enum class NodeKind : uint8_t {
+  // Expressions
+  int_lit, // a, b = low and high 32 bits of the value
+  bool_lit, // a = 0 or 1
+  string_lit, // a = offset into strings, b = length (raw text, escape sequences included)
+  ident, // a = SymbolId
+  bin_expr, // op = operator, a = lhs, b = rhs
+  func_call, // a = SymbolId of the function, b = list of argument expressions
+
+  // Statements
+  prog, // a = list of top level statements
+  scope, // a = list of statements
+  stmt_exit, // a = expression
+  stmt_let, // a = SymbolId, b = expression
+  stmt_assign, // a = SymbolId, b = expression
+  stmt_expr, // a = expression evaluated for its side effects (a call)
+  stmt_if, // a = condition, b = scope, c = else branch: null_node, a scope, or another stmt_if for `else if`
+  stmt_while, // a = condition, b = scope
+  stmt_for, // a = list of exactly four: init statement, condition, step statement, scope. init and step may be null_node
+  stmt_print, // a = expression
+  stmt_return, // a = expression
+  func_def, // a = SymbolId, b = list of parameter SymbolIds, c = body scope
+};
+
+enum class BinOp : uint8_t {
+  add,
+  sub,
+  mul,
+  div,
+  eq,
+  lt,
+  gt,
+  and_,
+  or_,
+};
+
+struct Node {
+  NodeKind kind;
+  BinOp op = BinOp::add; // bin_expr only
+  uint16_t flags = 0; // free for passes to annotate nodes
+  uint32_t a = null_node;
+  uint32_t b = null_node;
+  uint32_t c = null_node;
+
+  [[nodiscard]] inline int64_t int_value() const
+  {
+    return static_cast<int64_t>((static_cast<uint64_t>(b) << 32) | a);
+  }
+};
+
+static_assert(sizeof(Node) == 16);
+
+// The whole program: the node pool, the child lists and the string literal bytes. `root` is the prog node.
+class NodeProg {
+public:
+  std::vector<Node> nodes {};
+  std::vector<uint32_t> lists {};
+  std::string strings {};
+  NodeIndex root = null_node;
+
+  [[nodiscard]] inline const Node& operator[](NodeIndex index) const
+  {
+    return nodes[index];
+  }
+
+  [[nodiscard]] inline Node& operator[](NodeIndex index)
+  {
+    return nodes[index];
+  }
+
+  inline NodeIndex add(Node node)
+  {
+    nodes.push_back(node);
+    return static_cast<NodeIndex>(nodes.size() - 1);
+  }
+
+  inline NodeIndex add_int_lit(int64_t value)
+  {
+    auto bits = static_cast<uint64_t>(value);
+    return add({ .kind = NodeKind::int_lit, .a = static_cast<uint32_t>(bits), .b = static_cast<uint32_t>(bits >> 32) });
+  }
+
+  inline NodeIndex add_bin_expr(BinOp op, NodeIndex lhs, NodeIndex rhs)
+  {
+    return add({ .kind = NodeKind::bin_expr, .op = op, .a = lhs, .b = rhs });
+  }
+
+  // Store a list of children and return the index to put in the node
+  inline uint32_t add_list(std::span<const uint32_t> items)
+  {
+    auto index = static_cast<uint32_t>(lists.size());
+    lists.push_back(static_cast<uint32_t>(items.size()));
+    lists.insert(lists.end(), items.begin(), items.end());
+    return index;
+  }
+
+  [[nodiscard]] inline std::span<const uint32_t> list(uint32_t index) const
+  {
+    return { lists.data() + index + 1, lists[index] };
+  }
+
+  inline uint32_t add_string(std::string_view str)
+  {
+    auto offset = static_cast<uint32_t>(strings.size());
+    strings.append(str);
+    return offset;
+  }
+
+  [[nodiscard]] inline std::string_view string(const Node& node) const
+  {
+    assert(node.kind == NodeKind::string_lit);
+    return std::string_view(strings).substr(node.a, node.b);
+  }
+};
+
+// Whether the bin_expr itself (not its operands) can fault: a division by something that could be 0 (or -1, INT64_MIN / -1 faults too)
+[[nodiscard]] inline bool can_fault(const NodeProg& prog, const Node& bin_expr)
+{
+  if (bin_expr.op != BinOp::div) {
+    return false;
+  }
+  const Node& divisor = prog[bin_expr.b];
+  return divisor.kind != NodeKind::int_lit || divisor.int_value() == 0 || divisor.int_value() == -1;
+}
+
+// Whether evaluating the expression does anything besides producing its value: it calls a function, or divides by something that could be
+// 0 (see can_fault)
+[[nodiscard]] inline bool has_side_effects(const NodeProg& prog, NodeIndex expr)
+{
+  const Node& node = prog[expr];
+  switch (node.kind) {
+  case NodeKind::func_call:
+    return true;
+  case NodeKind::bin_expr:
+    return can_fault(prog, node) || has_side_effects(prog, node.a) || has_side_effects(prog, node.b);
+  default:
+    return false;
+  }
+}
+
+// Whether the program has a print statement anywhere. Exits flush the print buffer, and the print runtime is emitted, only in programs
+// that print at all
+[[nodiscard]] inline bool program_prints(const NodeProg& prog)
+{
+  for (const Node& node : prog.nodes) {
+    if (node.kind == NodeKind::stmt_print) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The pieces of code the backends generate separately, in the order they put them in the executable: the prog node for the main program
+// (the top level statements that aren't function definitions), then every func_def in source order
+[[nodiscard]] inline std::vector<NodeIndex> code_units(const NodeProg& prog)
+{
+  std::vector<NodeIndex> units = { prog.root };
+  for (NodeIndex index = 0; index < prog.nodes.size(); index++) {
+    if (prog[index].kind == NodeKind::func_def) {
+      units.push_back(index);
+    }
+  }
+  return units;
+}
@@ -0,0 +1,269 @@
+// This file reads and writes the parsed program as one flat binary file, so a parse can be kept and reused by later compilations (other
+// optimization levels, --dump-ir, analyses) without lexing and parsing the source again.
+// The AST already has no pointers (see ast.hpp), so the file is just its arrays laid end to end behind a fixed header, in host byte order:
+//   AstFileHeader | nodes (16 bytes each) | lists (u32) | name offsets (u32, symbol_count + 1) | string literal bytes | name bytes
+// The names are the interner's identifiers in SymbolId order, interning them again in that order gives every SymbolId in the nodes the
+// same meaning it had when the file was written. Every section is a multiple of 4 bytes long up to the two byte arrays at the end, so
+// a mapped file can be read in place: AstFile maps it and hands out spans into the mapping, loading it into a NodeProg is three copies.
+// The header keeps an XXH64 of the whole file (taken with that field 0), and every operand that refers to a node, a list, a symbol or
+// string bytes has to be in range. A file is rejected when the magic, the version, the size implied by the header, the hash or any
+// operand is off; bump `ast_file_version` whenever the layout or the meaning of a node changes.
+
+#pragma once
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "./ast.hpp"
+#include "./hash.hpp"
+#include "./interner.hpp"
+#include "./source.hpp"
+
+inline constexpr char ast_file_magic[8] = { 'H', 'Y', 'D', 'R', 'O', 'A', 'S', 'T' };
+inline constexpr uint32_t ast_file_version = 2;
+
+struct AstFileHeader {
+  char magic[8];
+  uint32_t version;
+  NodeIndex root;
+  uint32_t node_count;
+  uint32_t list_count;
+  uint32_t symbol_count;
+  uint32_t string_size;
+  uint32_t name_size;
+  uint32_t reserved = 0;
+  uint64_t file_hash; // ast_file_hash of the file
+};
+
+static_assert(sizeof(AstFileHeader) == 48);
+
+// The hash of a file with `header` in front of `payload` (everything behind the header), which goes into header.file_hash
+[[nodiscard]] inline uint64_t ast_file_hash(AstFileHeader header, std::string_view payload)
+{
+  header.file_hash = 0;
+  return xxh64(payload, xxh64(std::string_view(reinterpret_cast<const char*>(&header), sizeof(header))));
+}
+
+// Write `prog` and the names it refers to into `path`, false if the file can't be written
+inline bool write_ast_file(const std::string& path, const NodeProg& prog, const Interner& interner)
+{
+  std::vector<uint32_t> name_offsets;
+  name_offsets.reserve(interner.size() + 1);
+  std::string names;
+  for (SymbolId id = 0; id < interner.size(); id++) {
+    name_offsets.push_back(static_cast<uint32_t>(names.size()));
+    names.append(interner.name(id));
+  }
+  name_offsets.push_back(static_cast<uint32_t>(names.size()));
+
+  AstFileHeader header {};
+  std::memcpy(header.magic, ast_file_magic, sizeof(header.magic));
+  header.version = ast_file_version;
+  header.root = prog.root;
+  header.node_count = static_cast<uint32_t>(prog.nodes.size());
+  header.list_count = static_cast<uint32_t>(prog.lists.size());
+  header.symbol_count = static_cast<uint32_t>(interner.size());
+  header.string_size = static_cast<uint32_t>(prog.strings.size());
+  header.name_size = static_cast<uint32_t>(names.size());
+
+  std::string payload;
+  auto append = [&payload](const void* data, size_t size) { payload.append(static_cast<const char*>(data), size); };
+  append(prog.nodes.data(), prog.nodes.size() * sizeof(Node));
+  append(prog.lists.data(), prog.lists.size() * sizeof(uint32_t));
+  append(name_offsets.data(), name_offsets.size() * sizeof(uint32_t));
+  payload.append(prog.strings);
+  payload.append(names);
+  header.file_hash = ast_file_hash(header, payload);
+
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  auto write_all = [fd](const void* data, size_t size) {
+    auto bytes = static_cast<const char*>(data);
+    while (size > 0) {
+      ssize_t n = ::write(fd, bytes, size);
+      if (n <= 0) {
+        return false;
+      }
+      bytes += n;
+      size -= static_cast<size_t>(n);
+    }
+    return true;
+  };
+  bool ok = write_all(&header, sizeof(header)) && write_all(payload.data(), payload.size());
+  return ::close(fd) == 0 && ok;
+}
+
+// A mapped AST file, see the top of this file for the layout
+class AstFile {
+public:
+  // Map `path`, returns an empty optional if it can't be read or isn't an AST file of this version
+  static inline std::optional<AstFile> open(const std::string& path)
+  {
+    std::optional<SourceBuffer> buffer = SourceBuffer::open(path);
+    if (!buffer.has_value() || buffer->view().size() < sizeof(AstFileHeader)) {
+      return {};
+    }
+    AstFileHeader header {};
+    std::memcpy(&header, buffer->view().data(), sizeof(header));
+    if (std::memcmp(header.magic, ast_file_magic, sizeof(header.magic)) != 0 || header.version != ast_file_version) {
+      return {};
+    }
+    uint64_t expected = sizeof(AstFileHeader) + uint64_t { header.node_count } * sizeof(Node)
+      + (uint64_t { header.list_count } + header.symbol_count + 1) * sizeof(uint32_t) + header.string_size + header.name_size;
+    if (buffer->view().size() != expected || header.root >= header.node_count
+        || ast_file_hash(header, buffer->view().substr(sizeof(header))) != header.file_hash) {
+      return {};
+    }
+    AstFile file(std::move(buffer.value()), header);
+    if (!file.valid_nodes()) {
+      return {};
+    }
+    return file;
+  }
+
+  [[nodiscard]] inline NodeIndex root() const
+  {
+    return m_header.root;
+  }
+
+  [[nodiscard]] inline std::span<const Node> nodes() const
+  {
+    return { reinterpret_cast<const Node*>(m_buffer.view().data() + sizeof(AstFileHeader)), m_header.node_count };
+  }
+
+  [[nodiscard]] inline std::span<const uint32_t> lists() const
+  {
+    return { reinterpret_cast<const uint32_t*>(nodes().data() + m_header.node_count), m_header.list_count };
+  }
+
+  [[nodiscard]] inline std::string_view strings() const
+  {
+    return { reinterpret_cast<const char*>(name_offsets().data() + m_header.symbol_count + 1), m_header.string_size };
+  }
+
+  [[nodiscard]] inline size_t symbol_count() const
+  {
+    return m_header.symbol_count;
+  }
+
+  [[nodiscard]] inline std::string_view name(SymbolId id) const
+  {
+    std::span<const uint32_t> offsets = name_offsets();
+    std::string_view names(strings().data() + m_header.string_size, m_header.name_size);
+    return names.substr(offsets[id], offsets[id + 1] - offsets[id]);
+  }
+
+  // Copy the program into `prog` and its names into `interner`, which has to be empty. False if the names don't intern back into the ids
+  // they were written with (a damaged file), `interner` may have been partly filled by then
+  [[nodiscard]] inline bool load(NodeProg& prog, Interner& interner) const
+  {
+    for (SymbolId id = 0; id < m_header.symbol_count; id++) {
+      std::span<const uint32_t> offsets = name_offsets();
+      if (offsets[id] > offsets[id + 1] || offsets[id + 1] > m_header.name_size || interner.intern(name(id)) != id) {
+        return false;
+      }
+    }
+    prog.nodes.assign(nodes().begin(), nodes().end());
+    prog.lists.assign(lists().begin(), lists().end());
+    prog.strings.assign(strings());
+    prog.root = m_header.root;
+    return true;
+  }
+
+private:
+  inline AstFile(SourceBuffer&& buffer, const AstFileHeader& header)
+    : m_buffer(std::move(buffer))
+    , m_header(header)
+  {
+  }
+
+  [[nodiscard]] inline std::span<const uint32_t> name_offsets() const
+  {
+    return { lists().data() + m_header.list_count, m_header.symbol_count + 1 };
+  }
+
+  // Whether every operand of every node that refers to something is in range (see NodeKind for what each one is), so walking the program
+  // can't index outside its arrays. The root has to be the prog node
+  [[nodiscard]] inline bool valid_nodes() const
+  {
+    std::span<const Node> all = nodes();
+    std::span<const uint32_t> list_entries = lists();
+    auto node = [&](uint32_t index) { return index < all.size(); };
+    auto node_or_null = [&](uint32_t index) { return index == null_node || node(index); };
+    auto symbol = [&](uint32_t id) { return id < m_header.symbol_count; };
+    auto list = [&](uint32_t index, auto&& valid_entry) {
+      if (index >= list_entries.size() || list_entries[index] > list_entries.size() - index - 1) {
+        return false;
+      }
+      std::span<const uint32_t> entries = list_entries.subspan(index + 1, list_entries[index]);
+      return std::ranges::all_of(entries, valid_entry);
+    };
+    if (all[m_header.root].kind != NodeKind::prog) {
+      return false;
+    }
+    for (const Node& n : all) {
+      bool valid = false;
+      switch (n.kind) {
+      case NodeKind::int_lit:
+        valid = true;
+        break;
+      case NodeKind::bool_lit:
+        valid = n.a <= 1;
+        break;
+      case NodeKind::string_lit:
+        valid = uint64_t { n.a } + n.b <= m_header.string_size;
+        break;
+      case NodeKind::ident:
+        valid = symbol(n.a);
+        break;
+      case NodeKind::bin_expr:
+        valid = n.op <= BinOp::or_ && node(n.a) && node(n.b);
+        break;
+      case NodeKind::func_call:
+        valid = symbol(n.a) && list(n.b, node);
+        break;
+      case NodeKind::prog:
+      case NodeKind::scope:
+        valid = list(n.a, node);
+        break;
+      case NodeKind::stmt_exit:
+      case NodeKind::stmt_expr:
+      case NodeKind::stmt_print:
+      case NodeKind::stmt_return:
+        valid = node(n.a);
+        break;
+      case NodeKind::stmt_let:
+      case NodeKind::stmt_assign:
+        valid = symbol(n.a) && node(n.b);
+        break;
+      case NodeKind::stmt_if:
+        valid = node(n.a) && node(n.b) && node_or_null(n.c);
+        break;
+      case NodeKind::stmt_while:
+        valid = node(n.a) && node(n.b);
+        break;
+      case NodeKind::stmt_for:
+        valid = list(n.a, node_or_null) && list_entries[n.a] == 4 && node(list_entries[n.a + 2]) && node(list_entries[n.a + 4]);
+        break;
+      case NodeKind::func_def:
+        valid = symbol(n.a) && list(n.b, symbol) && node(n.c);
+        break;
+      }
+      if (!valid) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  SourceBuffer m_buffer;
+  AstFileHeader m_header;
+};
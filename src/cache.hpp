@@ -0,0 +1,291 @@
+// This file is the on-disk compilation cache. It keeps three kinds of entry, all stored under 64-bit XXH64 keys:
+// - finished executables, keyed on everything that decides what the executable looks like: the source bytes, the flags that change code
+//   generation, and the hydro binary itself, so rebuilding the compiler invalidates everything it cached before. On a hit the driver
+//   hands out the entry as the executable and skips tokenizing, parsing, code generation and assembling altogether. The executable is
+//   stored behind a CachedExecutableHeader with its XXH64, an entry that doesn't match it (a full disk, damage) is deleted and is a miss.
+// - parsed programs (see ast_file.hpp), keyed on the source and the compiler only, so a build at another optimization level, or one that
+//   wants the IR dump or the .asm file, still skips the tokenizer and the parser.
+// - the machine code of single functions (see object_file.hpp), keyed on what decides that function's code (see incremental.hpp), so
+//   when a file changed only the functions that changed with it are generated and assembled again.
+// Entries are written to a temporary file and renamed into place, so several hydro processes (or the -j threads of one) can share a
+// cache directory. The cache is trimmed to its size limit after a run by deleting entries oldest first: with the lru policy a hit counts
+// as a use and refreshes the entry's time, with fifo only storing it does. A cache remembers the size of its directory from its last trim
+// and adds what it stores, so a long-lived one (see CompileCaches) only reads the directory again once that goes over the limit.
+
+#pragma once
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "./ast_file.hpp"
+#include "./elf.hpp"
+#include "./hash.hpp"
+#include "./object_file.hpp"
+#include "./source.hpp"
+
+struct CacheOptions {
+  enum class Eviction : uint8_t {
+    lru, // least recently used (stored or hit) goes first
+    fifo, // least recently stored goes first
+  };
+
+  std::string dir {}; // empty: no cache
+  uint64_t max_bytes = 256ull << 20;
+  Eviction eviction = Eviction::lru;
+};
+
+inline constexpr char cached_executable_magic[8] = { 'H', 'Y', 'D', 'R', 'O', 'E', 'X', 'E' };
+inline constexpr uint32_t cached_executable_version = 1;
+
+// What is in front of the executable in a .bin entry, in host byte order
+struct CachedExecutableHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved = 0;
+  uint64_t size; // of the executable
+  uint64_t file_hash; // cached_executable_hash of the entry
+};
+
+static_assert(sizeof(CachedExecutableHeader) == 32);
+
+// The hash of an entry with `header` in front of `image`, which goes into header.file_hash
+[[nodiscard]] inline uint64_t cached_executable_hash(CachedExecutableHeader header, std::string_view image)
+{
+  header.file_hash = 0;
+  return xxh64(image, xxh64(std::string_view(reinterpret_cast<const char*>(&header), sizeof(header))));
+}
+
+class CompileCache {
+public:
+  inline explicit CompileCache(CacheOptions options)
+    : m_options(std::move(options))
+  {
+    std::error_code error;
+    std::filesystem::create_directories(m_options.dir, error);
+  }
+
+  // The hash of the running compiler, part of every key. Computed once per process
+  static inline uint64_t compiler_hash()
+  {
+    static const uint64_t hash = [] {
+      std::optional<SourceBuffer> self = SourceBuffer::open("/proc/self/exe");
+      return self.has_value() ? xxh64(self->view()) : 0;
+    }();
+    return hash;
+  }
+
+  // The executable cached under `key`, an empty optional on a miss
+  [[nodiscard]] inline std::optional<std::vector<uint8_t>> fetch(uint64_t key) const
+  {
+    std::filesystem::path entry = entry_path(key, executable_extension);
+    std::optional<SourceBuffer> file = SourceBuffer::open(entry);
+    if (!file.has_value()) {
+      return {};
+    }
+    std::string_view bytes = file->view();
+    CachedExecutableHeader header {};
+    if (bytes.size() >= sizeof(header)) {
+      std::memcpy(&header, bytes.data(), sizeof(header));
+    }
+    std::string_view image = bytes.substr(std::min(bytes.size(), sizeof(header)));
+    if (bytes.size() < sizeof(header) || std::memcmp(header.magic, cached_executable_magic, sizeof(header.magic)) != 0
+        || header.version != cached_executable_version || header.size != image.size()
+        || cached_executable_hash(header, image) != header.file_hash) {
+      std::error_code error;
+      std::filesystem::remove(entry, error); // it would never match, the next store replaces it
+      return {};
+    }
+    touch(entry);
+    return std::vector<uint8_t>(image.begin(), image.end());
+  }
+
+  // The program parsed from the source cached under `key`, its names interned into `interner` (which has to be empty). An empty optional
+  // on a miss, `interner` may have been partly filled by a damaged entry then
+  [[nodiscard]] inline std::optional<NodeProg> load_ast(uint64_t key, Interner& interner) const
+  {
+    std::filesystem::path entry = entry_path(key, ast_extension);
+    std::optional<AstFile> file = AstFile::open(entry);
+    NodeProg prog;
+    if (!file.has_value() || !file->load(prog, interner)) {
+      return {};
+    }
+    touch(entry);
+    return prog;
+  }
+
+  // The machine code cached under `key`, an empty optional on a miss
+  [[nodiscard]] inline std::optional<Assembler::Object> load_object(uint64_t key) const
+  {
+    std::filesystem::path entry = entry_path(key, object_extension);
+    std::optional<Assembler::Object> object = read_object_file(entry);
+    if (object.has_value()) {
+      touch(entry);
+    }
+    return object;
+  }
+
+  // Remember the executable `image` under `key`. Best effort: a cache that can't be written only costs the next build time
+  inline void store(uint64_t key, std::span<const uint8_t> image) const
+  {
+    publish(entry_path(key, executable_extension), [&](const std::filesystem::path& temp) { return write_entry(temp, image); });
+  }
+
+  // Remember the program parsed from the source with key `key`. Best effort, like store
+  inline void store_ast(uint64_t key, const NodeProg& prog, const Interner& interner) const
+  {
+    publish(entry_path(key, ast_extension), [&](const std::filesystem::path& temp) { return write_ast_file(temp, prog, interner); });
+  }
+
+  // Remember the machine code `object` under `key`. Best effort, like store
+  inline void store_object(uint64_t key, const Assembler::Object& object) const
+  {
+    publish(entry_path(key, object_extension), [&](const std::filesystem::path& temp) { return write_object_file(temp, object); });
+  }
+
+  // Delete entries, oldest first, until the cache fits in its size limit. Nothing to do, and the directory isn't read, while what the last
+  // trim left plus what was stored since fits. Entries other processes store only count from the next time the directory is read
+  inline void trim() const
+  {
+    std::lock_guard lock(m_trim_mutex);
+    if (m_trimmed_bytes.has_value() && m_trimmed_bytes.value() + m_stored_bytes.load() <= m_options.max_bytes) {
+      return;
+    }
+    m_stored_bytes = 0;
+    struct Entry {
+      std::filesystem::path path;
+      uint64_t size;
+      std::filesystem::file_time_type time;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    std::error_code error;
+    for (const auto& file : std::filesystem::directory_iterator(m_options.dir, error)) {
+      std::error_code file_error;
+      std::filesystem::path extension = file.path().extension();
+      if ((extension != executable_extension && extension != ast_extension && extension != object_extension)
+          || !file.is_regular_file(file_error)) {
+        continue;
+      }
+      Entry entry { file.path(), file.file_size(file_error), file.last_write_time(file_error) };
+      if (!file_error) {
+        total += entry.size;
+        entries.push_back(std::move(entry));
+      }
+    }
+    m_trimmed_bytes = total;
+    if (total <= m_options.max_bytes) {
+      return;
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) { return lhs.time < rhs.time; });
+    for (const Entry& entry : entries) {
+      if (total <= m_options.max_bytes) {
+        break;
+      }
+      if (std::filesystem::remove(entry.path, error)) {
+        total -= entry.size;
+      }
+    }
+    m_trimmed_bytes = total;
+  }
+
+private:
+  static constexpr std::string_view executable_extension = ".bin";
+  static constexpr std::string_view ast_extension = ".ast";
+  static constexpr std::string_view object_extension = ".obj";
+
+  [[nodiscard]] inline std::filesystem::path entry_path(uint64_t key, std::string_view extension) const
+  {
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string name(16, '0');
+    for (int i = 15; i >= 0; i--, key >>= 4) {
+      name[i] = digits[key & 15];
+    }
+    return std::filesystem::path(m_options.dir) / (name + std::string(extension));
+  }
+
+  // Count a hit as a use of the entry, under the lru policy
+  inline void touch(const std::filesystem::path& entry) const
+  {
+    if (m_options.eviction == CacheOptions::Eviction::lru) {
+      std::error_code error;
+      std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), error);
+    }
+  }
+
+  // Write the .bin entry for the executable `image` into `path`, false if the file can't be written
+  static inline bool write_entry(const std::filesystem::path& path, std::span<const uint8_t> image)
+  {
+    std::string_view bytes(reinterpret_cast<const char*>(image.data()), image.size());
+    CachedExecutableHeader header {};
+    std::memcpy(header.magic, cached_executable_magic, sizeof(header.magic));
+    header.version = cached_executable_version;
+    header.size = image.size();
+    header.file_hash = cached_executable_hash(header, bytes);
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    return static_cast<bool>(file.flush());
+  }
+
+  // Have write(temp) produce the entry in a file of its own and rename it into place, so nobody ever sees half an entry
+  template <typename F>
+  inline void publish(const std::filesystem::path& entry, F&& write) const
+  {
+    std::filesystem::path temp = entry;
+    temp += ".tmp" + std::to_string(getpid()) + "-" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::error_code error;
+    if (!write(temp)) {
+      std::filesystem::remove(temp, error);
+      return;
+    }
+    std::filesystem::rename(temp, entry, error);
+    if (error) {
+      std::filesystem::remove(temp, error);
+      return;
+    }
+    uint64_t size = std::filesystem::file_size(entry, error);
+    m_stored_bytes += error ? 0 : size;
+  }
+
+  CacheOptions m_options;
+  mutable std::mutex m_trim_mutex;
+  mutable std::optional<uint64_t> m_trimmed_bytes {}; // the directory's size after the last trim, none before the first
+  mutable std::atomic<uint64_t> m_stored_bytes = 0; // bytes stored since the directory was last read
+};
+
+// The caches of a process that runs many compiles, the compile server: one CompileCache per set of options, made the first time a
+// compile asks for it and kept, so the compiles share its bookkeeping instead of each reading the cache directory again
+class CompileCaches {
+public:
+  // The cache for `options`, the same one every time. Safe to call from several threads
+  [[nodiscard]] inline const CompileCache& get(const CacheOptions& options)
+  {
+    std::string key = std::filesystem::path(options.dir).lexically_normal().string();
+    key += '\0' + std::to_string(options.max_bytes) + (options.eviction == CacheOptions::Eviction::lru ? "lru" : "fifo");
+    std::lock_guard lock(m_mutex);
+    std::unique_ptr<CompileCache>& cache = m_caches[key];
+    if (cache == nullptr) {
+      cache = std::make_unique<CompileCache>(options);
+    }
+    return *cache;
+  }
+
+private:
+  std::mutex m_mutex;
+  std::unordered_map<std::string, std::unique_ptr<CompileCache>> m_caches;
+};
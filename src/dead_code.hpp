@@ -0,0 +1,624 @@
+// This file removes the code that can't change what a program does, on the AST after ConstantFolder, so neither backend spends time or
+// bytes on it:
+//   - unreachable statements: whatever follows an exit or return in the same statement list (or an if / scope that always ends in one),
+//     and the branches of an if, while or for whose condition folded to a constant
+//   - dead stores: an assignment that a later assignment in the same statement list overwrites before anything can read it
+//   - unused variables: a let nobody reads, together with every assignment to it. Parameters stay, the caller pushes them either way
+// A value with a side effect (a call, or a division that could fault) is still evaluated: the let or assignment becomes an expression
+// statement. Function definitions are never removed, they can be called from code that comes before them.
+// Names are resolved the way the code generators do it. A program with a name error is left exactly as it is, so the generator reports
+// the error it always has instead of the pass quietly deleting the code that has it.
+// Removed statements stay in the node pool, only the lists pointing at them change. A statement that goes away in the middle of a list
+// becomes an empty scope first and is dropped when the list is rebuilt.
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <ranges>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "./ast.hpp"
+#include "./interner.hpp"
+#include "./symbol_table.hpp"
+
+struct DeadCodeReport {
+  size_t unreachable = 0; // statements and constant-condition branches
+  size_t dead_stores = 0;
+  std::vector<std::string> unused_variables {}; // one entry per removed let, in the order they were found
+
+  [[nodiscard]] inline bool empty() const
+  {
+    return unreachable == 0 && dead_stores == 0 && unused_variables.empty();
+  }
+};
+
+class DeadCodeEliminator {
+public:
+  inline DeadCodeEliminator(NodeProg& prog, const Interner& interner)
+    : m_prog(prog)
+    , m_interner(interner)
+  {
+  }
+
+  inline DeadCodeReport run()
+  {
+    if (!resolve_program()) {
+      return {};
+    }
+    m_empty_list = m_prog.add_list({});
+    std::vector<NodeIndex> bodies { m_prog.root };
+    for (NodeIndex index = 0; index < m_prog.nodes.size(); index++) {
+      if (m_prog[index].kind == NodeKind::func_def) {
+        bodies.push_back(m_prog[index].c);
+      }
+    }
+    for (NodeIndex body : bodies) {
+      prune(body);
+    }
+    m_killed.assign(m_interner.size(), 0);
+    for (NodeIndex body : bodies) {
+      remove_dead_stores(body);
+    }
+    // Removing a variable can leave the ones its value was computed from unread, so this goes on until nothing changes
+    bool removed = true;
+    while (removed) {
+      std::fill(m_reads.begin(), m_reads.end(), 0);
+      for (NodeIndex body : bodies) {
+        count_reads_stmt(body);
+      }
+      removed = false;
+      for (NodeIndex body : bodies) {
+        removed |= remove_unused(body);
+      }
+    }
+    return std::move(m_report);
+  }
+
+private:
+  static constexpr uint32_t no_decl = UINT32_MAX;
+
+  // A let or a parameter
+  struct Decl {
+    SymbolId name;
+    bool is_param;
+  };
+
+  // Resolve every name in the program, false on anything the generators would report as an error
+  inline bool resolve_program()
+  {
+    m_decl_of.assign(m_prog.nodes.size(), no_decl);
+    for (const Node& node : m_prog.nodes) {
+      if (node.kind == NodeKind::func_def && !m_functions.declare(node.a, m_prog.list(node.b).size())) {
+        return false;
+      }
+    }
+    if (!resolve_stmt(m_prog.root)) {
+      return false;
+    }
+    for (const Node& node : m_prog.nodes) {
+      if (node.kind != NodeKind::func_def) {
+        continue;
+      }
+      m_vars = {};
+      m_in_function = true;
+      for (SymbolId param : m_prog.list(node.b)) {
+        if (!declare(param, true)) {
+          return false;
+        }
+      }
+      if (!resolve_stmt(node.c)) {
+        return false;
+      }
+    }
+    m_reads.assign(m_decls.size(), 0);
+    return true;
+  }
+
+  inline bool declare(SymbolId name, bool is_param)
+  {
+    m_decls.push_back({ name, is_param });
+    return m_vars.declare(name, static_cast<uint32_t>(m_decls.size() - 1));
+  }
+
+  inline bool resolve_name(NodeIndex index, SymbolId name)
+  {
+    const uint32_t* decl = m_vars.lookup(name);
+    if (decl == nullptr) {
+      return false;
+    }
+    m_decl_of[index] = *decl;
+    return true;
+  }
+
+  inline bool resolve_expr(NodeIndex index)
+  {
+    const Node& node = m_prog[index];
+    switch (node.kind) {
+    case NodeKind::ident:
+      return resolve_name(index, node.a);
+    case NodeKind::bin_expr:
+      return resolve_expr(node.a) && resolve_expr(node.b);
+    case NodeKind::func_call: {
+      const size_t* arity = m_functions.lookup(node.a);
+      std::span<const uint32_t> args = m_prog.list(node.b);
+      if (arity == nullptr || *arity != args.size()) {
+        return false;
+      }
+      for (NodeIndex arg : args) {
+        if (!resolve_expr(arg)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    default:
+      return true;
+    }
+  }
+
+  inline bool resolve_stmt(NodeIndex index)
+  {
+    const Node& stmt = m_prog[index];
+    switch (stmt.kind) {
+    case NodeKind::prog:
+    case NodeKind::scope: {
+      m_vars.begin_scope();
+      for (NodeIndex child : m_prog.list(stmt.a)) {
+        if (!resolve_stmt(child)) {
+          return false;
+        }
+      }
+      m_vars.end_scope();
+      return true;
+    }
+    case NodeKind::stmt_return:
+      return m_in_function && resolve_expr(stmt.a);
+    case NodeKind::stmt_exit:
+    case NodeKind::stmt_expr:
+    case NodeKind::stmt_print:
+      return resolve_expr(stmt.a);
+    case NodeKind::stmt_let:
+      // The value is evaluated before the name exists, `let x = x` reads an outer x
+      if (!resolve_expr(stmt.b) || !declare(stmt.a, false)) {
+        return false;
+      }
+      m_decl_of[index] = static_cast<uint32_t>(m_decls.size() - 1);
+      return true;
+    case NodeKind::stmt_assign:
+      return resolve_name(index, stmt.a) && resolve_expr(stmt.b);
+    case NodeKind::stmt_if:
+      return resolve_expr(stmt.a) && resolve_stmt(stmt.b) && (stmt.c == null_node || resolve_stmt(stmt.c));
+    case NodeKind::stmt_while:
+      return resolve_expr(stmt.a) && resolve_stmt(stmt.b);
+    case NodeKind::stmt_for: {
+      // The loop variable lives in a scope around the whole loop, the step comes after the body's scope has ended
+      std::span<const uint32_t> parts = m_prog.list(stmt.a);
+      m_vars.begin_scope();
+      bool ok = (parts[0] == null_node || resolve_stmt(parts[0])) && resolve_expr(parts[1]) && resolve_stmt(parts[3])
+        && (parts[2] == null_node || resolve_stmt(parts[2]));
+      m_vars.end_scope();
+      return ok;
+    }
+    case NodeKind::func_def:
+      return true; // resolved on its own, a function only sees its parameters and locals
+    default:
+      return false;
+    }
+  }
+
+  [[nodiscard]] inline bool is_removed(NodeIndex index) const
+  {
+    return m_prog[index].kind == NodeKind::scope && m_prog[index].a == m_empty_list;
+  }
+
+  inline void remove(NodeIndex index)
+  {
+    m_prog[index] = { .kind = NodeKind::scope, .a = m_empty_list };
+  }
+
+  // A let or assignment whose variable is never read: the value is still evaluated if that has an effect
+  inline void remove_store(NodeIndex index)
+  {
+    NodeIndex value = m_prog[index].b;
+    if (has_side_effects(m_prog, value)) {
+      m_prog[index] = { .kind = NodeKind::stmt_expr, .a = value };
+    }
+    else {
+      remove(index);
+    }
+  }
+
+  // A copy of the statement list of the prog or scope node `index`: rewriting the nested statements can add lists, which can move them
+  [[nodiscard]] inline std::vector<uint32_t> statements(NodeIndex index) const
+  {
+    std::span<const uint32_t> list = m_prog.list(m_prog[index].a);
+    return { list.begin(), list.end() };
+  }
+
+  // Drop the removed statements from the list of the prog or scope node `index`
+  inline void compact(NodeIndex index)
+  {
+    std::span<const uint32_t> list = m_prog.list(m_prog[index].a);
+    std::vector<uint32_t> kept;
+    kept.reserve(list.size());
+    for (NodeIndex stmt : list) {
+      if (!is_removed(stmt)) {
+        kept.push_back(stmt);
+      }
+    }
+    if (kept.size() != list.size()) {
+      m_prog[index].a = m_prog.add_list(kept);
+    }
+  }
+
+  // Remove unreachable code from the statement, returns whether it always ends the function (or the program)
+  inline bool prune(NodeIndex index)
+  {
+    switch (m_prog[index].kind) {
+    case NodeKind::stmt_exit:
+    case NodeKind::stmt_return:
+      return true;
+
+    case NodeKind::prog:
+    case NodeKind::scope: {
+      bool ends = false;
+      for (NodeIndex stmt : statements(index)) {
+        if (!ends) {
+          ends = prune(stmt);
+        }
+        else if (m_prog[stmt].kind != NodeKind::func_def) {
+          remove(stmt);
+          m_report.unreachable++;
+        }
+      }
+      compact(index);
+      return ends;
+    }
+
+    case NodeKind::stmt_if: {
+      const Node stmt = m_prog[index];
+      std::optional<int64_t> cond = constant(stmt.a);
+      if (!cond.has_value()) {
+        bool then_ends = prune(stmt.b);
+        bool else_ends = stmt.c != null_node && prune(stmt.c);
+        return then_ends && else_ends;
+      }
+      // Only the branch the condition picks is left, in place of the if
+      NodeIndex taken = cond.value() != 0 ? stmt.b : stmt.c;
+      NodeIndex dropped = cond.value() != 0 ? stmt.c : stmt.b;
+      if (dropped != null_node) {
+        m_report.unreachable++;
+      }
+      if (taken == null_node) {
+        remove(index);
+        return false;
+      }
+      m_prog[index] = m_prog[taken];
+      return prune(index);
+    }
+
+    case NodeKind::stmt_while:
+      if (constant(m_prog[index].a) == 0) {
+        remove(index);
+        m_report.unreachable++;
+        return false;
+      }
+      prune(m_prog[index].b);
+      return false;
+
+    case NodeKind::stmt_for: {
+      std::span<const uint32_t> parts = m_prog.list(m_prog[index].a);
+      if (constant(parts[1]) != 0) {
+        prune(parts[3]);
+        return false;
+      }
+      // Only the init runs, in a scope of its own like the loop's
+      NodeIndex init = parts[0];
+      m_report.unreachable++;
+      if (init == null_node) {
+        remove(index);
+      }
+      else {
+        m_prog[index] = { .kind = NodeKind::scope, .a = m_prog.add_list(std::span(&init, 1)) };
+      }
+      return false;
+    }
+
+    default:
+      return false;
+    }
+  }
+
+  [[nodiscard]] inline std::optional<int64_t> constant(NodeIndex index) const
+  {
+    const Node& node = m_prog[index];
+    if (node.kind == NodeKind::int_lit) {
+      return node.int_value();
+    }
+    if (node.kind == NodeKind::bool_lit) {
+      return node.a;
+    }
+    return {};
+  }
+
+  // Call f(name) on every variable the node reads, nested statements included
+  template <typename F>
+  inline void for_each_read(NodeIndex index, F&& f) const
+  {
+    if (index == null_node) {
+      return;
+    }
+    const Node& node = m_prog[index];
+    switch (node.kind) {
+    case NodeKind::ident:
+      f(node.a);
+      break;
+    case NodeKind::bin_expr:
+      for_each_read(node.a, f);
+      for_each_read(node.b, f);
+      break;
+    case NodeKind::func_call:
+    case NodeKind::prog:
+    case NodeKind::scope:
+    case NodeKind::stmt_for: {
+      NodeIndex list = node.kind == NodeKind::func_call ? node.b : node.a;
+      for (NodeIndex child : m_prog.list(list)) {
+        for_each_read(child, f);
+      }
+      break;
+    }
+    case NodeKind::stmt_exit:
+    case NodeKind::stmt_expr:
+    case NodeKind::stmt_print:
+    case NodeKind::stmt_return:
+      for_each_read(node.a, f);
+      break;
+    case NodeKind::stmt_let:
+    case NodeKind::stmt_assign:
+      for_each_read(node.b, f);
+      break;
+    case NodeKind::stmt_if:
+      for_each_read(node.a, f);
+      for_each_read(node.b, f);
+      for_each_read(node.c, f);
+      break;
+    case NodeKind::stmt_while:
+      for_each_read(node.a, f);
+      for_each_read(node.b, f);
+      break;
+    default:
+      break;
+    }
+  }
+
+  // Walk the statement lists backwards, remembering the variables a later statement of the same list assigns before anything reads them.
+  // Names stand for variables here, so a variable that has the same name as another one only ever looks more alive than it is
+  inline void remove_dead_stores(NodeIndex index)
+  {
+    // m_killed[name] is the number of the list that killed it: a nested list gets a new number, so its kills never leak out of it
+    uint32_t list_id = ++m_list_count;
+    for (NodeIndex child : statements(index) | std::views::reverse) {
+      const Node& node = m_prog[child];
+      if (node.kind == NodeKind::stmt_assign) {
+        // remove_store can rewrite the node into a stmt_expr in place, after which node.a is the value, not the name
+        SymbolId name = node.a;
+        if (m_killed[name] == list_id) {
+          remove_store(child);
+          m_report.dead_stores++;
+          if (is_removed(child)) {
+            continue;
+          }
+          // What is left is a stmt_expr of the value, whose reads still count below
+        }
+        else {
+          m_killed[name] = list_id;
+        }
+      }
+      else if (node.kind == NodeKind::stmt_let) {
+        m_killed[node.a] = 0; // a later assignment to the name is to this variable, not to one from before it
+      }
+      // The names it reads are live again, nested statement lists included
+      remove_dead_stores_nested(child);
+      for_each_read(child, [&](SymbolId name) { m_killed[name] = 0; });
+    }
+    compact(index);
+  }
+
+  // The statement lists inside a statement, each on its own
+  inline void remove_dead_stores_nested(NodeIndex index)
+  {
+    const Node& stmt = m_prog[index];
+    switch (stmt.kind) {
+    case NodeKind::scope:
+      remove_dead_stores(index);
+      break;
+    case NodeKind::stmt_if:
+      remove_dead_stores(stmt.b);
+      if (stmt.c != null_node) {
+        remove_dead_stores_nested(stmt.c);
+      }
+      break;
+    case NodeKind::stmt_while:
+      remove_dead_stores(stmt.b);
+      break;
+    case NodeKind::stmt_for:
+      remove_dead_stores(m_prog.list(stmt.a)[3]);
+      break;
+    default:
+      break;
+    }
+  }
+
+  inline void count_reads_expr(NodeIndex index)
+  {
+    const Node& node = m_prog[index];
+    switch (node.kind) {
+    case NodeKind::ident:
+      m_reads[m_decl_of[index]]++;
+      break;
+    case NodeKind::bin_expr:
+      count_reads_expr(node.a);
+      count_reads_expr(node.b);
+      break;
+    case NodeKind::func_call:
+      for (NodeIndex arg : m_prog.list(node.b)) {
+        count_reads_expr(arg);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  inline void count_reads_stmt(NodeIndex index)
+  {
+    if (index == null_node) {
+      return;
+    }
+    const Node& stmt = m_prog[index];
+    switch (stmt.kind) {
+    case NodeKind::prog:
+    case NodeKind::scope:
+      for (NodeIndex child : m_prog.list(stmt.a)) {
+        count_reads_stmt(child);
+      }
+      break;
+    case NodeKind::stmt_exit:
+    case NodeKind::stmt_expr:
+    case NodeKind::stmt_print:
+    case NodeKind::stmt_return:
+      count_reads_expr(stmt.a);
+      break;
+    case NodeKind::stmt_let:
+    case NodeKind::stmt_assign:
+      count_reads_expr(stmt.b);
+      break;
+    case NodeKind::stmt_if:
+      count_reads_expr(stmt.a);
+      count_reads_stmt(stmt.b);
+      count_reads_stmt(stmt.c);
+      break;
+    case NodeKind::stmt_while:
+      count_reads_expr(stmt.a);
+      count_reads_stmt(stmt.b);
+      break;
+    case NodeKind::stmt_for: {
+      std::span<const uint32_t> parts = m_prog.list(stmt.a);
+      count_reads_stmt(parts[0]);
+      count_reads_expr(parts[1]);
+      count_reads_stmt(parts[2]);
+      count_reads_stmt(parts[3]);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  // Whether the let or assignment writes a variable nothing reads
+  [[nodiscard]] inline bool is_unused_store(NodeIndex index) const
+  {
+    const Node& stmt = m_prog[index];
+    if (stmt.kind != NodeKind::stmt_let && stmt.kind != NodeKind::stmt_assign) {
+      return false;
+    }
+    uint32_t decl = m_decl_of[index];
+    return !m_decls[decl].is_param && m_reads[decl] == 0;
+  }
+
+  inline void remove_unused_store(NodeIndex index)
+  {
+    if (m_prog[index].kind == NodeKind::stmt_let) {
+      m_report.unused_variables.emplace_back(m_interner.name(m_prog[index].a));
+    }
+    remove_store(index);
+  }
+
+  // Remove the lets and assignments of unread variables, returns whether there were any
+  inline bool remove_unused(NodeIndex index)
+  {
+    if (index == null_node) {
+      return false;
+    }
+    const Node stmt = m_prog[index];
+    bool removed = false;
+    switch (stmt.kind) {
+    case NodeKind::prog:
+    case NodeKind::scope:
+      for (NodeIndex child : statements(index)) {
+        if (is_unused_store(child)) {
+          remove_unused_store(child);
+          removed = true;
+        }
+        else {
+          removed |= remove_unused(child);
+        }
+      }
+      compact(index);
+      break;
+    case NodeKind::stmt_if:
+      removed = remove_unused(stmt.b);
+      removed |= remove_unused(stmt.c);
+      break;
+    case NodeKind::stmt_while:
+      removed = remove_unused(stmt.b);
+      break;
+    case NodeKind::stmt_for: {
+      // The init and the step aren't in a list, an unused one becomes null_node (or an expression statement) in place
+      for (size_t part : { 0, 2 }) {
+        NodeIndex child = m_prog.list(stmt.a)[part];
+        if (child != null_node && is_unused_store(child)) {
+          remove_unused_store(child);
+          if (is_removed(child)) {
+            m_prog.lists[stmt.a + 1 + part] = null_node;
+          }
+          removed = true;
+        }
+      }
+      removed |= remove_unused(m_prog.list(stmt.a)[3]);
+      break;
+    }
+    default:
+      break;
+    }
+    return removed;
+  }
+
+  NodeProg& m_prog;
+  const Interner& m_interner;
+  DeadCodeReport m_report {};
+  ScopedSymbolTable<size_t> m_functions {}; // arity by name
+  ScopedSymbolTable<uint32_t> m_vars {}; // index in m_decls by name, while resolving
+  bool m_in_function = false;
+  std::vector<Decl> m_decls {};
+  std::vector<uint32_t> m_decl_of {}; // by node: the declaration an ident, let or assignment refers to
+  std::vector<uint32_t> m_reads {}; // by declaration
+  std::vector<uint32_t> m_killed {}; // by SymbolId, remove_dead_stores
+  uint32_t m_list_count = 0; // remove_dead_stores
+  uint32_t m_empty_list = 0;
+};
+
+// One line for `file`, e.g. "a.hy: removed 2 unreachable statements, 1 dead store, 1 unused variable (tmp)", for --verbose
+inline void print_dead_code_report(std::ostream& out, std::string_view file, const DeadCodeReport& report)
+{
+  out << file << ": ";
+  if (report.empty()) {
+    out << "no dead code\n";
+    return;
+  }
+  auto count = [&](size_t n, std::string_view what) { out << n << " " << what << (n == 1 ? "" : "s"); };
+  out << "removed ";
+  count(report.unreachable, "unreachable statement");
+  out << ", ";
+  count(report.dead_stores, "dead store");
+  out << ", ";
+  count(report.unused_variables.size(), "unused variable");
+  for (size_t i = 0; i < report.unused_variables.size(); i++) {
+    out << (i == 0 ? " (" : ", ") << report.unused_variables[i];
+  }
+  out << (report.unused_variables.empty() ? "\n" : ")\n");
+}
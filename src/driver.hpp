@@ -0,0 +1,350 @@
+// This file is the pipeline for one source file: map it, tokenize and parse it, inline small functions, fold constants, remove dead code, generate code (straight
+// from the AST at -O0 / -O1, through the IR at -O2) and assemble and link it into an executable, in memory (compile_source) or in a
+// file (compile_file). With a cache, a file whose executable is already in it is not compiled at all, one whose parse is in it is not
+// tokenized or parsed, and of any other only the functions that aren't in it yet are generated and assembled (see incremental.hpp).
+// Everything a compilation allocates (the source mapping, the interner and its arena, the node pool, the IR, the output buffers) belongs
+// to that call of compile_source, so any number of files can be compiled at the same time on different threads without sharing anything.
+// Errors in the program come out as a CompileError.
+
+#pragma once
+#include <cstdlib>
+#include <numeric>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "./cache.hpp"
+#include "./dead_code.hpp"
+#include "./elf.hpp"
+#include "./error.hpp"
+#include "./generation.hpp"
+#include "./incremental.hpp"
+#include "./inliner.hpp"
+#include "./ir_emitter.hpp"
+#include "./loops.hpp"
+#include "./lowering.hpp"
+#include "./optimizer.hpp"
+#include "./parallel.hpp"
+#include "./source.hpp"
+#include "./ssa.hpp"
+#include "./timing.hpp"
+#include "./vectorize.hpp"
+
+struct CompileOptions {
+  CodegenOptions codegen {};
+  bool dump_ir = false; // -O2: the IR after the SSA passes, in CompileResult::ir_dump
+  VectorIsa vector_isa = VectorIsa::sse2; // -O2: what the vectorised loops run on, -march
+  bool use_nasm = false; // Write <output>.asm and build with nasm and ld instead of the built-in assembler, for debugging the backends
+  bool verbose = false; // Say what dead code elimination removed, in CompileResult::dead_code
+  uint32_t inline_threshold = Inliner::default_threshold; // The most nodes an inlined function may have, 0 for --no-inline
+};
+
+struct CompileResult {
+  std::vector<uint8_t> executable {}; // compile_source: the executable file, empty with CompileOptions::use_nasm
+  AsmBuffer assembly {}; // compile_source with CompileOptions::use_nasm: the program for nasm instead
+  std::string ir_dump {};
+  bool cached = false; // The executable came out of the cache
+  DeadCodeReport dead_code {}; // with CompileOptions::verbose
+};
+
+// Quote a path for the shell, for the --nasm commands
+inline std::string shell_quote(const std::string& text)
+{
+  std::string quoted = "'";
+  for (char c : text) {
+    if (c == '\'') {
+      quoted += "'\\''";
+    }
+    else {
+      quoted += c;
+    }
+  }
+  return quoted + "'";
+}
+
+// The cache key of the parse of `source`: the source bytes and the compiler that parsed them, nothing else changes the AST
+inline uint64_t source_cache_key(std::string_view source)
+{
+  return xxh64(source, CompileCache::compiler_hash());
+}
+
+// The cache key of the executable built from the source with key `source_key`: that plus the optimization level, the inlining
+// threshold, the vector instructions and where a profiled executable writes its profile. The thread counts are left out on purpose, the
+// output is the same however many threads produced it
+inline uint64_t executable_cache_key(uint64_t source_key, const CompileOptions& options)
+{
+  uint64_t fields[] = { source_key, static_cast<uint64_t>(options.codegen.opt_level), options.inline_threshold,
+    options.codegen.profile.empty() ? 0 : xxh64(options.codegen.profile), static_cast<uint64_t>(options.vector_isa) };
+  return xxh64(std::string_view(reinterpret_cast<const char*>(fields), sizeof(fields)));
+}
+
+// Link what `assembler` has into the bytes of an executable
+inline std::vector<uint8_t> link_executable(Assembler& assembler)
+{
+  std::optional<std::vector<uint8_t>> image = elf_executable(elf_layout(assembler), assembler);
+  if (!image.has_value()) {
+    compile_error("Assembler: no _start in .text");
+  }
+  return std::move(image.value());
+}
+
+// Run the SSA passes on `functions` (indexes into the module) and take them out of SSA again, the IR dump in between goes into `result`
+inline void run_ir_passes(IrModule& module, std::span<const size_t> functions, const Interner& interner, const CompileOptions& options,
+  CompileResult& result, PhaseClock& clock)
+{
+  // The passes only look at the function they run on, so functions go through them in parallel
+  parallel_for(functions.size(), options.codegen.threads, [&](size_t i) {
+    IrFunction& fn = module.functions[functions[i]];
+    build_ssa(fn);
+    simplify_ssa(fn);
+    if (optimize_loops(fn) > 0) {
+      simplify_ssa(fn);
+    }
+    if (vectorize_loops(fn, options.vector_isa) > 0) {
+      simplify_ssa(fn);
+    }
+  });
+  clock.lap("ssa");
+  if (options.dump_ir) {
+    std::ostringstream dump;
+    print_ir(dump, module, interner);
+    result.ir_dump = dump.str();
+    clock.lap("dump-ir");
+  }
+  parallel_for(functions.size(), options.codegen.threads, [&](size_t i) { destruct_ssa(module.functions[functions[i]]); });
+  clock.lap("out-of-ssa");
+}
+
+// Generate the whole program and assemble and link it into result.executable, or with use_nasm leave the assembly in result.assembly
+inline void build(const NodeProg& prog, const Interner& interner, const CompileOptions& options, CompileResult& result, PhaseClock& clock)
+{
+  // -O0 and -O1 generate straight from the AST, -O2 goes through the IR: SSA, the passes on it, then register allocation
+  AsmBuffer assembly;
+  if (options.codegen.opt_level >= 2) {
+    IrModule module = IrLowering(prog, interner, options.codegen.profile).lower();
+    clock.lap("lower");
+    std::vector<size_t> functions(module.functions.size());
+    std::iota(functions.begin(), functions.end(), size_t { 0 });
+    run_ir_passes(module, functions, interner, options, result, clock);
+    assembly = IrEmitter(module, interner).emit();
+  }
+  else {
+    assembly = Generator(prog, interner, options.codegen).gen_prog();
+  }
+  clock.lap("codegen");
+  if (options.use_nasm) {
+    result.assembly = std::move(assembly);
+    return;
+  }
+
+  // Assemble and link in-process, straight to the executable
+  Assembler assembler(assembly.view());
+  assembler.assemble();
+  clock.lap("assemble");
+  result.executable = link_executable(assembler);
+  clock.lap("link");
+}
+
+// build through the per-function cache (see incremental.hpp): the code units that have machine code in `cache` are linked from
+// there, the others are generated and assembled on their own and stored for the next build. -O2 still lowers the whole program, the
+// IR has the string pool and the function table the emitter needs, but only the functions being generated go through the passes
+inline void build_incremental(const NodeProg& prog, const Interner& interner, const CompileOptions& options, const CompileCache& cache,
+  CompileResult& result, PhaseClock& clock, TimeReport* times)
+{
+  std::vector<NodeIndex> units = code_units(prog);
+  // The code of a profiled unit only refers to its own counters, the path they are written to is in the data
+  uint64_t shared[] = { CompileCache::compiler_hash(), static_cast<uint64_t>(options.codegen.opt_level), program_prints(prog),
+    !options.codegen.profile.empty(), static_cast<uint64_t>(options.vector_isa) };
+  std::vector<uint64_t> keys
+    = code_unit_keys(prog, interner, units, xxh64(std::string_view(reinterpret_cast<const char*>(shared), sizeof(shared))));
+  std::vector<std::optional<Assembler::Object>> objects(units.size());
+  std::vector<size_t> missing; // indexes into units
+  for (size_t i = 0; i < units.size(); i++) {
+    objects[i] = cache.load_object(keys[i]);
+    if (!objects[i].has_value()) {
+      missing.push_back(i);
+    }
+  }
+  clock.lap("load-code");
+  if (times != nullptr) {
+    times->code_units = units.size();
+    times->reused_units = units.size() - missing.size();
+  }
+
+  // The units are the main program and the functions in the same order as the IR's functions, so an index into units is one into
+  // IrModule::functions too. The dump shows every function, so with it they all go through the passes
+  std::vector<AsmBuffer> parts;
+  AsmBuffer data;
+  if (options.codegen.opt_level >= 2) {
+    IrModule module = IrLowering(prog, interner, options.codegen.profile).lower();
+    clock.lap("lower");
+    std::vector<size_t> all(module.functions.size());
+    std::iota(all.begin(), all.end(), size_t { 0 });
+    run_ir_passes(module, options.dump_ir ? all : missing, interner, options, result, clock);
+    IrEmitter emitter(module, interner);
+    parts = emitter.emit_units(missing);
+    data = emitter.emit_data();
+  }
+  else {
+    std::vector<NodeIndex> wanted;
+    for (size_t i : missing) {
+      wanted.push_back(units[i]);
+    }
+    Generator generator(prog, interner, options.codegen);
+    parts = generator.gen_units(wanted);
+    data = generator.gen_data();
+  }
+  clock.lap("codegen");
+
+  parallel_for(missing.size(), options.codegen.threads, [&](size_t i) {
+    Assembler assembler(parts[i].view());
+    assembler.assemble();
+    objects[missing[i]] = assembler.take_object();
+  });
+  Assembler data_assembler(data.view());
+  data_assembler.assemble();
+  Assembler::Object data_object = data_assembler.take_object();
+  clock.lap("assemble");
+  parallel_for(missing.size(), options.codegen.threads, [&](size_t i) {
+    cache.store_object(keys[missing[i]], objects[missing[i]].value());
+  });
+  clock.lap("store-code");
+
+  // The pieces go in the order a full build puts them in, so the executable is the same one
+  Assembler linker { std::string_view() };
+  for (const std::optional<Assembler::Object>& object : objects) {
+    linker.append(object.value());
+  }
+  linker.append(data_object);
+  result.executable = link_executable(linker);
+  clock.lap("link");
+}
+
+// Compile the program `source` into the executable in CompileResult::executable, reusing whatever `cache` already has of it: the executable
+// itself, the parse, or the machine code of some of its functions. `mapped` is the buffer `source` is a view of, if it is a mapped file,
+// so the tokenizer can read ahead in it. With `times`, every phase is timed into it, as far as the compilation got if it fails
+inline CompileResult compile_source(std::string_view source, const CompileOptions& options, const CompileCache* cache = nullptr,
+  TimeReport* times = nullptr, const SourceBuffer* mapped = nullptr)
+{
+  CompileResult result;
+  PhaseClock clock(times);
+
+  // Only the executable is cached, so builds that want the IR dump, the .asm file or the verbose report always generate code
+  std::optional<uint64_t> source_key;
+  std::optional<uint64_t> executable_key;
+  if (cache != nullptr) {
+    source_key = source_cache_key(source);
+    if (!options.dump_ir && !options.use_nasm && !options.verbose) {
+      executable_key = executable_cache_key(source_key.value(), options);
+      if (std::optional<std::vector<uint8_t>> executable = cache->fetch(executable_key.value())) {
+        clock.lap("cache");
+        result.executable = std::move(executable.value());
+        result.cached = true;
+        return result;
+      }
+    }
+    clock.lap("cache");
+  }
+
+  // Identifier names are interned once while lexing (or while loading a cached parse), everything after that works with SymbolIds
+  std::optional<Interner> interner(std::in_place);
+  std::optional<NodeProg> prog;
+  if (source_key.has_value()) {
+    prog = cache->load_ast(source_key.value(), interner.value());
+    if (!prog.has_value()) {
+      interner.emplace(); // a damaged entry may have left names behind
+    }
+    clock.lap("load-ast");
+  }
+
+  if (!prog.has_value()) {
+    // The parser pulls tokens from the tokenizer as it goes, lexing and parsing happen in one pass over the file
+    Tokenizer tokenizer(source, interner.value());
+    Parser parser(TokenStream(tokenizer, mapped));
+    prog = parser.parse_prog();
+    if (!prog.has_value()) {
+      compile_error("Invalid program");
+    }
+    clock.lap("parse");
+    if (times != nullptr) {
+      times->tokens = parser.token_count();
+    }
+    if (source_key.has_value()) {
+      cache->store_ast(source_key.value(), prog.value(), interner.value());
+      clock.lap("store-ast");
+    }
+  }
+  if (times != nullptr) {
+    times->nodes = prog->nodes.size();
+    times->arena_bytes = interner->arena_bytes();
+  }
+
+  // Small functions go into their callers first, so the constants they are called with get folded through their bodies
+  Inliner(prog.value(), interner.value(), options.inline_threshold).run();
+  clock.lap("inline");
+  // Evaluate everything that is known at compile time before generating code for it
+  ConstantFolder(prog.value()).run();
+  clock.lap("fold");
+  // Folding decides conditions, which can leave whole branches and the variables that only they used dead
+  DeadCodeReport dead_code = DeadCodeEliminator(prog.value(), interner.value()).run();
+  clock.lap("dead-code");
+  if (options.verbose) {
+    result.dead_code = std::move(dead_code);
+  }
+
+  // With a cache, the machine code of every function is kept as well, and only the functions that aren't in it yet are generated
+  if (cache != nullptr && !options.use_nasm) {
+    build_incremental(prog.value(), interner.value(), options, *cache, result, clock, times);
+  }
+  else {
+    build(prog.value(), interner.value(), options, result, clock);
+  }
+  if (executable_key.has_value()) {
+    cache->store(executable_key.value(), result.executable);
+    clock.lap("store");
+  }
+  return result;
+}
+
+// Compile `input` into the executable `output`, see compile_source. With use_nasm the assembly is written next to it and built with nasm
+// and ld
+inline CompileResult compile_file(const std::string& input, const std::string& output, const CompileOptions& options,
+  const CompileCache* cache = nullptr, TimeReport* times = nullptr)
+{
+  PhaseClock clock(times);
+  // Map the file to compile, the tokens point straight into this buffer so it has to stay alive until code generation is done
+  std::optional<SourceBuffer> source = SourceBuffer::open(input);
+  if (!source.has_value()) {
+    compile_error("Could not read ", input);
+  }
+  clock.lap("read");
+
+  CompileResult result = compile_source(source->view(), options, cache, times, &source.value());
+  PhaseClock write_clock(times);
+  if (options.use_nasm) {
+    // write the assembly code to a file next to the executable and build it with the system tools
+    std::string asm_path = output + ".asm";
+    std::string object_path = output + ".o";
+    if (!result.assembly.write_file(asm_path)) {
+      compile_error("Could not write ", asm_path);
+    }
+    write_clock.lap("write-asm");
+    if (system(("nasm -felf64 " + shell_quote(asm_path) + " -o " + shell_quote(object_path)).c_str()) != 0) {
+      compile_error("nasm failed on ", asm_path);
+    }
+    write_clock.lap("nasm");
+    if (system(("ld -o " + shell_quote(output) + " " + shell_quote(object_path)).c_str()) != 0) {
+      compile_error("ld failed on ", object_path);
+    }
+    write_clock.lap("ld");
+    result.assembly = AsmBuffer();
+    return result;
+  }
+  if (!write_executable(output, result.executable)) {
+    compile_error("Could not write ", output);
+  }
+  write_clock.lap("write");
+  result.executable = {}; // on disk now, a batch doesn't have to keep every executable in memory
+  return result;
+}
@@ -0,0 +1,247 @@
+// This file writes the machine code from assembler.hpp out as a static x86-64 Linux executable, what `ld -o out out.o` used to produce.
+// The file starts with the ELF header and two program headers, then .text, .rodata and .data, then a symbol table (every label, so gdb
+// and objdump show names) and the section headers. The first PT_LOAD maps everything up to the end of .rodata read+execute at 0x400000,
+// the way ld lays out a static executable without -z separate-code, the second maps .data read+write one page further up so the two never
+// share a page. .bss takes no room in the file: it follows .data in
+// the second PT_LOAD, whose size in memory is larger than in the file by that much, and the kernel zeroes the difference.
+// The executable is built in memory first (elf_executable), so the library API can hand it back without a file, then written out.
+
+#pragma once
+#include <elf.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "./assembler.hpp"
+
+// Where the sections end up in the file and in memory, the assembler needs the addresses to link before anything is written
+struct ElfLayout {
+  uint64_t text_offset;
+  uint64_t text_address;
+  uint64_t rodata_offset;
+  uint64_t rodata_address;
+  uint64_t data_offset;
+  uint64_t data_address;
+  uint64_t bss_address;
+};
+
+inline constexpr uint64_t elf_base_address = 0x400000;
+inline constexpr uint64_t elf_page_size = 0x1000;
+
+inline ElfLayout elf_layout(const Assembler& assembler)
+{
+  ElfLayout layout {};
+  layout.text_offset = sizeof(Elf64_Ehdr) + 2 * sizeof(Elf64_Phdr);
+  layout.text_address = elf_base_address + layout.text_offset;
+  layout.rodata_offset = (layout.text_offset + assembler.text().size() + 15) & ~uint64_t { 15 };
+  layout.rodata_address = elf_base_address + layout.rodata_offset;
+  layout.data_offset = (layout.rodata_offset + assembler.rodata().size() + 15) & ~uint64_t { 15 };
+  // The address has to be congruent to the file offset modulo the page size
+  layout.data_address = elf_base_address + layout.data_offset + elf_page_size;
+  layout.bss_address = (layout.data_address + assembler.data().size() + 15) & ~uint64_t { 15 };
+  return layout;
+}
+
+// Link the assembled code for `layout` and lay the executable out in memory, an empty optional if the code has no _start to enter at
+inline std::optional<std::vector<uint8_t>> elf_executable(const ElfLayout& layout, Assembler& assembler)
+{
+  assembler.link(layout.text_address, layout.rodata_address, layout.data_address, layout.bss_address);
+  const std::vector<uint8_t>& text = assembler.text();
+  const std::vector<uint8_t>& rodata = assembler.rodata();
+  const std::vector<uint8_t>& data = assembler.data();
+  auto start = assembler.symbols().find("_start");
+  if (start == assembler.symbols().end() || start->second.section != Assembler::Section::text) {
+    return {};
+  }
+
+  std::vector<uint8_t> image(layout.data_offset + data.size(), 0);
+  auto put = [&]<typename T>(uint64_t offset, const T& value) {
+    if (image.size() < offset + sizeof(T)) {
+      image.resize(offset + sizeof(T), 0);
+    }
+    std::memcpy(image.data() + offset, &value, sizeof(T));
+  };
+  auto append = [&](const void* bytes, size_t size, uint64_t align) {
+    uint64_t offset = (image.size() + align - 1) & ~(align - 1);
+    image.resize(offset + size, 0);
+    if (size > 0) {
+      std::memcpy(image.data() + offset, bytes, size);
+    }
+    return offset;
+  };
+  std::copy(text.begin(), text.end(), image.begin() + static_cast<std::ptrdiff_t>(layout.text_offset));
+  std::copy(rodata.begin(), rodata.end(), image.begin() + static_cast<std::ptrdiff_t>(layout.rodata_offset));
+  std::copy(data.begin(), data.end(), image.begin() + static_cast<std::ptrdiff_t>(layout.data_offset));
+
+  // Symbols, sorted by address so the table reads like the source, and by name where they share one, so the executable is the same whether
+  // it was assembled in one piece or linked from cached functions. Locals come first, _start is the one global
+  enum : uint16_t {
+    text_section = 1,
+    rodata_section = 2,
+    data_section = 3,
+    bss_section = 4,
+    symtab_section = 5,
+    strtab_section = 6,
+    shstrtab_section = 7,
+    section_count = 8
+  };
+  std::vector<std::pair<std::string_view, Assembler::Symbol>> labels(assembler.symbols().begin(), assembler.symbols().end());
+  std::sort(labels.begin(), labels.end(), [](const auto& lhs, const auto& rhs) {
+    bool lhs_start = lhs.first == "_start";
+    bool rhs_start = rhs.first == "_start";
+    if (lhs_start != rhs_start) {
+      return rhs_start;
+    }
+    if (lhs.second.section != rhs.second.section) {
+      return lhs.second.section < rhs.second.section;
+    }
+    if (lhs.second.offset != rhs.second.offset) {
+      return lhs.second.offset < rhs.second.offset;
+    }
+    return lhs.first < rhs.first; // labels at the same address in a fixed order, however the symbols were put together
+  });
+  std::string strtab(1, '\0');
+  std::vector<Elf64_Sym> symtab(1, Elf64_Sym {});
+  for (const auto& [name, symbol] : labels) {
+    Elf64_Sym sym {};
+    sym.st_name = static_cast<uint32_t>(strtab.size());
+    sym.st_info = ELF64_ST_INFO(name == "_start" ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE);
+    switch (symbol.section) {
+    case Assembler::Section::text:
+      sym.st_shndx = text_section;
+      sym.st_value = layout.text_address + symbol.offset;
+      break;
+    case Assembler::Section::rodata:
+      sym.st_shndx = rodata_section;
+      sym.st_value = layout.rodata_address + symbol.offset;
+      break;
+    case Assembler::Section::data:
+      sym.st_shndx = data_section;
+      sym.st_value = layout.data_address + symbol.offset;
+      break;
+    case Assembler::Section::bss:
+      sym.st_shndx = bss_section;
+      sym.st_value = layout.bss_address + symbol.offset;
+      break;
+    }
+    symtab.push_back(sym);
+    strtab.append(name);
+    strtab.push_back('\0');
+  }
+  const std::string shstrtab = std::string("\0.text\0.rodata\0.data\0.bss\0.symtab\0.strtab\0.shstrtab\0", 52);
+
+  uint64_t symtab_offset = append(symtab.data(), symtab.size() * sizeof(Elf64_Sym), 8);
+  uint64_t strtab_offset = append(strtab.data(), strtab.size(), 1);
+  uint64_t shstrtab_offset = append(shstrtab.data(), shstrtab.size(), 1);
+
+  // Value-initialized, each header sets only the fields that aren't 0 for it
+  Elf64_Shdr sections[section_count] {};
+  auto alloc_section = [&](size_t index, uint32_t name, uint32_t type, uint64_t flags, uint64_t address, uint64_t offset, uint64_t size) {
+    Elf64_Shdr& section = sections[index];
+    section.sh_name = name;
+    section.sh_type = type;
+    section.sh_flags = flags;
+    section.sh_addr = address;
+    section.sh_offset = offset;
+    section.sh_size = size;
+    section.sh_addralign = 16;
+  };
+  alloc_section(text_section, 1, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, layout.text_address, layout.text_offset, text.size());
+  alloc_section(rodata_section, 7, SHT_PROGBITS, SHF_ALLOC, layout.rodata_address, layout.rodata_offset, rodata.size());
+  alloc_section(data_section, 15, SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, layout.data_address, layout.data_offset, data.size());
+  alloc_section(bss_section, 21, SHT_NOBITS, SHF_ALLOC | SHF_WRITE, layout.bss_address, layout.data_offset + data.size(),
+    assembler.bss_size());
+
+  Elf64_Shdr& symtab_header = sections[symtab_section];
+  symtab_header.sh_name = 26;
+  symtab_header.sh_type = SHT_SYMTAB;
+  symtab_header.sh_offset = symtab_offset;
+  symtab_header.sh_size = symtab.size() * sizeof(Elf64_Sym);
+  symtab_header.sh_link = strtab_section;
+  symtab_header.sh_info = static_cast<uint32_t>(symtab.size() - 1); // one past the last local symbol, _start is the only global
+  symtab_header.sh_addralign = 8;
+  symtab_header.sh_entsize = sizeof(Elf64_Sym);
+
+  Elf64_Shdr& strtab_header = sections[strtab_section];
+  strtab_header.sh_name = 34;
+  strtab_header.sh_type = SHT_STRTAB;
+  strtab_header.sh_offset = strtab_offset;
+  strtab_header.sh_size = strtab.size();
+  strtab_header.sh_addralign = 1;
+
+  Elf64_Shdr& shstrtab_header = sections[shstrtab_section];
+  shstrtab_header.sh_name = 42;
+  shstrtab_header.sh_type = SHT_STRTAB;
+  shstrtab_header.sh_offset = shstrtab_offset;
+  shstrtab_header.sh_size = shstrtab.size();
+  shstrtab_header.sh_addralign = 1;
+  uint64_t sections_offset = append(sections, sizeof(sections), 8);
+
+  Elf64_Ehdr header {};
+  std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+  header.e_ident[EI_CLASS] = ELFCLASS64;
+  header.e_ident[EI_DATA] = ELFDATA2LSB;
+  header.e_ident[EI_VERSION] = EV_CURRENT;
+  header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  header.e_type = ET_EXEC;
+  header.e_machine = EM_X86_64;
+  header.e_version = EV_CURRENT;
+  header.e_entry = layout.text_address + start->second.offset;
+  header.e_phoff = sizeof(Elf64_Ehdr);
+  header.e_shoff = sections_offset;
+  header.e_ehsize = sizeof(Elf64_Ehdr);
+  header.e_phentsize = sizeof(Elf64_Phdr);
+  bool writable = !data.empty() || assembler.bss_size() > 0;
+  header.e_phnum = writable ? 2 : 1;
+  header.e_shentsize = sizeof(Elf64_Shdr);
+  header.e_shnum = section_count;
+  header.e_shstrndx = shstrtab_section;
+  put(0, header);
+
+  Elf64_Phdr code {};
+  code.p_type = PT_LOAD;
+  code.p_flags = PF_R | PF_X;
+  code.p_offset = 0;
+  code.p_vaddr = code.p_paddr = elf_base_address;
+  code.p_filesz = code.p_memsz = rodata.empty() ? layout.text_offset + text.size() : layout.rodata_offset + rodata.size();
+  code.p_align = elf_page_size;
+  put(sizeof(Elf64_Ehdr), code);
+  if (writable) {
+    Elf64_Phdr rw {};
+    rw.p_type = PT_LOAD;
+    rw.p_flags = PF_R | PF_W;
+    rw.p_offset = layout.data_offset;
+    rw.p_vaddr = rw.p_paddr = layout.data_address;
+    rw.p_filesz = data.size();
+    rw.p_memsz = assembler.bss_size() > 0 ? layout.bss_address + assembler.bss_size() - layout.data_address : data.size();
+    rw.p_align = elf_page_size;
+    put(sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr), rw);
+  }
+
+  return image;
+}
+
+// Write the executable `image` to `path`, false if the file can't be written. Like ld, the file is replaced rather than written into,
+// so an old `out` that is still running doesn't get in the way
+inline bool write_executable(const std::string& path, std::span<const uint8_t> image)
+{
+  std::error_code ignored;
+  std::filesystem::remove(path, ignored);
+  {
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    if (!file.write(reinterpret_cast<const char*>(image.data()), static_cast<std::streamsize>(image.size()))) {
+      return false;
+    }
+  }
+  std::filesystem::permissions(path, std::filesystem::perms::owner_all | std::filesystem::perms::group_read
+                                   | std::filesystem::perms::group_exec | std::filesystem::perms::others_read
+                                   | std::filesystem::perms::others_exec,
+    ignored);
+  return true;
+}
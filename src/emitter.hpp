@@ -0,0 +1,246 @@
+// This file is the buffer the backends write assembly text into. It is one growing block of memory that fragments are copied onto the
+// end of, numbers are formatted with std::to_chars, so emitting an instruction is a handful of memcpys instead of a trip through
+// iostreams and their locale machinery.
+// Labels (AsmLabel) and operands (AsmOperand) are small values that are only turned into text when they are appended, so creating one
+// doesn't allocate a string.
+// The text is handed to the built-in assembler as a string_view, or written to out.asm straight from the buffer with --nasm.
+
+#pragma once
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <concepts>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// A label made of a fixed prefix and a number, "label" 12 is label12. The prefix has to outlive the label
+struct AsmLabel {
+  std::string_view prefix;
+  uint32_t id;
+};
+
+// The label of the Hydro function `name`. Identifiers are letters and digits, so with `fn.` in front no function label can be a register
+// (`call rax` would call through rax), _start or one of the runtime's hydro_* and str_* labels
+[[nodiscard]] inline std::string function_label(std::string_view name)
+{
+  std::string label = "fn.";
+  label += name;
+  return label;
+}
+
+// An instruction operand: a register, a QWORD [base + offset] memory operand or an immediate
+struct AsmOperand {
+  enum class Kind : uint8_t {
+    reg,
+    mem,
+    imm,
+  };
+
+  Kind kind = Kind::reg;
+  std::string_view reg {}; // reg: the register, mem: the base register
+  int64_t value = 0; // mem: the offset from the base, imm: the value
+
+  inline AsmOperand() = default;
+
+  // A register, so a register name can be passed anywhere an operand is expected
+  inline AsmOperand(std::string_view name)
+    : reg(name)
+  {
+  }
+
+  inline AsmOperand(const char* name)
+    : reg(name)
+  {
+  }
+
+  static inline AsmOperand mem(std::string_view base, int64_t offset)
+  {
+    AsmOperand operand(base);
+    operand.kind = Kind::mem;
+    operand.value = offset;
+    return operand;
+  }
+
+  static inline AsmOperand imm(int64_t value)
+  {
+    AsmOperand operand;
+    operand.kind = Kind::imm;
+    operand.value = value;
+    return operand;
+  }
+
+  [[nodiscard]] inline bool is_reg() const
+  {
+    return kind == Kind::reg;
+  }
+
+  [[nodiscard]] inline bool is_mem() const
+  {
+    return kind == Kind::mem;
+  }
+
+  inline bool operator==(const AsmOperand& other) const = default;
+};
+
+class AsmBuffer {
+public:
+  inline explicit AsmBuffer(size_t capacity = 4096)
+  {
+    reserve(capacity);
+  }
+
+  inline AsmBuffer(AsmBuffer&& other) noexcept
+    : m_data(std::move(other.m_data))
+    , m_size(std::exchange(other.m_size, 0))
+    , m_capacity(std::exchange(other.m_capacity, 0))
+  {
+  }
+
+  inline AsmBuffer& operator=(AsmBuffer&& other) noexcept
+  {
+    m_data = std::move(other.m_data);
+    m_size = std::exchange(other.m_size, 0);
+    m_capacity = std::exchange(other.m_capacity, 0);
+    return *this;
+  }
+
+  inline void reserve(size_t capacity)
+  {
+    if (capacity <= m_capacity) {
+      return;
+    }
+    // Not std::vector or std::string: growing those zero-fills memory that is about to be overwritten anyway
+    std::unique_ptr<char[]> data(new char[capacity]);
+    if (m_size > 0) {
+      std::memcpy(data.get(), m_data.get(), m_size);
+    }
+    m_data = std::move(data);
+    m_capacity = capacity;
+  }
+
+  inline AsmBuffer& operator<<(std::string_view text)
+  {
+    std::memcpy(grow(text.size()), text.data(), text.size());
+    return *this;
+  }
+
+  inline AsmBuffer& operator<<(const char* text)
+  {
+    return *this << std::string_view(text);
+  }
+
+  inline AsmBuffer& operator<<(const std::string& text)
+  {
+    return *this << std::string_view(text);
+  }
+
+  inline AsmBuffer& operator<<(char c)
+  {
+    *grow(1) = c;
+    return *this;
+  }
+
+  template <std::integral T>
+    requires(!std::same_as<T, char> && !std::same_as<T, bool>)
+  inline AsmBuffer& operator<<(T value)
+  {
+    char* out = grow(max_number_length);
+    char* end = std::to_chars(out, out + max_number_length, value).ptr;
+    m_size -= max_number_length - static_cast<size_t>(end - out);
+    return *this;
+  }
+
+  inline AsmBuffer& operator<<(const AsmLabel& label)
+  {
+    return *this << label.prefix << label.id;
+  }
+
+  inline AsmBuffer& operator<<(const AsmOperand& operand)
+  {
+    switch (operand.kind) {
+    case AsmOperand::Kind::reg:
+      return *this << operand.reg;
+    case AsmOperand::Kind::imm:
+      return *this << operand.value;
+    case AsmOperand::Kind::mem:
+      *this << "QWORD [" << operand.reg;
+      if (operand.value < 0) {
+        *this << " - " << -operand.value;
+      }
+      else {
+        *this << " + " << operand.value;
+      }
+      return *this << ']';
+    }
+    return *this;
+  }
+
+  inline AsmBuffer& operator<<(const AsmBuffer& other)
+  {
+    return *this << other.view();
+  }
+
+  [[nodiscard]] inline std::string_view view() const
+  {
+    return { m_data.get(), m_size };
+  }
+
+  [[nodiscard]] inline size_t size() const
+  {
+    return m_size;
+  }
+
+  [[nodiscard]] inline bool empty() const
+  {
+    return m_size == 0;
+  }
+
+  // Write the whole buffer to `path`, replacing what was there. false if the file can't be written
+  [[nodiscard]] inline bool write_file(const std::string& path) const
+  {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    const char* p = m_data.get();
+    size_t left = m_size;
+    while (left > 0) {
+      ssize_t written = ::write(fd, p, left);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        ::close(fd);
+        return false;
+      }
+      p += written;
+      left -= static_cast<size_t>(written);
+    }
+    return ::close(fd) == 0;
+  }
+
+private:
+  static constexpr size_t max_number_length = 20; // -9223372036854775808 and 18446744073709551615
+
+  // Make room for `count` more bytes and return where they go
+  inline char* grow(size_t count)
+  {
+    if (m_size + count > m_capacity) {
+      reserve(std::max(m_capacity * 2, m_size + count));
+    }
+    char* out = m_data.get() + m_size;
+    m_size += count;
+    return out;
+  }
+
+  std::unique_ptr<char[]> m_data {};
+  size_t m_size = 0;
+  size_t m_capacity = 0;
+};
@@ -0,0 +1,24 @@
+// This file defines how the compiler reports an error in the program it is compiling. Every stage throws a CompileError instead of
+// printing and exiting, the driver catches it per file, so one bad file in a batch doesn't take the others down with it.
+
+#pragma once
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+class CompileError : public std::runtime_error {
+public:
+  inline explicit CompileError(const std::string& message)
+    : std::runtime_error(message)
+  {
+  }
+};
+
+// Throw a CompileError whose message is the arguments streamed one after another: compile_error("Undeclared identifier: ", name)
+template <typename... Args>
+[[noreturn]] inline void compile_error(const Args&... args)
+{
+  std::ostringstream message;
+  (message << ... << args);
+  throw CompileError(message.str());
+}
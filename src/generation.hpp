@@ -1,552 +1,1483 @@
 // File that generates the assembly code (Code generation)
-// It takes in the root node of the AST and traverses that tree and while its traversing it generates the assembly code. I have different method for generating each node type.
+// It takes in the root node of the AST and traverses that tree and while its traversing it generates the assembly code. I have different method for generating each node kind.
+// The generated code is a stack machine: every expression pushes its value, every operator pops its operands and pushes the result.
+// Function bodies are generated after the main program, each with its own frame, so execution never falls into them. The frame is sized
+// once in the prologue: every local in memory gets a slot below rbp, the slots of a scope are reused once it ends. The first six arguments
+// are passed in rdi, rsi, rdx, rcx, r8 and r9, the rest on the stack, and `return f(...)` inside f jumps back to the top of the body
+// instead of calling, so tail recursion runs in constant stack space (and so does `return n * f(n - 1)`, see tail_calls.hpp).
+// At -O1 expressions are evaluated in registers instead: the operand that needs more registers (its Sethi-Ullman number) is evaluated first,
+// temporaries live in caller-saved scratch registers and only get spilled to the stack when there are none left or around a call, and the
+// most used locals of the main program and of each function live in callee-saved registers for their whole lifetime.
+// The statement code is shared by both levels, it only asks for "the value of this expression in a register" (gen_value / gen_value_into).
+// Conditions are the exception: if, while and for branch on them directly (gen_branch), a comparison on the flags of its cmp and && / ||
+// on each side in turn, and an else if chain on one variable dispatches through a jump table or a binary search (see switches.hpp).
+// With -fprofile every function, loop and if counts how often it runs (see profile.hpp): the snippets go at the entry of each, the
+// exits of the functions and loops and the start of each branch, and keep every register, so both levels place them the same way.
+// Every function body (and the main program) has its own label namespace, `<function>.L<n>` for jump targets (function_label says what a
+// function's label is), string literals are named after their text (see StringLabel), and each has its own output buffer. That makes the
+// bodies independent of each other: with more than one codegen thread each function is generated by a worker Generator on the pool in
+// parallel.hpp, and the pieces are joined in source order, so the output doesn't depend on the thread count. It also lets incremental
+// builds generate only some of them.
 
 #pragma once
+#include "emitter.hpp"
+#include "error.hpp"
+#include "parallel.hpp"
 #include "parser.hpp"
-#include <cassert>
+#include "profile.hpp"
+#include "runtime.hpp"
+#include "switches.hpp"
+#include "symbol_table.hpp"
+#include "tail_calls.hpp"
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <string>
-#include <sstream>
+#include <string_view>
 #include <iostream>
+#include <utility>
+
+struct CodegenOptions {
+  int opt_level = 0; // 0: stack machine, 1: registers for temporaries and hot locals
+  unsigned threads = 1; // threads generating function bodies, 0 for one per hardware thread
+  std::string profile {}; // -fprofile: where the executable writes its profile (an absolute path), empty to build it without counters
+};
 
 class Generator {
 public:
-  inline explicit Generator(NodeProg prog)
-    : m_prog(std::move(prog)) // take the program out put from the parser (AST)
+  inline explicit Generator(const NodeProg& prog, const Interner& interner, CodegenOptions options = {})
+    : m_prog(prog) // take the program out put from the parser (AST)
+    , m_interner(interner) // to turn SymbolIds back into names for labels and error messages
+    , m_options(options)
   {
   }
-    std::stringstream m_data_section; // To store string literals
-
-    // Utility function to generate a unique label for each string literal
-    std::string make_string_label() {
-        static int string_label_count = 0;
-        return "str_lit_" + std::to_string(string_label_count++);
-    }
 
-    void gen_func_prologue() {
+    // The frame is sized once, every parameter and let in memory has its own slot below rbp for the whole function
+    void gen_func_prologue(size_t frame_slots) {
     m_output << "    push rbp\n";
     m_output << "    mov rbp, rsp\n";
-    // Reserve space for local variables if needed
+    if (frame_slots > 0) {
+        m_output << "    sub rsp, " << frame_slots * 8 << "\n";
+    }
+    m_frame_size = frame_slots;
     }
 
     void gen_func_epilogue() {
         m_output << "    mov rsp, rbp\n";
         m_output << "    pop rbp\n";
+        for (auto it = m_saved_regs.rbegin(); it != m_saved_regs.rend(); ++it) {
+            m_output << "    pop " << *it << "\n";
+        }
         m_output << "    ret\n";
     }
 
-    void gen_param_passing(const std::vector<Token>& params) {
-      for (int i = params.size() - 1; i >= 0; --i) {
-          // Assuming parameters are pushed onto the stack in reverse order before the call
-          m_output << "    push [rbp + " << (i + 2) * 8 << "]\n"; // +2 for return address and old rbp
+    // The first six arguments come in rdi, rsi, rdx, rcx, r8 and r9 and are moved to where the parameter lives: the register the -O1 plan
+    // gave it, or its slot in the frame. The rest were pushed by the caller and are used where they are, or loaded once into their register
+    void gen_params(std::span<const uint32_t> params) {
+      m_param_vars.clear();
+      for (size_t i = 0; i < params.size(); i++) {
+          std::string_view planned = m_options.opt_level > 0 ? m_local_plan.params[i] : std::string_view {};
+          Var var;
+          if (i < arg_regs.size()) {
+              var = planned.empty() ? Var { .frame_offset = frame_slot() } : Var { .reg = planned };
+              m_output << "    mov " << var_operand(var) << ", " << arg_regs[i] << "\n";
+          }
+          else {
+              // above rbp: the old rbp, the saved registers, the return address, then the arguments that didn't fit in registers
+              var = { .frame_offset = static_cast<int>((i - arg_regs.size() + 2 + m_saved_regs.size()) * 8) };
+              if (!planned.empty()) {
+                  m_output << "    mov " << planned << ", " << var_operand(var) << "\n";
+                  var = { .reg = planned };
+              }
+          }
+          if (!m_vars.declare(params[i], var)) {
+              compile_error("Duplicate parameter: ", m_interner.name(params[i]));
+          }
+          m_param_vars.push_back(var);
       }
     }
 
-    void gen_func_def(const NodeFuncDef* func_def) {
-      m_output << func_def->ident.value.value() << ":\n";
-      gen_func_prologue();
-      gen_param_passing(func_def->params);
-      gen_scope(func_def->body);
+    void gen_func_def(NodeIndex index) {
+      const Node& func_def = m_prog[index];
+      std::span<const uint32_t> params = m_prog.list(func_def.b);
+      m_output << function_label(m_interner.name(func_def.a)) << ":\n";
+
+      // A function only sees its own parameters and locals, offsets start over from the new frame
+      size_t saved_stack_size = std::exchange(m_stack_size, 0);
+      size_t saved_frame_used = std::exchange(m_frame_used, 0);
+      ScopedSymbolTable<Var> saved_vars = std::exchange(m_vars, {});
+      m_in_function = true;
+
+      // The registers our locals live in belong to the caller, save them below the frame
+      if (m_options.opt_level > 0) {
+          plan_locals(params, m_prog.list(m_prog[func_def.c].a));
+          m_saved_regs = m_local_plan.used;
+          for (std::string_view reg : m_saved_regs) {
+              m_output << "    push " << reg << "\n";
+          }
+      }
+      size_t param_slots = 0;
+      for (size_t i = 0; i < params.size() && i < arg_regs.size(); i++) {
+          param_slots += m_options.opt_level == 0 || m_local_plan.params[i].empty() ? 1 : 0;
+      }
+      m_recursion = find_self_recursion(m_prog, func_def);
+      size_t accumulator_slots = m_recursion.accumulator.has_value() ? 1 : 0;
+      gen_func_prologue(param_slots + accumulator_slots + count_frame_slots(m_prog.list(m_prog[func_def.c].a)));
+
+      begin_scope();
+      gen_params(params);
+      if (m_recursion.accumulator.has_value()) {
+          m_accumulator = { .frame_offset = frame_slot() };
+          m_output << "    mov " << var_operand(m_accumulator) << ", " << accumulator_identity(m_recursion.accumulator.value()) << "\n";
+      }
+      begin_profile(index, m_interner.name(func_def.a));
+      gen_profile(0, ProfileEvent::enter);
+      // A self tail call starts the body over from here, with the new arguments in the parameters
+      if (m_recursion.has_tail_calls) {
+          m_body_label = create_label();
+          m_output << m_body_label << ":\n";
+      }
+      gen_scope(func_def.c);
+      end_scope();
+
+      // Falling off the end of a function returns 0
+      m_output << "    mov rax, 0\n";
+      gen_accumulate("rax");
+      gen_profile_return();
       gen_func_epilogue();
+
+      m_in_function = false;
+      m_saved_regs.clear();
+      m_vars = std::move(saved_vars);
+      m_stack_size = saved_stack_size;
+      m_frame_used = saved_frame_used;
     }
 
-    void gen_func_call(const NodeFuncCall* func_call) {
-      // Push arguments in reverse order
-      for (auto it = func_call->args.rbegin(); it != func_call->args.rend(); ++it) {
+    void check_func_call(const Node& func_call) {
+      const FuncInfo* func = root().m_functions.lookup(func_call.a);
+      size_t arg_count = m_prog.list(func_call.b).size();
+      if (func == nullptr) {
+          compile_error("Undeclared function: ", m_interner.name(func_call.a));
+      }
+      if (func->arity != arg_count) {
+          compile_error("Function ", m_interner.name(func_call.a), " expects ", func->arity, " arguments");
+      }
+    }
+
+    void gen_func_call(const Node& func_call) {
+      check_func_call(func_call);
+      std::span<const uint32_t> args = m_prog.list(func_call.b);
+      size_t reg_args = std::min(args.size(), arg_regs.size());
+
+      // Push arguments in reverse order. The first six are popped into their registers again, the rest stay where the callee expects them
+      for (auto it = args.rbegin(); it != args.rend(); ++it) {
           gen_expr(*it);
       }
-      m_output << "    call " << func_call->ident.value.value() << "\n";
+      for (size_t i = 0; i < reg_args; i++) {
+          pop(arg_regs[i]);
+      }
+      m_output << "    call " << function_label(m_interner.name(func_call.a)) << "\n";
 
       // Adjust the stack pointer after the call
-      if (!func_call->args.empty()) {
-          m_output << "    add rsp, " << func_call->args.size() * 8 << "\n";
+      if (args.size() > reg_args) {
+          m_output << "    add rsp, " << (args.size() - reg_args) * 8 << "\n";
+          m_stack_size -= args.size() - reg_args;
       }
+      push("rax"); // the return value
     }
 
-    void gen_return_stmt(const NodeReturn* node_return) {
-        gen_expr(node_return->expr);
-        m_output << "    pop rax\n"; // Assuming the return value is at the top of the stack
+    void gen_return_stmt(const Node& node_return) {
+        if (!m_in_function) {
+            compile_error("return outside of a function");
+        }
+        SelfReturn ret = classify_return(m_prog, m_function, node_return.a);
+        if (m_recursion.uses(ret)) {
+            gen_tail_call(ret);
+            return;
+        }
+        gen_value_into(node_return.a, "rax"); // the return value goes back in rax
+        gen_accumulate("rax");
+        gen_profile_return();
         gen_func_epilogue();
     }
 
-  // A generate for each AST node, just as we parse each AST node we will generate each AST node as we traverse the tree
-  void gen_term(const NodeTerm* term){
-  struct TermVisitor {
-        Generator& gen;
+    // A return of a function with an accumulator (see tail_calls.hpp) returns the accumulator combined with the value
+    void gen_accumulate(std::string_view value) {
+        if (m_recursion.accumulator.has_value()) {
+            std::string_view instr = m_recursion.accumulator == BinOp::mul ? "imul" : "add";
+            m_output << "    " << instr << " " << value << ", " << var_operand(m_accumulator) << "\n";
+        }
+    }
 
-        void operator()(const NodeTermIntLit* term_int_lit) const {
-            gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-            gen.push("rax");
+    // `return f(...)` inside f, or `return x * f(...)` with x multiplied into the accumulator: the frame is reused instead of growing the
+    // stack by one frame per call. Every argument is evaluated first (they can read the parameters they replace), then they are stored
+    // over the parameters and the body starts over
+    void gen_tail_call(const SelfReturn& ret) {
+        const Node& func_call = m_prog[ret.call];
+        check_func_call(func_call);
+        if (ret.kind == SelfReturn::Kind::accumulate) {
+            push_value(ret.other);
+        }
+        std::span<const uint32_t> args = m_prog.list(func_call.b);
+        for (auto it = args.rbegin(); it != args.rend(); ++it) {
+            push_value(*it);
         }
+        for (const Var& param : m_param_vars) {
+            m_output << "    pop " << var_operand(param) << "\n";
+            m_stack_size--;
+        }
+        if (ret.kind == SelfReturn::Kind::accumulate) {
+            pop("rax");
+            gen_accumulate("rax");
+            m_output << "    mov " << var_operand(m_accumulator) << ", rax\n";
+        }
+        // Still the same activation, it only counts as another call
+        for (auto it = m_open_loops.rbegin(); it != m_open_loops.rend(); ++it) {
+            gen_profile(*it, ProfileEvent::leave);
+        }
+        gen_profile(0, ProfileEvent::primary);
+        m_output << "    jmp " << m_body_label << "\n";
+    }
 
-        // Add handling for boolean literals
-        void operator()(const NodeBoolLit* bool_lit) const {
-            // Convert the boolean value to an integer (0 for false, 1 for true)
-            int boolValue = bool_lit->value ? 1 : 0;
-            gen.m_output << "    mov rax, " << boolValue << "\n";
-            gen.push("rax");
+    // Evaluate an expression onto the stack, at either level
+    void push_value(NodeIndex expr) {
+        if (m_options.opt_level == 0) {
+            gen_expr(expr);
+            return;
         }
+        std::string_view value = gen_reg(expr);
+        push(value);
+        release(value);
+    }
 
-    // If we need to use a variable, extract the value of the variable and put it at the top of the stack
-    void operator()(const NodeTermIdent* term_ident) const{
-      auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-        return var.name == term_ident->ident.value.value(); 
-      });
-      if (it == gen.m_vars.cend()) {
-        std::cerr << "Undeclared identifier: " << term_ident->ident.value.value() << std::endl;
-        exit(EXIT_FAILURE);
-      }
-      std::stringstream offset;
-      // push the offset of the variable on the stack
-      offset << "QWORD [rsp + " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "]";
-      gen.push(offset.str());
+  // If we need to use a variable, extract the value of the variable and put it at the top of the stack
+  void gen_ident(const Node& term_ident){
+    push(var_operand(*lookup_var(term_ident.a)));
+  }
+
+  // Math operations
+  void gen_bin_expr(const Node& bin_expr){
+    switch (bin_expr.op) {
+    case BinOp::and_:
+    case BinOp::or_: {
+      // Each side branches straight to the label for the result it decides, see gen_branch
+      bool is_and = bin_expr.op == BinOp::and_;
+      AsmLabel labelShort = create_label();
+      AsmLabel labelEnd = create_label();
+      gen_branch(bin_expr.a, !is_and, labelShort);
+      gen_branch(bin_expr.b, !is_and, labelShort);
+      m_output << "    mov rax, " << (is_and ? 1 : 0) << "\n";  // Neither side decided it
+      m_output << "    jmp " << labelEnd << "\n";
+      m_output << labelShort << ":\n";
+      m_output << "    mov rax, " << (is_and ? 0 : 1) << "\n";
+      m_output << labelEnd << ":\n";
+      push("rax");
+      return;
     }
-    void operator()(const NodeTermParen* term_paren) const
-    {
-      gen.gen_expr(term_paren->expr);
+    default:
+      break;
     }
-  };
-    TermVisitor visitor({ .gen = *this });
-    std::visit(visitor, term->var);
+
+    // Every other operator evaluates both sides, left to right like every level does, lhs ends up in rax and rhs in rbx
+    gen_expr(bin_expr.a);
+    gen_expr(bin_expr.b);
+    pop("rbx");
+    pop("rax");
+    switch (bin_expr.op) {
+    case BinOp::add:
+      m_output << "    add rax, rbx\n";
+      break;
+    case BinOp::sub:
+      m_output << "    sub rax, rbx\n";
+      break;
+    case BinOp::mul:
+      m_output << "    mul rbx\n";
+      break;
+    case BinOp::div:
+      m_output << "    cqo\n"; // sign extend rax into rdx:rax
+      m_output << "    idiv rbx\n";
+      break;
+    case BinOp::eq:
+      gen_compare("sete");
+      break;
+    case BinOp::lt:
+      gen_compare("setl");
+      break;
+    case BinOp::gt:
+      gen_compare("setg");
+      break;
+    case BinOp::and_:
+    case BinOp::or_:
+      assert(false); // Unreachable, handled above
+    }
+    push("rax");
   }
 
-  // Math operations
-  void gen_bin_expr(const NodeBinExpr* bin_expr){
-    struct BinExprVisitor {
-      Generator& gen;
-      void operator()(const NodeBinExprSub* sub) const
-      {
-        gen.gen_expr(sub->rhs);
-        gen.gen_expr(sub->lhs);
-        gen.pop("rax");
-        gen.pop("rbx");
-        gen.m_output << "    sub rax, rbx\n";
-        gen.push("rax");
-      }
-      void operator()(const NodeBinExprAdd* add) const
-      {
-        gen.gen_expr(add->rhs);
-        gen.gen_expr(add->lhs);
-        gen.pop("rax");
-        gen.pop("rbx");
-        gen.m_output << "    add rax, rbx\n";
-        gen.push("rax");
-      }
-      void operator()(const NodeBinExprMulti* multi) const
-      {
-        gen.gen_expr(multi->rhs);
-        gen.gen_expr(multi->lhs);
-        gen.pop("rax");
-        gen.pop("rbx");
-        gen.m_output << "    mul rbx\n";
-        gen.push("rax");
-      }
-      void operator()(const NodeBinExprDiv* div) const
-      {
-        gen.gen_expr(div->rhs);
-        gen.gen_expr(div->lhs);
-        gen.pop("rax");
-        gen.pop("rbx");
-        gen.m_output << "    div rbx\n";
-        gen.push("rax");
-      }
-      void operator()(const NodeBinExprEq* eq) const {
-        gen.gen_expr(eq->rhs);
-        gen.gen_expr(eq->lhs);
-        gen.pop("rax");
-        gen.pop("rbx");
-        gen.m_output << "    cmp rax, rbx\n";
-        gen.m_output << "    sete al\n";
-        gen.m_output << "    movzx rax, al\n";
-        gen.push("rax");
-      }
-      void operator()(const NodeBinExprAnd* andExpr) const {
-        std::string labelFalse = gen.create_label();
-        std::string labelEnd = gen.create_label();
-
-        // Evaluate the left-hand side expression
-        gen.gen_expr(andExpr->lhs);
-        gen.pop("rax");
-        gen.m_output << "    cmp rax, 0\n";  // Compare with false
-        gen.m_output << "    je " << labelFalse << "\n";  // Jump if false
-
-        // Evaluate the right-hand side expression
-        gen.gen_expr(andExpr->rhs);
-        gen.pop("rax");
-        gen.m_output << "    cmp rax, 0\n";  // Compare with false
-        gen.m_output << "    je " << labelFalse << "\n";  // Jump if false
-
-        // Both are true
-        gen.m_output << "    mov rax, 1\n";  // Set result to true
-        gen.m_output << "    jmp " << labelEnd << "\n";
-
-        // False label
-        gen.m_output << labelFalse << ":\n";
-        gen.m_output << "    mov rax, 0\n";  // Set result to false
-
-        // End label
-        gen.m_output << labelEnd << ":\n";
-        gen.push("rax");
-      }
-      void operator()(const NodeBinExprOr* orExpr) const {
-        std::string labelTrue = gen.create_label();
-        std::string labelEnd = gen.create_label();
-
-        // Evaluate the left-hand side expression
-        gen.gen_expr(orExpr->lhs);
-        gen.pop("rax");
-        gen.m_output << "    cmp rax, 0\n";  // Compare with false
-        gen.m_output << "    jne " << labelTrue << "\n";  // Jump if true
-
-        // Evaluate the right-hand side expression
-        gen.gen_expr(orExpr->rhs);
-        gen.pop("rax");
-        gen.m_output << "    cmp rax, 0\n";  // Compare with false
-        gen.m_output << "    jne " << labelTrue << "\n";  // Jump if true
-
-        // Both are false
-        gen.m_output << "    mov rax, 0\n";  // Set result to false
-        gen.m_output << "    jmp " << labelEnd << "\n";
-
-        // True label
-        gen.m_output << labelTrue << ":\n";
-        gen.m_output << "    mov rax, 1\n";  // Set result to true
-
-        // End label
-        gen.m_output << labelEnd << ":\n";
-        gen.push("rax");
-      }
+  // rax = (rax <cond> rbx) as 0 or 1
+  void gen_compare(std::string_view set_instr){
+    m_output << "    cmp rax, rbx\n";
+    m_output << "    " << set_instr << " al\n";
+    m_output << "    movzx rax, al\n";
+  }
 
+  void gen_expr(NodeIndex expr){
+    const Node& node = m_prog[expr];
+    switch (node.kind) {
+    case NodeKind::int_lit:
+      m_output << "    mov rax, " << node.int_value() << "\n";
+      push("rax");
+      break;
+    case NodeKind::bool_lit:
+      // the boolean value as an integer (0 for false, 1 for true)
+      m_output << "    mov rax, " << node.a << "\n";
+      push("rax");
+      break;
+    case NodeKind::string_lit:
+      gen_string_lit(node);
+      break;
+    case NodeKind::ident:
+      gen_ident(node);
+      break;
+    case NodeKind::bin_expr:
+      gen_bin_expr(node);
+      break;
+    case NodeKind::func_call:
+      gen_func_call(node);
+      break;
+    default:
+      assert(false); // Unreachable, not an expression
+    }
+  }
 
-  };
+  // The value of an expression in a register, for the statements. At -O0 that is rax after popping it, at -O1 a scratch register the
+  // caller gives back with release()
+  std::string_view gen_value(NodeIndex expr){
+    if (m_options.opt_level > 0) {
+      return gen_reg(expr);
+    }
+    gen_expr(expr);
+    pop("rax");
+    return "rax";
+  }
 
-      BinExprVisitor visitor { .gen = *this };
-      std::visit(visitor, bin_expr->var);
+  // The value of an expression in a specific register
+  void gen_value_into(NodeIndex expr, std::string_view reg){
+    if (m_options.opt_level == 0) {
+      gen_expr(expr);
+      pop(reg);
+      return;
+    }
+    std::string_view value = gen_reg(expr);
+    m_output << "    mov " << reg << ", " << value << "\n";
+    release(value);
   }
 
-  void gen_expr(const NodeExpr* expr){
+  // Sethi-Ullman number of an expression: how many registers it takes to evaluate it without spilling.
+  // An operand that can be used directly by the instruction (an immediate or a variable) takes none
+  int reg_need(NodeIndex expr){
+    return need_entry(expr) & need_mask;
+  }
 
-      struct ExprVisitor {
-          Generator& gen;
-          void operator()(const NodeTerm* term) const
-          {
-              gen.gen_term(term);
-          }
-          void operator()(const NodeBinExpr* bin_expr) const
-          {
-              gen.gen_bin_expr(bin_expr);
-          }
-          void operator()(const NodeFuncCall* func_call) const {
-            gen.gen_func_call(func_call);
-          }  
-      };
+  // -O1: whether evaluating `expr` calls a function or can fault, see has_side_effects. Comes with the Sethi-Ullman number
+  bool has_effects(NodeIndex expr){
+    return (need_entry(expr) & effects_bit) != 0;
+  }
 
-      ExprVisitor visitor { .gen = *this };
-      std::visit(visitor, expr->var);
+  // The Sethi-Ullman number of `expr` and, in effects_bit, whether it has side effects
+  uint8_t need_entry(NodeIndex expr){
+    if (m_root != nullptr) {
+      return m_root->m_need[expr]; // the root filled in every node before the workers started
+    }
+    if (m_need.size() < m_prog.nodes.size()) {
+      m_need.resize(m_prog.nodes.size(), 0);
+    }
+    if (m_need[expr] != 0) {
+      return m_need[expr];
+    }
+    const Node& node = m_prog[expr];
+    int need = 1;
+    bool effects = false;
+    if (node.kind == NodeKind::func_call) {
+      // everything live is spilled around a call anyway, evaluating it first means there is nothing to spill
+      need = static_cast<int>(scratch_regs.size());
+      effects = true;
+    }
+    else if (node.kind == NodeKind::bin_expr) {
+      int lhs = reg_need(node.a);
+      int rhs = is_direct_operand(node.b, node.op) ? 0 : reg_need(node.b);
+      if (node.op == BinOp::and_ || node.op == BinOp::or_) {
+        need = std::max({ lhs, rhs, 1 }); // one side after the other, never both at once
+      }
+      else {
+        need = lhs == rhs ? lhs + 1 : std::max(lhs, rhs);
+      }
+      effects = can_fault(m_prog, node) || has_effects(node.a) || has_effects(node.b);
+    }
+    m_need[expr] = static_cast<uint8_t>(std::min(need, int { need_mask }) | (effects ? effects_bit : 0));
+    return m_need[expr];
   }
 
-  void gen_scope(const NodeScope* scope)
-  {
-      begin_scope();
-      for (const NodeStmt* stmt : scope->stmts) {
-          gen_stmt(stmt);
+  // Whether `expr` can be the second operand of the instruction for `op` as is, without loading it into a register first
+  bool is_direct_operand(NodeIndex expr, BinOp op){
+    const Node& node = m_prog[expr];
+    if (node.kind == NodeKind::ident) {
+      return true;
+    }
+    if (op == BinOp::div) {
+      return false; // idiv has no immediate form
+    }
+    if (node.kind == NodeKind::bool_lit) {
+      return true;
+    }
+    return node.kind == NodeKind::int_lit && node.int_value() >= INT32_MIN && node.int_value() <= INT32_MAX; // sign extended imm32
+  }
+
+  AsmOperand direct_operand(NodeIndex expr){
+    const Node& node = m_prog[expr];
+    switch (node.kind) {
+    case NodeKind::ident:
+      return var_operand(*lookup_var(node.a));
+    case NodeKind::bool_lit:
+      return AsmOperand::imm(node.a);
+    default:
+      return AsmOperand::imm(node.int_value());
+    }
+  }
+
+  // -O1: evaluate an expression into a scratch register and return it, the caller gives it back with release()
+  std::string_view gen_reg(NodeIndex expr){
+    const Node& node = m_prog[expr];
+    switch (node.kind) {
+    case NodeKind::int_lit:
+    case NodeKind::bool_lit:
+    case NodeKind::ident: {
+      std::string_view reg = allocate();
+      m_output << "    mov " << reg << ", " << direct_operand(expr) << "\n";
+      return reg;
+    }
+    case NodeKind::string_lit: {
+      std::string_view reg = allocate();
+      m_output << "    lea " << reg << ", [" << string_label(node) << "]\n";
+      return reg;
+    }
+    case NodeKind::bin_expr:
+      if (node.op == BinOp::and_ || node.op == BinOp::or_) {
+        return gen_logical_reg(node);
       }
-      end_scope();
+      return gen_bin_reg(node);
+    case NodeKind::func_call:
+      return gen_call_reg(node);
+    default:
+      assert(false); // Unreachable, not an expression
+      return {};
+    }
+  }
+
+  std::string_view gen_bin_reg(const Node& bin_expr){
+    return gen_operands(bin_expr, [&](std::string_view lhs, const AsmOperand& rhs) { gen_bin_op(bin_expr.op, lhs, rhs); });
+  }
+
+  // -O1: evaluate both operands of a binary operator and hand them to `emit`, the lhs in a scratch register, the rhs in another one, on
+  // the stack or as an immediate. Returns the lhs register, still allocated. Nothing between `emit` and the return touches the flags
+  template <typename Emit>
+  std::string_view gen_operands(const Node& bin_expr, Emit emit){
+    std::string_view lhs;
+    if (is_direct_operand(bin_expr.b, bin_expr.op)) {
+      lhs = gen_reg(bin_expr.a);
+      emit(lhs, direct_operand(bin_expr.b));
+      return lhs;
+    }
+
+    // The rhs only goes first when that can't be told apart: if both sides call functions (or fault) they run left to right, as written
+    bool in_order = has_effects(bin_expr.a) && has_effects(bin_expr.b);
+
+    // Holding one side while evaluating the other takes a second register. If there isn't one, spill a side to the stack
+    if (std::popcount(m_free_regs) < 2 && in_order) {
+      lhs = gen_reg(bin_expr.a);
+      push(lhs);
+      release(lhs);
+      std::string_view rhs = gen_reg(bin_expr.b);
+      // Swap them: the lhs into the register, the rhs where the lhs was. rdx is never a scratch register, see gen_bin_op
+      m_output << "    mov rdx, [rsp]\n";
+      m_output << "    mov [rsp], " << rhs << "\n";
+      m_output << "    mov " << rhs << ", rdx\n";
+      emit(rhs, AsmOperand::mem("rsp", 0));
+      m_output << "    lea rsp, [rsp + 8]\n";
+      m_stack_size--;
+      return rhs;
+    }
+    if (std::popcount(m_free_regs) < 2) {
+      std::string_view rhs = gen_reg(bin_expr.b);
+      push(rhs);
+      release(rhs);
+      lhs = gen_reg(bin_expr.a);
+      emit(lhs, AsmOperand::mem("rsp", 0));
+      m_output << "    lea rsp, [rsp + 8]\n";
+      m_stack_size--;
+      return lhs;
+    }
+
+    // The side that needs more registers goes first, while all of them are still free
+    std::string_view rhs;
+    if (reg_need(bin_expr.a) >= reg_need(bin_expr.b) || in_order) {
+      lhs = gen_reg(bin_expr.a);
+      rhs = gen_reg(bin_expr.b);
+    }
+    else {
+      rhs = gen_reg(bin_expr.b);
+      lhs = gen_reg(bin_expr.a);
+    }
+    emit(lhs, rhs);
+    release(rhs);
+    return lhs;
   }
 
-  std::string escape_string(const std::string& str) {
-    std::string escaped;
-    for (char c : str) {
-        switch (c) {
-            case '\n': escaped += "\\n"; break;
-            case '\t': escaped += "\\t"; break;
-            case '\"': escaped += "\\\""; break;
-            case '\\': escaped += "\\\\"; break;
-            // Other escape sequences as needed
-            default: escaped += c;
+  // lhs = lhs <op> rhs, rhs is a register, a memory operand or an immediate
+  void gen_bin_op(BinOp op, std::string_view lhs, const AsmOperand& rhs){
+    switch (op) {
+    case BinOp::add:
+      m_output << "    add " << lhs << ", " << rhs << "\n";
+      break;
+    case BinOp::sub:
+      m_output << "    sub " << lhs << ", " << rhs << "\n";
+      break;
+    case BinOp::mul:
+      m_output << "    imul " << lhs << ", " << rhs << "\n";
+      break;
+    case BinOp::div:
+      // rax and rdx are never handed out as scratch registers, so idiv can have them
+      m_output << "    mov rax, " << lhs << "\n";
+      m_output << "    cqo\n";
+      m_output << "    idiv " << rhs << "\n";
+      m_output << "    mov " << lhs << ", rax\n";
+      break;
+    case BinOp::eq:
+    case BinOp::lt:
+    case BinOp::gt:
+      m_output << "    cmp " << lhs << ", " << rhs << "\n";
+      m_output << "    set" << condition_code(op, true) << " al\n";
+      m_output << "    movzx " << lhs << ", al\n";
+      break;
+    case BinOp::and_:
+    case BinOp::or_:
+      assert(false); // Unreachable, handled by gen_logical_reg
+    }
+  }
+
+  // && and || only evaluate the rhs when the lhs doesn't decide the result already. Both sides branch straight to the label for the
+  // result they decide, a comparison without ever being turned into 0 or 1
+  std::string_view gen_logical_reg(const Node& bin_expr){
+    bool is_and = bin_expr.op == BinOp::and_;
+    AsmLabel short_label = create_label();
+    AsmLabel end_label = create_label();
+    gen_branch(bin_expr.a, !is_and, short_label);
+    gen_branch(bin_expr.b, !is_and, short_label);
+
+    // Every register is as free on the paths that jumped as on this one, so the result can go in any of them
+    std::string_view result = allocate();
+    m_output << "    mov " << result << ", " << (is_and ? 1 : 0) << "\n";
+    m_output << "    jmp " << end_label << "\n";
+    m_output << short_label << ":\n";
+    m_output << "    mov " << result << ", " << (is_and ? 0 : 1) << "\n";
+    m_output << end_label << ":\n";
+    return result;
+  }
+
+  // Jump to `target` when `cond` is true (`when`) or false (!`when`), fall through otherwise. A comparison branches on the flags of its
+  // cmp, && and || branch on each side in turn, and a constant is an unconditional jump or nothing. Nothing is left allocated or pushed
+  void gen_branch(NodeIndex cond, bool when, AsmLabel target){
+    const Node& node = m_prog[cond];
+    switch (node.kind) {
+    case NodeKind::int_lit:
+    case NodeKind::bool_lit:
+      if ((node.kind == NodeKind::bool_lit ? node.a != 0 : node.int_value() != 0) == when) {
+        m_output << "    jmp " << target << "\n";
+      }
+      return;
+    case NodeKind::bin_expr:
+      switch (node.op) {
+      case BinOp::and_:
+      case BinOp::or_: {
+        // the lhs alone decides || when true, && when false. If that is the outcome we jump on, it goes straight to the target,
+        // otherwise past the rhs
+        bool lhs_decides = node.op == BinOp::or_;
+        if (lhs_decides == when) {
+          gen_branch(node.a, when, target);
+          gen_branch(node.b, when, target);
+        }
+        else {
+          AsmLabel skip = create_label();
+          gen_branch(node.a, lhs_decides, skip);
+          gen_branch(node.b, when, target);
+          m_output << skip << ":\n";
         }
+        return;
+      }
+      case BinOp::eq:
+      case BinOp::lt:
+      case BinOp::gt:
+        gen_compare_flags(node);
+        m_output << "    j" << condition_code(node.op, when) << " " << target << "\n";
+        return;
+      default:
+        break;
+      }
+      break;
+    default:
+      break;
     }
-    return escaped;
+    std::string_view value = gen_value(cond);
+    m_output << "    test " << value << ", " << value << "\n";
+    m_output << "    " << (when ? "jnz" : "jz") << " " << target << "\n";
+    release(value);
   }
 
-  void gen_stmt(const NodeStmt* stmt){
+  // The flags of `cmp lhs, rhs` for a comparison, with both operands given back
+  void gen_compare_flags(const Node& bin_expr){
+    if (m_options.opt_level == 0) {
+      gen_expr(bin_expr.a);
+      gen_expr(bin_expr.b);
+      pop("rbx");
+      pop("rax");
+      m_output << "    cmp rax, rbx\n";
+      return;
+    }
+    // A variable is compared where it lives, unless both sides are in memory
+    if (m_prog[bin_expr.a].kind == NodeKind::ident && is_direct_operand(bin_expr.b, bin_expr.op)) {
+      AsmOperand lhs = direct_operand(bin_expr.a);
+      AsmOperand rhs = direct_operand(bin_expr.b);
+      if (lhs.kind == AsmOperand::Kind::reg || rhs.kind != AsmOperand::Kind::mem) {
+        m_output << "    cmp " << lhs << ", " << rhs << "\n";
+        return;
+      }
+    }
+    release(gen_operands(bin_expr, [&](std::string_view lhs, const AsmOperand& rhs) {
+      m_output << "    cmp " << lhs << ", " << rhs << "\n";
+    }));
+  }
 
-    struct StmtVisitor {
-      Generator& gen;
-      void operator()(const NodeStmtExit* stmt_exit) const {
-        gen.gen_expr(stmt_exit->expr);
-        gen.m_output << "    mov rax, 60\n";
-        gen.pop("rdi"); // pop from the stack and put it in rdi
-        gen.m_output << "    syscall\n";
+  // The jcc / setcc condition for a comparison being true (`when`) or false
+  static std::string_view condition_code(BinOp op, bool when){
+    switch (op) {
+    case BinOp::eq:
+      return when ? "e" : "ne";
+    case BinOp::lt:
+      return when ? "l" : "ge";
+    default:
+      return when ? "g" : "le";
+    }
+  }
+
+  // An if / else if chain on one variable, see switches.hpp. The variable is read into rax once, a jump table or a binary search over
+  // the cases picks the body
+  void gen_switch(const SwitchChain& chain){
+    std::vector<AsmLabel> case_labels;
+    for (size_t i = 0; i < chain.cases.size(); i++) {
+      case_labels.push_back(create_label());
+    }
+    AsmLabel default_label = create_label();
+    AsmLabel end_label = create_label();
+
+    m_output << "    mov rax, " << var_operand(*lookup_var(chain.var)) << "\n";
+    if (chain.dense()) {
+      // rax - min is below the table size exactly for the values between min and max, as an unsigned compare
+      int64_t min = chain.cases.front().value;
+      int64_t max = chain.cases.back().value;
+      AsmLabel table = create_label();
+      if (min != 0) {
+        m_output << "    sub rax, " << min << "\n";
+      }
+      m_output << "    cmp rax, " << max - min << "\n";
+      m_output << "    ja " << default_label << "\n";
+      m_output << "    jmp [" << table << " + rax*8]\n";
+      m_output << "section .rodata\n";
+      m_output << table << ":\n";
+      size_t next = 0;
+      for (int64_t value = min; value <= max; value++) {
+        bool is_case = chain.cases[next].value == value;
+        m_output << "    dq " << (is_case ? case_labels[next] : default_label) << "\n";
+        next += is_case ? 1 : 0;
       }
+      m_output << "section .text\n";
+    }
+    else {
+      gen_switch_search(chain.cases, case_labels, 0, chain.cases.size(), default_label);
+    }
 
-      // operator overload that allows objects of a class to be called as if they were functions.
-      // specifically designed to handle 'let' statement nodes (NodeStmtLet) in an Abstract Syntax Tree (AST).
-      void operator()(const NodeStmtLet* stmt_let) const {
-        // looks for the variable name in the existing variable list to ensure that the variable has not been declared before in the same scope.
-        auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-          return var.name == stmt_let->ident.value.value();  // [&] Capture all automatic (local) variables odr-used 
-        });
+    m_output << default_label << ":\n";
+    if (chain.otherwise != null_node) {
+      gen_stmt(chain.otherwise);
+    }
+    for (size_t i = 0; i < chain.cases.size(); i++) {
+      m_output << "    jmp " << end_label << "\n";
+      m_output << case_labels[i] << ":\n";
+      gen_scope(chain.cases[i].body);
+    }
+    m_output << end_label << ":\n";
+  }
 
-        if (it != gen.m_vars.cend()) {
-          // If the variable is already declared, if it doesn't equal the end then it doesn't exist
-          std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
-          exit(EXIT_FAILURE);
-        }
-        // the stack location
-        gen.m_vars.push_back({ .name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size });
-        gen.gen_expr(stmt_let->expr);
+  // Binary search for rax among cases [begin, end), a few compares in a row once the range is small
+  void gen_switch_search(const std::vector<SwitchCase>& cases, const std::vector<AsmLabel>& labels, size_t begin, size_t end,
+                         AsmLabel default_label){
+    if (end - begin <= 3) {
+      for (size_t i = begin; i < end; i++) {
+        m_output << "    cmp rax, " << cases[i].value << "\n";
+        m_output << "    je " << labels[i] << "\n";
       }
+      m_output << "    jmp " << default_label << "\n";
+      return;
+    }
+    size_t middle = begin + (end - begin) / 2;
+    AsmLabel upper = create_label();
+    m_output << "    cmp rax, " << cases[middle].value << "\n";
+    m_output << "    jge " << upper << "\n";
+    gen_switch_search(cases, labels, begin, middle, default_label);
+    m_output << upper << ":\n";
+    gen_switch_search(cases, labels, middle, end, default_label);
+  }
 
-      void operator()(const NodeScope* scope) const {
-        gen.gen_scope(scope);
+  std::string_view gen_call_reg(const Node& func_call){
+    check_func_call(func_call);
+    std::span<const uint32_t> args = m_prog.list(func_call.b);
+
+    // The call clobbers every scratch register, spill the ones holding temporaries. While the arguments are evaluated they are all free
+    uint32_t live = all_regs & ~m_free_regs;
+    for (size_t i = 0; i < scratch_regs.size(); i++) {
+      if ((live & (1u << i)) != 0) {
+        push(scratch_regs[i]);
+      }
+    }
+    m_free_regs = all_regs;
+
+    // Arguments are evaluated in reverse order, the same convention as -O0. The ones past the sixth are pushed where the callee expects
+    // them. The others go in registers, but a call in a later argument would clobber them, so each is pushed once it is computed and
+    // popped into its register at the end. The last one computed goes straight there, and variables and constants, which take no
+    // evaluating, are loaded last
+    size_t reg_args = std::min(args.size(), arg_regs.size());
+    for (size_t i = args.size(); i-- > reg_args;) {
+      std::string_view arg = gen_reg(args[i]);
+      push(arg);
+      release(arg);
+    }
+    size_t last_computed = 0;
+    while (last_computed < reg_args && is_simple_arg(args[last_computed])) {
+      last_computed++;
+    }
+    for (size_t i = reg_args; i-- > last_computed;) {
+      if (i == last_computed) {
+        gen_value_into(args[i], arg_regs[i]);
       }
+      else if (!is_simple_arg(args[i])) {
+        std::string_view arg = gen_reg(args[i]);
+        push(arg);
+        release(arg);
+      }
+    }
+    for (size_t i = last_computed + 1; i < reg_args; i++) {
+      if (!is_simple_arg(args[i])) {
+        pop(arg_regs[i]);
+      }
+    }
+    for (size_t i = 0; i < reg_args; i++) {
+      if (m_prog[args[i]].kind == NodeKind::string_lit) {
+        m_output << "    lea " << arg_regs[i] << ", [" << string_label(m_prog[args[i]]) << "]\n";
+      }
+      else if (is_simple_arg(args[i])) {
+        m_output << "    mov " << arg_regs[i] << ", " << direct_operand(args[i]) << "\n";
+      }
+    }
+    m_output << "    call " << function_label(m_interner.name(func_call.a)) << "\n";
+    if (args.size() > reg_args) {
+      m_output << "    add rsp, " << (args.size() - reg_args) * 8 << "\n";
+      m_stack_size -= args.size() - reg_args;
+    }
 
-      void operator()(const NodeStmtElse* stmt_else) const {
-        // Simply generate the code within the else scope, as it is unconditional.
-        gen.gen_scope(stmt_else->scope);
+    for (size_t i = scratch_regs.size(); i-- > 0;) {
+      if ((live & (1u << i)) != 0) {
+        pop(scratch_regs[i]);
       }
+    }
+    m_free_regs = all_regs & ~live;
+    std::string_view result = allocate();
+    m_output << "    mov " << result << ", rax\n";
+    return result;
+  }
 
-      void operator()(const NodeFuncDef* func_def) const {
-          gen.gen_func_def(func_def);
+  // -O1: decide which locals get one of the callee-saved registers. Every use counts, a use inside a loop counts 8 times as much per loop
+  // it is nested in. The busiest locals win, everything else lives on the stack like at -O0
+  void plan_locals(std::span<const uint32_t> params, std::span<const uint32_t> stmts){
+    std::vector<LocalUse> locals;
+    ScopedSymbolTable<uint32_t> names; // name -> index in locals
+    for (size_t i = 0; i < params.size(); i++) {
+      names.declare(params[i], static_cast<uint32_t>(locals.size()));
+      locals.push_back({ .param = i });
+    }
+    for (NodeIndex stmt : stmts) {
+      count_uses_stmt(stmt, names, locals, 1);
+    }
+
+    std::vector<uint32_t> order(locals.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+      order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t lhs, uint32_t rhs) { return locals[lhs].weight > locals[rhs].weight; });
+
+    m_local_plan = { .params = std::vector<std::string_view>(params.size()) };
+    for (size_t i = 0; i < order.size() && i < local_regs.size() && locals[order[i]].weight > 0; i++) {
+      const LocalUse& local = locals[order[i]];
+      if (local.let == null_node) {
+        m_local_plan.params[local.param] = local_regs[i];
       }
+      else {
+        m_local_plan.lets[local.let] = local_regs[i];
+      }
+      m_local_plan.used.push_back(local_regs[i]);
+    }
+  }
 
-      void operator()(const NodeReturn* return_stmt) const {
-          gen.gen_return_stmt(return_stmt);
+  void gen_scope(NodeIndex scope)
+  {
+      begin_scope();
+      for (NodeIndex stmt : m_prog.list(m_prog[scope].a)) {
+          gen_stmt(stmt);
       }
+      end_scope();
+  }
 
-      void operator()(const NodeStmtElseIf* stmt_else_if) const {
-        std::string end_label = gen.create_label(); // Label for the end of the entire if-else chain
+  // The label of the literal's entry in the string pool
+  StringLabel string_label(const Node& str_lit) const {
+      return StringLabel(m_prog.string(str_lit));
+  }
 
-        // Generate code for each else-if in the chain
-        while (stmt_else_if != nullptr) {
-          std::string next_label = gen.create_label(); // Label for the next else-if
+  void gen_string_lit(const Node& str_lit) {
+      StringLabel label = string_label(str_lit);
 
-          // Evaluate the else-if condition
-          gen.gen_expr(stmt_else_if->expr);
-          gen.pop("rax");
-          gen.m_output << "    cmp rax, 0\n";
-          gen.m_output << "    je " << next_label << "\n";
+      // Load the address of the string into a register
+      m_output << "    lea rax, [" << label << "]\n";
+      push("rax");
+  }
 
-          // Generate the code for the else-if scope
-          gen.gen_scope(stmt_else_if->scope);
-          gen.m_output << "    jmp " << end_label << "\n";
+  // Function to determine if the expression is a string expression: a string literal or a variable that was initialised with one
+  bool is_string_expression(NodeIndex expr) {
+      const Node& node = m_prog[expr];
+      if (node.kind == NodeKind::string_lit) {
+          return true;
+      }
+      if (node.kind == NodeKind::ident) {
+          return lookup_var(node.a)->is_string;
+      }
+      return false;
+  }
 
-          // Set up the next else-if (or else)
-          gen.m_output << next_label << ":\n";
-          stmt_else_if = stmt_else_if->next;
+  void gen_stmt(NodeIndex index){
+    const Node& stmt = m_prog[index];
+    assert(m_free_regs == all_regs); // temporaries never outlive the statement they are computed in
+    switch (stmt.kind) {
+    case NodeKind::stmt_exit:
+      gen_value_into(stmt.a, "rdi"); // the exit code goes in rdi
+      emit_exit(m_output, root().m_uses_print, profiling());
+      break;
+
+    case NodeKind::stmt_let:
+      // the variable lives in the next free slot of the frame, or in the register the -O1 plan gave it. It may shadow a variable from an
+      // outer scope, but it can't be declared twice in the same scope
+      {
+        bool is_string = is_string_expression(stmt.b);
+        Var var { .is_string = is_string };
+        auto planned = m_local_plan.lets.find(index);
+        if (m_options.opt_level > 0 && planned != m_local_plan.lets.end()) {
+          gen_value_into(stmt.b, planned->second);
+          var.reg = planned->second;
         }
+        else if (m_options.opt_level == 0) {
+          gen_expr(stmt.b);
+          var.frame_offset = frame_slot();
+          m_output << "    pop " << var_operand(var) << "\n";
+          m_stack_size--;
+        }
+        else {
+          std::string_view value = gen_reg(stmt.b);
+          var.frame_offset = frame_slot();
+          m_output << "    mov " << var_operand(var) << ", " << value << "\n";
+          release(value);
+        }
+        if (!m_vars.declare(stmt.a, var)) {
+          compile_error("Identifier already used: ", m_interner.name(stmt.a));
+        }
+      }
+      break;
 
-        // End label for the entire if-else chain
-        gen.m_output << end_label << ":\n";
+    case NodeKind::stmt_assign: {
+      const Var* var = lookup_var(stmt.a);
+      if (!var->reg.empty()) {
+        gen_value_into(stmt.b, var->reg);
+        break;
       }
+      std::string_view value = gen_value(stmt.b);
+      m_output << "    mov " << var_operand(*var) << ", " << value << "\n";
+      release(value);
+      break;
+    }
 
-      void operator()(const NodeStmtIf* stmt_if) const {
-        gen.gen_expr(stmt_if->expr);
-        gen.pop("rax");
-        std::string label = gen.create_label();
-        gen.m_output << "    test rax, rax\n";
-        gen.m_output << "    jz " << label << "\n";
-        gen.gen_scope(stmt_if->scope);
-        gen.m_output << label << ":\n";
+    case NodeKind::stmt_expr:
+      // the value isn't used, just drop it
+      release(gen_value(stmt.a));
+      break;
+
+    case NodeKind::scope:
+      gen_scope(index);
+      break;
+
+    case NodeKind::func_def:
+      // generated out of line after the main program, see gen_prog
+      break;
+
+    case NodeKind::stmt_return:
+      gen_return_stmt(stmt);
+      break;
+
+    case NodeKind::stmt_if: {
+      // A chain dispatched in one go would skip the counters of the ifs it jumps over
+      std::optional<SwitchChain> chain = profiling() ? std::nullopt : find_switch_chain(m_prog, index);
+      if (chain.has_value()) {
+        gen_switch(chain.value());
+        break;
       }
+      uint32_t site = profiling() ? m_profile_sites.at(index) : 0;
+      AsmLabel else_label = create_label();
+      gen_branch(stmt.a, false, else_label);
+      gen_profile(site, ProfileEvent::primary);
+      gen_scope(stmt.b);
+      if (stmt.c == null_node && !profiling()) {
+        m_output << else_label << ":\n";
+        break;
+      }
+      // else if / else: skip over it when the condition was true. Profiled, a missing else still counts the times it was false
+      AsmLabel end_label = create_label();
+      m_output << "    jmp " << end_label << "\n";
+      m_output << else_label << ":\n";
+      gen_profile(site, ProfileEvent::secondary);
+      if (stmt.c != null_node) {
+        gen_stmt(stmt.c);
+      }
+      m_output << end_label << ":\n";
+      break;
+    }
 
-      void operator()(const NodeStmtWhile* stmt_while) const {
-        std::string start_label = gen.create_label();
-        std::string end_label = gen.create_label();
+    case NodeKind::stmt_while: {
+      AsmLabel start_label = create_label();
+      AsmLabel end_label = create_label();
 
-        gen.m_output << start_label << ":\n";
-        gen.gen_expr(stmt_while->expr);
-        gen.pop("rax");
-        gen.m_output << "    cmp rax, 0\n";
-        gen.m_output << "    je " << end_label << "\n";
+      begin_profiled_loop(index);
+      m_output << start_label << ":\n";
+      gen_branch(stmt.a, false, end_label);
 
-        gen.gen_scope(stmt_while->scope);
-        gen.m_output << "    jmp " << start_label << "\n";
-        gen.m_output << end_label << ":\n";
-      }
+      gen_profile_iteration();
+      gen_scope(stmt.b);
+      m_output << "    jmp " << start_label << "\n";
+      m_output << end_label << ":\n";
+      end_profiled_loop();
+      break;
+    }
 
-      void operator()(const NodeStmtFor* stmt_for) const {
-        std::string start_label = gen.create_label();
-        std::string end_label = gen.create_label();
+    case NodeKind::stmt_for: {
+      std::span<const uint32_t> parts = m_prog.list(stmt.a); // init, condition, iteration, scope
+      AsmLabel start_label = create_label();
+      AsmLabel end_label = create_label();
 
-        // Generate initialization
-        gen.gen_expr(stmt_for->init);
+      // The loop variable lives in a scope around the whole loop
+      begin_scope();
 
-        gen.m_output << start_label << ":\n";
+      // Generate initialization
+      if (parts[0] != null_node) {
+        gen_stmt(parts[0]);
+      }
 
-        // Generate condition check
-        gen.gen_expr(stmt_for->condition);
-        gen.pop("rax");
-        gen.m_output << "    cmp rax, 0\n";
-        gen.m_output << "    je " << end_label << "\n";
+      begin_profiled_loop(index);
+      m_output << start_label << ":\n";
 
-        // Generate the for loop scope
-        gen.gen_scope(stmt_for->scope);
+      // Generate condition check
+      gen_branch(parts[1], false, end_label);
 
-        // Generate iteration
-        gen.gen_expr(stmt_for->iteration);
+      // Generate the for loop scope
+      gen_profile_iteration();
+      gen_scope(parts[3]);
 
-        gen.m_output << "    jmp " << start_label << "\n";
-        gen.m_output << end_label << ":\n";
+      // Generate iteration
+      if (parts[2] != null_node) {
+        gen_stmt(parts[2]);
       }
 
-      void operator()(const NodeBoolLit* bool_lit) const {
-        int boolValue = bool_lit->value ? 1 : 0;
-        gen.m_output << "    mov rax, " << boolValue << "\n";
-        gen.push("rax");
+      m_output << "    jmp " << start_label << "\n";
+      m_output << end_label << ":\n";
+      end_profiled_loop();
+      end_scope();
+      break;
+    }
+
+    case NodeKind::stmt_print:
+      // The runtime only touches caller-saved registers, so locals that live in callee-saved registers at -O1 survive it
+      if (m_prog[stmt.a].kind == NodeKind::string_lit) {
+        // The length of a literal is known here, the runtime only has to copy it
+        m_output << "    lea rsi, [" << string_label(m_prog[stmt.a]) << "]\n";
+        m_output << "    mov rdx, " << string_literal_length(m_prog.string(m_prog[stmt.a])) << "\n";
+        m_output << "    call hydro_print_string\n";
+      }
+      else if (is_string_expression(stmt.a)) {
+        gen_value_into(stmt.a, "rsi"); // Address of the string, its length is stored in front of it
+        m_output << "    mov rdx, QWORD [rsi - 8]\n";
+        m_output << "    call hydro_print_string\n";
+      }
+      else {
+        gen_value_into(stmt.a, "rax"); // Integer value
+        m_output << "    call hydro_print_int\n";
       }
-      
-      void operator()(const NodeStringLit* str_lit) const {
-          std::string label = gen.make_string_label();
+      break;
 
-          // Escape the string literal and store it in the data section
-          std::string escaped_str = escape_string(str_lit->value);
-          gen.m_data_section << label << ": db \"" << escaped_str << "\", 0\n"; // Null-terminated string
+    default:
+      assert(false); // Unreachable, not a statement
+    }
+  }
 
-          // Load the address of the string into a register
-          gen.m_output << "    lea rax, [" << label << "]\n";
-          gen.push("rax");
+  // The whole program: the main program, every function in source order, the string pool and the runtime
+  [[nodiscard]] AsmBuffer gen_prog() {
+      // The main program comes first and its buffer was reserved for the whole program, the rest is appended to it
+      std::vector<AsmBuffer> parts = gen_units(code_units(m_prog));
+      AsmBuffer program = std::move(parts.front());
+      for (size_t i = 1; i < parts.size(); i++) {
+          program << parts[i];
       }
-      // Function to determine if the expression is a string expression
-      bool is_string_expression(const NodeExpr* expr) {
-          if (!expr) {
-              return false; // Safety check in case expr is a nullptr
+      program << gen_data();
+      return program;
+  }
+
+  // The code of each of `units`, the prog node for the main program or a func_def, in a buffer of its own. The pieces don't refer to
+  // each other by anything but the functions' names, so the driver can generate only the ones it has no machine code for yet and link
+  // them with the rest (see incremental.hpp). Only called once per Generator, gen_data goes after it
+  [[nodiscard]] std::vector<AsmBuffer> gen_units(std::span<const NodeIndex> units) {
+      // Every function can be called from anywhere, so they are all declared before generating any code
+      for (const Node& node : m_prog.nodes) {
+          if (node.kind == NodeKind::func_def
+              && !m_functions.declare(node.a, { .arity = m_prog.list(node.b).size() })) {
+              compile_error("Function already defined: ", m_interner.name(node.a));
           }
+      }
 
-          // Check if the variant holds a NodeStringLit
-          return std::holds_alternative<NodeStringLit*>(expr->var);
-      }
-      // Convert an integer in a register to its ASCII string representation
-      void int_to_string(const std::string& int_reg, const std::string& str_reg) {
-          // Assuming int_reg contains the integer and str_reg is where the string should be stored
-          // This is a simplified example. A full implementation would handle negative numbers and zero.
-          gen.m_output << "    mov " << str_reg << ", rsp\n";  // Use stack for temporary storage
-          gen.m_output << "    mov rsi, " << int_reg << "\n";  // Integer to convert
-          gen.m_output << "    mov rbx, 10\n";                // Divisor for conversion
-          std::string loop_label = gen.create_label();
-          gen.m_output << loop_label << ":\n";
-          gen.m_output << "    xor rdx, rdx\n";               // Clear rdx for division
-          gen.m_output << "    div rbx\n";                    // rax = rsi / 10, rdx = rsi % 10
-          gen.m_output << "    add dl, '0'\n";                // Convert to ASCII
-          gen.m_output << "    push rdx\n";                   // Push character onto stack
-          gen.m_output << "    mov rsi, rax\n";               // Prepare next digit
-          gen.m_output << "    test rax, rax\n";              // Check if rax is zero
-          gen.m_output << "    jnz " << loop_label << "\n";   // Repeat if not zero
-          // Now, reverse the string on the stack into str_reg
-          gen.reverse_stack_string(str_reg);
-      }
-      // Reverse a string stored on the stack into a register
-      void reverse_stack_string(const std::string& str_reg) {
-          // Implementation depends on your register management
-          // Here's a placeholder example
-          gen.m_output << "    lea " << str_reg << ", [rsp]\n"; // String start
-          // Add logic to reverse the string on the stack into str_reg
-      }
-
-      void operator()(const NodeStmtPrint* stmt_print) const {
-        gen.gen_expr(stmt_print->expr);
-
-        if (is_string_expression(stmt_print->expr)) {
-            // For string printing
-            gen.pop("rax");  // Address of the string
-            gen.m_output << "    mov rdi, rax\n"; // First argument (string pointer)
-            gen.setup_string_length("rax");       // Second argument (string length)
-            gen.syscall_write();
-        } else {
-            // For integer printing
-            gen.pop("rax");  // Integer value
-            gen.int_to_string("rax", "rbx"); // Convert integer to string, stored at rbx
-            gen.m_output << "    mov rdi, rbx\n"; // First argument (string pointer)
-            gen.setup_string_length("rbx");       // Second argument (string length)
-            gen.syscall_write();
-        }
-    }
+      // Exits flush the print buffer, and the print runtime is emitted, only in programs that print at all
+      m_uses_print = program_prints(m_prog);
 
-    // Performs the write syscall
-    void syscall_write() {
-        gen.m_output << "    mov rax, 1\n";  // Syscall number for write
-        gen.m_output << "    mov rdx, rsi\n"; // Length of the string
-        gen.m_output << "    mov rdi, 1\n";   // File descriptor (stdout)
-        gen.m_output << "    syscall\n";
-    }
+      // Every distinct string literal gets one entry in the pool
+      for (const Node& node : m_prog.nodes) {
+          if (node.kind == NodeKind::string_lit && m_string_set.insert(m_prog.string(node)).second) {
+              m_strings.push_back(m_prog.string(node));
+          }
+      }
 
-  };
-    // NodeStmtPrint definition
-    struct NodeStmtPrint {
-        NodeExpr* expr;
-    };
-    StmtVisitor visitor { .gen = *this };
-    std::visit(visitor, stmt->var);
+      // The workers read the Sethi-Ullman numbers concurrently, so they are all computed up front instead of on demand
+      if (m_options.opt_level > 0) {
+          for (NodeIndex index = 0; index < m_prog.nodes.size(); index++) {
+              reg_need(index);
+          }
+      }
+
+      // Each function body is generated by its own worker, on as many threads as the options allow. The main program is generated
+      // here, it is the one that owns the tables the workers read
+      std::vector<AsmBuffer> parts(units.size());
+      std::vector<size_t> bodies;
+      for (size_t i = 0; i < units.size(); i++) {
+          if (units[i] == m_prog.root) {
+              gen_main();
+              parts[i] = std::move(m_output);
+              m_output = AsmBuffer();
+          }
+          else {
+              bodies.push_back(i);
+          }
+      }
+      parallel_for(bodies.size(), m_options.threads, [&](size_t i) {
+          Generator worker(*this, m_prog[units[bodies[i]]].a);
+          worker.gen_func_def(units[bodies[i]]);
+          parts[bodies[i]] = std::move(worker.m_output);
+      });
+      return parts;
+  }
+
+  // What goes after the code: the string pool, in programs that print the runtime, and with -fprofile the counters and their dump
+  [[nodiscard]] AsmBuffer gen_data() {
+      AsmBuffer data;
+      emit_string_pool(data, m_strings);
+      if (m_uses_print) {
+          emit_print_runtime(data);
+      }
+      if (profiling()) {
+          emit_profile_runtime(data, profile_table(m_prog, m_interner, m_options.profile), m_uses_print);
+      }
+      return data;
   }
 
-  [[nodiscard]] std::string gen_prog() {
+private:
+  // The main program, into m_output. _start never returns, so its locals can use the callee-saved registers without saving them
+  void gen_main() {
+      // Roughly what the program will take, so the buffer doesn't have to grow and copy itself over and over
+      m_output.reserve(m_prog.nodes.size() * 48);
+
       // Start with the text section which includes the main program
       m_output << "global _start\nsection .text\n_start:\n";
 
-      // Generate the assembly code for each statement in the program
-      for (const NodeStmt* stmt : m_prog.stmts) {
+      std::span<const uint32_t> stmts = m_prog.list(m_prog[m_prog.root].a);
+      if (m_options.opt_level > 0) {
+          plan_locals({}, stmts);
+      }
+      m_frame_size = count_frame_slots(stmts);
+      if (m_frame_size > 0) {
+          m_output << "    mov rbp, rsp\n";
+          m_output << "    sub rsp, " << m_frame_size * 8 << "\n";
+      }
+      // The main program is never left, hydro_profile_exit closes it
+      begin_profile(m_prog.root, "_start");
+      gen_profile(0, ProfileEvent::enter);
+      for (NodeIndex stmt : stmts) {
           gen_stmt(stmt);
       }
 
       // Common exit sequence for the program
-      m_output << "    mov rax, 60\n";  // syscall number for exit in x86-64 Linux
       m_output << "    mov rdi, 0\n";   // exit status
-      m_output << "    syscall\n";
+      emit_exit(m_output, m_uses_print, profiling());
+  }
+
+  // A worker for one function body. It has its own output and label namespace, the function table and the Sethi-Ullman numbers are
+  // read from `root`, which outlives it
+  inline Generator(const Generator& root, SymbolId function)
+    : m_prog(root.m_prog)
+    , m_interner(root.m_interner)
+    , m_options(root.m_options)
+    , m_root(&root)
+    , m_label_prefix(function_label(m_interner.name(function)) + ".L")
+    , m_function(function)
+  {
+  }
+
+  // The Generator for the whole program, the one that owns the tables shared with the workers
+  const Generator& root() const {
+    return m_root != nullptr ? *m_root : *this;
+  }
+
+  struct Var {
+    bool is_string = false; // initialised with a string, print writes it as text
+    std::string_view reg {}; // -O1: the callee-saved register the variable lives in instead, empty if it is in memory
+    int frame_offset = 0; // where it is in memory, [rbp + frame_offset]: below rbp for a slot of the frame, above for a pushed argument
+  };
+
+  struct FuncInfo {
+    size_t arity; // number of parameters
+  };
+
+  // How often a local of the function being planned is used, see plan_locals
+  struct LocalUse {
+    uint64_t weight = 0;
+    NodeIndex let = null_node; // the let that declares it, null_node for a parameter
+    size_t param = 0; // the parameter index otherwise
+  };
 
-      // Include the data section if there are string literals
-      if (!m_data_section.str().empty()) {
-          m_output << "section .data\n" << m_data_section.str();
+  // Which locals of the current function (or the main program) live in which callee-saved register
+  struct LocalPlan {
+    std::unordered_map<NodeIndex, std::string_view> lets {}; // by the let that declares them
+    std::vector<std::string_view> params {}; // by parameter index, empty for the ones that stay in memory
+    std::vector<std::string_view> used {}; // every register handed out, what a function has to save
+  };
+
+  void count_uses_expr(NodeIndex expr, ScopedSymbolTable<uint32_t>& names, std::vector<LocalUse>& locals, uint64_t weight){
+    const Node& node = m_prog[expr];
+    switch (node.kind) {
+    case NodeKind::ident:
+      if (const uint32_t* local = names.lookup(node.a)) {
+        locals[*local].weight += weight;
+      }
+      break;
+    case NodeKind::bin_expr:
+      count_uses_expr(node.a, names, locals, weight);
+      count_uses_expr(node.b, names, locals, weight);
+      break;
+    case NodeKind::func_call:
+      for (NodeIndex arg : m_prog.list(node.b)) {
+        count_uses_expr(arg, names, locals, weight);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  void count_uses_stmt(NodeIndex index, ScopedSymbolTable<uint32_t>& names, std::vector<LocalUse>& locals, uint64_t weight){
+    const Node& stmt = m_prog[index];
+    uint64_t loop_weight = std::min<uint64_t>(weight * 8, 4096);
+    switch (stmt.kind) {
+    case NodeKind::stmt_let:
+      count_uses_expr(stmt.b, names, locals, weight);
+      if (names.declare(stmt.a, static_cast<uint32_t>(locals.size()))) {
+        locals.push_back({ .let = index });
+      }
+      break;
+    case NodeKind::stmt_assign:
+      count_uses_expr(stmt.b, names, locals, weight);
+      if (const uint32_t* local = names.lookup(stmt.a)) {
+        locals[*local].weight += weight;
+      }
+      break;
+    case NodeKind::stmt_exit:
+    case NodeKind::stmt_expr:
+    case NodeKind::stmt_print:
+    case NodeKind::stmt_return:
+      count_uses_expr(stmt.a, names, locals, weight);
+      break;
+    case NodeKind::scope:
+      names.begin_scope();
+      for (NodeIndex child : m_prog.list(stmt.a)) {
+        count_uses_stmt(child, names, locals, weight);
+      }
+      names.end_scope();
+      break;
+    case NodeKind::stmt_if:
+      count_uses_expr(stmt.a, names, locals, weight);
+      count_uses_stmt(stmt.b, names, locals, weight);
+      if (stmt.c != null_node) {
+        count_uses_stmt(stmt.c, names, locals, weight);
+      }
+      break;
+    case NodeKind::stmt_while:
+      count_uses_expr(stmt.a, names, locals, loop_weight);
+      count_uses_stmt(stmt.b, names, locals, loop_weight);
+      break;
+    case NodeKind::stmt_for: {
+      std::span<const uint32_t> parts = m_prog.list(stmt.a);
+      names.begin_scope();
+      if (parts[0] != null_node) {
+        count_uses_stmt(parts[0], names, locals, weight);
+      }
+      count_uses_expr(parts[1], names, locals, loop_weight);
+      count_uses_stmt(parts[3], names, locals, loop_weight);
+      if (parts[2] != null_node) {
+        count_uses_stmt(parts[2], names, locals, loop_weight);
       }
+      names.end_scope();
+      break;
+    }
+    default:
+      break; // function definitions get their own plan
+    }
+  }
+
+  // -O1 temporaries. rax and rdx are left out for idiv, the setcc results and the calling convention
+  static constexpr std::array<std::string_view, 7> scratch_regs = { "rcx", "rsi", "rdi", "r8", "r9", "r10", "r11" };
+  static constexpr uint32_t all_regs = (1u << scratch_regs.size()) - 1;
+
+  // An m_need entry is the Sethi-Ullman number in the low bits and whether the node has side effects in the top one
+  static constexpr uint8_t need_mask = 0x7f;
+  static constexpr uint8_t effects_bit = 0x80;
 
-      return m_output.str();
+  // -O1 locals. Functions save the ones they use, so they survive calls
+  static constexpr std::array<std::string_view, 5> local_regs = { "rbx", "r12", "r13", "r14", "r15" };
+
+  // Where the first six arguments go, in order, the same registers as the SysV ABI. The rest are pushed last to first
+  static constexpr std::array<std::string_view, 6> arg_regs = { "rdi", "rsi", "rdx", "rcx", "r8", "r9" };
+
+  // An argument that takes no evaluating, its register can be loaded right before the call
+  bool is_simple_arg(NodeIndex expr){
+    NodeKind kind = m_prog[expr].kind;
+    return kind == NodeKind::ident || kind == NodeKind::int_lit || kind == NodeKind::bool_lit || kind == NodeKind::string_lit;
   }
 
-private:
-  void push(const std::string& reg){
-    m_output << "    push " << reg << "\n";
+  // The slots a statement's lets need at most at once, on top of the ones already in use where it starts. A let the -O1 plan put in a
+  // register takes none
+  size_t frame_slots(NodeIndex index){
+    const Node& stmt = m_prog[index];
+    switch (stmt.kind) {
+    case NodeKind::stmt_let:
+      return m_options.opt_level > 0 && m_local_plan.lets.contains(index) ? 0 : 1;
+    case NodeKind::scope:
+      return count_frame_slots(m_prog.list(stmt.a));
+    case NodeKind::stmt_if:
+      return std::max(frame_slots(stmt.b), stmt.c != null_node ? frame_slots(stmt.c) : 0);
+    case NodeKind::stmt_while:
+      return frame_slots(stmt.b);
+    case NodeKind::stmt_for: {
+      std::span<const uint32_t> parts = m_prog.list(stmt.a);
+      return (parts[0] != null_node ? frame_slots(parts[0]) : 0) + frame_slots(parts[3]);
+    }
+    default:
+      return 0;
+    }
+  }
+
+  // The same for a statement list: its lets stay in their slots until the list ends, nested scopes reuse the slots of the ones before
+  size_t count_frame_slots(std::span<const uint32_t> stmts){
+    size_t live = 0;
+    size_t peak = 0;
+    for (NodeIndex stmt : stmts) {
+      size_t need = frame_slots(stmt);
+      peak = std::max(peak, live + need);
+      if (m_prog[stmt].kind == NodeKind::stmt_let) {
+        live += need;
+      }
+    }
+    return peak;
+  }
+
+  // Take the next slot of the frame, it is given back when the scope ends
+  int frame_slot(){
+    m_frame_used++;
+    assert(m_frame_used <= m_frame_size);
+    return -static_cast<int>(m_frame_used * 8);
+  }
+
+  std::string_view allocate(){
+    assert(m_free_regs != 0); // gen_bin_reg spills before this can happen
+    int index = std::countr_zero(m_free_regs);
+    m_free_regs &= ~(1u << index);
+    return scratch_regs[index];
+  }
+
+  // Give back a scratch register, anything else (rax at -O0, a variable's register) is ignored
+  void release(std::string_view reg){
+    for (size_t i = 0; i < scratch_regs.size(); i++) {
+      if (scratch_regs[i] == reg) {
+        assert((m_free_regs & (1u << i)) == 0);
+        m_free_regs |= 1u << i;
+      }
+    }
+  }
+
+  // Where a variable's value is, as an instruction operand
+  AsmOperand var_operand(const Var& var){
+    if (!var.reg.empty()) {
+      return var.reg;
+    }
+    return AsmOperand::mem("rbp", var.frame_offset);
+  }
+
+  void push(const AsmOperand& value){
+    m_output << "    push " << value << "\n";
     m_stack_size++;
   }
 
-  void pop(const std::string& reg){
+  void pop(std::string_view reg){
     m_output << "    pop " << reg << "\n";
     m_stack_size--;
   }
 
   void begin_scope(){
-    m_scopes.push_back(m_vars.size());
+    m_vars.begin_scope();
+    m_scope_starts.push_back(m_frame_used);
   }
 
-  // when we end we want to pop the variables until we get to the last begin scope
+  // Locals live in slots of the frame, which was sized for the function up front, so ending a scope only frees its slots for the next
+  // one. Temporaries never outlive a statement, nothing was pushed that needs popping
   void end_scope(){
-    size_t pop_count = m_vars.size() - m_scopes.back(); // counter to know how many variables
-    m_output << "    add rsp, " << pop_count * 8 << "\n"; // subtract from the stack pointer. I multiply by 8 because each variable is 8 bytes 
+    assert(m_stack_size == 0);
+    m_frame_used = m_scope_starts.back();
+    m_scope_starts.pop_back();
+    m_vars.end_scope();
+  }
 
-    m_stack_size -= pop_count;
-    for (int i = 0; i < pop_count; i++) {
-      m_vars.pop_back();
+  const Var* lookup_var(SymbolId name){
+    const Var* var = m_vars.lookup(name);
+    if (var == nullptr) {
+      compile_error("Undeclared identifier: ", m_interner.name(name));
     }
+    return var;
+  }
 
-    m_scopes.pop_back();
+  bool profiling() const {
+    return !m_options.profile.empty();
   }
 
-  // create a label for the if statement to jump to
-  std::string create_label(){
-    std::stringstream ss;
-    ss << "label" << m_label_count++;
-    return ss.str();
+  // -fprofile: number the sites of the code unit about to be generated, see unit_profile_sites
+  void begin_profile(NodeIndex unit, std::string_view name) {
+    if (!profiling()) {
+      return;
+    }
+    m_profile_unit = name;
+    m_profile_sites.clear();
+    std::vector<ProfileSite> sites = unit_profile_sites(m_prog, unit);
+    for (uint32_t i = 0; i < sites.size(); i++) {
+      m_profile_sites.emplace(sites[i].node, i);
+    }
   }
 
-  struct Var {
-    std::string name; // the name of the variable
-    size_t stack_loc; // The location on the stack where this variables value is stored.
-  };
+  void gen_profile(uint32_t site, ProfileEvent event) {
+    if (profiling()) {
+      emit_profile_event(m_output, { m_profile_unit, site }, event);
+    }
+  }
+
+  // A loop is entered before its first test and left at its end label, which every way out of it but a return, a tail call and an exit
+  // goes through. Those leave it themselves (gen_profile_return, gen_tail_call, hydro_profile_exit)
+  void begin_profiled_loop(NodeIndex loop) {
+    if (profiling()) {
+      m_open_loops.push_back(m_profile_sites.at(loop));
+      gen_profile(m_open_loops.back(), ProfileEvent::enter);
+    }
+  }
+
+  void gen_profile_iteration() {
+    if (profiling()) {
+      gen_profile(m_open_loops.back(), ProfileEvent::secondary);
+    }
+  }
+
+  void end_profiled_loop() {
+    if (profiling()) {
+      gen_profile(m_open_loops.back(), ProfileEvent::leave);
+      m_open_loops.pop_back();
+    }
+  }
+
+  // A return leaves the loops it is in, innermost first, and then the function. The value is in rax already, the snippets keep it
+  void gen_profile_return() {
+    for (auto it = m_open_loops.rbegin(); it != m_open_loops.rend(); ++it) {
+      gen_profile(*it, ProfileEvent::leave);
+    }
+    gen_profile(0, ProfileEvent::leave);
+  }
+
+  // create a label for the if statement to jump to
+  AsmLabel create_label(){
+    return { m_label_prefix, m_label_count++ };
+  }
 
-  const NodeProg m_prog;
-  std::stringstream m_output;
-  size_t m_stack_size = 0;
-  std::vector<Var> m_vars {}; // vector of variables
-  std::vector<size_t> m_scopes {};
-  int m_label_count = 0;
-};
\ No newline at end of file
+  const NodeProg& m_prog;
+  const Interner& m_interner;
+  CodegenOptions m_options;
+  const Generator* m_root = nullptr; // set in workers
+  std::string m_label_prefix = "_start.L";
+  AsmBuffer m_output;
+  std::vector<std::string_view> m_strings {}; // root only: the string pool, raw text of each distinct literal
+  std::unordered_set<std::string_view> m_string_set {}; // root only: the literals already in m_strings
+  bool m_uses_print = false; // root only, see gen_units
+  size_t m_stack_size = 0; // temporaries pushed and not popped yet
+  size_t m_frame_size = 0; // slots in the current frame
+  size_t m_frame_used = 0; // slots taken by the locals in scope
+  std::vector<size_t> m_scope_starts {}; // m_frame_used when each open scope began
+  ScopedSymbolTable<Var> m_vars {}; // variables visible at this point, by interned name
+  ScopedSymbolTable<FuncInfo> m_functions {}; // every function in the program, by interned name
+  bool m_in_function = false;
+  uint32_t m_label_count = 0;
+  uint32_t m_free_regs = all_regs; // -O1 scratch registers not holding a temporary, bit i is scratch_regs[i]
+  std::vector<uint8_t> m_need {}; // -O1 Sethi-Ullman numbers by node (need_mask) and their effects_bit, 0 until computed
+  LocalPlan m_local_plan {}; // -O1
+  std::vector<std::string_view> m_saved_regs {}; // callee-saved registers the current function pushed before its frame
+  SymbolId m_function = 0; // workers: the function being generated
+  std::vector<Var> m_param_vars {}; // where its parameters live, in order
+  AsmLabel m_body_label {}; // where its body starts, after the parameters are in place
+  SelfRecursion m_recursion {}; // how its returns call it
+  Var m_accumulator {}; // with SelfRecursion::accumulator
+  std::string_view m_profile_unit {}; // -fprofile: the name of the code unit being generated, its counters are named after it
+  std::unordered_map<NodeIndex, uint32_t> m_profile_sites {}; // -fprofile: its sites by node, see unit_profile_sites
+  std::vector<uint32_t> m_open_loops {}; // -fprofile: the sites of the loops around the statement being generated, outermost first
+};
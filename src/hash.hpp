@@ -0,0 +1,71 @@
+// This file is the one hash function the compiler uses, for the cache keys (cache.hpp, incremental.hpp) and for the names of the string
+// pool's labels (runtime.hpp).
+
+#pragma once
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// XXH64, as specified by the xxHash project
+inline uint64_t xxh64(std::string_view data, uint64_t seed = 0)
+{
+  constexpr uint64_t prime1 = 0x9E3779B185EBCA87ull;
+  constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+  constexpr uint64_t prime3 = 0x165667B19E3779F9ull;
+  constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63ull;
+  constexpr uint64_t prime5 = 0x27D4EB2F165667C5ull;
+  auto read64 = [](const char* p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value; // xxHash is defined on little-endian reads, which is what x86-64 does
+  };
+  auto read32 = [](const char* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return static_cast<uint64_t>(value);
+  };
+  auto round = [](uint64_t acc, uint64_t input) { return std::rotl(acc + input * prime2, 31) * prime1; };
+  auto merge = [&](uint64_t acc, uint64_t value) { return (acc ^ round(0, value)) * prime1 + prime4; };
+
+  const char* p = data.data();
+  const char* end = p + data.size();
+  uint64_t hash;
+  if (data.size() >= 32) {
+    uint64_t v1 = seed + prime1 + prime2;
+    uint64_t v2 = seed + prime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - prime1;
+    for (; end - p >= 32; p += 32) {
+      v1 = round(v1, read64(p));
+      v2 = round(v2, read64(p + 8));
+      v3 = round(v3, read64(p + 16));
+      v4 = round(v4, read64(p + 24));
+    }
+    hash = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) + std::rotl(v4, 18);
+    hash = merge(hash, v1);
+    hash = merge(hash, v2);
+    hash = merge(hash, v3);
+    hash = merge(hash, v4);
+  }
+  else {
+    hash = seed + prime5;
+  }
+  hash += data.size();
+  for (; end - p >= 8; p += 8) {
+    hash = std::rotl(hash ^ round(0, read64(p)), 27) * prime1 + prime4;
+  }
+  if (end - p >= 4) {
+    hash = std::rotl(hash ^ (read32(p) * prime1), 23) * prime2 + prime3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    hash = std::rotl(hash ^ (static_cast<uint8_t>(*p) * prime5), 11) * prime1;
+  }
+  hash ^= hash >> 33;
+  hash *= prime2;
+  hash ^= hash >> 29;
+  hash *= prime3;
+  hash ^= hash >> 32;
+  return hash;
+}
@@ -0,0 +1,49 @@
+// This file is hydro as a library, for programs that compile many small sources and don't want to start a process for each: include it
+// (link the hydro_lib target) and call hydro_compile. Nothing in the compiler exits the process, every error in the program is a
+// CompileError thrown up to here, and hydro_compile hands it back as a value along with the executable it built.
+// A call shares nothing with other calls but the cache it is given, so any number of them can run at the same time on different threads.
+// `hydro --server` (server.hpp) is this behind a Unix socket, for callers that would rather not link the compiler in.
+
+#pragma once
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "./driver.hpp"
+
+struct HydroResult {
+  std::string error {}; // why the program didn't compile, empty if it did
+  std::vector<uint8_t> executable {}; // the ELF executable, write it out and mark it executable to run it
+  std::string ir_dump {}; // with CompileOptions::dump_ir
+  DeadCodeReport dead_code {}; // with CompileOptions::verbose
+  bool cached = false; // the executable came out of the cache
+
+  [[nodiscard]] inline bool ok() const
+  {
+    return error.empty();
+  }
+};
+
+// Compile the program `source` (the text of a .hy file) into an executable. `cache` is optional, see cache.hpp; use_nasm needs files to
+// work with and is an error here
+[[nodiscard]] inline HydroResult hydro_compile(
+  std::string_view source, const CompileOptions& options = {}, const CompileCache* cache = nullptr, TimeReport* times = nullptr)
+{
+  HydroResult result;
+  if (options.use_nasm) {
+    result.error = "nasm builds need an output file, use compile_file";
+    return result;
+  }
+  try {
+    CompileResult compiled = compile_source(source, options, cache, times);
+    result.executable = std::move(compiled.executable);
+    result.ir_dump = std::move(compiled.ir_dump);
+    result.dead_code = std::move(compiled.dead_code);
+    result.cached = compiled.cached;
+  }
+  catch (const std::exception& error) {
+    result.error = error.what();
+  }
+  return result;
+}
@@ -0,0 +1,201 @@
+// This file decides which functions an incremental build has to compile again. With a cache, the driver keeps the machine code of every
+// code unit (the main program and each function, see code_units) under a key of its own, and a build whose executable isn't cached
+// generates and assembles only the units whose key has no entry yet, then links them with the cached ones.
+// A unit's key covers everything its code depends on:
+// - the unit itself after inlining, folding and dead code elimination, with names written out as text (SymbolIds are only meaningful
+//   within one parse). A function that had a callee inlined into it has the callee's body in its own tree, so changing the callee
+//   changes the key of every caller that inlined it
+// - the functions it calls and their arities, which decide whether the call compiles at all; their bodies don't matter otherwise, a
+//   call is only a `call <name>`
+// - what the whole program shares: the compiler, the optimization level and whether the program prints (it decides what an exit does).
+//   String literals are labelled after their own text (see StringLabel), so the other literals of the program don't matter
+// The top level statements between the function definitions are the main program's unit, moving a definition around doesn't change
+// any key.
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "./ast.hpp"
+#include "./hash.hpp"
+#include "./interner.hpp"
+
+class CodeUnitHasher {
+public:
+  inline CodeUnitHasher(const NodeProg& prog, const Interner& interner)
+    : m_prog(prog)
+    , m_interner(interner)
+  {
+    for (const Node& node : m_prog.nodes) {
+      if (node.kind == NodeKind::func_def) {
+        m_arities.emplace(node.a, m_prog.list(node.b).size()); // a second definition is an error before any code is generated
+      }
+    }
+  }
+
+  // The key of the unit `unit` (the prog node or a func_def), `seed` is what every unit of the program shares
+  [[nodiscard]] inline uint64_t key(NodeIndex unit, uint64_t seed)
+  {
+    m_bytes.clear();
+    m_callees.clear();
+    const Node& node = m_prog[unit];
+    if (node.kind == NodeKind::func_def) {
+      write_name(node.a);
+      write_list(node.b, [&](uint32_t param) { write_name(param); });
+      write_stmt(node.c);
+    }
+    else {
+      write_stmts(m_prog.list(node.a));
+    }
+    for (SymbolId callee : m_callees) {
+      write_name(callee);
+      auto arity = m_arities.find(callee);
+      write(arity != m_arities.end() ? static_cast<uint64_t>(arity->second) : ~uint64_t { 0 });
+    }
+    return xxh64(m_bytes, seed);
+  }
+
+private:
+  inline void write(uint64_t value)
+  {
+    m_bytes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  inline void write_text(std::string_view text)
+  {
+    write(text.size());
+    m_bytes.append(text);
+  }
+
+  inline void write_name(SymbolId name)
+  {
+    write_text(m_interner.name(name));
+  }
+
+  template <typename F>
+  inline void write_list(uint32_t list, F&& item)
+  {
+    std::span<const uint32_t> items = m_prog.list(list);
+    write(items.size());
+    for (uint32_t entry : items) {
+      item(entry);
+    }
+  }
+
+  // A statement list without the function definitions in it: those are units of their own and generate nothing where they are
+  inline void write_stmts(std::span<const uint32_t> stmts)
+  {
+    for (NodeIndex stmt : stmts) {
+      if (m_prog[stmt].kind != NodeKind::func_def) {
+        write_stmt(stmt);
+      }
+    }
+    write(null_node);
+  }
+
+  inline void write_header(const Node& node)
+  {
+    write(static_cast<uint64_t>(node.kind) | static_cast<uint64_t>(node.op) << 8 | static_cast<uint64_t>(node.flags) << 16);
+  }
+
+  inline void write_expr(NodeIndex index)
+  {
+    const Node& node = m_prog[index];
+    write_header(node);
+    switch (node.kind) {
+    case NodeKind::int_lit:
+      write(static_cast<uint64_t>(node.int_value()));
+      break;
+    case NodeKind::bool_lit:
+      write(node.a);
+      break;
+    case NodeKind::string_lit:
+      write_text(m_prog.string(node));
+      break;
+    case NodeKind::ident:
+      write_name(node.a);
+      break;
+    case NodeKind::bin_expr:
+      write_expr(node.a);
+      write_expr(node.b);
+      break;
+    case NodeKind::func_call:
+      write_name(node.a);
+      write_list(node.b, [&](uint32_t arg) { write_expr(arg); });
+      if (std::find(m_callees.begin(), m_callees.end(), node.a) == m_callees.end()) {
+        m_callees.push_back(node.a);
+      }
+      break;
+    default:
+      break; // not an expression
+    }
+  }
+
+  inline void write_stmt(NodeIndex index)
+  {
+    if (index == null_node) {
+      write(null_node);
+      return;
+    }
+    const Node& node = m_prog[index];
+    write_header(node);
+    switch (node.kind) {
+    case NodeKind::scope:
+      write_stmts(m_prog.list(node.a));
+      break;
+    case NodeKind::stmt_exit:
+    case NodeKind::stmt_expr:
+    case NodeKind::stmt_print:
+    case NodeKind::stmt_return:
+      write_expr(node.a);
+      break;
+    case NodeKind::stmt_let:
+    case NodeKind::stmt_assign:
+      write_name(node.a);
+      write_expr(node.b);
+      break;
+    case NodeKind::stmt_if:
+      write_expr(node.a);
+      write_stmt(node.b);
+      write_stmt(node.c);
+      break;
+    case NodeKind::stmt_while:
+      write_expr(node.a);
+      write_stmt(node.b);
+      break;
+    case NodeKind::stmt_for: {
+      std::span<const uint32_t> parts = m_prog.list(node.a);
+      write_stmt(parts[0]);
+      write_expr(parts[1]);
+      write_stmt(parts[2]);
+      write_stmt(parts[3]);
+      break;
+    }
+    default:
+      break; // a nested func_def is a unit of its own
+    }
+  }
+
+  const NodeProg& m_prog;
+  const Interner& m_interner;
+  std::unordered_map<SymbolId, size_t> m_arities {}; // of every function defined in the program
+  std::string m_bytes {}; // the unit being hashed, serialized
+  std::vector<SymbolId> m_callees {}; // the functions it calls, in the order of their first call
+};
+
+// The cache key of the machine code of each of `units`. `shared` is the key of what every unit of the program depends on
+[[nodiscard]] inline std::vector<uint64_t> code_unit_keys(
+  const NodeProg& prog, const Interner& interner, std::span<const NodeIndex> units, uint64_t shared)
+{
+  CodeUnitHasher hasher(prog, interner);
+  std::vector<uint64_t> keys;
+  keys.reserve(units.size());
+  for (NodeIndex unit : units) {
+    keys.push_back(hasher.key(unit, shared));
+  }
+  return keys;
+}
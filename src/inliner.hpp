@@ -0,0 +1,353 @@
+// This file replaces calls to small functions with the functions' bodies, on the AST before ConstantFolder, so a helper like
+// `add(a, b)` costs neither a call nor a frame and the values it is called with fold straight into what it computes.
+// A function can be inlined when its body is nothing but lets followed by one return, none of it calls anything (after the calls in it
+// have been inlined themselves, so helpers built from helpers still qualify) and the returned expression, with every let substituted
+// into it, has at most `threshold` nodes. Recursive functions never qualify: the call to themselves is still there.
+// Such a function is turned into a template once, an expression over its parameters, and every call site gets its own copy with the
+// arguments in place of the parameters. A call site only takes it when that can't change what the program does:
+//   - no argument calls anything, because a call's arguments are evaluated (right to left) before its body and an expression doesn't
+//     pin an order down. Everything else the body and the arguments can do is fault on a division, and that happens either way
+//   - an argument the body uses more than once is a name, a literal or made of literals only (which folds into one), anything else would
+//     be computed again per use
+//   - an argument the body never uses has no side effects, so dropping it loses nothing
+//   - the result isn't a bare name or string literal: print writes those as text when they are strings, but the value of a call as a number
+// The definitions stay where they are, they are still generated for anything that wasn't inlined.
+// Call sites that would be an error (an undefined or twice defined function, the wrong number of arguments) are left for the generator
+// to report, and so is every function whose body has a name error.
+
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+#include "./ast.hpp"
+#include "./interner.hpp"
+
+class Inliner {
+public:
+  // Functions are inlined up to 24 nodes unless told otherwise, enough for arithmetic helpers, not for anything with real work in it
+  static constexpr uint32_t default_threshold = 24;
+
+  // `threshold` is the most nodes an inlined body may have, 0 turns inlining off
+  inline Inliner(NodeProg& prog, const Interner& interner, uint32_t threshold = default_threshold)
+    : m_prog(prog)
+    , m_threshold(threshold)
+    , m_functions(interner.size())
+  {
+  }
+
+  // Inline every call that qualifies, returns how many were
+  inline size_t run()
+  {
+    if (m_threshold == 0) {
+      return 0;
+    }
+    auto end = static_cast<NodeIndex>(m_prog.nodes.size()); // the templates are appended after this, they are not part of the program
+    for (NodeIndex index = 0; index < end; index++) {
+      if (m_prog[index].kind == NodeKind::func_def) {
+        Function& function = m_functions[m_prog[index].a];
+        function.def = function.def == null_node ? index : duplicate_def;
+      }
+    }
+    for (NodeIndex index = 0; index < end; index++) {
+      const Node& stmt = m_prog[index];
+      switch (stmt.kind) {
+      case NodeKind::stmt_exit:
+      case NodeKind::stmt_expr:
+      case NodeKind::stmt_if:
+      case NodeKind::stmt_while:
+      case NodeKind::stmt_print:
+      case NodeKind::stmt_return:
+        inline_calls(stmt.a);
+        break;
+      case NodeKind::stmt_let:
+      case NodeKind::stmt_assign:
+        inline_calls(stmt.b);
+        break;
+      case NodeKind::stmt_for:
+        inline_calls(m_prog.list(stmt.a)[1]); // the init and step statements are visited on their own
+        break;
+      default:
+        break;
+      }
+    }
+    return m_inlined;
+  }
+
+private:
+  static constexpr NodeIndex duplicate_def = null_node - 1;
+  static constexpr uint16_t param_flag = 1; // on the ident nodes of a template that stand for a parameter, `a` is its position
+
+  // The body of an inlinable function as an expression over its parameters
+  struct Template {
+    NodeIndex root = null_node;
+    std::vector<uint32_t> uses {}; // how often each parameter appears in it
+  };
+
+  struct Function {
+    enum class State : uint8_t { unknown, building, inlinable, not_inlinable };
+
+    NodeIndex def = null_node; // the func_def, duplicate_def if there are several
+    State state = State::unknown;
+    Template body {};
+  };
+
+  // A name visible while a template is built: a parameter, or a let with the expression it was initialised with
+  struct Binding {
+    SymbolId name;
+    NodeIndex value;
+    uint32_t reads = 0;
+  };
+
+  // Inline the calls in expression `index`, innermost first so their results can make the outer call's arguments call free
+  inline void inline_calls(NodeIndex index)
+  {
+    if (index == null_node) {
+      return;
+    }
+    const Node node = m_prog[index];
+    if (node.kind == NodeKind::bin_expr) {
+      inline_calls(node.a);
+      inline_calls(node.b);
+    }
+    else if (node.kind == NodeKind::func_call) {
+      for (NodeIndex arg : list(node.b)) {
+        inline_calls(arg);
+      }
+      inline_call(index);
+    }
+  }
+
+  // Replace the call `index` with a copy of its function's template, if the function and this call site both allow it
+  inline void inline_call(NodeIndex index)
+  {
+    const Node call = m_prog[index];
+    const Template* body = inlinable(call.a);
+    std::vector<NodeIndex> args = list(call.b);
+    if (body == nullptr || args.size() != body->uses.size()) {
+      return;
+    }
+    for (size_t i = 0; i < args.size(); i++) {
+      bool cheap = m_prog[args[i]].kind != NodeKind::bin_expr || only_literals(args[i]);
+      if (has_call(args[i]) || (body->uses[i] == 0 && has_side_effects(m_prog, args[i])) || (body->uses[i] > 1 && !cheap)) {
+        return;
+      }
+    }
+    const Node& root = m_prog[body->root];
+    if (root.kind == NodeKind::ident && (root.flags & param_flag) != 0) {
+      NodeKind result = m_prog[args[root.a]].kind;
+      if (result == NodeKind::ident || result == NodeKind::string_lit) {
+        return;
+      }
+    }
+    std::vector<bool> used(args.size(), false);
+    NodeIndex result = instantiate(body->root, args, used);
+    m_prog[index] = m_prog[result];
+    m_inlined++;
+  }
+
+  // A copy of the template expression `index` with `args` in place of the parameters. The first use of an argument is the argument's
+  // own node, later ones get a copy of it
+  inline NodeIndex instantiate(NodeIndex index, const std::vector<NodeIndex>& args, std::vector<bool>& used)
+  {
+    const Node node = m_prog[index];
+    if (node.kind == NodeKind::ident && (node.flags & param_flag) != 0) {
+      if (!used[node.a]) {
+        used[node.a] = true;
+        return args[node.a];
+      }
+      return copy(args[node.a]);
+    }
+    if (node.kind == NodeKind::bin_expr) {
+      NodeIndex lhs = instantiate(node.a, args, used);
+      NodeIndex rhs = instantiate(node.b, args, used);
+      return m_prog.add_bin_expr(node.op, lhs, rhs);
+    }
+    assert(node.kind != NodeKind::func_call); // templates have no calls left in them
+    return m_prog.add(node);
+  }
+
+  // The template of function `name`, built the first time it is asked for. nullptr if it can't be inlined, which includes asking for it
+  // again while it is being built: the function calls itself
+  inline const Template* inlinable(SymbolId name)
+  {
+    Function& function = m_functions[name]; // building others' templates in the middle of this one never resizes m_functions
+    if (function.state == Function::State::unknown) {
+      function.state = Function::State::building;
+      std::optional<Template> body;
+      if (function.def != null_node && function.def != duplicate_def) {
+        body = build_template(function.def);
+      }
+      function.state = body.has_value() ? Function::State::inlinable : Function::State::not_inlinable;
+      if (body.has_value()) {
+        function.body = std::move(body.value());
+      }
+    }
+    return function.state == Function::State::inlinable ? &function.body : nullptr;
+  }
+
+  inline std::optional<Template> build_template(NodeIndex def)
+  {
+    const Node func_def = m_prog[def];
+    std::vector<uint32_t> params = list(func_def.b); // SymbolIds
+    std::vector<NodeIndex> stmts = list(m_prog[func_def.c].a);
+    if (stmts.empty() || m_prog[stmts.back()].kind != NodeKind::stmt_return) {
+      return {};
+    }
+
+    // The names are all in one scope here (a let shadowing a parameter is treated as a redeclaration too: it's rare, and bailing on
+    // it keeps the lookup a plain search)
+    std::vector<Binding> bindings;
+    auto declared = [&](SymbolId name) {
+      return std::any_of(bindings.begin(), bindings.end(), [name](const Binding& binding) { return binding.name == name; });
+    };
+    for (size_t i = 0; i < params.size(); i++) {
+      if (declared(params[i])) {
+        return {};
+      }
+      NodeIndex param = m_prog.add({ .kind = NodeKind::ident, .flags = param_flag, .a = static_cast<uint32_t>(i) });
+      bindings.push_back({ .name = params[i], .value = param });
+    }
+    m_size = 0;
+    for (size_t i = 0; i + 1 < stmts.size(); i++) {
+      const Node stmt = m_prog[stmts[i]];
+      if (stmt.kind != NodeKind::stmt_let || declared(stmt.a)) {
+        return {};
+      }
+      std::optional<NodeIndex> value = substitute(stmt.b, bindings);
+      if (!value.has_value()) {
+        return {};
+      }
+      bindings.push_back({ .name = stmt.a, .value = value.value() });
+    }
+    std::optional<NodeIndex> root = substitute(m_prog[stmts.back()].a, bindings);
+    if (!root.has_value()) {
+      return {};
+    }
+    for (size_t i = params.size(); i < bindings.size(); i++) {
+      if (bindings[i].reads == 0 && has_side_effects(m_prog, bindings[i].value)) {
+        return {}; // an unused let that still has to be evaluated
+      }
+    }
+
+    inline_calls(root.value());
+    if (has_call(root.value()) || m_prog[root.value()].kind == NodeKind::string_lit) {
+      return {};
+    }
+    Template body { .root = root.value(), .uses = std::vector<uint32_t>(params.size(), 0) };
+    if (count_nodes(body.root, body.uses) > m_threshold) {
+      return {};
+    }
+    return body;
+  }
+
+  // A copy of body expression `index` with every name replaced by a copy of what it is bound to. Empty if a name isn't bound (an error
+  // the generator reports) or the copy grows past the threshold, which a chain of lets read more than once can do
+  inline std::optional<NodeIndex> substitute(NodeIndex index, std::vector<Binding>& bindings)
+  {
+    if (++m_size > m_threshold) {
+      return {};
+    }
+    const Node node = m_prog[index];
+    switch (node.kind) {
+    case NodeKind::ident:
+      for (auto binding = bindings.rbegin(); binding != bindings.rend(); binding++) {
+        if (binding->name == node.a) {
+          binding->reads++;
+          return copy(binding->value);
+        }
+      }
+      return {};
+    case NodeKind::bin_expr: {
+      std::optional<NodeIndex> lhs = substitute(node.a, bindings);
+      std::optional<NodeIndex> rhs = lhs.has_value() ? substitute(node.b, bindings) : std::nullopt;
+      if (!rhs.has_value()) {
+        return {};
+      }
+      return m_prog.add_bin_expr(node.op, lhs.value(), rhs.value());
+    }
+    case NodeKind::func_call: {
+      std::vector<NodeIndex> args;
+      for (NodeIndex arg : list(node.b)) {
+        std::optional<NodeIndex> value = substitute(arg, bindings);
+        if (!value.has_value()) {
+          return {};
+        }
+        args.push_back(value.value());
+      }
+      uint32_t arg_list = m_prog.add_list(args);
+      return m_prog.add({ .kind = NodeKind::func_call, .a = node.a, .b = arg_list });
+    }
+    default:
+      return m_prog.add(node);
+    }
+  }
+
+  // A deep copy of expression `index`
+  inline NodeIndex copy(NodeIndex index)
+  {
+    const Node node = m_prog[index];
+    if (node.kind == NodeKind::bin_expr) {
+      NodeIndex lhs = copy(node.a);
+      NodeIndex rhs = copy(node.b);
+      return m_prog.add_bin_expr(node.op, lhs, rhs);
+    }
+    if (node.kind == NodeKind::func_call) {
+      std::vector<NodeIndex> args;
+      for (NodeIndex arg : list(node.b)) {
+        args.push_back(copy(arg));
+      }
+      uint32_t arg_list = m_prog.add_list(args);
+      return m_prog.add({ .kind = NodeKind::func_call, .a = node.a, .b = arg_list });
+    }
+    return m_prog.add(node);
+  }
+
+  // The size of template expression `index`, counting the uses of each parameter into `uses`
+  inline uint32_t count_nodes(NodeIndex index, std::vector<uint32_t>& uses) const
+  {
+    const Node& node = m_prog[index];
+    if (node.kind == NodeKind::bin_expr) {
+      return 1 + count_nodes(node.a, uses) + count_nodes(node.b, uses);
+    }
+    if (node.kind == NodeKind::ident && (node.flags & param_flag) != 0) {
+      uses[node.a]++;
+    }
+    return 1;
+  }
+
+  // Whether expression `index` is an int or bool literal, or an operator on those
+  [[nodiscard]] inline bool only_literals(NodeIndex index) const
+  {
+    const Node& node = m_prog[index];
+    if (node.kind == NodeKind::bin_expr) {
+      return only_literals(node.a) && only_literals(node.b);
+    }
+    return node.kind == NodeKind::int_lit || node.kind == NodeKind::bool_lit;
+  }
+
+  [[nodiscard]] inline bool has_call(NodeIndex index) const
+  {
+    const Node& node = m_prog[index];
+    if (node.kind == NodeKind::func_call) {
+      return true;
+    }
+    return node.kind == NodeKind::bin_expr && (has_call(node.a) || has_call(node.b));
+  }
+
+  // A list copied out of the pool, which adding nodes and lists while walking it could otherwise move
+  [[nodiscard]] inline std::vector<uint32_t> list(uint32_t index) const
+  {
+    std::span<const uint32_t> items = m_prog.list(index);
+    return { items.begin(), items.end() };
+  }
+
+  NodeProg& m_prog;
+  uint32_t m_threshold;
+  std::vector<Function> m_functions; // by SymbolId
+  uint32_t m_size = 0; // nodes the template being built has so far
+  size_t m_inlined = 0;
+};
@@ -0,0 +1,117 @@
+// This file defines the identifier interner. Every distinct identifier gets a compact integer `SymbolId` the first time the tokenizer sees it,
+// after that the parser and the generator only carry and compare ids: a name lookup is an integer compare instead of a string compare.
+// The table is open addressing with linear probing over a power of two number of slots. Each slot keeps the full hash next to the id so
+// a probe only touches the name bytes when the hashes match. Names are copied once into an arena owned by the interner so ids stay
+// valid even after the source buffer they came from is gone.
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string_view>
+#include <vector>
+#include "./arena.hpp"
+
+using SymbolId = uint32_t;
+
+inline constexpr SymbolId invalid_symbol = std::numeric_limits<SymbolId>::max();
+
+class Interner {
+public:
+  inline Interner()
+    : m_slots(initial_slots)
+  {
+  }
+
+  inline Interner(const Interner& other) = delete;
+
+  inline Interner& operator=(const Interner& other) = delete;
+
+  // Return the id of `name`, giving it a new one if we haven't seen it before
+  inline SymbolId intern(std::string_view name)
+  {
+    uint32_t hash = hash_name(name);
+    size_t mask = m_slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      Slot& slot = m_slots[i];
+      if (slot.id == invalid_symbol) {
+        SymbolId id = static_cast<SymbolId>(m_names.size());
+        m_names.push_back(copy_name(name));
+        slot = { .hash = hash, .id = id };
+        // keep the load factor under 1/2 so probe sequences stay short
+        if (m_names.size() * 2 > m_slots.size()) {
+          grow();
+        }
+        return id;
+      }
+      if (slot.hash == hash && m_names[slot.id] == name) {
+        return slot.id;
+      }
+    }
+  }
+
+  [[nodiscard]] inline std::string_view name(SymbolId id) const
+  {
+    return m_names[id];
+  }
+
+  [[nodiscard]] inline size_t size() const
+  {
+    return m_names.size();
+  }
+
+  // Bytes of name storage handed out by the arena
+  [[nodiscard]] inline size_t arena_bytes() const
+  {
+    return m_storage.bytes_used();
+  }
+
+private:
+  static constexpr size_t initial_slots = 256;
+
+  struct Slot {
+    uint32_t hash = 0;
+    SymbolId id = invalid_symbol;
+  };
+
+  // FNV-1a, identifiers are short so this is about as fast as anything fancier
+  static inline uint32_t hash_name(std::string_view name)
+  {
+    uint32_t hash = 2166136261u;
+    for (char c : name) {
+      hash ^= static_cast<uint8_t>(c);
+      hash *= 16777619u;
+    }
+    return hash;
+  }
+
+  inline std::string_view copy_name(std::string_view name)
+  {
+    char* mem = m_storage.alloc_array<char>(name.size());
+    if (!name.empty()) {
+      memcpy(mem, name.data(), name.size());
+    }
+    return { mem, name.size() };
+  }
+
+  inline void grow()
+  {
+    std::vector<Slot> slots(m_slots.size() * 2);
+    size_t mask = slots.size() - 1;
+    for (const Slot& slot : m_slots) {
+      if (slot.id == invalid_symbol) {
+        continue;
+      }
+      size_t i = slot.hash & mask;
+      while (slots[i].id != invalid_symbol) {
+        i = (i + 1) & mask;
+      }
+      slots[i] = slot;
+    }
+    m_slots = std::move(slots);
+  }
+
+  std::vector<Slot> m_slots;
+  std::vector<std::string_view> m_names {}; // indexed by SymbolId
+  ArenaAllocator m_storage { 4 * 1024 };
+};
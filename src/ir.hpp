@@ -0,0 +1,373 @@
+// This file defines the intermediate representation the -O2 pipeline works on: AST -> IR (lowering.hpp) -> SSA and the passes on it
+// (ssa.hpp) -> out of SSA -> register allocation and x86-64 (ir_emitter.hpp).
+// Every function (the main program is function 0) is a list of basic blocks, every block a list of three-address instructions that ends
+// in exactly one terminator (jmp, br, ret or exit). Values live in an unbounded supply of virtual registers (Vreg) or are immediates.
+// The lowering gives every Hydro variable one vreg that is written by its `let` and by every assignment, everything else is written
+// exactly once. `build_ssa` turns the variables into SSA form with phi instructions so passes can treat every vreg as a single
+// definition, `destruct_ssa` turns the phis back into copies before register allocation. `IrFunction::ssa` says which form it is in.
+// Control flow is explicit in the CFG: && and || are lowered to branches like if statements are.
+// A loop the vectoriser (vectorize.hpp) takes over runs most of its iterations as one vector_sum instruction: the sum of a small
+// expression tree (IrVectorLoop) over a number of iterations, which the emitter turns into a loop over 2 or 4 iterations at a time.
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+#include "./ast.hpp"
+#include "./interner.hpp"
+#include "./profile.hpp"
+
+using Vreg = uint32_t;
+using BlockId = uint32_t;
+
+inline constexpr Vreg no_vreg = std::numeric_limits<Vreg>::max();
+inline constexpr BlockId no_block = std::numeric_limits<BlockId>::max();
+
+// An instruction operand: a virtual register or a 64-bit immediate
+struct IrValue {
+  enum class Kind : uint8_t {
+    none,
+    reg,
+    imm,
+  };
+
+  Kind kind = Kind::none;
+  Vreg reg = no_vreg;
+  int64_t imm = 0;
+
+  static inline IrValue of_reg(Vreg reg)
+  {
+    return { .kind = Kind::reg, .reg = reg };
+  }
+
+  static inline IrValue of_imm(int64_t imm)
+  {
+    return { .kind = Kind::imm, .imm = imm };
+  }
+
+  [[nodiscard]] inline bool is_reg() const
+  {
+    return kind == Kind::reg;
+  }
+
+  [[nodiscard]] inline bool is_imm() const
+  {
+    return kind == Kind::imm;
+  }
+
+  inline bool operator==(const IrValue& other) const = default;
+};
+
+enum class IrOp : uint8_t {
+  mov, // dst = a
+  bin, // dst = a <bin> b, any BinOp except && and || (those are control flow)
+  lea_str, // dst = address of the module string `index`
+  param, // dst = parameter number `index`
+  call, // dst = call of module function `index` with `args`
+  phi, // dst = args[i] when coming from the i'th predecessor of the block (SSA form only)
+  print_int, // write a as a decimal integer
+  print_str, // write the string at a, b is its length when that is known (an immediate), otherwise it's read from the string pool
+  profile, // -fprofile: the ProfileEvent in a (an immediate) at site `index` of the function, see profile.hpp
+  vector_sum, // dst = a plus (or minus) what IrFunction::vector_loops[index] adds up over b iterations, its leaves are `args`
+
+  // Terminators: always the last instruction of a block, and only there
+  jmp, // to target[0]
+  br, // to target[0] if a != 0, else to target[1]
+  ret, // return a
+  exit, // exit the process with status a
+};
+
+struct IrInst {
+  IrOp op;
+  BinOp bin = BinOp::add; // IrOp::bin only
+  Vreg dst = no_vreg;
+  IrValue a {};
+  IrValue b {};
+  uint32_t index = 0; // lea_str, param, call, profile, vector_sum: which string, parameter, function, profile site or vector loop
+  std::vector<IrValue> args {}; // call: the arguments, phi: one value per predecessor in the order of IrBlock::preds, vector_sum: leaves
+  BlockId target[2] = { no_block, no_block }; // jmp, br
+
+  [[nodiscard]] inline bool is_terminator() const
+  {
+    return op >= IrOp::jmp;
+  }
+
+  // Whether removing the instruction (when its result isn't used) changes what the program does. A division can fault, so it stays
+  [[nodiscard]] inline bool has_side_effects() const
+  {
+    switch (op) {
+    case IrOp::mov:
+    case IrOp::lea_str:
+    case IrOp::param:
+    case IrOp::phi:
+    case IrOp::vector_sum:
+      return false;
+    case IrOp::bin:
+      return bin == BinOp::div;
+    default:
+      return true;
+    }
+  }
+
+  // Call f on every operand the instruction reads, f can rewrite them in place
+  template <typename F>
+  inline void for_each_use(F&& f)
+  {
+    f(a);
+    f(b);
+    for (IrValue& arg : args) {
+      f(arg);
+    }
+  }
+
+  template <typename F>
+  inline void for_each_use(F&& f) const
+  {
+    const_cast<IrInst*>(this)->for_each_use([&](const IrValue& value) { f(value); });
+  }
+};
+
+// Which vector instructions -O2 may use for the loops it vectorises, -march
+enum class VectorIsa : uint8_t {
+  none, // -fno-vectorize
+  sse2, // 2 lanes of 64 bits, every x86-64 has it
+  avx2, // 4 lanes, x86-64-v3 (Haswell and later)
+};
+
+inline constexpr uint32_t vector_lanes(VectorIsa isa)
+{
+  return isa == VectorIsa::avx2 ? 4 : isa == VectorIsa::sse2 ? 2 : 1;
+}
+
+// One value of a vectorised loop body, on iteration j (counting from 0) of the loop
+struct IrVectorTerm {
+  enum class Kind : uint8_t {
+    invariant, // args[a] on every iteration
+    induction, // args[a] + j * args[b]
+    bin, // terms[a] <bin> terms[b], add, sub or mul
+  };
+
+  Kind kind;
+  BinOp bin = BinOp::add;
+  uint32_t a = 0;
+  uint32_t b = 0;
+};
+
+// What a vector_sum adds up: its `a`, then `reduce` with term `value` of every iteration, all arithmetic wrapping
+struct IrVectorLoop {
+  VectorIsa isa;
+  BinOp reduce; // add or sub
+  std::vector<IrVectorTerm> terms {}; // a term only refers to terms before it
+  uint32_t value = 0;
+
+  // The emitter keeps everything in the 16 vector registers: one per term, one for the step of each induction, the sum and two
+  // temporaries for multiplying
+  [[nodiscard]] inline size_t register_count() const
+  {
+    return terms.size() + std::count_if(terms.begin(), terms.end(), [](const IrVectorTerm& term) {
+      return term.kind == IrVectorTerm::Kind::induction;
+    }) + 3;
+  }
+};
+
+struct IrBlock {
+  std::vector<IrInst> insts {};
+  std::vector<BlockId> preds {}; // filled in by compute_preds
+
+  [[nodiscard]] inline const IrInst& terminator() const
+  {
+    return insts.back();
+  }
+
+  [[nodiscard]] inline IrInst& terminator()
+  {
+    return insts.back();
+  }
+
+  // The blocks control can go to from here
+  [[nodiscard]] inline std::span<const BlockId> succs() const
+  {
+    const IrInst& term = terminator();
+    switch (term.op) {
+    case IrOp::jmp:
+      return { term.target, 1 };
+    case IrOp::br:
+      return { term.target, term.target[0] == term.target[1] ? 1u : 2u };
+    default:
+      return {};
+    }
+  }
+};
+
+struct IrFunction {
+  SymbolId name = invalid_symbol; // invalid_symbol for the main program
+  uint32_t param_count = 0;
+  std::vector<IrBlock> blocks {}; // blocks[0] is the entry
+  uint32_t vreg_count = 0;
+  bool ssa = false;
+  std::vector<IrVectorLoop> vector_loops {}; // the bodies of its vector_sums
+
+  inline Vreg new_vreg()
+  {
+    return vreg_count++;
+  }
+
+  inline BlockId new_block()
+  {
+    blocks.emplace_back();
+    return static_cast<BlockId>(blocks.size() - 1);
+  }
+
+  [[nodiscard]] inline bool is_main() const
+  {
+    return name == invalid_symbol;
+  }
+};
+
+struct IrModule {
+  std::vector<IrFunction> functions {}; // functions[0] is the main program
+  std::vector<std::string> strings {}; // distinct string literals, raw text with the escape sequences still in it
+  bool uses_print = false; // the program has a print statement, see program_prints
+  std::optional<ProfileTable> profile {}; // -fprofile: the sites of every function, their counters go in the data
+};
+
+// Recompute IrBlock::preds from the terminators. Predecessors are in block order, phis rely on that order staying put once it's computed
+inline void compute_preds(IrFunction& fn)
+{
+  for (IrBlock& block : fn.blocks) {
+    block.preds.clear();
+  }
+  for (BlockId id = 0; id < fn.blocks.size(); id++) {
+    for (BlockId succ : fn.blocks[id].succs()) {
+      fn.blocks[succ].preds.push_back(id);
+    }
+  }
+}
+
+// Human readable dump, for --dump-ir
+inline void print_ir(std::ostream& out, const IrModule& module, const Interner& interner)
+{
+  auto value = [&](const IrValue& v) -> std::string {
+    switch (v.kind) {
+    case IrValue::Kind::reg: {
+      // Appended into one string rather than "%" + std::to_string(...), which GCC 12 warns about (-Wrestrict) once it is inlined
+      std::string text(1, '%');
+      text.append(std::to_string(v.reg));
+      return text;
+    }
+    case IrValue::Kind::imm:
+      return std::to_string(v.imm);
+    default:
+      return "_";
+    }
+  };
+  static constexpr const char* bin_names[] = { "add", "sub", "mul", "div", "eq", "lt", "gt", "and", "or" };
+
+  for (const IrFunction& fn : module.functions) {
+    out << "function " << (fn.is_main() ? "_start" : std::string(interner.name(fn.name))) << "(" << fn.param_count << ")"
+        << (fn.ssa ? " ssa" : "") << "\n";
+    for (BlockId id = 0; id < fn.blocks.size(); id++) {
+      const IrBlock& block = fn.blocks[id];
+      out << "b" << id << ":";
+      if (!block.preds.empty()) {
+        out << " ; preds";
+        for (BlockId pred : block.preds) {
+          out << " b" << pred;
+        }
+      }
+      out << "\n";
+      for (const IrInst& inst : block.insts) {
+        out << "    ";
+        if (inst.dst != no_vreg) {
+          out << "%" << inst.dst << " = ";
+        }
+        switch (inst.op) {
+        case IrOp::mov:
+          out << "mov " << value(inst.a);
+          break;
+        case IrOp::bin:
+          out << bin_names[static_cast<int>(inst.bin)] << " " << value(inst.a) << ", " << value(inst.b);
+          break;
+        case IrOp::lea_str:
+          out << "str " << inst.index;
+          break;
+        case IrOp::param:
+          out << "param " << inst.index;
+          break;
+        case IrOp::call:
+        case IrOp::phi:
+          if (inst.op == IrOp::call) {
+            const IrFunction& callee = module.functions[inst.index];
+            out << "call " << interner.name(callee.name) << "(";
+          }
+          else {
+            out << "phi(";
+          }
+          for (size_t i = 0; i < inst.args.size(); i++) {
+            out << (i > 0 ? ", " : "") << value(inst.args[i]);
+          }
+          out << ")";
+          break;
+        case IrOp::print_int:
+          out << "print_int " << value(inst.a);
+          break;
+        case IrOp::print_str:
+          out << "print_str " << value(inst.a);
+          if (inst.b.is_imm()) {
+            out << ", " << value(inst.b);
+          }
+          break;
+        case IrOp::profile: {
+          static constexpr const char* event_names[] = { "enter", "leave", "primary", "secondary" };
+          out << "profile " << inst.index << ", " << event_names[inst.a.imm];
+          break;
+        }
+        case IrOp::vector_sum: {
+          const IrVectorLoop& loop = fn.vector_loops[inst.index];
+          out << "vector_sum x" << vector_lanes(loop.isa) << " " << bin_names[static_cast<int>(loop.reduce)] << " " << value(inst.a) << ", "
+              << value(inst.b) << " (";
+          for (size_t i = 0; i < inst.args.size(); i++) {
+            out << (i > 0 ? ", " : "") << value(inst.args[i]);
+          }
+          out << ") {";
+          for (size_t i = 0; i < loop.terms.size(); i++) {
+            const IrVectorTerm& term = loop.terms[i];
+            out << (i > 0 ? "; t" : " t") << i << " = ";
+            switch (term.kind) {
+            case IrVectorTerm::Kind::invariant:
+              out << "$" << term.a;
+              break;
+            case IrVectorTerm::Kind::induction:
+              out << "$" << term.a << " + j * $" << term.b;
+              break;
+            case IrVectorTerm::Kind::bin:
+              out << bin_names[static_cast<int>(term.bin)] << " t" << term.a << ", t" << term.b;
+              break;
+            }
+          }
+          out << " } t" << loop.value;
+          break;
+        }
+        case IrOp::jmp:
+          out << "jmp b" << inst.target[0];
+          break;
+        case IrOp::br:
+          out << "br " << value(inst.a) << ", b" << inst.target[0] << ", b" << inst.target[1];
+          break;
+        case IrOp::ret:
+          out << "ret " << value(inst.a);
+          break;
+        case IrOp::exit:
+          out << "exit " << value(inst.a);
+          break;
+        }
+        out << "\n";
+      }
+    }
+  }
+}
@@ -0,0 +1,856 @@
+// This file turns IR (out of SSA form) into NASM text for x86-64, the -O2 backend.
+// Registers are assigned with linear scan: liveness is solved per block, every vreg gets one interval from its first to its last live
+// position in block order, and the intervals are handed registers in order of their start. A vreg that is live across a call or a print
+// only gets a callee-saved register, a copy tries to reuse the register of its source so the move disappears. When there are no registers
+// left the interval that ends last goes to a stack slot below rbp.
+// rax, rdx and r11 are never allocated: they are the scratch registers for idiv, setcc, immediates that don't fit in 32 bits and
+// memory-to-memory moves. Calls use the same convention as the tree backends: the first six arguments in rdi, rsi, rdx, rcx, r8 and r9,
+// the rest pushed last to first, the result in rax. A parameter prefers the register it arrives in.
+// A comparison that only feeds the branch ending its block is not turned into 0 / 1: its cmp is followed by a jcc on the flags.
+// A vector_sum is a loop of its own on the xmm / ymm registers (emit_vector_sum), which nothing else uses, counted down in rax.
+
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "./emitter.hpp"
+#include "./interner.hpp"
+#include "./ir.hpp"
+#include "./profile.hpp"
+#include "./runtime.hpp"
+
+class IrEmitter {
+public:
+  inline IrEmitter(const IrModule& module, const Interner& interner)
+    : m_module(module)
+    , m_interner(interner)
+  {
+  }
+
+  [[nodiscard]] inline AsmBuffer emit()
+  {
+    // Roughly what the program will take, so the buffer doesn't have to grow and copy itself over and over
+    size_t inst_count = 0;
+    for (const IrFunction& fn : m_module.functions) {
+      for (const IrBlock& block : fn.blocks) {
+        inst_count += block.insts.size();
+      }
+    }
+    m_output.reserve(inst_count * 32 + 4096);
+    for (const IrFunction& fn : m_module.functions) {
+      emit_function(fn);
+    }
+    m_output << emit_data();
+    return std::move(m_output);
+  }
+
+  // The code of each of `functions` (indexes into the module, 0 for the main program) in a buffer of its own, for incremental builds
+  [[nodiscard]] inline std::vector<AsmBuffer> emit_units(std::span<const size_t> functions)
+  {
+    std::vector<AsmBuffer> parts;
+    for (size_t index : functions) {
+      emit_function(m_module.functions[index]);
+      parts.push_back(std::exchange(m_output, AsmBuffer()));
+    }
+    return parts;
+  }
+
+  // What goes after the code: the string pool, in programs that print the runtime, and with -fprofile the counters and their dump
+  [[nodiscard]] inline AsmBuffer emit_data() const
+  {
+    AsmBuffer data;
+    emit_string_pool(data, m_module.strings);
+    if (m_module.uses_print) {
+      emit_print_runtime(data);
+    }
+    if (m_module.profile.has_value()) {
+      emit_profile_runtime(data, m_module.profile.value(), m_module.uses_print);
+    }
+    return data;
+  }
+
+private:
+  // Allocatable registers, caller-saved first
+  static constexpr std::array<std::string_view, 11> regs = { "rcx", "rsi", "rdi", "r8", "r9", "r10", "rbx", "r12", "r13", "r14", "r15" };
+  static constexpr uint32_t all_regs = (1u << regs.size()) - 1;
+  static constexpr uint32_t callee_saved = all_regs & ~((1u << 6) - 1);
+  static constexpr uint32_t no_position = std::numeric_limits<uint32_t>::max();
+
+  // Where the first six arguments go, in order. The rest are pushed last to first
+  static constexpr std::array<std::string_view, 6> arg_regs = { "rdi", "rsi", "rdx", "rcx", "r8", "r9" };
+
+  // The index in regs of argument register `i`, -1 for the ones that are never allocated (rdx)
+  static inline int arg_reg_index(size_t i)
+  {
+    auto it = std::find(regs.begin(), regs.end(), arg_regs[i]);
+    return it == regs.end() ? -1 : static_cast<int>(it - regs.begin());
+  }
+
+  // Sorted set union / difference on the sorted vreg lists liveness works with
+  static inline std::vector<Vreg> set_union(const std::vector<Vreg>& lhs, const std::vector<Vreg>& rhs)
+  {
+    std::vector<Vreg> result;
+    std::set_union(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), std::back_inserter(result));
+    return result;
+  }
+
+  static inline std::vector<Vreg> set_difference(const std::vector<Vreg>& lhs, const std::vector<Vreg>& rhs)
+  {
+    std::vector<Vreg> result;
+    std::set_difference(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), std::back_inserter(result));
+    return result;
+  }
+
+  static inline bool clobbers_caller_saved(const IrInst& inst)
+  {
+    return inst.op == IrOp::call || inst.op == IrOp::print_int || inst.op == IrOp::print_str;
+  }
+
+  static inline bool fits_imm32(int64_t value)
+  {
+    return value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max();
+  }
+
+  // One live interval per vreg, then linear scan. Fills m_reg, m_slot, m_slot_count and m_used_callee_saved
+  inline void allocate(const IrFunction& fn)
+  {
+    assert(!fn.ssa);
+    const size_t block_count = fn.blocks.size();
+
+    // Positions: every instruction gets one, in block order
+    std::vector<uint32_t> block_start(block_count);
+    std::vector<uint32_t> block_end(block_count);
+    std::vector<uint32_t> call_positions;
+    uint32_t position = 0;
+    for (BlockId id = 0; id < block_count; id++) {
+      block_start[id] = position;
+      for (const IrInst& inst : fn.blocks[id].insts) {
+        if (clobbers_caller_saved(inst)) {
+          call_positions.push_back(position);
+        }
+        position++;
+      }
+      block_end[id] = position - 1;
+    }
+
+    // Liveness: what each block reads before writing it (use) and what it writes (def), then iterate to a fixed point
+    std::vector<std::vector<Vreg>> use(block_count);
+    std::vector<std::vector<Vreg>> def(block_count);
+    std::vector<BlockId> defined_in(fn.vreg_count, no_block);
+    std::vector<BlockId> used_in(fn.vreg_count, no_block);
+    for (BlockId id = 0; id < block_count; id++) {
+      for (const IrInst& inst : fn.blocks[id].insts) {
+        inst.for_each_use([&](const IrValue& value) {
+          if (value.is_reg() && defined_in[value.reg] != id && used_in[value.reg] != id) {
+            used_in[value.reg] = id;
+            use[id].push_back(value.reg);
+          }
+        });
+        if (inst.dst != no_vreg && defined_in[inst.dst] != id) {
+          defined_in[inst.dst] = id;
+          def[id].push_back(inst.dst);
+        }
+      }
+      std::sort(use[id].begin(), use[id].end());
+      std::sort(def[id].begin(), def[id].end());
+    }
+    std::vector<std::vector<Vreg>> live_in(block_count);
+    std::vector<std::vector<Vreg>> live_out(block_count);
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (BlockId id = static_cast<BlockId>(block_count); id-- > 0;) {
+        std::vector<Vreg> out;
+        for (BlockId succ : fn.blocks[id].succs()) {
+          out = set_union(out, live_in[succ]);
+        }
+        std::vector<Vreg> in = set_union(use[id], set_difference(out, def[id]));
+        if (in != live_in[id] || out != live_out[id]) {
+          live_in[id] = std::move(in);
+          live_out[id] = std::move(out);
+          changed = true;
+        }
+      }
+    }
+
+    // Intervals
+    std::vector<uint32_t> start(fn.vreg_count, no_position);
+    std::vector<uint32_t> end(fn.vreg_count, 0);
+    std::vector<Vreg> hint(fn.vreg_count, no_vreg); // the source of a copy into the vreg
+    std::vector<int> preferred(fn.vreg_count, -1); // a parameter: the register it arrives in
+    auto extend = [&](Vreg reg, uint32_t pos) {
+      start[reg] = std::min(start[reg], pos);
+      end[reg] = std::max(end[reg], pos);
+    };
+    position = 0;
+    for (BlockId id = 0; id < block_count; id++) {
+      for (Vreg reg : live_in[id]) {
+        extend(reg, block_start[id]);
+      }
+      for (Vreg reg : live_out[id]) {
+        extend(reg, block_end[id]);
+      }
+      for (const IrInst& inst : fn.blocks[id].insts) {
+        inst.for_each_use([&](const IrValue& value) {
+          if (value.is_reg()) {
+            extend(value.reg, position);
+          }
+        });
+        if (inst.dst != no_vreg) {
+          extend(inst.dst, position);
+          if (inst.op == IrOp::mov && inst.a.is_reg()) {
+            hint[inst.dst] = inst.a.reg;
+          }
+          if (inst.op == IrOp::param && inst.index < arg_regs.size()) {
+            preferred[inst.dst] = arg_reg_index(inst.index);
+          }
+        }
+        position++;
+      }
+    }
+
+    std::vector<Vreg> order;
+    for (Vreg reg = 0; reg < fn.vreg_count; reg++) {
+      if (start[reg] != no_position) {
+        order.push_back(reg);
+      }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](Vreg lhs, Vreg rhs) { return start[lhs] < start[rhs]; });
+
+    m_reg.assign(fn.vreg_count, -1);
+    m_slot.assign(fn.vreg_count, -1);
+    m_slot_count = 0;
+    m_used_callee_saved = 0;
+    uint32_t free_regs = all_regs;
+    std::vector<Vreg> active;
+    for (Vreg reg : order) {
+      // An interval ending where this one starts can hand over its register: every instruction reads its operands before it writes
+      std::erase_if(active, [&](Vreg other) {
+        if (end[other] > start[reg]) {
+          return false;
+        }
+        free_regs |= 1u << m_reg[other];
+        return true;
+      });
+
+      auto call = std::upper_bound(call_positions.begin(), call_positions.end(), start[reg]);
+      bool crosses_call = call != call_positions.end() && *call < end[reg];
+      uint32_t allowed = crosses_call ? callee_saved : all_regs;
+      uint32_t candidates = free_regs & allowed;
+
+      int chosen = -1;
+      if (hint[reg] != no_vreg && m_reg[hint[reg]] >= 0 && (candidates & (1u << m_reg[hint[reg]])) != 0) {
+        chosen = m_reg[hint[reg]];
+      }
+      else if (preferred[reg] >= 0 && (candidates & (1u << preferred[reg])) != 0) {
+        chosen = preferred[reg];
+      }
+      else if (candidates != 0) {
+        chosen = std::countr_zero(candidates); // caller-saved first, they cost nothing to use
+      }
+      else {
+        // Nothing free: whoever ends last goes to the stack
+        auto victim = std::max_element(active.begin(), active.end(), [&](Vreg lhs, Vreg rhs) {
+          bool lhs_ok = (allowed & (1u << m_reg[lhs])) != 0;
+          bool rhs_ok = (allowed & (1u << m_reg[rhs])) != 0;
+          return lhs_ok != rhs_ok ? rhs_ok : end[lhs] < end[rhs];
+        });
+        if (victim != active.end() && (allowed & (1u << m_reg[*victim])) != 0 && end[*victim] > end[reg]) {
+          chosen = m_reg[*victim];
+          m_reg[*victim] = -1;
+          m_slot[*victim] = static_cast<int32_t>(m_slot_count++);
+          active.erase(victim);
+          free_regs |= 1u << chosen;
+        }
+        else {
+          m_slot[reg] = static_cast<int32_t>(m_slot_count++);
+          continue;
+        }
+      }
+      m_reg[reg] = chosen;
+      free_regs &= ~(1u << chosen);
+      active.push_back(reg);
+      if ((callee_saved & (1u << chosen)) != 0) {
+        m_used_callee_saved |= 1u << chosen;
+      }
+    }
+  }
+
+  // Where a vreg lives, as an instruction operand
+  [[nodiscard]] inline AsmOperand location(Vreg reg) const
+  {
+    if (m_reg[reg] >= 0) {
+      return regs[m_reg[reg]];
+    }
+    return AsmOperand::mem("rbp", -(m_slot[reg] + 1) * 8);
+  }
+
+  [[nodiscard]] inline AsmOperand operand(const IrValue& value) const
+  {
+    return value.is_imm() ? AsmOperand::imm(value.imm) : location(value.reg);
+  }
+
+  [[nodiscard]] inline bool in_memory(const IrValue& value) const
+  {
+    return value.is_reg() && m_reg[value.reg] < 0;
+  }
+
+  [[nodiscard]] inline bool in_register(const IrValue& value, std::string_view reg) const
+  {
+    return value.is_reg() && m_reg[value.reg] >= 0 && regs[m_reg[value.reg]] == reg;
+  }
+
+  // mov dst, value for any combination of register, memory and immediate
+  inline void emit_mov(const AsmOperand& dst, bool dst_in_memory, const IrValue& value)
+  {
+    AsmOperand src = operand(value);
+    if (src == dst) {
+      return;
+    }
+    if (dst_in_memory && (in_memory(value) || (value.is_imm() && !fits_imm32(value.imm)))) {
+      m_output << "    mov rax, " << src << "\n";
+      src = "rax";
+    }
+    m_output << "    mov " << dst << ", " << src << "\n";
+  }
+
+  inline void emit_mov(Vreg dst, const IrValue& value)
+  {
+    emit_mov(location(dst), m_reg[dst] < 0, value);
+  }
+
+  // Moves that all happen at once, as if every source was read before any destination is written. No two moves have the same
+  // destination, and a source in memory never has a memory destination. A move waits until no other one still reads its destination,
+  // a cycle of registers is broken by parking one of them in rax
+  inline void emit_parallel_move(std::vector<std::pair<AsmOperand, AsmOperand>> moves) // destination, source
+  {
+    std::erase_if(moves, [](const auto& move) { return move.first == move.second; });
+    while (!moves.empty()) {
+      auto ready = std::find_if(moves.begin(), moves.end(), [&](const auto& move) {
+        return std::none_of(moves.begin(), moves.end(), [&](const auto& other) { return other.second == move.first; });
+      });
+      if (ready == moves.end()) {
+        AsmOperand blocked = moves.front().first;
+        m_output << "    mov rax, " << blocked << "\n";
+        for (auto& move : moves) {
+          if (move.second == blocked) {
+            move.second = "rax";
+          }
+        }
+        continue;
+      }
+      m_output << "    mov " << ready->first << ", " << ready->second << "\n";
+      moves.erase(ready);
+    }
+  }
+
+  // The second operand of an arithmetic instruction: a register, memory, or an immediate that fits in 32 bits (otherwise via `scratch`)
+  inline AsmOperand source_operand(const IrValue& value, std::string_view scratch)
+  {
+    if (value.is_imm() && !fits_imm32(value.imm)) {
+      m_output << "    mov " << scratch << ", " << value.imm << "\n";
+      return scratch;
+    }
+    return operand(value);
+  }
+
+  inline void emit_bin(const IrInst& inst)
+  {
+    AsmOperand dst = location(inst.dst);
+    bool dst_in_memory = m_reg[inst.dst] < 0;
+    IrValue lhs = inst.a;
+    IrValue rhs = inst.b;
+
+    switch (inst.bin) {
+    case BinOp::add:
+    case BinOp::sub:
+    case BinOp::mul: {
+      // Compute in dst directly unless that would overwrite rhs before it is read
+      if (inst.bin != BinOp::sub && in_register(rhs, dst.reg) && !in_register(lhs, dst.reg)) {
+        std::swap(lhs, rhs);
+      }
+      AsmOperand work = !dst_in_memory && !in_register(rhs, dst.reg) ? dst : "rax";
+      emit_mov(work, false, lhs);
+      AsmOperand source = source_operand(rhs, "rdx");
+      std::string_view instr = inst.bin == BinOp::add ? "add" : inst.bin == BinOp::sub ? "sub" : "imul";
+      m_output << "    " << instr << " " << work << ", " << source << "\n";
+      if (work != dst) {
+        m_output << "    mov " << dst << ", " << work << "\n";
+      }
+      break;
+    }
+    case BinOp::div:
+      emit_mov("rax", false, lhs);
+      m_output << "    cqo\n"; // sign extend rax into rdx:rax
+      if (rhs.is_imm()) {
+        m_output << "    mov r11, " << rhs.imm << "\n";
+        m_output << "    idiv r11\n";
+      }
+      else {
+        m_output << "    idiv " << operand(rhs) << "\n";
+      }
+      m_output << "    mov " << dst << ", rax\n";
+      break;
+    case BinOp::eq:
+    case BinOp::lt:
+    case BinOp::gt: {
+      emit_compare(inst);
+      m_output << "    set" << condition_code(inst.bin, true) << " al\n";
+      if (dst_in_memory) {
+        m_output << "    movzx rax, al\n";
+        m_output << "    mov " << dst << ", rax\n";
+      }
+      else {
+        m_output << "    movzx " << dst << ", al\n";
+      }
+      break;
+    }
+    case BinOp::and_:
+    case BinOp::or_:
+      assert(false); // Unreachable, lowered to branches
+    }
+  }
+
+  // cmp for a comparison, the flags say what its result would be
+  inline void emit_compare(const IrInst& inst)
+  {
+    AsmOperand left = operand(inst.a);
+    if (inst.a.is_imm() || (in_memory(inst.a) && in_memory(inst.b))) {
+      emit_mov("rax", false, inst.a);
+      left = "rax";
+    }
+    AsmOperand right = source_operand(inst.b, "rdx"); // may emit a mov of its own, so not in the middle of the cmp line
+    m_output << "    cmp " << left << ", " << right << "\n";
+  }
+
+  // The jcc / setcc condition for a comparison being true (`when`) or false
+  static inline std::string_view condition_code(BinOp op, bool when)
+  {
+    switch (op) {
+    case BinOp::eq:
+      return when ? "e" : "ne";
+    case BinOp::lt:
+      return when ? "l" : "ge";
+    default:
+      return when ? "g" : "le";
+    }
+  }
+
+  // Whether insts[i] is a comparison only the br ending the block reads, with nothing but moves in between. Its cmp then goes where the
+  // comparison is and the br jumps on the flags (a mov doesn't change them) instead of on a 0 / 1 made with setcc
+  [[nodiscard]] inline bool branches_on_flags(std::span<const IrInst> insts, size_t i) const
+  {
+    const IrInst& inst = insts[i];
+    if (inst.op != IrOp::bin || (inst.bin != BinOp::eq && inst.bin != BinOp::lt && inst.bin != BinOp::gt) || m_use_count[inst.dst] != 1) {
+      return false;
+    }
+    size_t next = i + 1;
+    while (next < insts.size() && insts[next].op == IrOp::mov) {
+      next++;
+    }
+    return next < insts.size() && insts[next].op == IrOp::br && insts[next].a.is_reg() && insts[next].a.reg == inst.dst;
+  }
+
+  [[nodiscard]] inline std::string label_of(const IrFunction& fn) const
+  {
+    return fn.is_main() ? "_start" : function_label(m_interner.name(fn.name));
+  }
+
+  [[nodiscard]] inline AsmLabel block_label(BlockId id) const
+  {
+    return { m_block_prefix, id };
+  }
+
+  inline void emit_jump(BlockId target, BlockId next)
+  {
+    if (target != next) {
+      m_output << "    jmp " << block_label(target) << "\n";
+    }
+  }
+
+  inline void emit_epilogue()
+  {
+    m_output << "    mov rsp, rbp\n";
+    m_output << "    pop rbp\n";
+    for (size_t i = m_saved_regs.size(); i-- > 0;) {
+      m_output << "    pop " << m_saved_regs[i] << "\n";
+    }
+    m_output << "    ret\n";
+  }
+
+  inline void emit_inst(const IrInst& inst, BlockId next)
+  {
+    switch (inst.op) {
+    case IrOp::mov:
+      emit_mov(inst.dst, inst.a);
+      break;
+    case IrOp::bin:
+      emit_bin(inst);
+      break;
+    case IrOp::lea_str: {
+      AsmOperand dst = location(inst.dst);
+      bool dst_in_memory = m_reg[inst.dst] < 0;
+      m_output << "    lea " << (dst_in_memory ? "rax" : dst) << ", [" << StringLabel(m_module.strings[inst.index]) << "]\n";
+      if (dst_in_memory) {
+        m_output << "    mov " << dst << ", rax\n";
+      }
+      break;
+    }
+    case IrOp::param:
+      assert(false); // Unreachable, emit_params takes them all at the top of the entry block
+      break;
+    case IrOp::call: {
+      size_t reg_args = std::min(inst.args.size(), arg_regs.size());
+      for (size_t i = inst.args.size(); i-- > reg_args;) {
+        const IrValue& arg = inst.args[i];
+        if (arg.is_imm() && !fits_imm32(arg.imm)) {
+          m_output << "    mov rax, " << arg.imm << "\n";
+          m_output << "    push rax\n";
+        }
+        else {
+          m_output << "    push " << operand(arg) << "\n";
+        }
+      }
+      // The arguments may already be in each other's registers
+      std::vector<std::pair<AsmOperand, AsmOperand>> moves;
+      for (size_t i = 0; i < reg_args; i++) {
+        moves.emplace_back(arg_regs[i], operand(inst.args[i]));
+      }
+      emit_parallel_move(std::move(moves));
+      m_output << "    call " << label_of(m_module.functions[inst.index]) << "\n";
+      if (inst.args.size() > reg_args) {
+        m_output << "    add rsp, " << (inst.args.size() - reg_args) * 8 << "\n";
+      }
+      m_output << "    mov " << location(inst.dst) << ", rax\n";
+      break;
+    }
+    case IrOp::print_int:
+      emit_mov("rax", false, inst.a);
+      m_output << "    call hydro_print_int\n";
+      break;
+    case IrOp::print_str:
+      emit_mov("rsi", false, inst.a);
+      if (inst.b.is_imm()) {
+        m_output << "    mov rdx, " << inst.b.imm << "\n";
+      }
+      else {
+        m_output << "    mov rdx, QWORD [rsi - 8]\n"; // the pool stores the length in front of the string
+      }
+      m_output << "    call hydro_print_string\n";
+      break;
+    case IrOp::profile:
+      emit_profile_event(m_output, { m_unit_name, inst.index }, static_cast<ProfileEvent>(inst.a.imm));
+      break;
+    case IrOp::vector_sum:
+      emit_vector_sum(inst);
+      break;
+    case IrOp::jmp:
+      emit_jump(inst.target[0], next);
+      break;
+    case IrOp::br: {
+      if (m_flags_of != nullptr) {
+        // the cmp is already out, see branches_on_flags
+        assert(inst.a.is_reg() && inst.a.reg == m_flags_of->dst);
+        BinOp op = std::exchange(m_flags_of, nullptr)->bin;
+        if (inst.target[1] == next) {
+          m_output << "    j" << condition_code(op, true) << " " << block_label(inst.target[0]) << "\n";
+        }
+        else {
+          m_output << "    j" << condition_code(op, false) << " " << block_label(inst.target[1]) << "\n";
+          emit_jump(inst.target[0], next);
+        }
+        break;
+      }
+      if (inst.a.is_imm()) {
+        emit_jump(inst.target[inst.a.imm != 0 ? 0 : 1], next);
+        break;
+      }
+      if (in_memory(inst.a)) {
+        m_output << "    cmp " << operand(inst.a) << ", 0\n";
+      }
+      else {
+        m_output << "    test " << operand(inst.a) << ", " << operand(inst.a) << "\n";
+      }
+      if (inst.target[1] == next) {
+        m_output << "    jnz " << block_label(inst.target[0]) << "\n";
+      }
+      else {
+        m_output << "    jz " << block_label(inst.target[1]) << "\n";
+        emit_jump(inst.target[0], next);
+      }
+      break;
+    }
+    case IrOp::ret:
+      emit_mov("rax", false, inst.a);
+      emit_epilogue();
+      break;
+    case IrOp::exit:
+      emit_mov("rdi", false, inst.a);
+      emit_exit(m_output, m_module.uses_print, m_module.profile.has_value());
+      break;
+    case IrOp::phi:
+      assert(false); // Unreachable, destruct_ssa removed them
+    }
+  }
+
+  // The loop of a vector_sum, `lanes` iterations of IrVectorLoop at a time. Register 0 has the sum (lane 0 starts at a, the others at 0),
+  // 1 and 2 are temporaries, the terms follow in order and every induction has the register after its own for lanes * step, what
+  // each of its lanes goes up by per trip. A bin term is recomputed every trip, the others are set up once
+  inline void emit_vector_sum(const IrInst& inst)
+  {
+    static constexpr std::array<std::string_view, 16> xmm = { "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7", "xmm8",
+      "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15" };
+    static constexpr std::array<std::string_view, 16> ymm = { "ymm0", "ymm1", "ymm2", "ymm3", "ymm4", "ymm5", "ymm6", "ymm7", "ymm8",
+      "ymm9", "ymm10", "ymm11", "ymm12", "ymm13", "ymm14", "ymm15" };
+    const IrVectorLoop& loop = m_function->vector_loops[inst.index];
+    bool avx = loop.isa == VectorIsa::avx2;
+    uint32_t lanes = vector_lanes(loop.isa);
+    const std::array<std::string_view, 16>& vec = avx ? ymm : xmm;
+    std::string_view movq = avx ? "vmovq" : "movq";
+    std::vector<uint32_t> reg(loop.terms.size());
+    uint32_t next_reg = 3;
+    for (size_t i = 0; i < loop.terms.size(); i++) {
+      reg[i] = next_reg;
+      next_reg += loop.terms[i].kind == IrVectorTerm::Kind::induction ? 2 : 1;
+    }
+    assert(next_reg <= 16 && next_reg == loop.register_count());
+
+    // dst = lhs <op> rhs on every lane, SSE2 only has dst <op>= rhs
+    auto emit_op = [&](std::string_view op, uint32_t dst, uint32_t lhs, uint32_t rhs) {
+      if (avx) {
+        m_output << "    v" << op << " " << vec[dst] << ", " << vec[lhs] << ", " << vec[rhs] << "\n";
+        return;
+      }
+      if (dst != lhs) {
+        m_output << "    movdqa " << xmm[dst] << ", " << xmm[lhs] << "\n";
+      }
+      m_output << "    " << op << " " << xmm[dst] << ", " << xmm[rhs] << "\n";
+    };
+    auto emit_shift = [&](std::string_view op, uint32_t dst, uint32_t src, uint32_t count) {
+      if (avx) {
+        m_output << "    v" << op << " " << vec[dst] << ", " << vec[src] << ", " << count << "\n";
+        return;
+      }
+      if (dst != src) {
+        m_output << "    movdqa " << xmm[dst] << ", " << xmm[src] << "\n";
+      }
+      m_output << "    " << op << " " << xmm[dst] << ", " << count << "\n";
+    };
+    // The low lane from `value`, the others zeroed
+    auto emit_load = [&](uint32_t dst, const IrValue& value) {
+      if (value.is_imm()) {
+        m_output << "    mov rax, " << value.imm << "\n";
+        m_output << "    " << movq << " " << xmm[dst] << ", rax\n";
+      }
+      else {
+        m_output << "    " << movq << " " << xmm[dst] << ", " << operand(value) << "\n";
+      }
+    };
+    auto emit_broadcast = [&](uint32_t dst, const IrValue& value) {
+      emit_load(dst, value);
+      if (avx) {
+        m_output << "    vpbroadcastq " << ymm[dst] << ", " << xmm[dst] << "\n";
+      }
+      else {
+        m_output << "    punpcklqdq " << xmm[dst] << ", " << xmm[dst] << "\n";
+      }
+    };
+
+    emit_load(0, inst.a);
+    for (size_t i = 0; i < loop.terms.size(); i++) {
+      const IrVectorTerm& term = loop.terms[i];
+      if (term.kind == IrVectorTerm::Kind::invariant) {
+        emit_broadcast(reg[i], inst.args[term.a]);
+      }
+      else if (term.kind == IrVectorTerm::Kind::induction) {
+        // Lane l starts at init + l * step, worked out in rax. Lanes 0 and 1 go in the low half, with AVX2 2 and 3 in the high one
+        uint32_t r = reg[i];
+        emit_mov("rax", false, inst.args[term.a]);
+        AsmOperand step = source_operand(inst.args[term.b], "rdx");
+        m_output << "    " << movq << " " << xmm[r] << ", rax\n";
+        m_output << "    add rax, " << step << "\n";
+        m_output << "    " << movq << " xmm1, rax\n";
+        if (avx) {
+          m_output << "    vpunpcklqdq " << xmm[r] << ", " << xmm[r] << ", xmm1\n";
+          m_output << "    add rax, " << step << "\n";
+          m_output << "    vmovq xmm1, rax\n";
+          m_output << "    add rax, " << step << "\n";
+          m_output << "    vmovq xmm2, rax\n";
+          m_output << "    vpunpcklqdq xmm1, xmm1, xmm2\n";
+          m_output << "    vinserti128 " << ymm[r] << ", " << ymm[r] << ", xmm1, 1\n";
+        }
+        else {
+          m_output << "    punpcklqdq " << xmm[r] << ", xmm1\n";
+        }
+        emit_broadcast(r + 1, inst.args[term.b]);
+        emit_shift("psllq", r + 1, r + 1, std::countr_zero(lanes));
+      }
+    }
+    emit_mov("rax", false, inst.b);
+
+    AsmLabel top { m_vector_prefix, inst.index };
+    m_output << top << ":\n";
+    for (size_t i = 0; i < loop.terms.size(); i++) {
+      const IrVectorTerm& term = loop.terms[i];
+      if (term.kind != IrVectorTerm::Kind::bin) {
+        continue;
+      }
+      uint32_t lhs = reg[term.a];
+      uint32_t rhs = reg[term.b];
+      if (term.bin != BinOp::mul) {
+        emit_op(term.bin == BinOp::add ? "paddq" : "psubq", reg[i], lhs, rhs);
+        continue;
+      }
+      // lo(a) * lo(b) + ((hi(a) * lo(b) + lo(a) * hi(b)) << 32), the hi * hi part would be shifted out. pmuludq multiplies the low
+      // halves of the lanes into all 64 bits. A square has the same cross product twice
+      emit_shift("psrlq", 1, lhs, 32);
+      emit_op("pmuludq", 1, 1, rhs);
+      if (lhs == rhs) {
+        emit_shift("psllq", 1, 1, 33);
+      }
+      else {
+        emit_shift("psrlq", 2, rhs, 32);
+        emit_op("pmuludq", 2, 2, lhs);
+        emit_op("paddq", 1, 1, 2);
+        emit_shift("psllq", 1, 1, 32);
+      }
+      emit_op("pmuludq", reg[i], lhs, rhs);
+      emit_op("paddq", reg[i], reg[i], 1);
+    }
+    emit_op(loop.reduce == BinOp::add ? "paddq" : "psubq", 0, 0, reg[loop.value]);
+    for (size_t i = 0; i < loop.terms.size(); i++) {
+      if (loop.terms[i].kind == IrVectorTerm::Kind::induction) {
+        emit_op("paddq", reg[i], reg[i], reg[i] + 1);
+      }
+    }
+    m_output << "    sub rax, " << lanes << "\n";
+    m_output << "    jnz " << top << "\n";
+
+    // Add up the lanes
+    if (avx) {
+      m_output << "    vextracti128 xmm1, ymm0, 1\n";
+      m_output << "    vpaddq xmm0, xmm0, xmm1\n";
+      m_output << "    vpshufd xmm1, xmm0, 0x4e\n";
+      m_output << "    vpaddq xmm0, xmm0, xmm1\n";
+    }
+    else {
+      m_output << "    pshufd xmm1, xmm0, 0x4e\n";
+      m_output << "    paddq xmm0, xmm1\n";
+    }
+    m_output << "    " << movq << " " << location(inst.dst) << ", xmm0\n";
+    if (avx) {
+      m_output << "    vzeroupper\n"; // the upper halves would slow down the SSE code of whatever comes next
+    }
+  }
+
+  inline void emit_function(const IrFunction& fn)
+  {
+    allocate(fn);
+    m_function = &fn;
+    m_use_count.assign(fn.vreg_count, 0);
+    for (const IrBlock& block : fn.blocks) {
+      for (const IrInst& inst : block.insts) {
+        inst.for_each_use([&](const IrValue& value) {
+          if (value.is_reg()) {
+            m_use_count[value.reg]++;
+          }
+        });
+      }
+    }
+    m_unit_name = fn.is_main() ? "_start" : m_interner.name(fn.name);
+    std::string label = label_of(fn);
+    m_block_prefix = label + ".b";
+    m_vector_prefix = label + ".v";
+    if (fn.is_main()) {
+      m_output << "global _start\nsection .text\n";
+    }
+    m_output << label << ":\n";
+
+    // A function saves the callee-saved registers it uses below its frame. _start never returns, it doesn't have to
+    m_saved_regs.clear();
+    if (!fn.is_main()) {
+      for (size_t i = 0; i < regs.size(); i++) {
+        if ((m_used_callee_saved & (1u << i)) != 0) {
+          m_saved_regs.push_back(regs[i]);
+          m_output << "    push " << regs[i] << "\n";
+        }
+      }
+      m_output << "    push rbp\n";
+    }
+    m_output << "    mov rbp, rsp\n";
+    if (m_slot_count > 0) {
+      m_output << "    sub rsp, " << m_slot_count * 8 << "\n";
+    }
+
+    for (BlockId id = 0; id < fn.blocks.size(); id++) {
+      if (!fn.blocks[id].preds.empty()) {
+        m_output << block_label(id) << ":\n";
+      }
+      BlockId next = id + 1 < fn.blocks.size() ? id + 1 : no_block;
+      std::span<const IrInst> insts = fn.blocks[id].insts;
+      if (id == 0) {
+        insts = insts.subspan(emit_params(insts));
+      }
+      for (size_t i = 0; i < insts.size(); i++) {
+        if (branches_on_flags(insts, i)) {
+          emit_compare(insts[i]);
+          m_flags_of = &insts[i];
+          continue;
+        }
+        emit_inst(insts[i], next);
+      }
+    }
+  }
+
+  // The params at the top of the entry block, returns how many there are. They are read together: a parameter's register can be the one
+  // another argument arrives in
+  inline size_t emit_params(std::span<const IrInst> insts)
+  {
+    size_t count = 0;
+    std::vector<std::pair<AsmOperand, AsmOperand>> moves;
+    for (; count < insts.size() && insts[count].op == IrOp::param; count++) {
+      const IrInst& inst = insts[count];
+      if (inst.index < arg_regs.size()) {
+        moves.emplace_back(location(inst.dst), arg_regs[inst.index]);
+        continue;
+      }
+      // above rbp: the old rbp, the saved registers, the return address, then the arguments that didn't fit in registers. One going
+      // to a stack slot is copied right away, through rax, before the other moves need it
+      AsmOperand arg = AsmOperand::mem("rbp", static_cast<int64_t>((inst.index - arg_regs.size() + 2 + m_saved_regs.size()) * 8));
+      if (m_reg[inst.dst] < 0) {
+        m_output << "    mov rax, " << arg << "\n";
+        m_output << "    mov " << location(inst.dst) << ", rax\n";
+      }
+      else {
+        moves.emplace_back(location(inst.dst), arg);
+      }
+    }
+    emit_parallel_move(std::move(moves));
+    return count;
+  }
+
+  const IrModule& m_module;
+  const Interner& m_interner;
+  AsmBuffer m_output;
+
+  // The function being emitted
+  const IrFunction* m_function = nullptr;
+  std::string_view m_unit_name; // of the function being emitted, its profile counters are named after it
+  std::string m_block_prefix; // <function>.b, the block labels are that and the block id
+  std::string m_vector_prefix; // <function>.v, the loop of a vector_sum is that and its IrInst::index
+  std::vector<int8_t> m_reg {}; // index into regs per vreg, -1 if it lives in a stack slot
+  std::vector<int32_t> m_slot {}; // stack slot per vreg, [rbp - 8 * (slot + 1)]
+  uint32_t m_slot_count = 0;
+  uint32_t m_used_callee_saved = 0; // bit i is regs[i]
+  std::vector<std::string_view> m_saved_regs {};
+  std::vector<uint32_t> m_use_count {}; // reads of each vreg
+  const IrInst* m_flags_of = nullptr; // the comparison whose cmp was emitted for the br coming up
+};
@@ -0,0 +1,326 @@
+// This file holds the loop optimisations of the -O2 pipeline, on a function in SSA form after simplify_ssa.
+// The loops are the natural loops of the CFG: a back edge goes from a block to one that dominates it, the loop is everything that reaches
+// the back edge without passing through that header. The lowering rotates every loop and gives it a preheader (lowering.hpp), loops
+// without one (there are none today) are left alone.
+// Loops are handled innermost first, so what is hoisted out of an inner loop can be hoisted again out of the one around it:
+//   - loop-invariant code motion moves every instruction whose operands are all defined outside the loop into the preheader. Only
+//     instructions that can't fault move, the preheader runs even when the path through the loop that had the instruction doesn't
+//   - strength reduction finds the basic induction variables (a header phi that every trip around the loop adds the same invariant step
+//     to) and replaces each multiply of one by an invariant with a new induction variable of its own that steps by step * factor. 64-bit
+//     arithmetic wraps, so the sum is the product on every iteration even when they overflow
+// Both leave copies and now unused instructions behind, simplify_ssa cleans them up afterwards.
+
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <utility>
+#include <vector>
+#include "./ir.hpp"
+#include "./ssa.hpp"
+
+struct IrLoop {
+  BlockId header;
+  BlockId preheader;
+  std::vector<BlockId> blocks; // in block order, the header first
+  std::vector<uint8_t> contains; // by block
+};
+
+// The natural loops of `fn` that have a preheader, innermost first. Blocks have to be in reverse postorder (build_ssa leaves them so)
+inline std::vector<IrLoop> find_loops(const IrFunction& fn)
+{
+  std::vector<BlockId> idom = compute_idoms(fn);
+  auto dominates = [&](BlockId dominator, BlockId block) {
+    while (block != dominator && block != 0) {
+      block = idom[block];
+    }
+    return block == dominator;
+  };
+
+  std::vector<IrLoop> loops;
+  for (BlockId header = 0; header < fn.blocks.size(); header++) {
+    IrLoop loop { .header = header, .preheader = no_block, .blocks = {}, .contains = {} };
+    std::vector<BlockId> worklist;
+    for (BlockId pred : fn.blocks[header].preds) {
+      if (pred >= header && dominates(header, pred)) {
+        worklist.push_back(pred);
+      }
+    }
+    if (worklist.empty()) {
+      continue;
+    }
+    loop.contains.assign(fn.blocks.size(), 0);
+    loop.contains[header] = 1;
+    while (!worklist.empty()) {
+      BlockId block = worklist.back();
+      worklist.pop_back();
+      if (loop.contains[block] == 0) {
+        loop.contains[block] = 1;
+        worklist.insert(worklist.end(), fn.blocks[block].preds.begin(), fn.blocks[block].preds.end());
+      }
+    }
+    for (BlockId pred : fn.blocks[header].preds) {
+      if (loop.contains[pred] != 0) {
+        continue;
+      }
+      bool first = loop.preheader == no_block;
+      loop.preheader = first && fn.blocks[pred].succs().size() == 1 ? pred : no_block;
+      if (!first) {
+        break;
+      }
+    }
+    if (loop.preheader == no_block) {
+      continue;
+    }
+    for (BlockId block = header; block < fn.blocks.size(); block++) {
+      if (loop.contains[block] != 0) {
+        loop.blocks.push_back(block);
+      }
+    }
+    loops.push_back(std::move(loop));
+  }
+  std::stable_sort(loops.begin(), loops.end(), [](const IrLoop& lhs, const IrLoop& rhs) { return lhs.blocks.size() < rhs.blocks.size(); });
+  return loops;
+}
+
+class LoopOptimizer {
+public:
+  inline explicit LoopOptimizer(IrFunction& fn)
+    : m_fn(fn)
+  {
+  }
+
+  // Returns the number of instructions hoisted or strength-reduced
+  inline size_t run()
+  {
+    assert(m_fn.ssa);
+    std::vector<IrLoop> loops = find_loops(m_fn);
+    if (loops.empty()) {
+      return 0;
+    }
+    m_def_block.assign(m_fn.vreg_count, no_block);
+    for (BlockId id = 0; id < m_fn.blocks.size(); id++) {
+      for (const IrInst& inst : m_fn.blocks[id].insts) {
+        if (inst.dst != no_vreg) {
+          m_def_block[inst.dst] = id;
+        }
+      }
+    }
+    size_t changed = 0;
+    for (const IrLoop& loop : loops) {
+      changed += hoist_invariants(loop);
+      changed += reduce_multiplies(loop);
+    }
+    return changed;
+  }
+
+private:
+  // A basic induction variable: `phi` in the header, `next` = phi + step (or - step) is what every back edge brings back
+  struct Induction {
+    Vreg phi;
+    Vreg next;
+    IrValue init; // from the preheader
+    IrValue step;
+    BinOp op; // add or sub
+  };
+
+  // The induction variable made for the multiplies of one basic one by one factor
+  struct Reduced {
+    Vreg base; // Induction::phi
+    IrValue factor;
+    Vreg phi; // base * factor
+    Vreg next; // next * factor
+  };
+
+  [[nodiscard]] inline bool is_invariant(const IrLoop& loop, const IrValue& value) const
+  {
+    return !value.is_reg() || m_def_block[value.reg] == no_block || loop.contains[m_def_block[value.reg]] == 0;
+  }
+
+  // Whether the instruction can run on paths that didn't run it before: no side effects, and no fault. A division faults for 0 and for
+  // the most negative number divided by -1, so only a division by another constant can move
+  static inline bool is_speculatable(const IrInst& inst)
+  {
+    switch (inst.op) {
+    case IrOp::mov:
+    case IrOp::lea_str:
+      return true;
+    case IrOp::bin:
+      return inst.bin != BinOp::div || (inst.b.is_imm() && inst.b.imm != 0 && inst.b.imm != -1);
+    default:
+      return false;
+    }
+  }
+
+  inline Vreg new_vreg(BlockId block)
+  {
+    m_def_block.push_back(block);
+    return m_fn.new_vreg();
+  }
+
+  // Append to the preheader, in front of its jump
+  inline void add_to_preheader(const IrLoop& loop, IrInst inst)
+  {
+    std::vector<IrInst>& insts = m_fn.blocks[loop.preheader].insts;
+    m_def_block[inst.dst] = loop.preheader;
+    insts.insert(insts.end() - 1, std::move(inst));
+  }
+
+  inline size_t hoist_invariants(const IrLoop& loop)
+  {
+    // The blocks are in reverse postorder, so a definition is seen before the uses it dominates and one pass finds the chains too
+    size_t hoisted = 0;
+    for (BlockId id : loop.blocks) {
+      std::vector<IrInst>& insts = m_fn.blocks[id].insts;
+      size_t kept = 0;
+      for (size_t i = 0; i < insts.size(); i++) {
+        IrInst& inst = insts[i];
+        bool invariant = inst.dst != no_vreg && is_speculatable(inst);
+        inst.for_each_use([&](const IrValue& value) { invariant = invariant && is_invariant(loop, value); });
+        if (invariant) {
+          add_to_preheader(loop, std::move(inst));
+          hoisted++;
+          continue;
+        }
+        if (kept != i) {
+          insts[kept] = std::move(inst);
+        }
+        kept++;
+      }
+      insts.resize(kept);
+    }
+    return hoisted;
+  }
+
+  inline std::vector<Induction> find_inductions(const IrLoop& loop) const
+  {
+    const IrBlock& header = m_fn.blocks[loop.header];
+    size_t preheader_index = std::find(header.preds.begin(), header.preds.end(), loop.preheader) - header.preds.begin();
+    std::vector<Induction> inductions;
+    for (const IrInst& phi : header.insts) {
+      if (phi.op != IrOp::phi) {
+        break;
+      }
+      // Every back edge has to bring the same value
+      IrValue next {};
+      for (size_t i = 0; i < phi.args.size(); i++) {
+        if (i == preheader_index) {
+          continue;
+        }
+        if (!phi.args[i].is_reg() || (next.kind != IrValue::Kind::none && phi.args[i] != next)) {
+          next = {};
+          break;
+        }
+        next = phi.args[i];
+      }
+      if (!next.is_reg() || is_invariant(loop, next)) {
+        continue;
+      }
+      const IrInst* step = definition(next.reg);
+      IrValue self = IrValue::of_reg(phi.dst);
+      if (step == nullptr || step->op != IrOp::bin) {
+        continue;
+      }
+      if (step->bin == BinOp::add && step->a == self && is_invariant(loop, step->b)) {
+        inductions.push_back({ phi.dst, next.reg, phi.args[preheader_index], step->b, BinOp::add });
+      }
+      else if (step->bin == BinOp::add && step->b == self && is_invariant(loop, step->a)) {
+        inductions.push_back({ phi.dst, next.reg, phi.args[preheader_index], step->a, BinOp::add });
+      }
+      else if (step->bin == BinOp::sub && step->a == self && is_invariant(loop, step->b)) {
+        inductions.push_back({ phi.dst, next.reg, phi.args[preheader_index], step->b, BinOp::sub });
+      }
+    }
+    return inductions;
+  }
+
+  [[nodiscard]] inline const IrInst* definition(Vreg reg) const
+  {
+    for (const IrInst& inst : m_fn.blocks[m_def_block[reg]].insts) {
+      if (inst.dst == reg) {
+        return &inst;
+      }
+    }
+    return nullptr;
+  }
+
+  inline size_t reduce_multiplies(const IrLoop& loop)
+  {
+    std::vector<Induction> inductions = find_inductions(loop);
+    if (inductions.empty()) {
+      return 0;
+    }
+    std::vector<Reduced> reduced;
+    auto reduce = [&](const Induction& iv, const IrValue& factor) -> const Reduced& {
+      for (const Reduced& r : reduced) {
+        if (r.base == iv.phi && r.factor == factor) {
+          return r;
+        }
+      }
+      // phi starts at init * factor and goes up by step * factor, both computed once in the preheader
+      Vreg init = new_vreg(loop.preheader);
+      add_to_preheader(loop, { .op = IrOp::bin, .bin = BinOp::mul, .dst = init, .a = iv.init, .b = factor });
+      Vreg step = new_vreg(loop.preheader);
+      add_to_preheader(loop, { .op = IrOp::bin, .bin = BinOp::mul, .dst = step, .a = iv.step, .b = factor });
+      Reduced r { .base = iv.phi, .factor = factor, .phi = new_vreg(loop.header), .next = new_vreg(m_def_block[iv.next]) };
+      IrBlock& header = m_fn.blocks[loop.header];
+      IrInst phi { .op = IrOp::phi, .dst = r.phi };
+      for (BlockId pred : header.preds) {
+        phi.args.push_back(IrValue::of_reg(pred == loop.preheader ? init : r.next));
+      }
+      header.insts.insert(header.insts.begin(), std::move(phi));
+      std::vector<IrInst>& insts = m_fn.blocks[m_def_block[iv.next]].insts;
+      auto after = std::find_if(insts.begin(), insts.end(), [&](const IrInst& inst) { return inst.dst == iv.next; }) + 1;
+      insts.insert(after, { .op = IrOp::bin, .bin = iv.op, .dst = r.next, .a = IrValue::of_reg(r.phi), .b = IrValue::of_reg(step) });
+      reduced.push_back(r);
+      return reduced.back();
+    };
+
+    // Collect first: making a new induction variable inserts instructions into the blocks being looked at
+    struct Multiply {
+      BlockId block;
+      Vreg dst;
+      size_t induction;
+      bool of_next; // multiplies Induction::next rather than the phi
+      IrValue factor;
+    };
+    std::vector<Multiply> multiplies;
+    for (BlockId id : loop.blocks) {
+      for (const IrInst& inst : m_fn.blocks[id].insts) {
+        if (inst.op != IrOp::bin || inst.bin != BinOp::mul) {
+          continue;
+        }
+        bool found = false;
+        for (size_t i = 0; i < inductions.size() && !found; i++) {
+          const Induction& iv = inductions[i];
+          for (auto [var, factor] : { std::pair { inst.a, inst.b }, std::pair { inst.b, inst.a } }) {
+            bool of_next = var == IrValue::of_reg(iv.next);
+            if ((of_next || var == IrValue::of_reg(iv.phi)) && is_invariant(loop, factor)) {
+              multiplies.push_back({ id, inst.dst, i, of_next, factor });
+              found = true;
+              break;
+            }
+          }
+        }
+      }
+    }
+    for (const Multiply& multiply : multiplies) {
+      const Reduced& r = reduce(inductions[multiply.induction], multiply.factor);
+      IrValue value = IrValue::of_reg(multiply.of_next ? r.next : r.phi);
+      for (IrInst& inst : m_fn.blocks[multiply.block].insts) {
+        if (inst.dst == multiply.dst) {
+          inst = { .op = IrOp::mov, .dst = multiply.dst, .a = value };
+          break;
+        }
+      }
+    }
+    return multiplies.size();
+  }
+
+  IrFunction& m_fn;
+  std::vector<BlockId> m_def_block {}; // by vreg, no_block for the ones nothing defines
+};
+
+inline size_t optimize_loops(IrFunction& fn)
+{
+  return LoopOptimizer(fn).run();
+}
@@ -0,0 +1,598 @@
+// This file lowers the AST to the IR in ir.hpp, one IrFunction for the main program and one per function definition.
+// Every `let` gets a fresh vreg that the variable keeps for its whole lifetime, assignments write to it again. Expressions have no side
+// effects on variables, so an identifier is used directly as an operand instead of being copied first.
+// if / while / for and the && / || operators become branches between basic blocks, a condition made of && and || branches on each of
+// its sides in turn. An else if chain comparing one variable against constants becomes a binary search over them. Code after a `return`
+// or `exit` lands in a fresh block nothing jumps to, build_ssa drops those.
+// Loops come out rotated: the condition is tested once in front of the loop and again at the bottom of the body, so an iteration takes one
+// conditional branch back instead of a jump to a test at the top. The test in front leads to a preheader, an empty block that is the only
+// way into the loop from outside, where loops.hpp puts what it hoists.
+// A function that returns a call of itself (see tail_calls.hpp) gets its body in a block of its own: the tail calls assign the parameters
+// and jump there, so the recursion is a loop like any other and the entry block, with the params, is its preheader.
+// With -fprofile the functions, loops and ifs get IrOp::profile instructions at the same points the Generator puts its counters, a loop
+// is entered in front of its first test and left at the top of the block after it.
+// The errors are the ones Generator reports, so -O2 rejects exactly the programs -O0 and -O1 reject.
+
+#pragma once
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "./ast.hpp"
+#include "./error.hpp"
+#include "./interner.hpp"
+#include "./ir.hpp"
+#include "./profile.hpp"
+#include "./runtime.hpp"
+#include "./switches.hpp"
+#include "./symbol_table.hpp"
+#include "./tail_calls.hpp"
+
+class IrLowering {
+public:
+  // `profile` is CodegenOptions::profile: where the executable writes its profile, empty to build it without counters
+  inline IrLowering(const NodeProg& prog, const Interner& interner, std::string profile = {})
+    : m_prog(prog)
+    , m_interner(interner)
+  {
+    if (!profile.empty()) {
+      m_module.profile = profile_table(prog, interner, std::move(profile));
+    }
+  }
+
+  [[nodiscard]] inline IrModule lower()
+  {
+    // Every function can be called from anywhere, so they are all declared before lowering any code. functions[0] is the main program
+    m_module.uses_print = program_prints(m_prog);
+    m_module.functions.emplace_back();
+    for (const Node& node : m_prog.nodes) {
+      if (node.kind != NodeKind::func_def) {
+        continue;
+      }
+      auto arity = static_cast<uint32_t>(m_prog.list(node.b).size());
+      if (!m_functions.declare(node.a, { .index = static_cast<uint32_t>(m_module.functions.size()), .arity = arity })) {
+        compile_error("Function already defined: ", m_interner.name(node.a));
+      }
+      m_module.functions.push_back({ .name = node.a, .param_count = arity });
+    }
+
+    begin_function(m_module.functions[0], m_prog.root);
+    profile(0, ProfileEvent::enter); // never left, hydro_profile_exit closes it
+    for (NodeIndex stmt : m_prog.list(m_prog[m_prog.root].a)) {
+      lower_stmt(stmt);
+    }
+    terminate({ .op = IrOp::exit, .a = IrValue::of_imm(0) });
+    end_function();
+
+    size_t next = 1;
+    for (NodeIndex index = 0; index < m_prog.nodes.size(); index++) {
+      if (m_prog[index].kind == NodeKind::func_def) {
+        lower_func_def(index, m_module.functions[next++]);
+      }
+    }
+    return std::move(m_module);
+  }
+
+private:
+  struct Var {
+    Vreg reg;
+    bool is_string = false; // initialised with a string, print writes it as text
+  };
+
+  struct FuncInfo {
+    uint32_t index; // in IrModule::functions
+    uint32_t arity;
+  };
+
+  // `unit` is its node, the prog node for the main program or its func_def
+  inline void begin_function(IrFunction& fn, NodeIndex unit)
+  {
+    m_fn = &fn;
+    m_block = fn.new_block();
+    m_vars = {};
+    if (m_module.profile.has_value()) {
+      m_profile_sites.clear();
+      std::vector<ProfileSite> sites = unit_profile_sites(m_prog, unit);
+      for (uint32_t i = 0; i < sites.size(); i++) {
+        m_profile_sites.emplace(sites[i].node, i);
+      }
+    }
+  }
+
+  inline void profile(uint32_t site, ProfileEvent event)
+  {
+    if (m_module.profile.has_value()) {
+      emit({ .op = IrOp::profile, .a = IrValue::of_imm(static_cast<int64_t>(event)), .index = site });
+    }
+  }
+
+  // A return or a tail call leaves the loops it is in, innermost first
+  inline void profile_leave_loops()
+  {
+    for (size_t i = m_open_loops.size(); i-- > 0;) {
+      profile(m_open_loops[i], ProfileEvent::leave);
+    }
+  }
+
+  inline void lower_func_def(NodeIndex index, IrFunction& fn)
+  {
+    const Node& func_def = m_prog[index];
+    begin_function(fn, index);
+    m_in_function = true;
+    m_function = func_def.a;
+    m_recursion = find_self_recursion(m_prog, func_def);
+    m_params.clear();
+    std::span<const uint32_t> params = m_prog.list(func_def.b);
+    for (uint32_t i = 0; i < params.size(); i++) {
+      Vreg reg = fn.new_vreg();
+      emit({ .op = IrOp::param, .dst = reg, .index = i });
+      if (!m_vars.declare(params[i], { .reg = reg })) {
+        compile_error("Duplicate parameter: ", m_interner.name(params[i]));
+      }
+      m_params.push_back(reg);
+    }
+    if (m_recursion.accumulator.has_value()) {
+      m_accumulator = fn.new_vreg();
+      emit({ .op = IrOp::mov, .dst = m_accumulator, .a = IrValue::of_imm(accumulator_identity(m_recursion.accumulator.value())) });
+    }
+    profile(0, ProfileEvent::enter);
+    // Self tail calls jump back to the body, which makes it a loop with the entry block as its preheader
+    if (m_recursion.has_tail_calls) {
+      m_body_block = m_fn->new_block();
+      jump(m_body_block);
+      set_block(m_body_block);
+    }
+    lower_scope(func_def.c);
+
+    // Falling off the end of a function returns 0
+    IrValue result = accumulate(IrValue::of_imm(0));
+    profile(0, ProfileEvent::leave);
+    terminate({ .op = IrOp::ret, .a = result });
+    end_function();
+    m_in_function = false;
+  }
+
+  // A return value of a function with an accumulator is combined with it, see tail_calls.hpp
+  inline IrValue accumulate(IrValue value)
+  {
+    if (!m_recursion.accumulator.has_value()) {
+      return value;
+    }
+    Vreg reg = m_fn->new_vreg();
+    emit({ .op = IrOp::bin, .bin = m_recursion.accumulator.value(), .dst = reg, .a = IrValue::of_reg(m_accumulator), .b = value });
+    return IrValue::of_reg(reg);
+  }
+
+  // `return f(...)` inside f (or `return x * f(...)`, x goes into the accumulator): the arguments are written to the parameters and the
+  // body starts over. They are all evaluated and copied first, an argument can read a parameter that another one replaces
+  inline void lower_tail_call(const SelfReturn& ret)
+  {
+    const Node& func_call = m_prog[ret.call];
+    std::span<const uint32_t> args = m_prog.list(func_call.b);
+    check_call(func_call);
+    bool accumulates = ret.kind == SelfReturn::Kind::accumulate;
+    IrValue other;
+    if (accumulates && !ret.call_first) {
+      other = lower_expr(ret.other);
+    }
+    std::vector<IrValue> values(args.size());
+    for (size_t i = args.size(); i-- > 0;) {
+      values[i] = lower_expr(args[i]);
+    }
+    if (accumulates && ret.call_first) {
+      other = lower_expr(ret.other);
+    }
+    for (IrValue& value : values) {
+      if (value.is_reg()) {
+        Vreg copy = m_fn->new_vreg();
+        emit({ .op = IrOp::mov, .dst = copy, .a = value });
+        value = IrValue::of_reg(copy);
+      }
+    }
+    if (accumulates) {
+      emit({ .op = IrOp::mov, .dst = m_accumulator, .a = accumulate(other) });
+    }
+    for (size_t i = 0; i < values.size(); i++) {
+      emit({ .op = IrOp::mov, .dst = m_params[i], .a = values[i] });
+    }
+    // Still the same activation, it only counts as another call
+    profile_leave_loops();
+    profile(0, ProfileEvent::primary);
+    jump(m_body_block);
+  }
+
+  // The last terminate() opened a block for code that never came, drop it so every block ends in a terminator
+  inline void end_function()
+  {
+    assert(m_fn->blocks[m_block].insts.empty() && m_block == m_fn->blocks.size() - 1);
+    m_fn->blocks.pop_back();
+    m_block = no_block;
+  }
+
+  inline void emit(IrInst inst)
+  {
+    m_fn->blocks[m_block].insts.push_back(std::move(inst));
+  }
+
+  // End the current block. Whatever comes next goes in a new block, unreachable unless someone jumps to it with set_block
+  inline void terminate(IrInst inst)
+  {
+    assert(inst.is_terminator());
+    emit(std::move(inst));
+    m_block = m_fn->new_block();
+  }
+
+  inline void jump(BlockId target)
+  {
+    terminate({ .op = IrOp::jmp, .target = { target, no_block } });
+  }
+
+  inline void branch(IrValue cond, BlockId if_true, BlockId if_false)
+  {
+    terminate({ .op = IrOp::br, .a = cond, .target = { if_true, if_false } });
+  }
+
+  // Continue in `block`. The current block must already be terminated, which terminate() leaves as an empty block
+  inline void set_block(BlockId block)
+  {
+    assert(m_fn->blocks[m_block].insts.empty());
+    m_fn->blocks.pop_back();
+    assert(m_block == m_fn->blocks.size());
+    m_block = block;
+  }
+
+  inline const Var& lookup_var(SymbolId name)
+  {
+    const Var* var = m_vars.lookup(name);
+    if (var == nullptr) {
+      compile_error("Undeclared identifier: ", m_interner.name(name));
+    }
+    return *var;
+  }
+
+  inline bool is_string_expression(NodeIndex expr)
+  {
+    const Node& node = m_prog[expr];
+    if (node.kind == NodeKind::string_lit) {
+      return true;
+    }
+    if (node.kind == NodeKind::ident) {
+      return lookup_var(node.a).is_string;
+    }
+    return false;
+  }
+
+  inline IrValue lower_expr(NodeIndex expr)
+  {
+    const Node& node = m_prog[expr];
+    switch (node.kind) {
+    case NodeKind::int_lit:
+      return IrValue::of_imm(node.int_value());
+    case NodeKind::bool_lit:
+      return IrValue::of_imm(node.a);
+    case NodeKind::string_lit: {
+      // Identical literals share one entry of the module's string pool
+      Vreg reg = m_fn->new_vreg();
+      auto [string, added] = m_string_ids.emplace(m_prog.string(node), static_cast<uint32_t>(m_module.strings.size()));
+      if (added) {
+        m_module.strings.emplace_back(m_prog.string(node));
+      }
+      emit({ .op = IrOp::lea_str, .dst = reg, .index = string->second });
+      return IrValue::of_reg(reg);
+    }
+    case NodeKind::ident:
+      return IrValue::of_reg(lookup_var(node.a).reg);
+    case NodeKind::bin_expr: {
+      if (node.op == BinOp::and_ || node.op == BinOp::or_) {
+        return lower_logical(expr);
+      }
+      IrValue lhs = lower_expr(node.a);
+      IrValue rhs = lower_expr(node.b);
+      Vreg reg = m_fn->new_vreg();
+      emit({ .op = IrOp::bin, .bin = node.op, .dst = reg, .a = lhs, .b = rhs });
+      return IrValue::of_reg(reg);
+    }
+    case NodeKind::func_call:
+      return lower_func_call(node);
+    default:
+      assert(false); // Unreachable, not an expression
+      return {};
+    }
+  }
+
+  // a && b: b is only evaluated when a is true. The result is written on both paths, in SSA form it becomes a phi
+  inline IrValue lower_logical(NodeIndex expr)
+  {
+    Vreg result = m_fn->new_vreg();
+    BlockId true_block = m_fn->new_block();
+    BlockId false_block = m_fn->new_block();
+    BlockId end_block = m_fn->new_block();
+    lower_cond(expr, true_block, false_block);
+
+    set_block(true_block);
+    emit({ .op = IrOp::mov, .dst = result, .a = IrValue::of_imm(1) });
+    jump(end_block);
+
+    set_block(false_block);
+    emit({ .op = IrOp::mov, .dst = result, .a = IrValue::of_imm(0) });
+    jump(end_block);
+
+    set_block(end_block);
+    return IrValue::of_reg(result);
+  }
+
+  // Branch to `if_true` or `if_false` on the condition `expr`. && and || branch on each side in turn, straight to the block the side
+  // decides, so no 0 / 1 is made of them on the way. A comparison branches on itself, IrEmitter fuses the two into cmp and jcc
+  inline void lower_cond(NodeIndex expr, BlockId if_true, BlockId if_false)
+  {
+    const Node& node = m_prog[expr];
+    if (node.kind == NodeKind::bin_expr && (node.op == BinOp::and_ || node.op == BinOp::or_)) {
+      BlockId rhs_block = m_fn->new_block();
+      bool is_and = node.op == BinOp::and_;
+      lower_cond(node.a, is_and ? rhs_block : if_true, is_and ? if_false : rhs_block);
+      set_block(rhs_block);
+      lower_cond(node.b, if_true, if_false);
+      return;
+    }
+    branch(lower_expr(expr), if_true, if_false);
+  }
+
+  inline const FuncInfo& check_call(const Node& func_call)
+  {
+    const FuncInfo* func = m_functions.lookup(func_call.a);
+    if (func == nullptr) {
+      compile_error("Undeclared function: ", m_interner.name(func_call.a));
+    }
+    if (func->arity != m_prog.list(func_call.b).size()) {
+      compile_error("Function ", m_interner.name(func_call.a), " expects ", func->arity, " arguments");
+    }
+    return *func;
+  }
+
+  inline IrValue lower_func_call(const Node& func_call)
+  {
+    const FuncInfo* func = &check_call(func_call);
+    std::span<const uint32_t> args = m_prog.list(func_call.b);
+
+    // The arguments are evaluated last to first, like the stack machine pushes them
+    IrInst call { .op = IrOp::call, .dst = m_fn->new_vreg(), .index = func->index, .args = std::vector<IrValue>(args.size()) };
+    for (size_t i = args.size(); i-- > 0;) {
+      call.args[i] = lower_expr(args[i]);
+    }
+    Vreg result = call.dst;
+    emit(std::move(call));
+    return IrValue::of_reg(result);
+  }
+
+  inline void lower_scope(NodeIndex scope)
+  {
+    m_vars.begin_scope();
+    for (NodeIndex stmt : m_prog.list(m_prog[scope].a)) {
+      lower_stmt(stmt);
+    }
+    m_vars.end_scope();
+  }
+
+  // An if / else if chain on one variable, see switches.hpp. The IR only branches two ways, so the cases are found with a binary search
+  // on the variable, dense or not
+  inline void lower_switch(const SwitchChain& chain)
+  {
+    IrValue var = IrValue::of_reg(lookup_var(chain.var).reg);
+    std::vector<BlockId> case_blocks;
+    for (size_t i = 0; i < chain.cases.size(); i++) {
+      case_blocks.push_back(m_fn->new_block());
+    }
+    BlockId default_block = m_fn->new_block();
+    BlockId end_block = m_fn->new_block();
+    lower_switch_search(chain, var, case_blocks, 0, chain.cases.size(), default_block);
+
+    set_block(default_block);
+    if (chain.otherwise != null_node) {
+      lower_stmt(chain.otherwise);
+    }
+    jump(end_block);
+    for (size_t i = 0; i < chain.cases.size(); i++) {
+      set_block(case_blocks[i]);
+      lower_scope(chain.cases[i].body);
+      jump(end_block);
+    }
+    set_block(end_block);
+  }
+
+  // Branch to the block of the case among [begin, end) that `var` is equal to, or to `default_block`. A few compares in a row once the
+  // range is small
+  inline void lower_switch_search(const SwitchChain& chain, IrValue var, const std::vector<BlockId>& case_blocks, size_t begin,
+    size_t end, BlockId default_block)
+  {
+    auto compare = [&](BinOp op, int64_t value) {
+      Vreg cond = m_fn->new_vreg();
+      emit({ .op = IrOp::bin, .bin = op, .dst = cond, .a = var, .b = IrValue::of_imm(value) });
+      return IrValue::of_reg(cond);
+    };
+    if (end - begin <= 3) {
+      for (size_t i = begin; i < end; i++) {
+        BlockId next_block = m_fn->new_block();
+        branch(compare(BinOp::eq, chain.cases[i].value), case_blocks[i], next_block);
+        set_block(next_block);
+      }
+      jump(default_block);
+      return;
+    }
+    size_t middle = begin + (end - begin) / 2;
+    BlockId lower_block = m_fn->new_block();
+    BlockId upper_block = m_fn->new_block();
+    branch(compare(BinOp::lt, chain.cases[middle].value), lower_block, upper_block);
+    set_block(lower_block);
+    lower_switch_search(chain, var, case_blocks, begin, middle, default_block);
+    set_block(upper_block);
+    lower_switch_search(chain, var, case_blocks, middle, end, default_block);
+  }
+
+  // A while loop, or a for loop once its init has run (`iteration` is null_node for while). The condition is lowered twice, in front of
+  // the loop and at the bottom, it has no side effects beyond its calls and each copy runs when the one test it replaces would have
+  inline void lower_loop(NodeIndex loop, NodeIndex cond, NodeIndex scope, NodeIndex iteration)
+  {
+    BlockId preheader = m_fn->new_block();
+    BlockId body = m_fn->new_block();
+    BlockId end_block = m_fn->new_block();
+    uint32_t site = m_module.profile.has_value() ? m_profile_sites.at(loop) : 0;
+    profile(site, ProfileEvent::enter);
+    lower_cond(cond, preheader, end_block);
+
+    set_block(preheader);
+    jump(body);
+
+    set_block(body);
+    profile(site, ProfileEvent::secondary);
+    m_open_loops.push_back(site);
+    lower_scope(scope);
+    if (iteration != null_node) {
+      lower_stmt(iteration);
+    }
+    m_open_loops.pop_back();
+    lower_cond(cond, body, end_block);
+    set_block(end_block);
+    profile(site, ProfileEvent::leave);
+  }
+
+  inline void lower_stmt(NodeIndex index)
+  {
+    const Node& stmt = m_prog[index];
+    switch (stmt.kind) {
+    case NodeKind::stmt_exit:
+      terminate({ .op = IrOp::exit, .a = lower_expr(stmt.a) });
+      break;
+
+    case NodeKind::stmt_let: {
+      // The variable is declared after its initialiser, `let x = x + 1` reads the outer x
+      bool is_string = is_string_expression(stmt.b);
+      IrValue value = lower_expr(stmt.b);
+      Vreg reg = m_fn->new_vreg();
+      emit({ .op = IrOp::mov, .dst = reg, .a = value });
+      if (!m_vars.declare(stmt.a, { .reg = reg, .is_string = is_string })) {
+        compile_error("Identifier already used: ", m_interner.name(stmt.a));
+      }
+      break;
+    }
+
+    case NodeKind::stmt_assign: {
+      Vreg reg = lookup_var(stmt.a).reg;
+      emit({ .op = IrOp::mov, .dst = reg, .a = lower_expr(stmt.b) });
+      break;
+    }
+
+    case NodeKind::stmt_expr:
+      lower_expr(stmt.a);
+      break;
+
+    case NodeKind::scope:
+      lower_scope(index);
+      break;
+
+    case NodeKind::func_def:
+      // lowered into its own IrFunction, see lower()
+      break;
+
+    case NodeKind::stmt_return: {
+      if (!m_in_function) {
+        compile_error("return outside of a function");
+      }
+      if (SelfReturn ret = classify_return(m_prog, m_function, stmt.a); m_recursion.uses(ret)) {
+        lower_tail_call(ret);
+        break;
+      }
+      IrValue result = accumulate(lower_expr(stmt.a));
+      profile_leave_loops();
+      profile(0, ProfileEvent::leave);
+      terminate({ .op = IrOp::ret, .a = result });
+      break;
+    }
+
+    case NodeKind::stmt_if: {
+      // A chain searched in one go would skip the counters of the ifs it jumps over
+      bool profiled = m_module.profile.has_value();
+      std::optional<SwitchChain> chain = profiled ? std::nullopt : find_switch_chain(m_prog, index);
+      if (chain.has_value()) {
+        lower_switch(chain.value());
+        break;
+      }
+      uint32_t site = profiled ? m_profile_sites.at(index) : 0;
+      BlockId then_block = m_fn->new_block();
+      BlockId else_block = m_fn->new_block();
+      BlockId end_block = stmt.c == null_node && !profiled ? else_block : m_fn->new_block();
+      lower_cond(stmt.a, then_block, else_block);
+
+      set_block(then_block);
+      profile(site, ProfileEvent::primary);
+      lower_scope(stmt.b);
+      jump(end_block);
+      if (else_block != end_block) {
+        set_block(else_block);
+        profile(site, ProfileEvent::secondary);
+        if (stmt.c != null_node) {
+          lower_stmt(stmt.c); // a scope, or the next if of an else if chain
+        }
+        jump(end_block);
+      }
+      set_block(end_block);
+      break;
+    }
+
+    case NodeKind::stmt_while:
+      lower_loop(index, stmt.a, stmt.b, null_node);
+      break;
+
+    case NodeKind::stmt_for: {
+      std::span<const uint32_t> parts = m_prog.list(stmt.a); // init, condition, iteration, scope
+
+      // The loop variable lives in a scope around the whole loop
+      m_vars.begin_scope();
+      if (parts[0] != null_node) {
+        lower_stmt(parts[0]);
+      }
+      lower_loop(index, parts[1], parts[3], parts[2]);
+      m_vars.end_scope();
+      break;
+    }
+
+    case NodeKind::stmt_print:
+      if (m_prog[stmt.a].kind == NodeKind::string_lit) {
+        IrValue length = IrValue::of_imm(static_cast<int64_t>(string_literal_length(m_prog.string(m_prog[stmt.a]))));
+        emit({ .op = IrOp::print_str, .a = lower_expr(stmt.a), .b = length });
+      }
+      else if (is_string_expression(stmt.a)) {
+        emit({ .op = IrOp::print_str, .a = lower_expr(stmt.a) });
+      }
+      else {
+        emit({ .op = IrOp::print_int, .a = lower_expr(stmt.a) });
+      }
+      break;
+
+    default:
+      assert(false); // Unreachable, not a statement
+    }
+  }
+
+  const NodeProg& m_prog;
+  const Interner& m_interner;
+  IrModule m_module {};
+  std::unordered_map<std::string_view, uint32_t> m_string_ids {}; // index in m_module.strings by raw text
+  ScopedSymbolTable<FuncInfo> m_functions {}; // every function in the program, by interned name
+
+  // The function being lowered
+  IrFunction* m_fn = nullptr;
+  BlockId m_block = no_block; // where instructions go
+  ScopedSymbolTable<Var> m_vars {};
+  bool m_in_function = false;
+  SymbolId m_function = 0; // the function being lowered, when m_in_function
+  SelfRecursion m_recursion {}; // how its returns call it
+  std::vector<Vreg> m_params {}; // the vreg of each parameter
+  Vreg m_accumulator = no_vreg; // with SelfRecursion::accumulator
+  BlockId m_body_block = no_block; // where a self tail call jumps to
+  std::unordered_map<NodeIndex, uint32_t> m_profile_sites {}; // -fprofile: its sites by node, see unit_profile_sites
+  std::vector<uint32_t> m_open_loops {}; // -fprofile: the sites of the loops around the statement being lowered, outermost first
+};
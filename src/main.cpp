@@ -1,61 +1,351 @@
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <optional>
-#include <sstream>
-#include <vector>
+#include <set>
 #include <string>
-#include "./generation.hpp"
+#include <string_view>
+#include <vector>
+#include "./driver.hpp"
+#include "./parallel.hpp"
+#include "./profile.hpp"
+#include "./server.hpp"
+#include "./timing.hpp"
 
-int main(int argc, char* argv[]){
-  std::string file_name = argv[1];
-  bool is_hydro_file = false;
-  if (file_name.substr(file_name.find_last_of(".") + 1) == "hy") {
-    is_hydro_file = true;
+static constexpr const char* usage
+  = "hydro [-O0 | -O1 | -O2] [--dump-ir] [--nasm] [-v | --verbose] [--inline-threshold=N | --no-inline]\n"
+    "      [--codegen-threads=N] [-j N] [-o <output>] [-fprofile[=PATH]] [-march=x86-64|x86-64-v3|native] [-fno-vectorize]\n"
+    "      [--cache-dir=DIR | --no-cache] [--cache-size=N[K|M|G]] [--cache-eviction=lru|fifo]\n"
+    "      [--time-report[=text|json]] [--time-report-file=PATH] <input.hy>...\n"
+    "hydro --show-profile=FILE\n"
+    "hydro --server=SOCKET\n"
+    "hydro --connect=SOCKET <arguments for the server>";
+
+// A count argument: threads (0 for one per hardware thread) or the inline threshold
+static bool parse_count(std::string_view text, unsigned& count)
+{
+  auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), count);
+  return !text.empty() && ec == std::errc() && end == text.data() + text.size();
+}
+
+// A size in bytes, with an optional K, M or G suffix
+static bool parse_size(std::string_view text, uint64_t& size)
+{
+  int shift = 0;
+  if (!text.empty() && (text.back() == 'K' || text.back() == 'M' || text.back() == 'G')) {
+    shift = text.back() == 'K' ? 10 : text.back() == 'M' ? 20 : 30;
+    text.remove_suffix(1);
   }
-  else {
-    is_hydro_file = false;
-    std::cerr << "Incorrect file type. File type must be .hy" << std::endl;
-    std::cerr << "Correct usage is..." << std::endl;
-    std::cerr << "hydro <input.hy>" << std::endl;
+  auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), size);
+  if (text.empty() || ec != std::errc() || end != text.data() + text.size() || size > (UINT64_MAX >> shift)) {
+    return false;
+  }
+  size <<= shift;
+  return true;
+}
+
+// One compile command line, `args` without the program name. Everything it prints goes to `out` and `err`, so the compile server (see
+// server.hpp) can run it for a client and send the output back. Relative paths are relative to `cwd` (the process's working directory
+// if it is empty): the server runs many clients' command lines at once and can't change directory for each of them. The server also keeps
+// its caches in `caches` from one command line to the next, without it the cache is opened for this one only
+static int run(const std::string& cwd, const std::vector<std::string>& args, std::ostream& out, std::ostream& err,
+  CompileCaches* caches = nullptr)
+{
+  auto resolve = [&cwd](const std::string& path) { return path.empty() ? path : (std::filesystem::path(cwd) / path).string(); };
+  CompileOptions options;
+  // The cache is off unless it has somewhere to live: --cache-dir, or HYDRO_CACHE_DIR in the environment
+  CacheOptions cache_options;
+  if (const char* dir = std::getenv("HYDRO_CACHE_DIR"); dir != nullptr) {
+    cache_options.dir = resolve(dir);
+  }
+  unsigned jobs = 1; // files compiled at the same time
+  std::optional<std::string> output;
+  // --time-report: per file phase times and sizes, once everything is compiled. On stderr unless --time-report-file says where
+  enum class ReportFormat : uint8_t { none, text, json };
+  ReportFormat report_format = ReportFormat::none;
+  std::optional<std::string> report_path;
+  // -fprofile: the executables count what runs and write it to PATH, or next to themselves as <output>.prof (see profile.hpp)
+  bool profile = false;
+  std::optional<std::string> profile_path;
+  std::optional<std::string> show_profile;
+  bool vectorize = true; // -fno-vectorize wins over any -march
+  std::vector<std::string> inputs;
+  for (size_t i = 0; i < args.size(); i++) {
+    const std::string& arg = args[i];
+    if (arg == "-O0" || arg == "-O1" || arg == "-O2") {
+      options.codegen.opt_level = arg[2] - '0';
+    }
+    else if (arg == "--dump-ir") {
+      options.dump_ir = true;
+    }
+    else if (arg == "--nasm") {
+      options.use_nasm = true;
+    }
+    else if (arg == "-v" || arg == "--verbose") {
+      options.verbose = true;
+    }
+    else if (arg.starts_with("--inline-threshold=")) {
+      // Functions whose body is at most this many nodes are inlined into their callers, 0 turns it off
+      std::string_view threshold = std::string_view(arg).substr(arg.find('=') + 1);
+      if (!parse_count(threshold, options.inline_threshold)) {
+        err << "Invalid inline threshold " << threshold << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    else if (arg == "--no-inline") {
+      options.inline_threshold = 0;
+    }
+    else if (arg.starts_with("--codegen-threads=")) {
+      // Function bodies are generated on this many threads, 0 for one per hardware thread
+      std::string_view count = std::string_view(arg).substr(arg.find('=') + 1);
+      if (!parse_count(count, options.codegen.threads)) {
+        err << "Invalid thread count " << count << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    else if (arg.starts_with("-j")) {
+      // -j N or -jN
+      std::string_view count = arg.size() > 2 ? std::string_view(arg).substr(2) : i + 1 < args.size() ? std::string_view(args[++i]) : "";
+      if (!parse_count(count, jobs)) {
+        err << "Invalid job count " << count << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    else if (arg == "-o") {
+      if (i + 1 == args.size()) {
+        err << "-o needs an output path" << std::endl;
+        return EXIT_FAILURE;
+      }
+      output = resolve(args[++i]);
+    }
+    else if (arg.starts_with("--cache-dir=")) {
+      cache_options.dir = resolve(arg.substr(arg.find('=') + 1));
+    }
+    else if (arg == "--no-cache") {
+      cache_options.dir.clear();
+    }
+    else if (arg.starts_with("--cache-size=")) {
+      std::string_view size = std::string_view(arg).substr(arg.find('=') + 1);
+      if (!parse_size(size, cache_options.max_bytes)) {
+        err << "Invalid cache size " << size << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    else if (arg == "--cache-eviction=lru" || arg == "--cache-eviction=fifo") {
+      cache_options.eviction = arg.ends_with("lru") ? CacheOptions::Eviction::lru : CacheOptions::Eviction::fifo;
+    }
+    else if (arg == "--time-report" || arg == "--time-report=text") {
+      report_format = ReportFormat::text;
+    }
+    else if (arg == "--time-report=json") {
+      report_format = ReportFormat::json;
+    }
+    else if (arg.starts_with("--time-report-file=")) {
+      report_path = resolve(arg.substr(arg.find('=') + 1));
+    }
+    else if (arg == "-fprofile") {
+      profile = true;
+    }
+    else if (arg.starts_with("-fprofile=")) {
+      profile = true;
+      std::string path = arg.substr(arg.find('=') + 1);
+      if (path.empty()) {
+        err << "-fprofile= needs a path" << std::endl;
+        return EXIT_FAILURE;
+      }
+      profile_path = resolve(path);
+    }
+    else if (arg == "-march=x86-64" || arg == "-march=x86-64-v2" || arg == "-march=sse2") {
+      // What the loops -O2 vectorises run on: SSE2 by default, which every x86-64 has, AVX2 only when the executable is for one that has it
+      options.vector_isa = VectorIsa::sse2;
+    }
+    else if (arg == "-march=x86-64-v3" || arg == "-march=x86-64-v4" || arg == "-march=avx2") {
+      options.vector_isa = VectorIsa::avx2;
+    }
+    else if (arg == "-march=native") {
+      options.vector_isa = __builtin_cpu_supports("avx2") ? VectorIsa::avx2 : VectorIsa::sse2;
+    }
+    else if (arg == "-fno-vectorize") {
+      vectorize = false;
+    }
+    else if (arg.starts_with("--show-profile=")) {
+      show_profile = arg.substr(arg.find('=') + 1);
+    }
+    else if (arg.starts_with("-")) {
+      err << "Unknown option " << arg << std::endl;
+      return EXIT_FAILURE;
+    }
+    else {
+      inputs.push_back(arg);
+    }
+  }
+  if (!vectorize) {
+    options.vector_isa = VectorIsa::none;
+  }
+
+  // Print a profile an executable built with -fprofile wrote, instead of compiling
+  if (show_profile.has_value()) {
+    if (!inputs.empty()) {
+      err << "--show-profile takes no input files" << std::endl;
+      return EXIT_FAILURE;
+    }
+    std::optional<std::vector<ProfileEntry>> entries = read_profile(resolve(show_profile.value()));
+    if (!entries.has_value()) {
+      err << "Not a profile hydro can read: " << show_profile.value() << std::endl;
+      return EXIT_FAILURE;
+    }
+    print_profile(out, entries.value());
+    return EXIT_SUCCESS;
   }
 
-  if (argc != 2){
-    std::cerr << "Incorrect usage. Correct usage is..." << std::endl;
-    std::cerr << "hydro <input.hy>" << std::endl;
+  if (inputs.empty()){
+    err << "Incorrect usage. Correct usage is..." << std::endl;
+    err << usage << std::endl;
     return EXIT_FAILURE;
   }
 
-  std::string contents;
-  {
-    // Reading the file to compile
-    std::stringstream contents_stream;
-    std::fstream input(argv[1], std::ios::in);
-    contents_stream << input.rdbuf();
-    contents = contents_stream.str();
+  for (const std::string& file_name : inputs) {
+    if (file_name.substr(file_name.find_last_of(".") + 1) != "hy") {
+      err << "Incorrect file type. File type must be .hy: " << file_name << std::endl;
+      err << "Correct usage is..." << std::endl;
+      err << usage << std::endl;
+      return EXIT_FAILURE;
+    }
   }
-  
-  //Start lexing the file
-  Tokenizer tokenizer(std::move(contents));
-  std::vector<Token> tokens = tokenizer.tokenize();
 
-  Parser parser(std::move(tokens));
-  std::optional<NodeProg> prog = parser.parse_prog();
+  // Where each executable goes. A single file builds `out` (or the -o path), like it always has. In a batch every file gets its own
+  // executable named after it, next to the source or in the -o directory, so files never overwrite each other's output
+  std::vector<std::string> outputs;
+  if (inputs.size() == 1) {
+    outputs.push_back(output.value_or(resolve("out")));
+  }
+  else {
+    if (output.has_value() && !std::filesystem::is_directory(output.value())) {
+      err << "With several input files, -o has to be a directory: " << output.value() << std::endl;
+      return EXIT_FAILURE;
+    }
+    std::set<std::string> seen;
+    for (const std::string& input : inputs) {
+      std::filesystem::path path(resolve(input));
+      path.replace_extension();
+      if (output.has_value()) {
+        path = std::filesystem::path(output.value()) / path.filename();
+      }
+      if (!seen.insert(path.lexically_normal().string()).second) {
+        err << "Two input files would both be written to " << path.string() << std::endl;
+        return EXIT_FAILURE;
+      }
+      outputs.push_back(path.string());
+    }
+    if (profile_path.has_value()) {
+      err << "With several input files, -fprofile can't name one profile for all of them" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
 
-  if (!prog.has_value()) {
-    std::cerr << "Invalid program" << std::endl;
-    exit(EXIT_FAILURE);
+  // Every file is compiled on its own, any of the -j threads picks up the next one as soon as it is done with the last. A file that fails
+  // doesn't stop the others, the errors are reported per file in the order the files were given
+  std::optional<CompileCache> own_cache;
+  const CompileCache* cache = nullptr;
+  if (!cache_options.dir.empty()) {
+    cache = caches != nullptr ? &caches->get(cache_options) : &own_cache.emplace(cache_options);
   }
+  std::vector<CompileResult> results(inputs.size());
+  std::vector<std::string> errors(inputs.size());
+  std::vector<TimeReport> times(report_format != ReportFormat::none ? inputs.size() : 0);
+  parallel_for(inputs.size(), jobs, [&](size_t i) {
+    try {
+      // The executable can run from anywhere, the profile path is made absolute against where it was built
+      CompileOptions file_options = options;
+      if (profile) {
+        file_options.codegen.profile = std::filesystem::absolute(profile_path.value_or(outputs[i] + ".prof")).string();
+      }
+      results[i] = compile_file(resolve(inputs[i]), outputs[i], file_options, cache, times.empty() ? nullptr : &times[i]);
+    }
+    catch (const std::exception& error) {
+      errors[i] = error.what();
+    }
+  });
 
-  // write the assembly code to a file
-  Generator generator(prog.value());
-  {
-    std::fstream file("out.asm", std::ios::out);
-    file << generator.gen_prog();
+  // Entries are only evicted once the whole batch is in, one pass over the cache directory instead of one per file
+  if (cache != nullptr) {
+    cache->trim();
   }
 
-  // execute the assembly code
-  system("nasm -felf64 out.asm");
-  system("ld -o out out.o");
+  int failed = 0;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    if (!results[i].ir_dump.empty()) {
+      if (inputs.size() > 1) {
+        out << "; " << inputs[i] << "\n";
+      }
+      out << results[i].ir_dump;
+    }
+    if (options.verbose && errors[i].empty()) {
+      print_dead_code_report(err, inputs[i], results[i].dead_code);
+    }
+    if (!errors[i].empty()) {
+      err << inputs[i] << ": " << errors[i] << std::endl;
+      failed++;
+    }
+  }
+  if (failed > 0 && inputs.size() > 1) {
+    err << failed << " of " << inputs.size() << " files failed to compile" << std::endl;
+  }
 
-  return EXIT_SUCCESS;
-}
\ No newline at end of file
+  if (report_format != ReportFormat::none) {
+    std::ofstream report_file;
+    if (report_path.has_value()) {
+      report_file.open(report_path.value());
+      if (!report_file) {
+        err << "Could not write " << report_path.value() << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    std::ostream& report = report_path.has_value() ? report_file : err;
+    if (report_format == ReportFormat::json) {
+      print_time_report_json(report, inputs, times);
+    }
+    else {
+      print_time_report(report, inputs, times);
+    }
+  }
+  return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]){
+  // hydro [-O0 | -O1 | -O2] [--dump-ir] [--nasm] [-v | --verbose] [--inline-threshold=N | --no-inline]
+  //       [--codegen-threads=N] [-j N] [-o <output>] [-fprofile[=PATH]] [-march=x86-64|x86-64-v3|native] [-fno-vectorize]
+  //       [--cache-dir=DIR | --no-cache] [--cache-size=N[K|M|G]] [--cache-eviction=lru|fifo]
+  //       [--time-report[=text|json]] [--time-report-file=PATH] <input.hy>...
+  // hydro --show-profile=FILE
+  // hydro --server=SOCKET
+  // hydro --connect=SOCKET <the command line above>
+  std::vector<std::string> args(argv + 1, argv + argc);
+  if (!args.empty() && args.front().starts_with("--server=")) {
+    // Compile what clients send until killed. The server's own environment doesn't decide the cache, the client's does (below)
+    if (args.size() > 1) {
+      std::cerr << "--server takes no other arguments" << std::endl;
+      return EXIT_FAILURE;
+    }
+    std::string error;
+    CompileCaches caches; // alive as long as the server, so compiles find their caches warm
+    auto handle = [&caches](const std::string& cwd, const std::vector<std::string>& request, std::ostream& out, std::ostream& err) {
+      return run(cwd, request, out, err, &caches);
+    };
+    serve(args.front().substr(args.front().find('=') + 1), handle, error);
+    std::cerr << error << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (!args.empty() && args.front().starts_with("--connect=")) {
+    // The rest of the command line compiles in the server, with the cache this process would have used
+    std::string socket = args.front().substr(args.front().find('=') + 1);
+    const char* dir = std::getenv("HYDRO_CACHE_DIR");
+    args.front() = dir != nullptr ? std::string("--cache-dir=") + dir : "--no-cache";
+    std::optional<int> status = request_compile(socket, args, std::cout, std::cerr);
+    return status.value_or(EXIT_FAILURE);
+  }
+  return run("", args, std::cout, std::cerr);
+}
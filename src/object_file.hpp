@@ -0,0 +1,153 @@
+// This file reads and writes the machine code of one piece of a program (an Assembler::Object) as a flat binary file, so an incremental
+// build can keep the code of every function in the cache and link it again without generating or assembling it (see incremental.hpp).
+// The layout is the object's arrays laid end to end behind a fixed header, in host byte order:
+//   ObjectFileHeader | text | rodata | data | labels (24 bytes each) | references (32 bytes each) | names
+// The records are copied out rather than read in place, the byte sections in front of them leave them unaligned.
+// The header keeps an XXH64 of the whole file (taken with that field 0): a damaged file is a miss, not wrong code in an executable.
+// A file is rejected when the magic, the version, the size implied by the header, the hash or any record is off; bump `object_file_version`
+// whenever the layout or the meaning of a record changes.
+
+#pragma once
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+#include "./assembler.hpp"
+#include "./hash.hpp"
+#include "./source.hpp"
+
+inline constexpr char object_file_magic[8] = { 'H', 'Y', 'D', 'R', 'O', 'O', 'B', 'J' };
+inline constexpr uint32_t object_file_version = 3;
+
+struct ObjectFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t text_size;
+  uint32_t rodata_size;
+  uint32_t data_size;
+  uint32_t label_count;
+  uint32_t reference_count;
+  uint32_t name_size;
+  uint32_t reserved = 0;
+  uint64_t bss_size;
+  uint64_t file_hash; // object_file_hash of the file
+};
+
+static_assert(sizeof(ObjectFileHeader) == 56);
+
+// The hash of a file with `header` in front of `payload` (everything behind the header), which goes into header.file_hash
+[[nodiscard]] inline uint64_t object_file_hash(ObjectFileHeader header, std::string_view payload)
+{
+  header.file_hash = 0;
+  return xxh64(payload, xxh64(std::string_view(reinterpret_cast<const char*>(&header), sizeof(header))));
+}
+static_assert(sizeof(Assembler::Object::Label) == 24);
+static_assert(sizeof(Assembler::Object::Reference) == 32);
+
+// Write `object` into `path`, false if the file can't be written
+inline bool write_object_file(const std::string& path, const Assembler::Object& object)
+{
+  ObjectFileHeader header {};
+  std::memcpy(header.magic, object_file_magic, sizeof(header.magic));
+  header.version = object_file_version;
+  header.text_size = static_cast<uint32_t>(object.text.size());
+  header.rodata_size = static_cast<uint32_t>(object.rodata.size());
+  header.data_size = static_cast<uint32_t>(object.data.size());
+  header.label_count = static_cast<uint32_t>(object.labels.size());
+  header.reference_count = static_cast<uint32_t>(object.references.size());
+  header.name_size = static_cast<uint32_t>(object.names.size());
+  header.bss_size = object.bss_size;
+
+  std::string payload;
+  auto append = [&payload](const void* data, size_t size) { payload.append(static_cast<const char*>(data), size); };
+  append(object.text.data(), object.text.size());
+  append(object.rodata.data(), object.rodata.size());
+  append(object.data.data(), object.data.size());
+  append(object.labels.data(), object.labels.size() * sizeof(Assembler::Object::Label));
+  append(object.references.data(), object.references.size() * sizeof(Assembler::Object::Reference));
+  payload.append(object.names);
+  header.file_hash = object_file_hash(header, payload);
+
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  auto write_all = [fd](const void* data, size_t size) {
+    auto bytes = static_cast<const char*>(data);
+    while (size > 0) {
+      ssize_t n = ::write(fd, bytes, size);
+      if (n <= 0) {
+        return false;
+      }
+      bytes += n;
+      size -= static_cast<size_t>(n);
+    }
+    return true;
+  };
+  bool ok = write_all(&header, sizeof(header)) && write_all(payload.data(), payload.size());
+  return ::close(fd) == 0 && ok;
+}
+
+// The object in `path`, an empty optional if it can't be read or isn't an object file of this version
+inline std::optional<Assembler::Object> read_object_file(const std::string& path)
+{
+  std::optional<SourceBuffer> buffer = SourceBuffer::open(path);
+  if (!buffer.has_value() || buffer->view().size() < sizeof(ObjectFileHeader)) {
+    return {};
+  }
+  const char* p = buffer->view().data();
+  ObjectFileHeader header {};
+  std::memcpy(&header, p, sizeof(header));
+  if (std::memcmp(header.magic, object_file_magic, sizeof(header.magic)) != 0 || header.version != object_file_version) {
+    return {};
+  }
+  uint64_t expected = sizeof(ObjectFileHeader) + uint64_t { header.text_size } + header.rodata_size + header.data_size
+    + uint64_t { header.label_count } * sizeof(Assembler::Object::Label)
+    + uint64_t { header.reference_count } * sizeof(Assembler::Object::Reference) + header.name_size;
+  if (buffer->view().size() != expected || object_file_hash(header, buffer->view().substr(sizeof(header))) != header.file_hash) {
+    return {};
+  }
+  p += sizeof(header);
+
+  Assembler::Object object;
+  auto read = [&p]<typename T>(std::vector<T>& items, size_t count) {
+    items.resize(count);
+    if (count > 0) {
+      std::memcpy(items.data(), p, count * sizeof(T));
+    }
+    p += count * sizeof(T);
+  };
+  read(object.text, header.text_size);
+  read(object.rodata, header.rodata_size);
+  read(object.data, header.data_size);
+  read(object.labels, header.label_count);
+  read(object.references, header.reference_count);
+  object.names.assign(p, header.name_size);
+  object.bss_size = header.bss_size;
+
+  // Every name has to be inside `names` and every offset inside its section, or linking the object would write out of bounds
+  uint64_t section_sizes[] = { header.text_size, header.rodata_size, header.data_size, header.bss_size };
+  auto in_names = [&](uint32_t offset, uint32_t size) { return uint64_t { offset } + size <= header.name_size; };
+  auto valid_section = [](Assembler::Section section) {
+    return static_cast<uint8_t>(section) <= static_cast<uint8_t>(Assembler::Section::bss);
+  };
+  for (const Assembler::Object::Label& label : object.labels) {
+    if (!in_names(label.name, label.name_size) || !valid_section(label.section)
+        || label.offset > section_sizes[static_cast<size_t>(label.section)]) {
+      return {};
+    }
+  }
+  for (const Assembler::Object::Reference& reference : object.references) {
+    size_t width = reference.kind == Assembler::Fixup::Kind::abs64 ? 8 : 4;
+    if (!in_names(reference.label, reference.label_size) || !valid_section(reference.section)
+        || reference.section == Assembler::Section::bss
+        || static_cast<uint8_t>(reference.kind) > static_cast<uint8_t>(Assembler::Fixup::Kind::abs64)
+        || reference.offset + width > section_sizes[static_cast<size_t>(reference.section)]) {
+      return {};
+    }
+  }
+  return object;
+}
@@ -0,0 +1,258 @@
+// This file holds the optimisation passes that run on the AST between `Parser::parse_prog()` and `Generator::gen_prog()`.
+// `ConstantFolder` evaluates operators whose operands are known at compile time and simplifies algebraic identities, so something like
+// `let y = (10 - 2 * 3) / 2;` reaches the generator as `let y = 2;`.
+// Nodes are rewritten in place: a folded bin_expr becomes an int_lit, and an identity such as `x * 1` becomes a copy of the node for `x`.
+// A node's children are always folded before the node itself. Rewrites that throw an operand away (`x * 0`, `f() && false`) only happen when
+// that operand has no side effects, i.e. contains no function call.
+
+#pragma once
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+#include "./ast.hpp"
+
+class ConstantFolder {
+public:
+  inline explicit ConstantFolder(NodeProg& prog)
+    : m_prog(prog)
+    , m_state(prog.nodes.size(), State::unvisited)
+  {
+  }
+
+  // Fold every expression in the program, returns the number of nodes that were rewritten
+  inline size_t run()
+  {
+    for (NodeIndex i = 0; i < m_prog.nodes.size(); i++) {
+      if (m_prog[i].kind == NodeKind::bin_expr) {
+        fold(i);
+      }
+    }
+    return m_rewritten;
+  }
+
+  // Wrapping arithmetic, the same result the generated code would compute at runtime. Shared with the IR passes
+  static inline std::optional<int64_t> evaluate(BinOp op, int64_t lhs, int64_t rhs)
+  {
+    auto ulhs = static_cast<uint64_t>(lhs);
+    auto urhs = static_cast<uint64_t>(rhs);
+    switch (op) {
+    case BinOp::add:
+      return static_cast<int64_t>(ulhs + urhs);
+    case BinOp::sub:
+      return static_cast<int64_t>(ulhs - urhs);
+    case BinOp::mul:
+      return static_cast<int64_t>(ulhs * urhs);
+    case BinOp::div:
+      // leave the division in so it faults at runtime just like it would have
+      if (rhs == 0 || (lhs == std::numeric_limits<int64_t>::min() && rhs == -1)) {
+        return {};
+      }
+      return lhs / rhs;
+    case BinOp::eq:
+      return lhs == rhs;
+    case BinOp::lt:
+      return lhs < rhs;
+    case BinOp::gt:
+      return lhs > rhs;
+    case BinOp::and_:
+      return lhs != 0 && rhs != 0;
+    case BinOp::or_:
+      return lhs != 0 || rhs != 0;
+    }
+    return {};
+  }
+
+private:
+  enum class State : uint8_t {
+    unvisited,
+    pure, // folded, evaluating it has no side effects
+    impure, // folded, contains a function call
+  };
+
+  // The value of a node if it is a compile time constant
+  [[nodiscard]] inline std::optional<int64_t> constant(NodeIndex index) const
+  {
+    const Node& node = m_prog[index];
+    if (node.kind == NodeKind::int_lit) {
+      return node.int_value();
+    }
+    if (node.kind == NodeKind::bool_lit) {
+      return node.a;
+    }
+    return {};
+  }
+
+  // Whether the node always evaluates to 0 or 1, so `x && true` can become just `x`
+  [[nodiscard]] inline bool is_boolean(NodeIndex index) const
+  {
+    const Node& node = m_prog[index];
+    if (node.kind == NodeKind::bool_lit) {
+      return true;
+    }
+    if (node.kind == NodeKind::int_lit) {
+      return node.int_value() == 0 || node.int_value() == 1;
+    }
+    if (node.kind != NodeKind::bin_expr) {
+      return false;
+    }
+    switch (node.op) {
+    case BinOp::eq:
+    case BinOp::lt:
+    case BinOp::gt:
+    case BinOp::and_:
+    case BinOp::or_:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // Fold the children of `index`, then the node itself. Returns whether the result is free of side effects
+  inline bool fold(NodeIndex index)
+  {
+    if (index >= m_state.size()) {
+      // appended by the fold itself, never the case today but cheap to be safe about
+      m_state.resize(m_prog.nodes.size(), State::unvisited);
+    }
+    if (m_state[index] != State::unvisited) {
+      return m_state[index] == State::pure;
+    }
+
+    const Node node = m_prog[index];
+    bool pure = true;
+    switch (node.kind) {
+    case NodeKind::bin_expr:
+      pure = fold(node.a) & fold(node.b); // not &&, both sides have to be folded
+      pure = fold_bin_expr(index, pure);
+      break;
+    case NodeKind::func_call:
+      for (NodeIndex arg : m_prog.list(node.b)) {
+        fold(arg);
+      }
+      pure = false;
+      break;
+    default:
+      break;
+    }
+    m_state[index] = pure ? State::pure : State::impure;
+    return pure;
+  }
+
+  inline void replace_with_int(NodeIndex index, int64_t value)
+  {
+    auto bits = static_cast<uint64_t>(value);
+    m_prog[index] = { .kind = NodeKind::int_lit, .a = static_cast<uint32_t>(bits), .b = static_cast<uint32_t>(bits >> 32) };
+    m_rewritten++;
+  }
+
+  inline void replace_with(NodeIndex index, NodeIndex operand)
+  {
+    m_prog[index] = m_prog[operand];
+    m_rewritten++;
+  }
+
+  // `operands_pure` says whether both operands are free of side effects, returns the same for the (possibly rewritten) node
+  inline bool fold_bin_expr(NodeIndex index, bool operands_pure)
+  {
+    const Node node = m_prog[index];
+    std::optional<int64_t> lhs = constant(node.a);
+    std::optional<int64_t> rhs = constant(node.b);
+
+    if (lhs.has_value() && rhs.has_value()) {
+      if (std::optional<int64_t> value = evaluate(node.op, lhs.value(), rhs.value())) {
+        replace_with_int(index, value.value());
+      }
+      return true;
+    }
+
+    // lhs_pure / rhs_pure: can the operand be dropped without losing a side effect
+    bool lhs_pure = m_state[node.a] == State::pure;
+    bool rhs_pure = m_state[node.b] == State::pure;
+
+    switch (node.op) {
+    case BinOp::add:
+      if (lhs == 0) {
+        replace_with(index, node.b); // 0 + x
+        return rhs_pure;
+      }
+      if (rhs == 0) {
+        replace_with(index, node.a); // x + 0
+        return lhs_pure;
+      }
+      break;
+    case BinOp::sub:
+      if (rhs == 0) {
+        replace_with(index, node.a); // x - 0
+        return lhs_pure;
+      }
+      break;
+    case BinOp::mul:
+      if (lhs == 1) {
+        replace_with(index, node.b); // 1 * x
+        return rhs_pure;
+      }
+      if (rhs == 1) {
+        replace_with(index, node.a); // x * 1
+        return lhs_pure;
+      }
+      if ((lhs == 0 && rhs_pure) || (rhs == 0 && lhs_pure)) {
+        replace_with_int(index, 0); // 0 * x, x * 0
+        return true;
+      }
+      break;
+    case BinOp::div:
+      if (rhs == 1) {
+        replace_with(index, node.a); // x / 1
+        return lhs_pure;
+      }
+      break;
+    case BinOp::and_:
+      // false && x never evaluates x
+      if (lhs == 0) {
+        replace_with_int(index, 0);
+        return true;
+      }
+      // true && x is x, as long as x is already 0 or 1
+      if (lhs.has_value() && is_boolean(node.b)) {
+        replace_with(index, node.b);
+        return rhs_pure;
+      }
+      if (rhs == 0 && lhs_pure) {
+        replace_with_int(index, 0);
+        return true;
+      }
+      if (rhs.has_value() && rhs != 0 && is_boolean(node.a)) {
+        replace_with(index, node.a);
+        return lhs_pure;
+      }
+      break;
+    case BinOp::or_:
+      // true || x never evaluates x
+      if (lhs.has_value() && lhs != 0) {
+        replace_with_int(index, 1);
+        return true;
+      }
+      if (lhs == 0 && is_boolean(node.b)) {
+        replace_with(index, node.b);
+        return rhs_pure;
+      }
+      if (rhs.has_value() && rhs != 0 && lhs_pure) {
+        replace_with_int(index, 1);
+        return true;
+      }
+      if (rhs == 0 && is_boolean(node.a)) {
+        replace_with(index, node.a);
+        return lhs_pure;
+      }
+      break;
+    default:
+      break;
+    }
+    return operands_pure;
+  }
+
+  NodeProg& m_prog;
+  std::vector<State> m_state; // per node
+  size_t m_rewritten = 0;
+};
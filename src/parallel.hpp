@@ -0,0 +1,62 @@
+// This file runs independent pieces of compilation (function bodies, mostly) on several threads.
+// `parallel_for` hands out indices one at a time from an atomic counter, so a few big functions don't leave the other threads idle behind
+// a fixed split. Callers write each result into its own slot and combine them in index order afterwards, that keeps the output the same
+// no matter how many threads ran or which one finished first.
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+// How many threads `requested` means: 0 is one per hardware thread
+inline unsigned resolve_thread_count(unsigned requested)
+{
+  if (requested != 0) {
+    return requested;
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Call body(i) for every i in [0, count) on up to `threads` threads (the calling thread is one of them). With one thread, or one item,
+// it is a plain loop. If a body throws, the remaining items still run and the exception of the lowest index is rethrown at the end,
+// the same one a serial run would have stopped at
+template <typename F>
+inline void parallel_for(size_t count, unsigned threads, F&& body)
+{
+  threads = static_cast<unsigned>(std::min<size_t>(resolve_thread_count(threads), count));
+  if (threads <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      body(i);
+    }
+    return;
+  }
+
+  std::atomic<size_t> next { 0 };
+  std::vector<std::exception_ptr> errors(count);
+  auto work = [&] {
+    for (size_t i = next.fetch_add(1, std::memory_order_relaxed); i < count; i = next.fetch_add(1, std::memory_order_relaxed)) {
+      try {
+        body(i);
+      }
+      catch (...) {
+        errors[i] = std::current_exception();
+      }
+    }
+  };
+  {
+    std::vector<std::jthread> workers;
+    workers.reserve(threads - 1);
+    for (unsigned i = 1; i < threads; i++) {
+      workers.emplace_back(work);
+    }
+    work();
+  }
+  for (const std::exception_ptr& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
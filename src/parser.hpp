@@ -1,471 +1,264 @@
-// This file define data structures by defining the necessary data structures for the AST and implementing a parser to construct the AST from a sequence of tokens.  This parser utilizes a recursive descent parsing strategy, operator precedence parsing, and efficient memory allocation via an arena allocator to parse the programming language constructs into an AST. It works like the tokenizer but instead of going character by character, it goes token by token peeking tokens and then consuming them. It also has a recursive descent parsing strategy, operator precedence parsing, and efficient memory allocation via an arena allocator to parse the programming language constructs into an AST.
+// This file implements the parser that builds the AST (see ast.hpp) from the stream of tokens. This parser utilizes a recursive descent parsing strategy and operator precedence parsing to parse the programming language constructs into a flat, index based AST. It works like the tokenizer but instead of going character by character, it goes token by token peeking tokens and then consuming them.
+// Nodes are appended to the node pool of the `NodeProg` being built and refer to their children by index. Lists of children (the statements of a scope, the arguments of a call) are collected on a scratch stack while they are parsed and then copied into the program's list storage in one go, so nested scopes don't need a vector each.
 
 #pragma once
-#include <cassert>
-#include <variant>
-#include "./arena.hpp"
-#include "tokenization.hpp"
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <span>
 #include <string>
-#include <memory>
 #include <vector>
+#include "./ast.hpp"
+#include "./error.hpp"
+#include "tokenization.hpp"
 
-// Token representing an integer literal
-struct NodeTermIntLit {
-    Token int_lit;
-};
-
-// Token representing an identifier
-struct NodeTermIdent {
-    Token ident;
-};
-
-// Forward declaration of expression node
-struct NodeExpr;
-
-// Node representing an expression enclosed in parentheses
-struct NodeTermParen {
-    NodeExpr* expr;
-};
-
-// Node representing a binary addition expression
-struct NodeBinExprAdd {
-    NodeExpr* lhs; // left
-    NodeExpr* rhs; // right
-};
-
-// Node representing a binary MULTIPLICATION expression
-struct NodeBinExprMulti {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-
-// Node representing a binary subtraction expression
-struct NodeBinExprSub {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-
-// Node representing a binary division expression
-struct NodeBinExprDiv {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-
-// Node representing a binary expression ==
-struct NodeBinExprEq {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-
-// Node representing a binary expression &&
-struct NodeBinExprAnd {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-
-// Node representing a binary expression ||
-struct NodeBinExprOr {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-
-// Node representing a scope for while loop
-struct NodeStmtWhile {
-    NodeExpr* expr;
-    NodeScope* scope;
-};
-
-// Node representing a string literal
-struct NodeStringLit {
-    std::string value;
-};
-
-// Node representing a boolean literal true or false constants
-struct NodeBoolLit {
-    bool value;
-};
-
-// Node representing a for loop
-struct NodeStmtFor {
-    NodeExpr* init;
-    NodeExpr* condition;
-    NodeExpr* iteration;
-    NodeScope* scope;
-};
-struct NodeFuncDef {
-    Token ident;                // Function name identifier
-    std::vector<Token> params;  // Parameter identifiers
-    NodeScope* body;            // Function body
-};
-
-struct NodeFuncCall {
-    Token ident;                // Function name identifier
-    std::vector<NodeExpr*> args; // Arguments in the function call
-};
-
-struct NodeParamList {
-    std::vector<Token> params;  // Parameter identifiers
-};
-
-struct NodeReturn {
-    NodeExpr* expr;             // Expression to return
-};
-
-struct NodeStmtPrint {
-    NodeExpr* expr; // Expression to be printed
-};
-
-// Node representing any binary expression
-struct NodeBinExpr {
-    std::variant<NodeBinExprAdd*, NodeBinExprMulti*, NodeBinExprSub*, NodeBinExprDiv*, NodeBinExprEq*, NodeBinExprAnd*, NodeBinExprOr*> var;
-};
-
-// Node representing a terminal symbol in an expression
-struct NodeTerm {
-    std::variant<std::shared_ptr<NodeTermIntLit>, std::shared_ptr<NodeTermIdent>, std::shared_ptr<NodeStringLit>> var;
-};
-
-// Node representing an expression
-struct NodeExpr {
-    std::variant<NodeTerm*, NodeBinExpr*> var;
-};
-
-// Node representing an exit statement
-struct NodeStmtExit {
-    NodeExpr* expr;
-};
-
-// Node representing an else statement
-struct NodeStmtElse {
-    NodeScope* scope;
-};
-
-// Node representing an else if statement
-struct NodeStmtElseIf {
-    NodeExpr* expr;
-    NodeScope* scope;
-    NodeStmtElseIf* next; // For chaining else if clauses
-};
-
-// Node representing a let statement
-struct NodeStmtLet {
-    Token ident;
-    NodeExpr* expr;
-};
-
-// Forward declaration of statement node
-struct NodeStmt;
-
-// Node representing a block scope
-struct NodeScope {
-    std::vector<NodeStmt*> stmts;
-};
-
-// Node representing an if statement
-struct NodeStmtIf {
-    NodeExpr* expr;
-    NodeScope* scope;
-};
-
-// Node representing a statement
-struct NodeStmt {
-    std::variant<NodeStmtExit*, NodeStmtLet*, NodeScope*, NodeStmtIf*> var;
-};
-
-// Node representing the entire program
-struct NodeProg {
-    std::vector<NodeStmt*> stmts;
+// How a token parses between two operands: the operator it stands for and how tightly it binds. Precedence 0 means it isn't a binary
+// operator. A left associative operator takes the operands of a higher precedence on its right, `a - b - c` is `(a - b) - c`
+struct InfixOperator {
+  uint8_t precedence = 0;
+  BinOp op = BinOp::add;
+  bool right_assoc = false;
 };
 
-// Node representing a boolean literal true or false constants
-struct NodeBoolLit {
-    bool value;
-};
+// Every binary operator, indexed by its token. Comparisons bind looser than arithmetic and tighter than the logical operators, so
+// `a + 1 < b && c == 2` needs no parentheses
+inline constexpr std::array<InfixOperator, token_type_count> infix_operators = [] {
+  std::array<InfixOperator, token_type_count> table {};
+  auto set = [&table](TokenType type, uint8_t precedence, BinOp op) { table[static_cast<size_t>(type)] = { precedence, op }; };
+  set(TokenType::or_or, 1, BinOp::or_);
+  set(TokenType::and_and, 2, BinOp::and_);
+  set(TokenType::eq_eq, 3, BinOp::eq);
+  set(TokenType::lt, 3, BinOp::lt);
+  set(TokenType::gt, 3, BinOp::gt);
+  set(TokenType::plus, 4, BinOp::add);
+  set(TokenType::minus, 4, BinOp::sub);
+  set(TokenType::star, 5, BinOp::mul);
+  set(TokenType::fslash, 5, BinOp::div);
+  return table;
+}();
+
+inline const InfixOperator& infix_operator(TokenType type)
+{
+  return infix_operators[static_cast<size_t>(type)];
+}
 
 class Parser {
 public:
-  inline explicit Parser(std::vector<Token> tokens)
-    : m_tokens(std::move(tokens))
-    , m_allocator(1024 * 1024 * 4) // 4 mb memory to allocate memory for the AST nodes
+  inline explicit Parser(TokenStream tokens)
+    : m_tokens(std::move(tokens)) // tokens are lexed on demand as the parser asks for them
   {
   }
-  std::optional<NodeFuncDef*> parse_func_def() {
-      auto func_token = expect(TokenType::function, "Expected 'function' keyword");
 
-      auto ident_token = expect(TokenType::ident, "Expected function name identifier");
-      auto params = parse_param_list();
-      auto body = parse_scope();
-
-      auto func_def = m_allocator.alloc<NodeFuncDef>();
-      func_def->ident = ident_token.value();
-      func_def->params = std::move(params);
-      func_def->body = body.value();
-
-      return func_def;
+  // Tokens lexed so far, all of them once parse_prog is done
+  [[nodiscard]] inline size_t token_count() const
+  {
+    return m_tokens.token_count();
   }
-  
-  bool is_string_expression(const NodeExpr* expr) {
-      if (!expr || !expr->term) {
-          return false; // Return false if expr or its term is nullptr
-      }
 
-      // Check if the term is a string literal
-      return std::holds_alternative<std::shared_ptr<NodeStringLit>>(expr->term->var);
+  // let ident = function (params) { body }, the `let ident =` part is already consumed
+  std::optional<NodeIndex> parse_func_def(SymbolId ident) {
+      try_consume(TokenType::function, "Expected 'function' keyword");
+      uint32_t params = parse_param_list();
+      auto body = parse_scope();
+      if (!body.has_value()) {
+          compile_error("Expected function body");
+      }
+      try_consume(TokenType::semi); // the `;` after the closing `}` is optional
+      return m_prog.add({ .kind = NodeKind::func_def, .a = ident, .b = params, .c = body.value() });
   }
 
-  std::vector<Token> parse_param_list() {
-    expect(TokenType::open_paren, "Expected '(' for parameter list");
-    std::vector<Token> params;
+  uint32_t parse_param_list() {
+    try_consume(TokenType::open_paren, "Expected '(' for parameter list");
+    size_t mark = m_scratch.size();
 
     while (peek().has_value() && peek()->type != TokenType::close_paren) {
-        auto param = expect(TokenType::ident, "Expected parameter identifier");
-        params.push_back(param.value());
+        Token param = try_consume(TokenType::ident, "Expected parameter identifier");
+        m_scratch.push_back(param.symbol);
 
         if (peek().has_value() && peek()->type == TokenType::comma) {
             consume(); // Consume comma
         }
     }
 
-    expect(TokenType::close_paren, "Expected ')' after parameters");
-    return params;
+    try_consume(TokenType::close_paren, "Expected ')' after parameters");
+    return take_list(mark);
   }
 
-  std::optional<NodeFuncCall*> parse_func_call() {
-    auto ident_token = expect(TokenType::ident, "Expected function name identifier");
+  std::optional<NodeIndex> parse_func_call() {
+    Token ident_token = try_consume(TokenType::ident, "Expected function name identifier");
 
-    expect(TokenType::open_paren, "Expected '(' for function call");
-    std::vector<NodeExpr*> args;
+    try_consume(TokenType::open_paren, "Expected '(' for function call");
+    size_t mark = m_scratch.size();
 
     while (peek().has_value() && peek()->type != TokenType::close_paren) {
         auto arg = parse_expr();
         if (!arg.has_value()) {
             return {}; // Error handling
         }
-        args.push_back(arg.value());
+        m_scratch.push_back(arg.value());
 
         if (peek().has_value() && peek()->type == TokenType::comma) {
             consume(); // Consume comma
         }
     }
 
-    expect(TokenType::close_paren, "Expected ')' after function call arguments");
-
-    auto func_call = m_allocator.alloc<NodeFuncCall>();
-    func_call->ident = ident_token.value();
-    func_call->args = std::move(args);
-
-    return func_call;
+    try_consume(TokenType::close_paren, "Expected ')' after function call arguments");
+    return m_prog.add({ .kind = NodeKind::func_call, .a = ident_token.symbol, .b = take_list(mark) });
   }
 
-
-  std::optional<NodeTerm*> parse_term(){
+  std::optional<NodeIndex> parse_term(){
       if (auto token = try_consume(TokenType::true_)) {
-        auto node = m_allocator.alloc<NodeBoolLit>();
-        node->value = true;
-        auto term = m_allocator.alloc<NodeTerm>();
-        term->var = node;
-        return term;
+        return m_prog.add({ .kind = NodeKind::bool_lit, .a = 1 });
       }
       else if (auto token = try_consume(TokenType::false_)) {
-        auto node = m_allocator.alloc<NodeBoolLit>();
-        node->value = false;
-        auto term = m_allocator.alloc<NodeTerm>();
-        term->var = node;
-        return term;
+        return m_prog.add({ .kind = NodeKind::bool_lit, .a = 0 });
       }
       else if (auto int_lit = try_consume(TokenType::int_lit)) {
-        auto term_int_lit = m_allocator.alloc<NodeTermIntLit>();
-        term_int_lit->int_lit = int_lit.value();
-        auto term = m_allocator.alloc<NodeTerm>();
-        term->var = term_int_lit;
-        return term;
+        std::string_view digits = int_lit->value.value();
+        int64_t value = 0;
+        auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+        if (ec != std::errc()) {
+          compile_error("Integer literal out of range: ", digits);
+        }
+        return m_prog.add_int_lit(value);
+      }
+      else if (auto str_lit = try_consume(TokenType::string_lit)) {
+        std::string_view raw = str_lit->value.value();
+        return m_prog.add({ .kind = NodeKind::string_lit, .a = m_prog.add_string(raw), .b = static_cast<uint32_t>(raw.size()) });
+      }
+      else if (peek().has_value() && peek()->type == TokenType::ident && peek(1).has_value() && peek(1)->type == TokenType::open_paren) {
+        return parse_func_call(); // a call is a term like any other, it can be an operand on either side
       }
       else if (auto ident = try_consume(TokenType::ident)) {
-        auto expr_ident = m_allocator.alloc<NodeTermIdent>();
-        expr_ident->ident = ident.value();
-        auto term = m_allocator.alloc<NodeTerm>();
-        term->var = expr_ident;
-        return term;
+        return m_prog.add({ .kind = NodeKind::ident, .a = ident->symbol });
       }
       else if (auto open_paren = try_consume(TokenType::open_paren)) {
+        // a parenthesised expression is just its inner expression, the tree shape already records the grouping
         auto expr = parse_expr();
         if (!expr.has_value()) {
-          std::cerr << "Expected expression" << std::endl;
-          exit(EXIT_FAILURE);
+          compile_error("Expected expression");
         }
         try_consume(TokenType::close_paren, "Expected `)`");
-        auto term_paren = m_allocator.alloc<NodeTermParen>();
-        term_paren->expr = expr.value();
-        auto term = m_allocator.alloc<NodeTerm>();
-        term->var = term_paren;
-        return term;
-      }
-      else if (auto func_def = parse_func_def()) {
-        auto stmt = m_allocator.alloc<NodeStmt>();
-        stmt->var = func_def.value();
-        return stmt;
+        return expr;
       }
       else {
         return {};
       }
   }
- 
-  // Parses an expression with optional binary operations, adhering to a specified minimum precedence.
-  // The function will parse a left-hand side term and then look ahead to determine if a binary operator follows.
-  // If a binary operator is found and its precedence is greater or equal to `min_prec`, the function will recursively parse the right-hand side expression with a higher precedence. This process ensures that the 
-  // expression is parsed according to operator precedence rules. If a binary operator is not followed by a valid
-  // expression, the function reports an error and terminates. The function returns an optional pointer to a 
-  // `NodeExpr` which may be an expression or a binary expression depending on the input. If parsing fails 
-  // at any point, an empty optional is returned.
-  //create the full trie to make the code generation for it
-  std::optional<NodeExpr*> parse_expr(int min_prec = 0){
-    // Check if the current token sequence represents a function call
-    if (peek().has_value() && peek()->type == TokenType::ident && 
-        peek(1).has_value() && peek(1)->type == TokenType::open_paren) {
-      return parse_func_call(); // parse_func_call handles the parsing of function calls
-    }
-    
-    std::optional<NodeTerm*> term_lhs = parse_term();
-    if (!term_lhs.has_value()) {
-      return {}; 
+
+  // Parses an expression whose operators all bind at least as tightly as `min_prec` (precedence climbing, a Pratt parser for binary
+  // operators). It parses a term, then, as long as the next token is an operator from infix_operators that binds tightly enough, consumes
+  // it and parses its right hand side with the precedence that operator leaves for it: one more than its own for a left associative one,
+  // its own for a right associative one. Each operator adds a single bin_expr node, which becomes the left hand side of whatever follows.
+  // `1 + 2 * 3 - 4` parses `1`, sees `+` and parses `2 * 3` as its rhs (the `-` binds too loosely to go with it), then `- 4` applies to
+  // the sum. Returns the index of the expression node, or an empty optional if there is no term where the expression should start
+  std::optional<NodeIndex> parse_expr(int min_prec = 1){
+    std::optional<NodeIndex> expr_lhs = parse_term();
+    if (!expr_lhs.has_value()) {
+      return {};
     }
-    // before the loop, we have a term
-    auto expr_lhs = m_allocator.alloc<NodeExpr>();
-    expr_lhs->var = term_lhs.value();
 
-    // we need to see if as an expresion has a binary operator can be only a single term
     while (true) {
-    std::optional<Token> curr_tok = peek(); // optional token
-    std::optional<int> prec; // optional precedence
-
-    if (curr_tok.has_value()) { // if it doesn't have a value then we break out of the loop
-      prec = bin_prec(curr_tok->type);
-      if (!prec.has_value() || prec < min_prec) { // if it doesn't have a value or the precedence is less than the min prec then we break out of the loop
+      std::optional<Token> curr_tok = peek();
+      if (!curr_tok.has_value()) {
+        break;
+      }
+      const InfixOperator& infix = infix_operator(curr_tok->type);
+      if (infix.precedence == 0 || infix.precedence < min_prec) { // not an operator, or one that belongs to an enclosing expression
         break;
       }
-    }
-    else { // no value then we break out of the loop
-      break;
-    }
-
-    Token op = consume(); // consume the next token
-    int next_min_prec = prec.value() + 1; // the next precedence
-    auto expr_rhs = parse_expr(next_min_prec);
-
-    if (!expr_rhs.has_value()) {
-      std::cerr << "\033[31mUnable to parse expression\033[0m" << std::endl;
-      exit(EXIT_FAILURE);
-    }
 
-    auto expr = m_allocator.alloc<NodeBinExpr>();
-    auto expr_lhs2 = m_allocator.alloc<NodeExpr>(); // to avoid the dangling pointer
-
-    // know the expression type of the next token. The lhs and rhs put them together
-    // Specifically, it checks whether the current operator token (`op`) is of type `TokenType::plus`,
-    // indicating an addition operation between two expressions. If the token matches, it creates a new `NodeBinExprAdd` node,
-    // which represents a binary addition expression in the AST. This new node will have its `lhs` (left-hand side) and `rhs`
-    // (right-hand side) properties set to the previously parsed left expression (`expr_lhs2`) and the right expression (`expr_rhs`) respectively.
-    // The left expression (`expr_lhs2`) is also updated to inherit the variable from the original left expression (`expr_lhs`).
-    // Finally, the variable of the encompassing expression (`expr`) is set to the newly created `NodeBinExprAdd` node,
-    // effectively building the AST subtree for this binary expression and preparing the parser to continue parsing any further expressions.
-    if (op.type == TokenType::plus) { // know the type of the next token
-      auto add = m_allocator.alloc<NodeBinExprAdd>();
-      expr_lhs2->var = expr_lhs->var; // create a new expression here and take the var out of it
-      add->lhs = expr_lhs2;
-      add->rhs = expr_rhs.value();
-      expr->var = add;
-    }
-    else if (op.type == TokenType::eq_eq) {
-        auto eq = m_allocator.alloc<NodeBinExprEq>();
-        expr_lhs2->var = expr_lhs->var;
-        eq->lhs = expr_lhs2;
-        eq->rhs = expr_rhs.value();
-        expr->var = eq;
-    }
-    else if (op.type == TokenType::and_and) {
-        auto andExpr = m_allocator.alloc<NodeBinExprAnd>();
-        expr_lhs2->var = expr_lhs->var;
-        andExpr->lhs = expr_lhs2;
-        andExpr->rhs = expr_rhs.value();
-        expr->var = andExpr;
-    } else if (op.type == TokenType::or_or) {
-        auto orExpr = m_allocator.alloc<NodeBinExprOr>();
-        expr_lhs2->var = expr_lhs->var;
-        orExpr->lhs = expr_lhs2;
-        orExpr->rhs = expr_rhs.value();
-        expr->var = orExpr;
-    }
-    else if (op.type == TokenType::star) {
-      auto multi = m_allocator.alloc<NodeBinExprMulti>();
-      expr_lhs2->var = expr_lhs->var;
-      multi->lhs = expr_lhs2;
-      multi->rhs = expr_rhs.value();
-      expr->var = multi;
-    }
-    else if (op.type == TokenType::minus) {
-      auto sub = m_allocator.alloc<NodeBinExprSub>();
-      expr_lhs2->var = expr_lhs->var;
-      sub->lhs = expr_lhs2;
-      sub->rhs = expr_rhs.value();
-      expr->var = sub;
-    }
-    else if (op.type == TokenType::fslash) {
-      auto div = m_allocator.alloc<NodeBinExprDiv>();
-      expr_lhs2->var = expr_lhs->var;
-      div->lhs = expr_lhs2;
-      div->rhs = expr_rhs.value();
-      expr->var = div;
-    }
-    else {
-      assert(false); // Unreachable;
+      consume();
+      auto expr_rhs = parse_expr(infix.right_assoc ? infix.precedence : infix.precedence + 1);
+      if (!expr_rhs.has_value()) {
+        compile_error("\033[31mUnable to parse expression\033[0m");
+      }
+      expr_lhs = m_prog.add_bin_expr(infix.op, expr_lhs.value(), expr_rhs.value());
     }
-    // reset the left hand side to the expression
-    expr_lhs->var = expr;
 
-    }
-    
-    // once we are done with the loop, we return the expression which is in the left hand side
     return expr_lhs;
   }
 
-  std::optional<NodeScope*> parse_scope(){
+  std::optional<NodeIndex> parse_scope(){
     if (!try_consume(TokenType::open_curly).has_value()) {
       return {};
     }
 
-    auto scope = m_allocator.alloc<NodeScope>();
-
-    while (auto stmt = parse_stmt()) {
-      scope->stmts.push_back(stmt.value());
+    size_t mark = m_scratch.size();
+    while (peek().has_value() && peek()->type != TokenType::close_curly) {
+      auto stmt = parse_stmt();
+      if (!stmt.has_value()) {
+        compile_error("Invalid statement");
+      }
+      m_scratch.push_back(stmt.value());
     }
     try_consume(TokenType::close_curly, "Expected `}`");
 
-    return scope;
+    return m_prog.add({ .kind = NodeKind::scope, .a = take_list(mark) });
   }
 
-  std::optional<NodeStmtElseIf*> parse_else_if_chain() {
+  // if (expr) { ... } followed by any number of `else if (expr) { ... }` and an optional `else { ... }`, the `if` is already consumed.
+  // Every `else if` is another stmt_if hanging off the else branch of the previous one
+  std::optional<NodeIndex> parse_if() {
+    try_consume(TokenType::open_paren, "Expected `(`");
     auto expr = parse_expr();
     if (!expr.has_value()) {
-        std::cerr << "Expected an expression after 'else if'" << std::endl;
-        exit(EXIT_FAILURE);
+      compile_error("Invalid expression");
     }
+    try_consume(TokenType::close_paren, "Expected `)`");
     auto scope = parse_scope();
     if (!scope.has_value()) {
-        std::cerr << "Expected a scope after 'else if' condition" << std::endl;
-        exit(EXIT_FAILURE);
+      compile_error("Invalid scope {}");
     }
 
-    auto stmt_else_if = m_allocator.alloc<NodeStmtElseIf>();
-    stmt_else_if->expr = expr.value();
-    stmt_else_if->scope = scope.value();
-    stmt_else_if->next = nullptr;
-
-    // Check for a chained else if
-    if (peek().has_value() && peek().value().type == TokenType::else_if) {
-        stmt_else_if->next = parse_else_if_chain().value();
+    NodeIndex else_branch = null_node;
+    if (try_consume(TokenType::else_)) {
+      if (try_consume(TokenType::if_)) {
+        else_branch = parse_if().value();
+      }
+      else if (auto else_scope = parse_scope()) {
+        else_branch = else_scope.value();
+      }
+      else {
+        compile_error("Expected a scope after 'else'");
+      }
     }
 
-    return stmt_else_if;
+    return m_prog.add({ .kind = NodeKind::stmt_if, .a = expr.value(), .b = scope.value(), .c = else_branch });
+  }
+
+  // The statements that can appear without their `;`, in a for loop header: let ident = expr, ident = expr, or a call
+  std::optional<NodeIndex> parse_simple_stmt() {
+    if (peek().has_value() && peek()->type == TokenType::let && peek(1).has_value() && peek(1)->type == TokenType::ident
+        && peek(2).has_value() && peek(2)->type == TokenType::eq) {
+      consume();
+      SymbolId ident = consume().symbol;
+      consume();
+      auto expr = parse_expr();
+      if (!expr.has_value()) {
+        compile_error("Invalid expression");
+      }
+      return m_prog.add({ .kind = NodeKind::stmt_let, .a = ident, .b = expr.value() });
+    }
+    if (peek().has_value() && peek()->type == TokenType::ident && peek(1).has_value() && peek(1)->type == TokenType::eq) {
+      SymbolId ident = consume().symbol;
+      consume();
+      auto expr = parse_expr();
+      if (!expr.has_value()) {
+        compile_error("Invalid expression");
+      }
+      return m_prog.add({ .kind = NodeKind::stmt_assign, .a = ident, .b = expr.value() });
+    }
+    if (peek().has_value() && peek()->type == TokenType::ident && peek(1).has_value() && peek(1)->type == TokenType::open_paren) {
+      auto call = parse_func_call();
+      if (!call.has_value()) {
+        compile_error("Invalid function call");
+      }
+      return m_prog.add({ .kind = NodeKind::stmt_expr, .a = call.value() });
+    }
+    return {};
   }
 
 /**
@@ -475,291 +268,174 @@ public:
  * types of statements present in the programming language being parsed.
  *
  * Function Signature:
- * - Returns: `std::optional<NodeStmt*>`, indicating an optional pointer to
- *   a `NodeStmt` object. An empty `std::optional` is returned if no matching
- *   statement type is found or if there's a parsing error.
+ * - Returns: `std::optional<NodeIndex>`, the index of the statement node in
+ *   the node pool. An empty `std::optional` is returned if no matching
+ *   statement type is found.
  *
  * Parsing Different Statement Types:
- * - Exit Statement: Checks for an `exit` statement by looking for tokens
- *   `exit` followed by an open parenthesis. A `NodeStmtExit` object is
- *   created and an expression is parsed if present.
- * - Let Statement: Checks for a `let` statement, looking for tokens `let`
- *   followed by an identifier and an equals sign. A `NodeStmtLet` object
- *   is created and an expression is parsed.
+ * - Exit Statement: `exit` followed by a parenthesised expression.
+ * - Function Definition: `let ident = function (params) { body }`.
+ * - Let Statement, Assignment and Call: see `parse_simple_stmt`, followed
+ *   by a `;`.
  * - Scope: Activated when an open curly brace is found, indicating a new
- *   scope. A `NodeStmt` object is created and the scope is parsed.
- * - If Statement: Checks for an `if` statement, looking for the `if` token
- *   followed by an open parenthesis. A `NodeStmtIf` object is created,
- *   an expression and a scope are parsed.
+ *   scope.
+ * - If Statement: `if (expr) { }` with its `else if` / `else` chain.
+ * - While and For loops, Print and Return statements.
  *
  * Error Handling:
- * - Provides error feedback through `std::cerr` and may terminate the program
- *   using `exit()` if there's an invalid expression, scope, or unexpected
- *   token encountered.
- *
- * Memory Allocation:
- * - Utilizes a custom memory allocator (`m_allocator`) for managing AST node
- *   memory during the creation of `NodeStmt`, `NodeStmtExit`, `NodeStmtLet`,
- *   and `NodeStmtIf` objects.
+ * - Throws a CompileError (error.hpp) with a message if there's an invalid
+ *   expression, scope, or unexpected token encountered.
  *
  * Token Management:
  * - Employs `peek()` and `consume()` methods for looking ahead at upcoming
  *   tokens and consuming tokens from the token stream, respectively, aiding
  *   in the recursive descent parsing process.
  */
-  std::optional<NodeStmt*> parse_stmt(){
-    if (peek().value().type == TokenType::exit && peek(1).has_value() && peek(1).value().type == TokenType::open_paren) {
+  std::optional<NodeIndex> parse_stmt(){
+    if (peek().has_value() && peek()->type == TokenType::exit && peek(1).has_value() && peek(1)->type == TokenType::open_paren) {
       consume();
       consume();
-      auto stmt_exit = m_allocator.alloc<NodeStmtExit>();
-      if (auto node_expr = parse_expr()) {
-        stmt_exit->expr = node_expr.value();
-      }
-      else {
-        std::cerr << "Invalid expression" << std::endl;
-          (EXIT_FAILURE);
+      auto node_expr = parse_expr();
+      if (!node_expr.has_value()) {
+        compile_error("Invalid expression");
       }
       try_consume(TokenType::close_paren, "Expected `)`");
       try_consume(TokenType::semi, "Expected `;`");
-      auto stmt = m_allocator.alloc<NodeStmt>();
-      stmt->var = stmt_exit;
-      return stmt;
+      return m_prog.add({ .kind = NodeKind::stmt_exit, .a = node_expr.value() });
     }
 
-    else if ( //check that the one after that is an identifier and then the one after that is an identifier
-      peek().has_value() && peek().value().type == TokenType::let && peek(1).has_value()
-      && peek(1).value().type == TokenType::ident && peek(2).has_value()
-      && peek(2).value().type == TokenType::eq
+    else if ( // let ident = function ...
+      peek().has_value() && peek()->type == TokenType::let && peek(1).has_value() && peek(1)->type == TokenType::ident
+      && peek(2).has_value() && peek(2)->type == TokenType::eq && peek(3).has_value() && peek(3)->type == TokenType::function
             ) {
       consume();
-      auto stmt_let = m_allocator.alloc<NodeStmtLet>();
-      stmt_let->ident = consume();
+      SymbolId ident = consume().symbol;
       consume();
-      // if the expression is parsed correctly
-      if (auto expr = parse_expr()) {
-          stmt_let->expr = expr.value();
-      }
-      else {
-          std::cerr << "Invalid expression" << std::endl;
-          exit(EXIT_FAILURE);
-      }
-      // check if it had a semicol
-      try_consume(TokenType::semi, "Expected `;`");
-      auto stmt = m_allocator.alloc<NodeStmt>();
-      stmt->var = stmt_let;
-      return stmt; // return a node statement
-    }
-
-    else if (peek().has_value() && peek().value().type == TokenType::open_curly) {
-      if (auto scope = parse_scope()) {
-        auto stmt = m_allocator.alloc<NodeStmt>();
-        stmt->var = scope.value();
-        return stmt;
-      }
-      else {
-        std::cerr << "Invalid scope" << std::endl;
-        exit(EXIT_FAILURE);
-      }
+      return parse_func_def(ident);
     }
 
-    else if (auto if_ = try_consume(TokenType::if_)) {
-      try_consume(TokenType::open_paren, "Expected `(`");
-      auto stmt_if = m_allocator.alloc<NodeStmtIf>();
-      if (auto expr = parse_expr()) {
-        stmt_if->expr = expr.value();
-      }
-      else {
-        std::cerr << "Invalid expression" << std::endl;
-        exit(EXIT_FAILURE);
-      }
-      try_consume(TokenType::close_paren, "Expected `)`");
-      if (auto scope = parse_scope()) {
-        stmt_if->scope = scope.value();
-      }
-      else {
-        std::cerr << "Invalid scope {}" << std::endl;
-        exit(EXIT_FAILURE);
-      }
-      auto stmt = m_allocator.alloc<NodeStmt>();
-      stmt->var = stmt_if;
+    else if (auto stmt = parse_simple_stmt()) {
+      // check if it had a semicol
+      try_consume(TokenType::semi, "Expected `;`");
       return stmt;
     }
-    
-    else if (auto else_token = try_consume(TokenType::else_)) {
-        auto scope = parse_scope();
-        if (!scope.has_value()) {
-            std::cerr << "Expected a scope after 'else'" << std::endl;
-            exit(EXIT_FAILURE);
-        }
-        auto stmt_else = m_allocator.alloc<NodeStmtElse>();
-        stmt_else->scope = scope.value();
 
-        auto stmt = m_allocator.alloc<NodeStmt>();
-        stmt->var = stmt_else;
-        return stmt;
+    else if (peek().has_value() && peek()->type == TokenType::open_curly) {
+      return parse_scope();
     }
-    
-    else if (auto else_if_token = try_consume(TokenType::else_if)) {
-        auto stmt_else_if = parse_else_if_chain();
-        if (!stmt_else_if.has_value()) {
-            std::cerr << "Invalid else if chain" << std::endl;
-            exit(EXIT_FAILURE);
-        }
 
-        auto stmt = m_allocator.alloc<NodeStmt>();
-        stmt->var = stmt_else_if.value();
-        return stmt;
+    else if (auto if_ = try_consume(TokenType::if_)) {
+      return parse_if();
     }
 
     else if (auto while_token = try_consume(TokenType::while_)) {
+        try_consume(TokenType::open_paren, "Expected `(` after 'while'");
         auto expr = parse_expr();
         if (!expr.has_value()) {
-            std::cerr << "Expected an expression after 'while'" << std::endl;
-            exit(EXIT_FAILURE);
+            compile_error("Expected an expression after 'while'");
         }
+        try_consume(TokenType::close_paren, "Expected `)` after 'while' condition");
         auto scope = parse_scope();
         if (!scope.has_value()) {
-            std::cerr << "Expected a scope after 'while' condition" << std::endl;
-            exit(EXIT_FAILURE);
+            compile_error("Expected a scope after 'while' condition");
         }
-
-        auto stmt_while = m_allocator.alloc<NodeStmtWhile>();
-        stmt_while->expr = expr.value();
-        stmt_while->scope = scope.value();
-
-        auto stmt = m_allocator.alloc<NodeStmt>();
-        stmt->var = stmt_while;
-        return stmt;
+        return m_prog.add({ .kind = NodeKind::stmt_while, .a = expr.value(), .b = scope.value() });
     }
 
     else if (auto for_token = try_consume(TokenType::for_)) {
         try_consume(TokenType::open_paren, "Expected `(` after 'for'");
-        auto init = parse_expr(); // Assuming initialization is an expression
+        NodeIndex init = parse_simple_stmt().value_or(null_node);
         try_consume(TokenType::semi, "Expected `;` after initialization");
         auto condition = parse_expr();
+        if (!condition.has_value()) {
+            compile_error("Expected a condition in 'for' loop");
+        }
         try_consume(TokenType::semi, "Expected `;` after condition");
-        auto iteration = parse_expr();
+        NodeIndex iteration = parse_simple_stmt().value_or(null_node);
         try_consume(TokenType::close_paren, "Expected `)` after iteration");
 
         auto scope = parse_scope();
         if (!scope.has_value()) {
-            std::cerr << "Expected a scope after 'for' loop" << std::endl;
-            exit(EXIT_FAILURE);
+            compile_error("Expected a scope after 'for' loop");
         }
 
-        auto stmt_for = m_allocator.alloc<NodeStmtFor>();
-        stmt_for->init = init.value();
-        stmt_for->condition = condition.value();
-        stmt_for->iteration = iteration.value();
-        stmt_for->scope = scope.value();
-
-        auto stmt = m_allocator.alloc<NodeStmt>();
-        stmt->var = stmt_for;
-        return stmt;
-    }
-    
-    else if (auto token = try_consume(TokenType::string_lit)) {
-      auto node = m_allocator.alloc<NodeStringLit>();
-      node->value = token->value.value(); // Assuming token->value holds the string
-      return node;
-    }
-
-    else if (auto token = try_consume(TokenType::true_)) {
-      auto node = m_allocator.alloc<NodeBoolLit>();
-      node->value = true;
-      return node;
+        const uint32_t parts[] = { init, condition.value(), iteration, scope.value() };
+        return m_prog.add({ .kind = NodeKind::stmt_for, .a = m_prog.add_list(parts) });
     }
 
-    else if (auto token = try_consume(TokenType::false_)) {
-        auto node = m_allocator.alloc<NodeBoolLit>();
-        node->value = false;
-        return node;
-    }
     else if (auto print_token = try_consume(TokenType::print)) {
       // Expecting an expression after 'print'
       auto expr = parse_expr();
       if (!expr.has_value()) {
-        std::cerr << "Expected expression after 'print'" << std::endl;
-        exit(EXIT_FAILURE);
+        compile_error("Expected expression after 'print'");
       }
 
       // Expecting a semicolon after the print expression
       try_consume(TokenType::semi, "Expected `;` after print statement");
+      return m_prog.add({ .kind = NodeKind::stmt_print, .a = expr.value() });
+    }
 
-      auto stmt_print = m_allocator.alloc<NodeStmtPrint>();
-      stmt_print->expr = expr.value();
-      
-      auto stmt = m_allocator.alloc<NodeStmt>();
-      stmt->var = stmt_print;
-      return stmt;
+    else if (auto return_token = try_consume(TokenType::return_)) {
+      auto expr = parse_expr();
+      if (!expr.has_value()) {
+        compile_error("Expected expression after 'return'");
+      }
+      try_consume(TokenType::semi, "Expected `;` after return statement");
+      return m_prog.add({ .kind = NodeKind::stmt_return, .a = expr.value() });
     }
+
     else {
         return {};
     }
   }
 
 /**
- * @brief Parses a series of statements to construct a program node of an Abstract Syntax Tree (AST).
- * 
- * This function is an essential part of the AST construction phase in a compiler, enabling the translation 
+ * @brief Parses a series of statements to construct the program node of the Abstract Syntax Tree (AST).
+ *
+ * This function is an essential part of the AST construction phase in a compiler, enabling the translation
  * of source code into a structured representation for further analysis and transformation.
- * 
- * @return std::optional<NodeProg> - An optional object encapsulating the NodeProg object representing the parsed program.
- * If the parsing fails at any point, an empty std::optional object is returned.
- * 
+ *
+ * @return std::optional<NodeProg> - The finished node pool, its `root` is a prog node listing the top level statements.
+ *
  * Detailed Breakdown:
- * 1. Function Signature: 
- *    - Returns a std::optional<NodeProg> object encapsulating a NodeProg object or nothing (in case of parsing failure).
- * 
- * 2. Local Variables:
- *    - NodeProg prog; creates an instance of NodeProg to represent the program being parsed.
- *    
- * 3. Loop:
- *    - The while (peek().has_value()) loop iterates as long as the peek() function returns a value, suggesting that peek() 
- *      is checking the next token or element in the input stream to see if there's more to parse.
- *   
- * 4. Statement Parsing:
- *    - Within the loop, parse_stmt() is called to parse individual statements.
- *    - If parse_stmt() returns a value (i.e., a successfully parsed statement), it is added to prog.stmts using the push_back method.
- *      prog.stmts is likely a vector or similar collection within the NodeProg structure, holding all the parsed statements.
- *   
- * 5. Error Handling:
- *    - If parse_stmt() fails to return a value (i.e., fails to parse a statement), an error message "Invalid statement" is output to std::cerr,
- *      and the program exits with exit(EXIT_FAILURE), indicating a failure.
- * 
- * 6. Return Value:
- *    - Once all statements have been parsed (or an error has occurred), prog is returned wrapped in a std::optional, indicating the parsed program.
+ * 1. Loop:
+ *    - The while (peek().has_value()) loop iterates as long as there are tokens left in the stream.
+ *
+ * 2. Statement Parsing:
+ *    - Within the loop, parse_stmt() is called to parse individual statements and their indexes are collected.
+ *
+ * 3. Error Handling:
+ *    - If parse_stmt() fails to return a value (i.e., fails to parse a statement), a CompileError with the message "Invalid statement" is
+ *      thrown, which fails the compilation of this file.
+ *
+ * 4. Return Value:
+ *    - Once all statements have been parsed the prog node is added and the whole program is moved out of the parser.
  */
   std::optional<NodeProg> parse_prog(){
-    NodeProg prog;
+    size_t mark = m_scratch.size();
     // keep going until we can parse anything else
     while (peek().has_value()) {
         if (auto stmt = parse_stmt()) {
-          prog.stmts.push_back(stmt.value());
+          m_scratch.push_back(stmt.value());
         }
         else {
-          std::cerr << "Invalid statement" << std::endl;
-          exit(EXIT_FAILURE);
+          compile_error("Invalid statement");
         }
     }
-    return prog;
+    m_prog.root = m_prog.add({ .kind = NodeKind::prog, .a = take_list(mark) });
+    return std::move(m_prog);
   }
 
 private:
-  // same as in tokenization.hpp
-  [[nodiscard]] inline std::optional<Token> peek(int offset = 0) const
+  // look ahead without consuming, the token stream lexes as far as it needs to
+  [[nodiscard]] inline std::optional<Token> peek(int offset = 0)
   {
-    if (m_index + offset >= m_tokens.size()) {
-      return {};
-    }
-    else {
-      return m_tokens.at(m_index + offset);
-    }
+    return m_tokens.peek(offset);
   }
-  // same as in tokenization.hpp
+
   inline Token consume()
   {
-    return m_tokens.at(m_index++);
+    return m_tokens.consume();
   }
 
   inline Token try_consume(TokenType type, const std::string& err_msg)
@@ -768,8 +444,7 @@ private:
         return consume();
       }
       else {
-        std::cerr << err_msg << std::endl;
-        exit(EXIT_FAILURE);
+        compile_error(err_msg);
       }
   }
 
@@ -783,7 +458,15 @@ private:
       }
   }
 
-  const std::vector<Token> m_tokens;
-  size_t m_index = 0;
-  ArenaAllocator m_allocator;
-};
\ No newline at end of file
+  // Move everything pushed on the scratch stack since `mark` into a list in the program
+  inline uint32_t take_list(size_t mark)
+  {
+    uint32_t list = m_prog.add_list(std::span<const uint32_t>(m_scratch).subspan(mark));
+    m_scratch.resize(mark);
+    return list;
+  }
+
+  TokenStream m_tokens;
+  NodeProg m_prog {};
+  std::vector<uint32_t> m_scratch {}; // children of the lists that are still being parsed
+};
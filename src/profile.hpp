@@ -0,0 +1,366 @@
+// This file is -fprofile: counters the backends build into the executable, and the file it writes them to when it exits.
+// Every code unit (the main program and each function, see code_units) has profile sites: the unit itself, each of its loops and each of
+// its ifs, numbered in node order with the unit first. A site has four 64-bit counters in .bss (ProfileCounter), under a label made of the
+// unit's name and the site's number, so the code of one unit doesn't depend on the sites of the others and incremental builds still work.
+// - a function counts its calls and the rdtsc cycles spent in it, the main program its cycles
+// - a loop counts how often it is reached, its iterations and its cycles
+// - an if counts how often its condition was true and how often it was false
+// Cycles are kept as a sum without remembering when an activation started: entering subtracts the timestamp, leaving adds it. A return
+// leaves every loop it is in and the function, a self tail call leaves the loops and counts another call of the same activation. Whatever
+// is still running when the program exits (the main program, the functions and loops an `exit` is in) is closed at that point, by adding
+// the timestamp once per activation still open. Cycles include everything called from the site, a recursive function counts each level
+// of the recursion it is in.
+// The snippets keep every register except the flags, so they can go anywhere the flags aren't live, in any backend.
+// The executable writes the profile with plain syscalls on every exit: a header and a table of the sites (built here, at compile time, into
+// .rodata), then the counters. A program killed by a signal writes nothing. read_profile and print_profile are the other end, for
+// `hydro --show-profile`.
+// The layout, in host byte order:
+//   ProfileFileHeader | ProfileRecord per site | the unit names | 4 u64 counters per site
+// Else if chains are not turned into jump tables or searches while profiling, so every if in them is counted.
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "./ast.hpp"
+#include "./emitter.hpp"
+#include "./interner.hpp"
+#include "./runtime.hpp"
+#include "./source.hpp"
+
+enum class ProfileSiteKind : uint8_t {
+  function, // the main program or a function definition
+  loop, // while or for
+  branch, // if
+};
+
+// The counters of a site, in this order
+enum class ProfileCounter : uint8_t {
+  primary, // function: calls, loop: times it was reached, if: times its condition was true
+  secondary, // loop: iterations, if: times its condition was false
+  active, // function and loop: activations entered and not left yet. 0 in the file, they are closed before it is written
+  cycles, // function and loop: rdtsc cycles spent in them
+};
+
+inline constexpr size_t profile_counter_count = 4;
+
+// What the code does at a point of the program
+enum class ProfileEvent : uint8_t {
+  enter, // a function or loop starts: count it and subtract the timestamp
+  leave, // it ends: add the timestamp
+  primary, // count ProfileCounter::primary (a self tail call, a true condition)
+  secondary, // count ProfileCounter::secondary (an iteration, a false condition)
+};
+
+struct ProfileSite {
+  NodeIndex node;
+  ProfileSiteKind kind;
+};
+
+// The sites of the code unit `unit` (the prog node or a func_def), in the order they are numbered: the unit, then its loops and ifs in
+// node order. Function definitions nested in it are units of their own
+[[nodiscard]] inline std::vector<ProfileSite> unit_profile_sites(const NodeProg& prog, NodeIndex unit)
+{
+  std::vector<ProfileSite> sites = { { unit, ProfileSiteKind::function } };
+  auto walk = [&](auto& self, NodeIndex index) -> void {
+    if (index == null_node) {
+      return;
+    }
+    const Node& node = prog[index];
+    switch (node.kind) {
+    case NodeKind::scope:
+      for (NodeIndex stmt : prog.list(node.a)) {
+        self(self, stmt);
+      }
+      break;
+    case NodeKind::stmt_if:
+      sites.push_back({ index, ProfileSiteKind::branch });
+      self(self, node.b);
+      self(self, node.c);
+      break;
+    case NodeKind::stmt_while:
+      sites.push_back({ index, ProfileSiteKind::loop });
+      self(self, node.b);
+      break;
+    case NodeKind::stmt_for:
+      sites.push_back({ index, ProfileSiteKind::loop });
+      self(self, prog.list(node.a)[3]);
+      break;
+    default:
+      break; // no statements in it
+    }
+  };
+  const Node& node = prog[unit];
+  if (node.kind == NodeKind::func_def) {
+    walk(walk, node.c);
+  }
+  else {
+    for (NodeIndex stmt : prog.list(node.a)) {
+      walk(walk, stmt);
+    }
+  }
+  return sites;
+}
+
+// The label of the counters of site `site` of the unit named `unit` (_start for the main program): hydro_prof.<unit>.<site>
+struct ProfileLabel {
+  std::string_view unit;
+  uint32_t site;
+};
+
+inline AsmBuffer& operator<<(AsmBuffer& out, const ProfileLabel& label)
+{
+  return out << "hydro_prof." << label.unit << "." << label.site;
+}
+
+// The code for `event` at site `label`. It changes nothing but the counters and the flags
+inline void emit_profile_event(AsmBuffer& out, const ProfileLabel& label, ProfileEvent event)
+{
+  auto counter = [&](ProfileCounter which) -> AsmBuffer& {
+    return out << "QWORD [" << label << " + " << static_cast<int>(which) * 8 << "]";
+  };
+  auto timestamp = [&](std::string_view instr) {
+    out << "    push rax\n"
+           "    push rdx\n"
+           "    rdtsc\n"
+           "    shl rdx, 32\n"
+           "    or rax, rdx\n"
+           "    " << instr << " ";
+    counter(ProfileCounter::cycles) << ", rax\n";
+    out << "    pop rdx\n"
+           "    pop rax\n";
+  };
+  switch (event) {
+  case ProfileEvent::enter:
+    timestamp("sub");
+    out << "    inc ";
+    counter(ProfileCounter::active) << "\n";
+    out << "    inc ";
+    counter(ProfileCounter::primary) << "\n";
+    break;
+  case ProfileEvent::leave:
+    timestamp("add");
+    out << "    dec ";
+    counter(ProfileCounter::active) << "\n";
+    break;
+  case ProfileEvent::primary:
+    out << "    inc ";
+    counter(ProfileCounter::primary) << "\n";
+    break;
+  case ProfileEvent::secondary:
+    out << "    inc ";
+    counter(ProfileCounter::secondary) << "\n";
+    break;
+  }
+}
+
+// Every site of a program, unit by unit in the order of code_units, and where the executable writes the profile
+struct ProfileTable {
+  struct Unit {
+    std::string name;
+    std::vector<ProfileSiteKind> sites;
+  };
+
+  std::string path;
+  std::vector<Unit> units;
+};
+
+[[nodiscard]] inline ProfileTable profile_table(const NodeProg& prog, const Interner& interner, std::string path)
+{
+  ProfileTable table { .path = std::move(path), .units = {} };
+  for (NodeIndex unit : code_units(prog)) {
+    ProfileTable::Unit& entry = table.units.emplace_back();
+    entry.name = unit == prog.root ? "_start" : std::string(interner.name(prog[unit].a));
+    for (const ProfileSite& site : unit_profile_sites(prog, unit)) {
+      entry.sites.push_back(site.kind);
+    }
+  }
+  return table;
+}
+
+inline constexpr char profile_file_magic[8] = { 'H', 'Y', 'D', 'R', 'O', 'P', 'R', 'F' };
+inline constexpr uint64_t profile_file_version = 1;
+
+struct ProfileFileHeader {
+  char magic[8];
+  uint64_t version;
+  uint64_t site_count;
+  uint64_t name_size; // of the names after the records
+};
+
+struct ProfileRecord {
+  uint64_t kind; // a ProfileSiteKind
+  uint64_t site; // its number in the unit
+  uint64_t name_offset; // the unit's name, in the names after the records
+  uint64_t name_size;
+};
+
+static_assert(sizeof(ProfileFileHeader) == 32);
+static_assert(sizeof(ProfileRecord) == 32);
+
+// The counters of every site and hydro_profile_exit, which writes them out and then exits with the status in rdi like emit_exit
+inline void emit_profile_runtime(AsmBuffer& out, const ProfileTable& table, bool uses_print)
+{
+  uint64_t site_count = 0;
+  uint64_t name_size = 0;
+  for (const ProfileTable::Unit& unit : table.units) {
+    site_count += unit.sites.size();
+    name_size += unit.name.size();
+  }
+  uint64_t header_size = sizeof(ProfileFileHeader) + site_count * sizeof(ProfileRecord) + name_size;
+  uint64_t counter_size = site_count * profile_counter_count * 8;
+
+  // Close whatever is still open, then open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644), write the table and the counters and close
+  out << "section .text\n"
+         "hydro_profile_exit:\n"
+         "    push rdi\n"
+         "    rdtsc\n"
+         "    shl rdx, 32\n"
+         "    or rax, rdx\n"
+         "    mov r9, rax\n"
+         "    lea rsi, [hydro_profile_counters]\n"
+         "    mov rcx, " << site_count << "\n"
+         "hydro_profile_exit.close:\n"
+         "    mov rax, QWORD [rsi + 16]\n"
+         "    imul rax, r9\n"
+         "    add QWORD [rsi + 24], rax\n"
+         "    mov QWORD [rsi + 16], 0\n"
+         "    add rsi, 32\n"
+         "    dec rcx\n"
+         "    jnz hydro_profile_exit.close\n"
+         "    mov rax, 2\n"
+         "    lea rdi, [hydro_profile_path]\n"
+         "    mov rsi, 577\n"
+         "    mov rdx, 420\n"
+         "    syscall\n"
+         "    test rax, rax\n"
+         "    js hydro_profile_exit.done\n"
+         "    mov r8, rax\n"
+         "    mov rdi, r8\n"
+         "    lea rsi, [hydro_profile_header]\n"
+         "    mov rdx, " << header_size << "\n"
+         "    mov rax, 1\n"
+         "    syscall\n"
+         "    mov rdi, r8\n"
+         "    lea rsi, [hydro_profile_counters]\n"
+         "    mov rdx, " << counter_size << "\n"
+         "    mov rax, 1\n"
+         "    syscall\n"
+         "    mov rdi, r8\n"
+         "    mov rax, 3\n"
+         "    syscall\n"
+         "hydro_profile_exit.done:\n"
+         "    pop rdi\n";
+  emit_exit(out, uses_print);
+
+  out << "section .rodata\n"
+         "hydro_profile_header:\n"
+         "    db `HYDROPRF`\n"
+         "    dq " << profile_file_version << ", " << site_count << ", " << name_size << "\n";
+  uint64_t name_offset = 0;
+  for (const ProfileTable::Unit& unit : table.units) {
+    for (size_t site = 0; site < unit.sites.size(); site++) {
+      out << "    dq " << static_cast<uint64_t>(unit.sites[site]) << ", " << site << ", " << name_offset << ", " << unit.name.size()
+          << "\n";
+    }
+    name_offset += unit.name.size();
+  }
+  for (const ProfileTable::Unit& unit : table.units) {
+    out << "    db `" << unit.name << "`\n"; // identifiers, nothing to escape
+  }
+  // The path byte by byte, it may have anything in it
+  out << "hydro_profile_path: db ";
+  for (char c : table.path) {
+    out << static_cast<int>(static_cast<unsigned char>(c)) << ", ";
+  }
+  out << "0\n";
+
+  out << "section .bss\n"
+         "hydro_profile_counters:\n";
+  for (const ProfileTable::Unit& unit : table.units) {
+    for (uint32_t site = 0; site < unit.sites.size(); site++) {
+      out << ProfileLabel { unit.name, site } << ": resq " << profile_counter_count << "\n";
+    }
+  }
+}
+
+// One site of a profile file
+struct ProfileEntry {
+  std::string unit;
+  ProfileSiteKind kind;
+  uint64_t site;
+  uint64_t counters[profile_counter_count];
+};
+
+// The sites in the profile file at `path`, an empty optional if it can't be read or isn't a profile of this version
+[[nodiscard]] inline std::optional<std::vector<ProfileEntry>> read_profile(const std::string& path)
+{
+  std::optional<SourceBuffer> buffer = SourceBuffer::open(path);
+  if (!buffer.has_value() || buffer->view().size() < sizeof(ProfileFileHeader)) {
+    return {};
+  }
+  std::string_view file = buffer->view();
+  ProfileFileHeader header {};
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, profile_file_magic, sizeof(header.magic)) != 0 || header.version != profile_file_version) {
+    return {};
+  }
+  uint64_t records_size = header.site_count * sizeof(ProfileRecord);
+  uint64_t counters_size = header.site_count * profile_counter_count * 8;
+  if (header.site_count > file.size() / sizeof(ProfileRecord) || header.name_size > file.size()
+      || file.size() != sizeof(ProfileFileHeader) + records_size + header.name_size + counters_size) {
+    return {};
+  }
+  std::string_view names = file.substr(sizeof(ProfileFileHeader) + records_size, header.name_size);
+  const char* counters = file.data() + sizeof(ProfileFileHeader) + records_size + header.name_size;
+
+  std::vector<ProfileEntry> entries(header.site_count);
+  for (uint64_t i = 0; i < header.site_count; i++) {
+    ProfileRecord record {};
+    std::memcpy(&record, file.data() + sizeof(ProfileFileHeader) + i * sizeof(ProfileRecord), sizeof(record));
+    if (record.kind > static_cast<uint64_t>(ProfileSiteKind::branch) || record.name_offset > names.size()
+        || record.name_size > names.size() - record.name_offset) {
+      return {};
+    }
+    ProfileEntry& entry = entries[i];
+    entry.unit = names.substr(record.name_offset, record.name_size);
+    entry.kind = static_cast<ProfileSiteKind>(record.kind);
+    entry.site = record.site;
+    std::memcpy(entry.counters, counters + i * sizeof(entry.counters), sizeof(entry.counters));
+  }
+  return entries;
+}
+
+// The sites as a table, one per line: `fib` for a function, `fib loop 2` / `fib if 3` for the loops and ifs numbered as in
+// unit_profile_sites
+inline void print_profile(std::ostream& out, std::span<const ProfileEntry> entries)
+{
+  out << std::left << std::setw(32) << "site" << std::right << std::setw(14) << "calls/entries" << std::setw(14) << "iter/false"
+      << std::setw(20) << "cycles" << "\n";
+  for (const ProfileEntry& entry : entries) {
+    std::string name = entry.unit;
+    if (entry.kind != ProfileSiteKind::function) {
+      name += (entry.kind == ProfileSiteKind::loop ? " loop " : " if ") + std::to_string(entry.site);
+    }
+    out << std::left << std::setw(32) << name << std::right << std::setw(14) << entry.counters[0];
+    if (entry.kind == ProfileSiteKind::function) {
+      out << std::setw(14) << "-";
+    }
+    else {
+      out << std::setw(14) << entry.counters[1];
+    }
+    if (entry.kind == ProfileSiteKind::branch) {
+      out << std::setw(20) << "-";
+    }
+    else {
+      out << std::setw(20) << entry.counters[static_cast<size_t>(ProfileCounter::cycles)];
+    }
+    out << "\n";
+  }
+}
@@ -0,0 +1,229 @@
+// This file holds the pieces of assembly that don't depend on the program being compiled: the print runtime both backends call, and how
+// the string literals are written into .rodata.
+// Output goes through a buffer in .bss instead of one write syscall per print, and is flushed when the buffer fills up and when the
+// program exits, so every exit of a program that prints has to go through hydro_exit. A program killed by a signal loses what is still in
+// the buffer.
+// Integers are converted without a div: two digits at a time, the quotient by 100 is a multiply by its reciprocal and the digit pair comes
+// out of a 200 byte table.
+// The subroutines keep to the caller-saved registers (rax, rcx, rdx, rsi, rdi, r8, r9, r11), callers keep anything that has to survive a
+// print in the callee-saved ones.
+
+#pragma once
+#include <cstdint>
+#include <string_view>
+#include "./emitter.hpp"
+#include "./hash.hpp"
+
+inline constexpr int print_buffer_size = 8192;
+
+// The string literal comes straight from the source with its escape sequences still in it. NASM's backquoted strings understand the
+// same escape sequences (\n, \t, \", \\), so the raw text is emitted as-is and only a backtick needs escaping.
+inline void write_nasm_string(AsmBuffer& out, std::string_view raw)
+{
+  out << '`';
+  for (size_t tick = raw.find('`'); tick != std::string_view::npos; tick = raw.find('`')) {
+    out << raw.substr(0, tick) << "\\`";
+    raw.remove_prefix(tick + 1);
+  }
+  out << raw << '`';
+}
+
+// The number of bytes the literal stands for: every escape sequence the tokenizer accepts is a backslash and one character
+inline uint64_t string_literal_length(std::string_view raw)
+{
+  uint64_t length = 0;
+  for (size_t i = 0; i < raw.size(); i++) {
+    i += raw[i] == '\\';
+    length++;
+  }
+  return length;
+}
+
+// The label of a string literal in the pool, str_<hash of the raw text>. It is named after the text rather than numbered so the code
+// that refers to it doesn't depend on the other literals of the program, which lets incremental builds reuse the machine code of a
+// function whatever strings were added or removed elsewhere
+struct StringLabel {
+  uint64_t hash;
+
+  inline explicit StringLabel(std::string_view raw)
+    : hash(xxh64(raw))
+  {
+  }
+};
+
+inline AsmBuffer& operator<<(AsmBuffer& out, const StringLabel& label)
+{
+  static constexpr char digits[] = "0123456789abcdef";
+  char name[] = "str_0000000000000000";
+  uint64_t hash = label.hash;
+  for (size_t i = sizeof(name) - 2; hash != 0; i--, hash >>= 4) {
+    name[i] = digits[hash & 15];
+  }
+  return out << std::string_view(name, sizeof(name) - 1);
+}
+
+// The string pool: every distinct literal once, in .rodata, under its StringLabel. Its length is stored in the 8 bytes in front of it, so
+// printing a string is a copy of known size whether the length is known where it's printed (a literal) or not (a variable holding one)
+template <typename Strings>
+inline void emit_string_pool(AsmBuffer& out, const Strings& strings)
+{
+  if (strings.empty()) {
+    return;
+  }
+  out << "section .rodata\n";
+  for (std::string_view raw : strings) {
+    out << "    dq " << string_literal_length(raw) << "\n";
+    out << StringLabel(raw) << ":";
+    if (!raw.empty()) {
+      out << " db ";
+      write_nasm_string(out, raw);
+    }
+    out << "\n";
+  }
+}
+
+// The runtime, emitted once after everything else in programs that print. Its text, data and bss each get their own section directive, so
+// it can go after the program's own sections:
+//   hydro_print_int     writes the integer in rax in decimal
+//   hydro_print_string  writes the rdx bytes rsi points at
+//   hydro_flush         writes out the buffer
+//   hydro_write         writes the rdx bytes rsi points at straight to stdout
+//   hydro_exit          flushes and exits with the status in rdi, never returns
+inline void emit_print_runtime(AsmBuffer& out)
+{
+  // A number takes at most 20 digits and a sign, the buffer is flushed first unless that much is free
+  out << "section .text\n"
+         "hydro_print_int:\n"
+         "    mov rcx, QWORD [hydro_out_len]\n"
+         "    cmp rcx, " << print_buffer_size - 21 << "\n"
+         "    jbe hydro_print_int.room\n"
+         "    push rax\n"
+         "    call hydro_flush\n"
+         "    pop rax\n"
+         "    xor rcx, rcx\n"
+         "hydro_print_int.room:\n"
+         "    lea rdi, [hydro_out_buf]\n"
+         "    add rdi, rcx\n" // Where the number goes
+         "    test rax, rax\n"
+         "    jns hydro_print_int.count\n"
+         "    mov byte [rdi], '-'\n"
+         "    inc rdi\n"
+         "    neg rax\n" // From here on rax is unsigned, so the most negative number comes out right too
+         "hydro_print_int.count:\n"
+         "    mov rsi, 1\n" // Count the digits, so they can be written backwards from the end straight into the buffer
+         "    mov rdx, 10\n"
+         "hydro_print_int.count_loop:\n"
+         "    cmp rax, rdx\n"
+         "    jb hydro_print_int.counted\n"
+         "    inc rsi\n"
+         "    cmp rsi, 20\n" // 10^20 doesn't fit in 64 bits
+         "    je hydro_print_int.counted\n"
+         "    imul rdx, rdx, 10\n"
+         "    jmp hydro_print_int.count_loop\n"
+         "hydro_print_int.counted:\n"
+         "    add rsi, rdi\n" // One past the last digit
+         "    lea rcx, [hydro_out_buf]\n"
+         "    mov rdx, rsi\n"
+         "    sub rdx, rcx\n"
+         "    mov QWORD [hydro_out_len], rdx\n"
+         "    lea r11, [hydro_digit_pairs]\n"
+         "hydro_print_int.pairs:\n"
+         "    cmp rax, 100\n"
+         "    jb hydro_print_int.last\n"
+         "    mov r9, rax\n"
+         "    shr rax, 2\n" // n / 100 = ((n >> 2) * ceil(2^66 / 100)) >> 66, exact for every 64-bit n
+         "    mov rdx, 0x28F5C28F5C28F5C3\n"
+         "    mul rdx\n"
+         "    shr rdx, 2\n"
+         "    mov rax, rdx\n"
+         "    imul rdx, rdx, 100\n"
+         "    sub r9, rdx\n" // n % 100
+         "    mov cl, byte [r11 + r9*2]\n"
+         "    mov byte [rsi - 2], cl\n"
+         "    mov cl, byte [r11 + r9*2 + 1]\n"
+         "    mov byte [rsi - 1], cl\n"
+         "    sub rsi, 2\n"
+         "    jmp hydro_print_int.pairs\n"
+         "hydro_print_int.last:\n"
+         "    cmp rax, 10\n"
+         "    jb hydro_print_int.one\n"
+         "    mov cl, byte [r11 + rax*2]\n"
+         "    mov byte [rsi - 2], cl\n"
+         "    mov cl, byte [r11 + rax*2 + 1]\n"
+         "    mov byte [rsi - 1], cl\n"
+         "    ret\n"
+         "hydro_print_int.one:\n"
+         "    add al, '0'\n"
+         "    mov byte [rsi - 1], al\n"
+         "    ret\n"
+         "hydro_print_string:\n"
+         "    mov rcx, QWORD [hydro_out_len]\n"
+         "    mov rax, " << print_buffer_size << "\n"
+         "    sub rax, rcx\n" // Room left in the buffer
+         "    cmp rdx, rax\n"
+         "    jbe hydro_print_string.copy\n"
+         "    push rsi\n"
+         "    push rdx\n"
+         "    call hydro_flush\n"
+         "    pop rdx\n"
+         "    pop rsi\n"
+         "    xor rcx, rcx\n"
+         "    cmp rdx, " << print_buffer_size << "\n"
+         "    ja hydro_write\n" // Bigger than the whole buffer, no point in copying it
+         "hydro_print_string.copy:\n"
+         "    lea rdi, [hydro_out_buf]\n"
+         "    add rdi, rcx\n"
+         "    add rcx, rdx\n"
+         "    mov QWORD [hydro_out_len], rcx\n"
+         "    mov rcx, rdx\n"
+         "    rep movsb\n"
+         "    ret\n"
+         "hydro_flush:\n"
+         "    lea rsi, [hydro_out_buf]\n"
+         "    mov rdx, QWORD [hydro_out_len]\n"
+         "    mov QWORD [hydro_out_len], 0\n"
+         "hydro_write:\n"
+         "    test rdx, rdx\n"
+         "    jz hydro_write.done\n"
+         "    mov rax, 1\n"
+         "    mov rdi, 1\n"
+         "    syscall\n"
+         "    test rax, rax\n" // A short write carries on with the rest, an error drops it
+         "    jle hydro_write.done\n"
+         "    add rsi, rax\n"
+         "    sub rdx, rax\n"
+         "    jmp hydro_write\n"
+         "hydro_write.done:\n"
+         "    ret\n"
+         "hydro_exit:\n"
+         "    mov r8, rdi\n" // hydro_flush leaves r8 alone
+         "    call hydro_flush\n"
+         "    mov rdi, r8\n"
+         "    mov rax, 60\n"
+         "    syscall\n";
+  out << "section .rodata\n"
+         "hydro_digit_pairs: db `";
+  for (int i = 0; i < 100; i++) {
+    out << static_cast<char>('0' + i / 10) << static_cast<char>('0' + i % 10);
+  }
+  out << "`\n";
+  out << "section .bss\n"
+         "hydro_out_len: resq 1\n"
+         "hydro_out_buf: resb " << print_buffer_size << "\n";
+}
+
+// How a program leaves with the status in rdi: through hydro_profile_exit when it is profiled (see profile.hpp), which writes the profile
+// and then comes back here, through hydro_exit when it prints, so the output gets flushed, or straight out when it doesn't
+inline void emit_exit(AsmBuffer& out, bool uses_print, bool profile = false)
+{
+  if (profile) {
+    out << "    jmp hydro_profile_exit\n";
+  }
+  else if (uses_print) {
+    out << "    jmp hydro_exit\n";
+  }
+  else {
+    out << "    mov rax, 60\n"
+           "    syscall\n";
+  }
+}
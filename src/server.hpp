@@ -0,0 +1,320 @@
+// This file is `hydro --server=SOCKET` and `hydro --connect=SOCKET`: one long running compiler that takes command lines over a Unix
+// socket, so a build that runs thousands of small compiles pays for starting the compiler, hashing its binary for the cache keys (see
+// CompileCache::compiler_hash), opening its caches (main.cpp keeps them in a CompileCaches for the server's lifetime) and warming up the
+// allocator once instead of once per file.
+// A request is one connection. Everything is in host byte order, both ends are on the same machine:
+//   request:   u32 count | count NUL-terminated strings: the client's working directory, then its arguments
+//   response:  u32 exit status | u64 size | what the compile wrote to stdout | u64 size | what it wrote to stderr
+// The server starts one worker thread per hardware thread (at least `server_min_workers`) and hands every connection to the next free one,
+// so clients compile at the same time and a long compile only holds up its own client. A client that sends or takes nothing for
+// `server_timeout_seconds` is dropped, and until then it only ties up one worker, which idles meanwhile.
+// A request runs for the working directory of its client: the handler gets it and resolves relative paths against it (the process has
+// one working directory for all the requests), so they mean what they would have meant to a local hydro. A compile uses as many
+// threads as its -j and --codegen-threads ask for, on top of its worker.
+
+#pragma once
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Runs one command line (without the program name) for a client in the directory `cwd`, writing what it prints to `out` and `err`, and
+// returns the exit status. Called on several threads at once
+using ServerHandler
+  = std::function<int(const std::string& cwd, const std::vector<std::string>& args, std::ostream& out, std::ostream& err)>;
+
+// How long the server waits for a client to send its request or take its answer before it hangs up on it
+inline constexpr int server_timeout_seconds = 30;
+
+// The most a request may hold: strings, bytes in one of them (a path or an option) and bytes altogether. A bigger one is dropped unread
+inline constexpr uint32_t server_max_strings = 1 << 16;
+inline constexpr size_t server_max_string_size = 1 << 16;
+inline constexpr size_t server_max_request_size = 1 << 22;
+
+// Workers wait on their clients as much as they compile, so even a machine with few hardware threads gets this many
+inline constexpr unsigned server_min_workers = 8;
+
+// Write all of `data` to `fd`, false if the other end went away
+inline bool write_fully(int fd, std::string_view data)
+{
+  while (!data.empty()) {
+    ssize_t n = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data.remove_prefix(static_cast<size_t>(n));
+  }
+  return true;
+}
+
+// Read exactly `size` bytes of `fd` into `data`, false if it ends first
+inline bool read_fully(int fd, char* data, size_t size)
+{
+  while (size > 0) {
+    ssize_t n = ::read(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+template <typename T>
+inline void append_raw(std::string& out, const T& value)
+{
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// The address of the socket at `path`, an empty optional if the path is too long for one
+inline std::optional<sockaddr_un> socket_address(const std::string& path)
+{
+  sockaddr_un address {};
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    return {};
+  }
+  std::memcpy(address.sun_path, path.data(), path.size());
+  return address;
+}
+
+// Read one request from `client`: its working directory and its arguments. An empty optional if the client hung up halfway or the
+// request is over one of the server_max_* limits
+inline std::optional<std::vector<std::string>> read_request(int client)
+{
+  uint32_t count = 0;
+  if (!read_fully(client, reinterpret_cast<char*>(&count), sizeof(count)) || count == 0 || count > server_max_strings) {
+    return {};
+  }
+  size_t total = 0;
+  std::vector<std::string> strings;
+  std::string current;
+  char buffer[4096];
+  while (strings.size() < count) {
+    ssize_t n = ::read(client, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return {};
+    }
+    total += static_cast<size_t>(n);
+    if (total > server_max_request_size) {
+      return {};
+    }
+    // Each string up to its NUL in one append, a string can go on into the next chunk
+    std::string_view chunk(buffer, static_cast<size_t>(n));
+    while (!chunk.empty() && strings.size() < count) {
+      size_t end = chunk.find('\0');
+      current.append(chunk.substr(0, end));
+      if (current.size() > server_max_string_size) {
+        return {};
+      }
+      if (end == std::string_view::npos) {
+        break;
+      }
+      strings.push_back(std::move(current));
+      current.clear();
+      chunk.remove_prefix(end + 1);
+    }
+  }
+  return strings;
+}
+
+// Answer the one request on `client`, then close it. A client that stalls for server_timeout_seconds fails its read or write and is dropped
+inline void answer_client(int client, const ServerHandler& handle)
+{
+  timeval timeout { .tv_sec = server_timeout_seconds, .tv_usec = 0 };
+  ::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  std::optional<std::vector<std::string>> request = read_request(client);
+  if (request.has_value()) {
+    std::ostringstream out;
+    std::ostringstream err;
+    int status = 1;
+    std::error_code error;
+    const std::string& cwd = request->front();
+    if (!std::filesystem::path(cwd).is_absolute() || !std::filesystem::is_directory(cwd, error)) {
+      err << "The server can't enter " << cwd << std::endl;
+    }
+    else {
+      std::vector<std::string> args(request->begin() + 1, request->end());
+      status = handle(cwd, args, out, err);
+    }
+    std::string response;
+    append_raw(response, static_cast<uint32_t>(status));
+    for (const std::string& text : { out.str(), err.str() }) {
+      append_raw(response, static_cast<uint64_t>(text.size()));
+      response += text;
+    }
+    write_fully(client, response);
+  }
+  ::close(client);
+}
+
+// Whether something may be listening on the socket at `address`: only a refused connection says for sure that nothing is
+inline bool is_listening(const sockaddr_un& address)
+{
+  int probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probe < 0) {
+    return true;
+  }
+  bool listening = ::connect(probe, reinterpret_cast<const sockaddr*>(&address), sizeof(sockaddr_un)) == 0 || errno != ECONNREFUSED;
+  ::close(probe);
+  return listening;
+}
+
+// Listen on `path` and hand every request to `handle` on one of the workers, until the process is killed. A socket nothing listens on
+// at `path`, left by a server that didn't shut down cleanly, is replaced; anything else there is left alone. False, with the reason in
+// `error`, if the socket can't be set up
+inline bool serve(const std::string& path, const ServerHandler& handle, std::string& error)
+{
+  std::optional<sockaddr_un> address = socket_address(path);
+  if (!address.has_value()) {
+    error = "Invalid socket path " + path;
+    return false;
+  }
+  int listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    error = std::string("Could not create a socket: ") + std::strerror(errno);
+    return false;
+  }
+  struct stat info {};
+  if (::lstat(path.c_str(), &info) == 0) {
+    if (!S_ISSOCK(info.st_mode) || is_listening(address.value())) {
+      error = S_ISSOCK(info.st_mode) ? "A server is already listening on " + path : path + " exists and isn't a socket";
+      ::close(listener);
+      return false;
+    }
+    ::unlink(path.c_str());
+  }
+  if (::bind(listener, reinterpret_cast<const sockaddr*>(&address.value()), sizeof(sockaddr_un)) != 0 || ::listen(listener, 128) != 0) {
+    error = "Could not listen on " + path + ": " + std::strerror(errno);
+    ::close(listener);
+    return false;
+  }
+  ::signal(SIGPIPE, SIG_IGN); // a client that hangs up only loses its own answer
+
+  // The accepted connections no worker has taken yet. The workers are declared last, so they are joined before what they use goes away
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<int> clients;
+  bool stopping = false;
+  std::vector<std::jthread> workers;
+  for (unsigned i = 0; i < std::max(server_min_workers, std::thread::hardware_concurrency()); i++) {
+    workers.emplace_back([&] {
+      for (;;) {
+        int client;
+        {
+          std::unique_lock lock(mutex);
+          ready.wait(lock, [&] { return stopping || !clients.empty(); });
+          if (clients.empty()) {
+            return;
+          }
+          client = clients.front();
+          clients.pop_front();
+        }
+        answer_client(client, handle);
+      }
+    });
+  }
+
+  for (;;) {
+    int client = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      error = std::string("accept failed: ") + std::strerror(errno);
+      ::close(listener);
+      {
+        std::lock_guard lock(mutex);
+        stopping = true; // the workers answer the clients already accepted, then return
+      }
+      ready.notify_all();
+      return false;
+    }
+    {
+      std::lock_guard lock(mutex);
+      clients.push_back(client);
+    }
+    ready.notify_one();
+  }
+}
+
+// Send the command line `args` to the server at `path` and write what it printed to `out` and `err`. Its exit status, or an empty
+// optional (with the reason in `err`) if there is no server or it went away before answering
+inline std::optional<int> request_compile(const std::string& path, const std::vector<std::string>& args, std::ostream& out,
+  std::ostream& err)
+{
+  std::optional<sockaddr_un> address = socket_address(path);
+  if (!address.has_value()) {
+    err << "Invalid socket path " << path << std::endl;
+    return {};
+  }
+  std::vector<char> cwd(4096);
+  while (::getcwd(cwd.data(), cwd.size()) == nullptr) {
+    if (errno != ERANGE) {
+      err << "Could not get the working directory: " << std::strerror(errno) << std::endl;
+      return {};
+    }
+    cwd.resize(cwd.size() * 2);
+  }
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || ::connect(fd, reinterpret_cast<const sockaddr*>(&address.value()), sizeof(sockaddr_un)) != 0) {
+    err << "Could not connect to the server at " << path << ": " << std::strerror(errno) << std::endl;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return {};
+  }
+
+  std::string request;
+  append_raw(request, static_cast<uint32_t>(args.size() + 1));
+  request.append(cwd.data());
+  request += '\0';
+  for (const std::string& arg : args) {
+    request += arg;
+    request += '\0';
+  }
+  uint32_t status = 0;
+  bool ok = write_fully(fd, request) && read_fully(fd, reinterpret_cast<char*>(&status), sizeof(status));
+  for (std::ostream* stream : { &out, &err }) {
+    uint64_t size = 0;
+    ok = ok && read_fully(fd, reinterpret_cast<char*>(&size), sizeof(size));
+    std::string text(ok ? size : 0, '\0');
+    ok = ok && read_fully(fd, text.data(), text.size());
+    *stream << text;
+  }
+  ::close(fd);
+  if (!ok) {
+    err << "The server at " << path << " went away before answering" << std::endl;
+    return {};
+  }
+  return static_cast<int>(status);
+}
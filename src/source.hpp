@@ -0,0 +1,158 @@
+// This file owns the bytes of the program being compiled. Tokens keep `std::string_view`s that point straight into this buffer, so it has to
+// outlive the tokenizer, the parser and the generator.
+// Regular files are memory-mapped read-only: the kernel pages the file in as the tokenizer walks over it and nothing is copied. Anything that
+// can't be mapped (pipes, empty files, /dev/stdin) is read into a heap buffer instead.
+// While the token stream walks a mapped file front to back it calls `prefetch` for the window ahead of the tokenizer, so reading overlaps
+// with lexing and parsing, and `release_before` for what it has left behind, so the source doesn't stay in our RSS all at once.
+
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+class SourceBuffer {
+public:
+  // Open and map (or read) the file, returns an empty optional if the file can't be opened or read
+  static inline std::optional<SourceBuffer> open(const std::string& path)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return {};
+    }
+    std::optional<SourceBuffer> result;
+    struct stat st {};
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void* addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        madvise(addr, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL); // we read the file front to back once
+        result = SourceBuffer(static_cast<const char*>(addr), static_cast<size_t>(st.st_size), true);
+      }
+    }
+    if (!result.has_value()) {
+      result = read_all(fd);
+    }
+    close(fd);
+    return result;
+  }
+
+  inline SourceBuffer(SourceBuffer&& other) noexcept
+    : m_data(std::exchange(other.m_data, nullptr))
+    , m_size(std::exchange(other.m_size, 0))
+    , m_mapped(other.m_mapped)
+  {
+  }
+
+  inline SourceBuffer& operator=(SourceBuffer&& other) noexcept
+  {
+    if (this != &other) {
+      release();
+      m_data = std::exchange(other.m_data, nullptr);
+      m_size = std::exchange(other.m_size, 0);
+      m_mapped = other.m_mapped;
+    }
+    return *this;
+  }
+
+  inline SourceBuffer(const SourceBuffer& other) = delete;
+
+  inline SourceBuffer& operator=(const SourceBuffer& other) = delete;
+
+  inline ~SourceBuffer()
+  {
+    release();
+  }
+
+  [[nodiscard]] inline std::string_view view() const
+  {
+    return { m_data, m_size };
+  }
+
+  // Ask the kernel to start reading [offset, offset + length) in the background
+  inline void prefetch(size_t offset, size_t length) const
+  {
+    if (!m_mapped || offset >= m_size) {
+      return;
+    }
+    size_t start = page_floor(offset);
+    madvise(const_cast<char*>(m_data) + start, std::min(m_size, offset + length) - start, MADV_WILLNEED);
+  }
+
+  // The pages before `offset` are not going to be read again soon. The mapping is private and never written, so dropping them is always
+  // safe: a string_view that still points in there just faults the page back in from the page cache
+  inline void release_before(size_t offset) const
+  {
+    size_t end = page_floor(std::min(offset, m_size));
+    if (!m_mapped || end == 0) {
+      return;
+    }
+    madvise(const_cast<char*>(m_data), end, MADV_DONTNEED);
+  }
+
+private:
+  inline SourceBuffer(const char* data, size_t size, bool mapped)
+    : m_data(data)
+    , m_size(size)
+    , m_mapped(mapped)
+  {
+  }
+
+  // Fallback for files we can't map, read it in chunks into a growing heap buffer
+  static inline std::optional<SourceBuffer> read_all(int fd)
+  {
+    size_t capacity = 64 * 1024;
+    size_t size = 0;
+    auto data = static_cast<char*>(malloc(capacity));
+    while (data != nullptr) {
+      if (size == capacity) {
+        capacity *= 2;
+        auto grown = static_cast<char*>(realloc(data, capacity));
+        if (grown == nullptr) {
+          break;
+        }
+        data = grown;
+      }
+      ssize_t n = read(fd, data + size, capacity - size);
+      if (n == 0) {
+        return SourceBuffer(data, size, false);
+      }
+      if (n < 0) {
+        break;
+      }
+      size += static_cast<size_t>(n);
+    }
+    free(data);
+    return {};
+  }
+
+  static inline size_t page_floor(size_t offset)
+  {
+    static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return offset & ~(page_size - 1);
+  }
+
+  inline void release()
+  {
+    if (m_data == nullptr) {
+      return;
+    }
+    if (m_mapped) {
+      munmap(const_cast<char*>(m_data), m_size);
+    }
+    else {
+      free(const_cast<char*>(m_data));
+    }
+    m_data = nullptr;
+  }
+
+  const char* m_data = nullptr;
+  size_t m_size = 0;
+  bool m_mapped = false;
+};
@@ -0,0 +1,438 @@
+// This file converts IR functions into and out of SSA form, and holds the cleanup that runs while a function is in it.
+// `build_ssa` is the classic construction: dominators with the Cooper-Harvey-Kennedy iteration, phis for every vreg that is assigned more
+// than once placed on the iterated dominance frontier of its definitions, then one walk over the dominator tree renaming every definition
+// to a fresh vreg. A variable read on a path where it was never written (only possible for phis that nothing reads) becomes 0.
+// `simplify_ssa` propagates copies and constants, folds instructions whose operands became constant or that are an identity (x + 0),
+// drops phis that only ever see one value, and removes instructions whose result isn't used. In SSA form all of that is a single forward
+// rewrite.
+// `destruct_ssa` splits critical edges and replaces every phi with copies at the end of its predecessors. The copies into one block are a
+// parallel assignment, they are ordered (with a temporary for cycles) so that no copy overwrites a value another one still has to read.
+
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <optional>
+#include <vector>
+#include "./ir.hpp"
+#include "./optimizer.hpp"
+
+// Renumber the blocks in reverse postorder and drop the unreachable ones. Successors are visited last to first, so for the structured
+// code the lowering produces this is the order of the source: a loop body comes right after its header, the else right after the then
+inline void order_blocks(IrFunction& fn)
+{
+  std::vector<BlockId> order;
+  std::vector<uint8_t> visited(fn.blocks.size(), 0);
+  std::vector<std::pair<BlockId, size_t>> stack { { 0, 0 } }; // block, successors visited so far
+  visited[0] = 1;
+  while (!stack.empty()) {
+    auto& [block, visited_succs] = stack.back();
+    std::span<const BlockId> succs = fn.blocks[block].succs();
+    if (visited_succs < succs.size()) {
+      BlockId succ = succs[succs.size() - 1 - visited_succs++];
+      if (visited[succ] == 0) {
+        visited[succ] = 1;
+        stack.emplace_back(succ, 0);
+      }
+      continue;
+    }
+    order.push_back(block);
+    stack.pop_back();
+  }
+  std::reverse(order.begin(), order.end());
+
+  std::vector<BlockId> renumbered(fn.blocks.size(), no_block);
+  for (BlockId i = 0; i < order.size(); i++) {
+    renumbered[order[i]] = i;
+  }
+  std::vector<IrBlock> blocks;
+  blocks.reserve(order.size());
+  for (BlockId id : order) {
+    blocks.push_back(std::move(fn.blocks[id]));
+    for (BlockId& target : blocks.back().terminator().target) {
+      if (target != no_block) {
+        target = renumbered[target];
+      }
+    }
+  }
+  fn.blocks = std::move(blocks);
+  compute_preds(fn);
+}
+
+// Immediate dominator of every block, blocks must be in reverse postorder (order_blocks). The entry is its own
+inline std::vector<BlockId> compute_idoms(const IrFunction& fn)
+{
+  std::vector<BlockId> idom(fn.blocks.size(), no_block);
+  idom[0] = 0;
+  auto intersect = [&](BlockId lhs, BlockId rhs) {
+    while (lhs != rhs) {
+      while (lhs > rhs) {
+        lhs = idom[lhs];
+      }
+      while (rhs > lhs) {
+        rhs = idom[rhs];
+      }
+    }
+    return lhs;
+  };
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (BlockId id = 1; id < fn.blocks.size(); id++) {
+      BlockId new_idom = no_block;
+      for (BlockId pred : fn.blocks[id].preds) {
+        if (idom[pred] != no_block) {
+          new_idom = new_idom == no_block ? pred : intersect(pred, new_idom);
+        }
+      }
+      if (idom[id] != new_idom) {
+        idom[id] = new_idom;
+        changed = true;
+      }
+    }
+  }
+  return idom;
+}
+
+inline void build_ssa(IrFunction& fn)
+{
+  order_blocks(fn);
+  const size_t block_count = fn.blocks.size();
+  const Vreg var_limit = fn.vreg_count; // vregs created from here on are the renamed ones, never variables
+  std::vector<BlockId> idom = compute_idoms(fn);
+
+  // The variables: every vreg with more than one definition, and the blocks defining them
+  std::vector<uint32_t> def_count(var_limit, 0);
+  for (const IrBlock& block : fn.blocks) {
+    for (const IrInst& inst : block.insts) {
+      if (inst.dst != no_vreg) {
+        def_count[inst.dst]++;
+      }
+    }
+  }
+  std::vector<std::vector<BlockId>> def_blocks(var_limit);
+  for (BlockId id = 0; id < block_count; id++) {
+    for (const IrInst& inst : fn.blocks[id].insts) {
+      if (inst.dst != no_vreg && def_count[inst.dst] > 1
+          && (def_blocks[inst.dst].empty() || def_blocks[inst.dst].back() != id)) {
+        def_blocks[inst.dst].push_back(id);
+      }
+    }
+  }
+
+  // Dominance frontiers
+  std::vector<std::vector<BlockId>> frontier(block_count);
+  for (BlockId id = 0; id < block_count; id++) {
+    const std::vector<BlockId>& preds = fn.blocks[id].preds;
+    if (preds.size() < 2) {
+      continue;
+    }
+    for (BlockId runner : preds) {
+      while (runner != idom[id]) {
+        if (frontier[runner].empty() || frontier[runner].back() != id) {
+          frontier[runner].push_back(id);
+        }
+        runner = idom[runner];
+      }
+    }
+  }
+
+  // Phis on the iterated dominance frontier. Their arguments start out as the variable itself, renaming fills in the real values
+  std::vector<Vreg> phi_for(block_count, no_vreg); // the last variable that got a phi in each block
+  std::vector<Vreg> queued_for(block_count, no_vreg);
+  std::vector<BlockId> worklist;
+  for (Vreg var = 0; var < var_limit; var++) {
+    if (def_blocks[var].empty()) {
+      continue;
+    }
+    worklist = def_blocks[var];
+    for (BlockId block : worklist) {
+      queued_for[block] = var;
+    }
+    while (!worklist.empty()) {
+      BlockId block = worklist.back();
+      worklist.pop_back();
+      for (BlockId join : frontier[block]) {
+        if (phi_for[join] == var) {
+          continue;
+        }
+        phi_for[join] = var;
+        IrBlock& target = fn.blocks[join];
+        target.insts.insert(target.insts.begin(),
+            { .op = IrOp::phi, .dst = var, .args = std::vector<IrValue>(target.preds.size(), IrValue::of_reg(var)) });
+        if (queued_for[join] != var) {
+          queued_for[join] = var;
+          worklist.push_back(join);
+        }
+      }
+    }
+  }
+
+  // Rename along the dominator tree. Each variable has a stack of the vregs its definitions were renamed to, the top is the one visible
+  std::vector<std::vector<BlockId>> children(block_count);
+  for (BlockId id = 1; id < block_count; id++) {
+    children[idom[id]].push_back(id);
+  }
+  std::vector<std::vector<Vreg>> names(var_limit);
+  auto current = [&](Vreg var) {
+    return names[var].empty() ? IrValue::of_imm(0) : IrValue::of_reg(names[var].back());
+  };
+  auto is_var = [&](const IrValue& value) { return value.is_reg() && value.reg < var_limit && def_count[value.reg] > 1; };
+
+  struct Frame {
+    BlockId block;
+    size_t pushed_start; // where this block's definitions start in `pushed`
+    bool entered;
+  };
+  std::vector<Vreg> pushed; // variables with a name pushed by the blocks on the walk, innermost last
+  std::vector<Frame> walk { { 0, 0, false } };
+  while (!walk.empty()) {
+    if (walk.back().entered) {
+      for (size_t i = pushed.size(); i-- > walk.back().pushed_start;) {
+        names[pushed[i]].pop_back();
+      }
+      pushed.resize(walk.back().pushed_start);
+      walk.pop_back();
+      continue;
+    }
+    BlockId id = walk.back().block;
+    walk.back() = { id, pushed.size(), true };
+
+    IrBlock& block = fn.blocks[id];
+    for (IrInst& inst : block.insts) {
+      if (inst.op != IrOp::phi) {
+        inst.for_each_use([&](IrValue& value) {
+          if (is_var(value)) {
+            value = current(value.reg);
+          }
+        });
+      }
+      if (inst.dst != no_vreg && inst.dst < var_limit && def_count[inst.dst] > 1) {
+        Vreg name = fn.new_vreg();
+        names[inst.dst].push_back(name);
+        pushed.push_back(inst.dst);
+        inst.dst = name;
+      }
+    }
+    for (BlockId succ : block.succs()) {
+      IrBlock& target = fn.blocks[succ];
+      size_t pred_index = std::find(target.preds.begin(), target.preds.end(), id) - target.preds.begin();
+      for (IrInst& phi : target.insts) {
+        if (phi.op != IrOp::phi) {
+          break;
+        }
+        IrValue& arg = phi.args[pred_index];
+        if (is_var(arg)) {
+          arg = current(arg.reg);
+        }
+      }
+    }
+    for (BlockId child : children[id]) {
+      walk.push_back({ child, 0, false });
+    }
+  }
+  fn.ssa = true;
+}
+
+// What a bin with one constant operand comes down to when the constant is the identity of the operator (x + 0, x * 1) or absorbs it
+// (x * 0). The optimisers leave those behind, e.g. strength reduction of a loop that counts from 0 by 1
+inline std::optional<IrValue> identity(const IrInst& inst)
+{
+  auto is = [](const IrValue& value, int64_t imm) { return value.is_imm() && value.imm == imm; };
+  switch (inst.bin) {
+  case BinOp::add:
+    return is(inst.b, 0) ? std::optional(inst.a) : is(inst.a, 0) ? std::optional(inst.b) : std::nullopt;
+  case BinOp::sub:
+    return is(inst.b, 0) ? std::optional(inst.a) : std::nullopt;
+  case BinOp::mul:
+    if (is(inst.a, 0) || is(inst.b, 0)) {
+      return IrValue::of_imm(0);
+    }
+    return is(inst.b, 1) ? std::optional(inst.a) : is(inst.a, 1) ? std::optional(inst.b) : std::nullopt;
+  case BinOp::div:
+    return is(inst.b, 1) ? std::optional(inst.a) : std::nullopt;
+  default:
+    return std::nullopt;
+  }
+}
+
+// Copy and constant propagation, folding and dead code removal on a function in SSA form. Returns the number of instructions removed
+inline size_t simplify_ssa(IrFunction& fn)
+{
+  assert(fn.ssa);
+  // replacement[v]: the value every use of v should read instead, none if v stays
+  std::vector<IrValue> replacement(fn.vreg_count);
+  auto resolve = [&](IrValue& value) {
+    while (value.is_reg() && replacement[value.reg].kind != IrValue::Kind::none) {
+      value = replacement[value.reg];
+    }
+  };
+
+  // Keep the instructions of `block` for which keep(inst) is true, keep may rewrite them
+  auto filter = [](IrBlock& block, auto&& keep) {
+    size_t kept = 0;
+    for (size_t i = 0; i < block.insts.size(); i++) {
+      if (keep(block.insts[i])) {
+        if (kept != i) {
+          block.insts[kept] = std::move(block.insts[i]);
+        }
+        kept++;
+      }
+    }
+    size_t removed = block.insts.size() - kept;
+    block.insts.resize(kept);
+    return removed;
+  };
+
+  size_t removed = 0;
+  size_t round = 1;
+  while (round > 0) {
+    round = 0;
+    for (IrBlock& block : fn.blocks) {
+      round += filter(block, [&](IrInst& inst) {
+        inst.for_each_use(resolve);
+        std::optional<IrValue> value;
+        if (inst.op == IrOp::mov) {
+          value = inst.a;
+        }
+        else if (inst.op == IrOp::bin && inst.a.is_imm() && inst.b.is_imm()) {
+          if (std::optional<int64_t> folded = ConstantFolder::evaluate(inst.bin, inst.a.imm, inst.b.imm)) {
+            value = IrValue::of_imm(folded.value());
+          }
+        }
+        else if (inst.op == IrOp::bin) {
+          value = identity(inst);
+        }
+        else if (inst.op == IrOp::phi) {
+          // a phi whose arguments are all the same value (or the phi itself, around a loop) is just that value
+          IrValue only {};
+          bool trivial = true;
+          for (const IrValue& arg : inst.args) {
+            if (arg == IrValue::of_reg(inst.dst) || arg == only) {
+              continue;
+            }
+            if (only.kind != IrValue::Kind::none) {
+              trivial = false;
+              break;
+            }
+            only = arg;
+          }
+          if (trivial && only.kind != IrValue::Kind::none) {
+            value = only;
+          }
+        }
+        if (!value.has_value()) {
+          return true;
+        }
+        replacement[inst.dst] = value.value();
+        return false;
+      });
+    }
+    removed += round;
+  }
+
+  // Instructions nobody reads, repeated because removing one can make its operands unused
+  std::vector<uint32_t> uses(fn.vreg_count, 0);
+  for (IrBlock& block : fn.blocks) {
+    for (IrInst& inst : block.insts) {
+      inst.for_each_use([&](IrValue& value) {
+        resolve(value);
+        if (value.is_reg()) {
+          uses[value.reg]++;
+        }
+      });
+    }
+  }
+  round = 1;
+  while (round > 0) {
+    round = 0;
+    for (IrBlock& block : fn.blocks) {
+      round += filter(block, [&](const IrInst& inst) {
+        if (inst.dst == no_vreg || uses[inst.dst] != 0 || inst.has_side_effects()) {
+          return true;
+        }
+        inst.for_each_use([&](const IrValue& value) {
+          if (value.is_reg()) {
+            uses[value.reg]--;
+          }
+        });
+        return false;
+      });
+    }
+    removed += round;
+  }
+  return removed;
+}
+
+// Emit `dst_i = src_i` for all i as if they happened at once, before the terminator of `block`
+inline void emit_parallel_copies(IrFunction& fn, IrBlock& block, std::vector<std::pair<Vreg, IrValue>> copies)
+{
+  std::erase_if(copies, [](const auto& copy) { return copy.second == IrValue::of_reg(copy.first); });
+  std::vector<IrInst> sequence;
+  while (!copies.empty()) {
+    // A copy whose destination no other pending copy still reads can go now
+    auto ready = std::find_if(copies.begin(), copies.end(), [&](const auto& copy) {
+      return std::none_of(copies.begin(), copies.end(), [&](const auto& other) { return other.second == IrValue::of_reg(copy.first); });
+    });
+    if (ready != copies.end()) {
+      sequence.push_back({ .op = IrOp::mov, .dst = ready->first, .a = ready->second });
+      copies.erase(ready);
+      continue;
+    }
+    // Only cycles are left: save one destination in a temporary and read that instead
+    Vreg saved = copies.front().first;
+    Vreg temp = fn.new_vreg();
+    sequence.push_back({ .op = IrOp::mov, .dst = temp, .a = IrValue::of_reg(saved) });
+    for (auto& copy : copies) {
+      if (copy.second == IrValue::of_reg(saved)) {
+        copy.second = IrValue::of_reg(temp);
+      }
+    }
+  }
+  block.insts.insert(block.insts.end() - 1, sequence.begin(), sequence.end());
+}
+
+inline void destruct_ssa(IrFunction& fn)
+{
+  assert(fn.ssa);
+  // Split the critical edges into blocks with phis, so the copies for one edge can't run on another
+  for (BlockId id = 0; id < fn.blocks.size(); id++) {
+    if (fn.blocks[id].insts.front().op != IrOp::phi || fn.blocks[id].preds.size() < 2) {
+      continue;
+    }
+    for (size_t i = 0; i < fn.blocks[id].preds.size(); i++) {
+      BlockId pred = fn.blocks[id].preds[i];
+      if (fn.blocks[pred].succs().size() < 2) {
+        continue;
+      }
+      BlockId split = fn.new_block();
+      fn.blocks[split].insts.push_back({ .op = IrOp::jmp, .target = { id, no_block } });
+      fn.blocks[split].preds.push_back(pred);
+      for (BlockId& target : fn.blocks[pred].terminator().target) {
+        if (target == id) {
+          target = split;
+        }
+      }
+      fn.blocks[id].preds[i] = split;
+    }
+  }
+
+  for (IrBlock& block : fn.blocks) {
+    size_t phi_count = 0;
+    while (phi_count < block.insts.size() && block.insts[phi_count].op == IrOp::phi) {
+      phi_count++;
+    }
+    if (phi_count == 0) {
+      continue;
+    }
+    for (size_t i = 0; i < block.preds.size(); i++) {
+      std::vector<std::pair<Vreg, IrValue>> copies;
+      for (size_t p = 0; p < phi_count; p++) {
+        copies.emplace_back(block.insts[p].dst, block.insts[p].args[i]);
+      }
+      emit_parallel_copies(fn, fn.blocks[block.preds[i]], std::move(copies));
+    }
+    block.insts.erase(block.insts.begin(), block.insts.begin() + static_cast<std::ptrdiff_t>(phi_count));
+  }
+  fn.ssa = false;
+  order_blocks(fn); // the split blocks go where they belong in the layout
+}
@@ -0,0 +1,84 @@
+// This file finds the else if chains that compare one variable against constants, `if (x == 1) {..} else if (x == 4) {..} else {..}`,
+// so the backends can dispatch on x directly instead of testing every case in turn: through a jump table when the constants are dense
+// enough, with a binary search over them when they are not.
+// The chain is only a switch when every condition is `x == K` or `K == x` for the same name x, K is an integer literal that fits in 32
+// bits (an immediate for cmp) and no K appears twice. It ends at the first else that isn't such an if, that else is the default.
+// Reading a variable has no side effects, so testing x once instead of once per case changes nothing but the time it takes.
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include "./ast.hpp"
+
+// Fewer cases than this stay a chain of compares, which is as fast as anything else for a handful
+inline constexpr size_t min_switch_cases = 4;
+
+struct SwitchCase {
+  int64_t value;
+  NodeIndex body; // the scope taken when x == value
+};
+
+struct SwitchChain {
+  SymbolId var;
+  std::vector<SwitchCase> cases {}; // sorted by value
+  NodeIndex otherwise = null_node; // the else after the last case: null_node, a scope, or an if that isn't part of the chain
+
+  // Whether the values are close enough together for a table with one entry per value between the smallest and largest, at least a
+  // quarter of them cases
+  [[nodiscard]] inline bool dense() const
+  {
+    auto span = static_cast<uint64_t>(cases.back().value - cases.front().value) + 1;
+    return span <= 4 * cases.size();
+  }
+};
+
+// The variable and constant of `x == K`, if the condition has that shape
+[[nodiscard]] inline std::optional<SwitchCase> switch_condition(const NodeProg& prog, NodeIndex cond, SymbolId& var)
+{
+  const Node& node = prog[cond];
+  if (node.kind != NodeKind::bin_expr || node.op != BinOp::eq) {
+    return {};
+  }
+  NodeIndex ident = prog[node.a].kind == NodeKind::ident ? node.a : node.b;
+  NodeIndex constant = ident == node.a ? node.b : node.a;
+  if (prog[ident].kind != NodeKind::ident || prog[constant].kind != NodeKind::int_lit) {
+    return {};
+  }
+  int64_t value = prog[constant].int_value();
+  if (value < INT32_MIN || value > INT32_MAX) {
+    return {};
+  }
+  var = prog[ident].a;
+  return SwitchCase { .value = value, .body = null_node };
+}
+
+// The switch that starts at the stmt_if `index`, if it is one
+[[nodiscard]] inline std::optional<SwitchChain> find_switch_chain(const NodeProg& prog, NodeIndex index)
+{
+  std::optional<SwitchChain> chain;
+  NodeIndex stmt = index;
+  while (stmt != null_node && prog[stmt].kind == NodeKind::stmt_if) {
+    SymbolId var = invalid_symbol;
+    std::optional<SwitchCase> test = switch_condition(prog, prog[stmt].a, var);
+    if (!test.has_value() || (chain.has_value() && var != chain->var)) {
+      break;
+    }
+    if (!chain.has_value()) {
+      chain = SwitchChain { .var = var };
+    }
+    chain->cases.push_back({ .value = test->value, .body = prog[stmt].b });
+    stmt = prog[stmt].c;
+  }
+  if (!chain.has_value() || chain->cases.size() < min_switch_cases) {
+    return {};
+  }
+  chain->otherwise = stmt;
+  std::sort(chain->cases.begin(), chain->cases.end(), [](const SwitchCase& a, const SwitchCase& b) { return a.value < b.value; });
+  auto same = [](const SwitchCase& a, const SwitchCase& b) { return a.value == b.value; };
+  if (std::adjacent_find(chain->cases.begin(), chain->cases.end(), same) != chain->cases.end()) {
+    return {}; // the later case is unreachable, leave the chain as it is written
+  }
+  return chain;
+}
@@ -0,0 +1,87 @@
+// This file defines the scoped symbol table the generator uses to resolve variables.
+// Every declaration is an entry on one stack of entries, `begin_scope` remembers where the stack was and `end_scope` pops back to it.
+// Each SymbolId also has a "head": the index of its innermost live entry, and every entry remembers the entry it shadows. Interned ids are
+// small and dense, so the heads are a flat array indexed by id: declare, lookup and pop are all O(1) with no hashing at all.
+// Shadowing works across nested scopes: `let x` in an inner scope hides the outer `x` until that scope ends. Only declaring the same name
+// twice in one scope is rejected.
+
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "./interner.hpp"
+
+template <typename T>
+class ScopedSymbolTable {
+public:
+  // Open a new (nested) scope
+  inline void begin_scope()
+  {
+    m_scopes.push_back(m_entries.size());
+  }
+
+  // Close the innermost scope, un-shadowing everything its declarations were hiding
+  inline void end_scope()
+  {
+    size_t mark = m_scopes.back();
+    while (m_entries.size() > mark) {
+      const Entry& entry = m_entries.back();
+      m_heads[entry.name] = entry.shadowed;
+      m_entries.pop_back();
+    }
+    m_scopes.pop_back();
+  }
+
+  // Returns false if `name` was already declared in the current scope
+  inline bool declare(SymbolId name, T value)
+  {
+    if (name >= m_heads.size()) {
+      m_heads.resize(name + 1, no_entry);
+    }
+    uint32_t head = m_heads[name];
+    if (head != no_entry && head >= current_scope_start()) {
+      return false;
+    }
+    m_heads[name] = static_cast<uint32_t>(m_entries.size());
+    m_entries.push_back({ .name = name, .shadowed = head, .value = std::move(value) });
+    return true;
+  }
+
+  // The innermost visible declaration of `name`, or nullptr if there is none
+  [[nodiscard]] inline const T* lookup(SymbolId name) const
+  {
+    if (name >= m_heads.size() || m_heads[name] == no_entry) {
+      return nullptr;
+    }
+    return &m_entries[m_heads[name]].value;
+  }
+
+  // Number of declarations in the innermost scope
+  [[nodiscard]] inline size_t scope_size() const
+  {
+    return m_entries.size() - current_scope_start();
+  }
+
+  // Number of visible declarations in all scopes
+  [[nodiscard]] inline size_t size() const
+  {
+    return m_entries.size();
+  }
+
+private:
+  static constexpr uint32_t no_entry = UINT32_MAX;
+
+  struct Entry {
+    SymbolId name;
+    uint32_t shadowed; // the entry this one hides, or no_entry
+    T value;
+  };
+
+  [[nodiscard]] inline size_t current_scope_start() const
+  {
+    return m_scopes.empty() ? 0 : m_scopes.back();
+  }
+
+  std::vector<Entry> m_entries {};
+  std::vector<uint32_t> m_heads {}; // indexed by SymbolId
+  std::vector<size_t> m_scopes {}; // where each open scope starts in m_entries
+};
@@ -0,0 +1,117 @@
+// This file finds the returns of a function that call the function itself, which the backends turn into jumps back to the top of the body
+// instead of calls, so the recursion runs in one frame:
+//   - `return f(a, b);` is a tail call: the arguments replace the parameters and the body starts over
+//   - `return x * f(a, b);` (or `+`, the call on either side) is accumulator recursion: the result of the call would only be combined with
+//     x, and since + and * are associative and commutative, also in 64-bit wrapping arithmetic, the x of every level can be folded into
+//     an accumulator on the way down instead: acc = acc * x, then the tail call. Every other return of the function returns acc * value.
+//     The accumulator starts at 0 for + and 1 for *, so the outermost call returns exactly what it did before
+// x has to be free of side effects, so it doesn't matter whether it is evaluated before or after the levels below it. A function only
+// gets an accumulator when all its accumulating returns use the same operator.
+
+#pragma once
+#include <cstdint>
+#include <optional>
+#include "./ast.hpp"
+
+struct SelfReturn {
+  enum class Kind : uint8_t {
+    plain, // anything else
+    tail_call, // return f(...)
+    accumulate, // return x op f(...)
+  };
+
+  Kind kind = Kind::plain;
+  NodeIndex call = null_node; // tail_call, accumulate: the func_call node
+  NodeIndex other = null_node; // accumulate: x
+  BinOp op = BinOp::add; // accumulate
+  bool call_first = false; // accumulate: the call is the lhs, it is evaluated before x
+};
+
+// What the value of `return value;` inside `function` is
+[[nodiscard]] inline SelfReturn classify_return(const NodeProg& prog, SymbolId function, NodeIndex value)
+{
+  const Node& node = prog[value];
+  auto is_self_call = [&](NodeIndex expr) { return prog[expr].kind == NodeKind::func_call && prog[expr].a == function; };
+  if (is_self_call(value)) {
+    return { .kind = SelfReturn::Kind::tail_call, .call = value };
+  }
+  if (node.kind != NodeKind::bin_expr || (node.op != BinOp::add && node.op != BinOp::mul)) {
+    return {};
+  }
+  if (is_self_call(node.b) && !has_side_effects(prog, node.a)) {
+    return { .kind = SelfReturn::Kind::accumulate, .call = node.b, .other = node.a, .op = node.op };
+  }
+  if (is_self_call(node.a) && !has_side_effects(prog, node.b)) {
+    return { .kind = SelfReturn::Kind::accumulate, .call = node.a, .other = node.b, .op = node.op, .call_first = true };
+  }
+  return {};
+}
+
+// How the returns of the function definition `func_def` call it
+struct SelfRecursion {
+  bool has_tail_calls = false; // any tail_call, or an accumulate that uses the accumulator
+  std::optional<BinOp> accumulator {}; // the operator of its accumulating returns, if they all agree
+
+  // Whether a return of this function takes part: its tail calls always do, accumulating returns only with the accumulator's operator
+  [[nodiscard]] inline bool uses(const SelfReturn& ret) const
+  {
+    return ret.kind == SelfReturn::Kind::tail_call || (ret.kind == SelfReturn::Kind::accumulate && accumulator == ret.op);
+  }
+};
+
+// The returns in statement `index` of `function`: whether one is a tail call, and in `ops` bit 0 if one accumulates with +, bit 1 with *
+inline void scan_self_returns(const NodeProg& prog, SymbolId function, NodeIndex index, bool& tail_calls, uint8_t& ops)
+{
+  if (index == null_node) {
+    return;
+  }
+  const Node& stmt = prog[index];
+  switch (stmt.kind) {
+  case NodeKind::scope:
+    for (NodeIndex child : prog.list(stmt.a)) {
+      scan_self_returns(prog, function, child, tail_calls, ops);
+    }
+    break;
+  case NodeKind::stmt_if:
+    scan_self_returns(prog, function, stmt.b, tail_calls, ops);
+    scan_self_returns(prog, function, stmt.c, tail_calls, ops);
+    break;
+  case NodeKind::stmt_while:
+    scan_self_returns(prog, function, stmt.b, tail_calls, ops);
+    break;
+  case NodeKind::stmt_for:
+    scan_self_returns(prog, function, prog.list(stmt.a)[3], tail_calls, ops);
+    break;
+  case NodeKind::stmt_return: {
+    SelfReturn ret = classify_return(prog, function, stmt.a);
+    if (ret.kind == SelfReturn::Kind::tail_call) {
+      tail_calls = true;
+    }
+    else if (ret.kind == SelfReturn::Kind::accumulate) {
+      ops |= ret.op == BinOp::add ? 1 : 2;
+    }
+    break;
+  }
+  default:
+    break; // a nested function definition has its own returns
+  }
+}
+
+[[nodiscard]] inline SelfRecursion find_self_recursion(const NodeProg& prog, const Node& func_def)
+{
+  bool tail_calls = false;
+  uint8_t ops = 0;
+  scan_self_returns(prog, func_def.a, func_def.c, tail_calls, ops);
+  SelfRecursion result { .has_tail_calls = tail_calls };
+  if (ops == 1 || ops == 2) {
+    result.accumulator = ops == 1 ? BinOp::add : BinOp::mul;
+    result.has_tail_calls = true;
+  }
+  return result;
+}
+
+// The value the accumulator starts with, the one that leaves the other operand as it is
+[[nodiscard]] inline int64_t accumulator_identity(BinOp op)
+{
+  return op == BinOp::mul ? 1 : 0;
+}
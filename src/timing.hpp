@@ -0,0 +1,156 @@
+// This file measures where a compilation spends its time, for --time-report.
+// The driver calls `PhaseClock::lap(name)` at the end of every phase. The phase gets the wall time since the previous lap and the CPU
+// time the process used in that interval, so the CPU column includes the codegen worker threads (and, with -j, whatever the other files
+// being compiled at the same time did). Lexing and parsing are one phase: the parser pulls tokens from the tokenizer as it goes.
+// Next to the phases a report has the sizes that usually explain them: tokens, AST nodes and the bytes the arenas handed out. Peak RSS
+// is a property of the process and is printed once, after all files.
+
+#pragma once
+#include <sys/resource.h>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct PhaseTime {
+  std::string_view name;
+  double wall_ms;
+  double cpu_ms;
+};
+
+struct TimeReport {
+  std::vector<PhaseTime> phases {};
+  uint64_t tokens = 0; // 0 when the parse came out of the cache
+  uint64_t nodes = 0; // 0 when the executable came out of the cache
+  uint64_t arena_bytes = 0;
+  uint64_t code_units = 0; // incremental builds: the main program and the functions, 0 otherwise
+  uint64_t reused_units = 0; // the ones whose machine code came out of the cache
+};
+
+// Splits the time since it was created into phases, does nothing when given no report to fill
+class PhaseClock {
+public:
+  inline explicit PhaseClock(TimeReport* report)
+    : m_report(report)
+  {
+    if (m_report != nullptr) {
+      m_wall = std::chrono::steady_clock::now();
+      m_cpu = cpu_now();
+    }
+  }
+
+  // End the phase `name` (a string literal, the report keeps the view)
+  inline void lap(std::string_view name)
+  {
+    if (m_report == nullptr) {
+      return;
+    }
+    auto wall = std::chrono::steady_clock::now();
+    double cpu = cpu_now();
+    m_report->phases.push_back(
+      { name, std::chrono::duration<double, std::milli>(wall - m_wall).count(), cpu - m_cpu });
+    m_wall = wall;
+    m_cpu = cpu;
+  }
+
+private:
+  // CPU time of the whole process so far, in milliseconds
+  static inline double cpu_now()
+  {
+    timespec now {};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return static_cast<double>(now.tv_sec) * 1e3 + static_cast<double>(now.tv_nsec) / 1e6;
+  }
+
+  TimeReport* m_report;
+  std::chrono::steady_clock::time_point m_wall {};
+  double m_cpu = 0;
+};
+
+// Peak resident set size of the process so far, in kilobytes
+inline uint64_t peak_rss_kb()
+{
+  rusage usage {};
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<uint64_t>(usage.ru_maxrss); // Linux reports kilobytes
+}
+
+// The reports of `files` as a table per file
+inline void print_time_report(std::ostream& out, std::span<const std::string> files, std::span<const TimeReport> reports)
+{
+  out << std::fixed << std::setprecision(3);
+  for (size_t i = 0; i < files.size(); i++) {
+    const TimeReport& report = reports[i];
+    out << "Time report for " << files[i] << "\n";
+    out << "  " << std::left << std::setw(12) << "phase" << std::right << std::setw(12) << "wall ms" << std::setw(12) << "cpu ms"
+        << "\n";
+    double wall = 0;
+    double cpu = 0;
+    for (const PhaseTime& phase : report.phases) {
+      out << "  " << std::left << std::setw(12) << phase.name << std::right << std::setw(12) << phase.wall_ms << std::setw(12)
+          << phase.cpu_ms << "\n";
+      wall += phase.wall_ms;
+      cpu += phase.cpu_ms;
+    }
+    out << "  " << std::left << std::setw(12) << "total" << std::right << std::setw(12) << wall << std::setw(12) << cpu << "\n";
+    out << "  " << report.tokens << " tokens, " << report.nodes << " AST nodes, " << report.arena_bytes << " arena bytes";
+    if (report.code_units > 0) {
+      out << ", " << report.reused_units << " of " << report.code_units << " code units reused";
+    }
+    out << "\n";
+  }
+  out << "Peak RSS " << peak_rss_kb() << " KB" << std::endl;
+}
+
+// Write `text` as a JSON string literal
+inline void print_json_string(std::ostream& out, std::string_view text)
+{
+  static constexpr char hex[] = "0123456789abcdef";
+  out << '"';
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    }
+    else if (static_cast<unsigned char>(c) < 0x20) {
+      out << "\\u00" << hex[c >> 4] << hex[c & 15];
+    }
+    else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+// The reports of `files` as one JSON object, for tools that track compile times:
+// {"files": [{"file": "a.hy", "phases": [{"name": "parse", "wall_ms": 1.5, "cpu_ms": 1.4}, ...], "total_wall_ms": ..., "total_cpu_ms": ...,
+//   "tokens": ..., "nodes": ..., "arena_bytes": ..., "code_units": ..., "reused_units": ...}, ...], "peak_rss_kb": ...}
+inline void print_time_report_json(std::ostream& out, std::span<const std::string> files, std::span<const TimeReport> reports)
+{
+  out << std::fixed << std::setprecision(3);
+  out << "{\"files\": [";
+  for (size_t i = 0; i < files.size(); i++) {
+    const TimeReport& report = reports[i];
+    out << (i == 0 ? "" : ", ") << "{\"file\": ";
+    print_json_string(out, files[i]);
+    out << ", \"phases\": [";
+    double wall = 0;
+    double cpu = 0;
+    for (size_t j = 0; j < report.phases.size(); j++) {
+      const PhaseTime& phase = report.phases[j];
+      out << (j == 0 ? "" : ", ") << "{\"name\": ";
+      print_json_string(out, phase.name);
+      out << ", \"wall_ms\": " << phase.wall_ms << ", \"cpu_ms\": " << phase.cpu_ms << "}";
+      wall += phase.wall_ms;
+      cpu += phase.cpu_ms;
+    }
+    out << "], \"total_wall_ms\": " << wall << ", \"total_cpu_ms\": " << cpu << ", \"tokens\": " << report.tokens
+        << ", \"nodes\": " << report.nodes << ", \"arena_bytes\": " << report.arena_bytes << ", \"code_units\": " << report.code_units
+        << ", \"reused_units\": " << report.reused_units << "}";
+  }
+  out << "], \"peak_rss_kb\": " << peak_rss_kb() << "}" << std::endl;
+}
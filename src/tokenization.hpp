@@ -25,9 +25,23 @@
 
 // These tokens represent the syntactic elements found in the source code, and are categorized based on their types, such as keywords, identifiers, operators, literals, and punctuation symbols. They are ready to be fed into the next stage of the compilation process, which is parsing.
 
+// Token values are `std::string_view`s into the source buffer (see source.hpp), so tokenizing an identifier or a literal doesn't allocate and
+// copying a Token around is as cheap as copying a couple of pointers.
+
 #pragma once // include the file only once
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <iostream>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
+#include "./error.hpp"
+#include "./interner.hpp"
+#include "./source.hpp"
 
 // Syntax
 enum class TokenType{
@@ -52,6 +66,8 @@ enum class TokenType{
   true_,
   false_,
   eq_eq, // ==
+  lt, // <
+  gt, // >
   and_and,  // for '&&' operator
   or_or,    // for '||' operator
   while_,
@@ -64,288 +80,389 @@ enum class TokenType{
   print,
 };
 
-// check the precedence of binary operators and return the precedence of each. Basically return the precedence of the operator
-std::optional<int> bin_prec(TokenType type){
-  switch (type) {
-  case TokenType::minus:
-  case TokenType::plus:
-    return 0;
-  case TokenType::fslash:
-  case TokenType::star:
-    return 1;
-  default:
-    return {}; // return null (not a binary operator)
-  }
-}
+// One past the last token type, for tables indexed by TokenType. `print` has to stay the last entry of the enum
+inline constexpr size_t token_type_count = static_cast<size_t>(TokenType::print) + 1;
 
 struct Token {
   TokenType type;
-  std::optional<std::string> value {};
+  std::optional<std::string_view> value {}; // points into the source buffer, which must outlive the token
+  SymbolId symbol = invalid_symbol; // interned name of an identifier
 };
 
+struct Keyword {
+  std::string_view spelling;
+  TokenType type;
+};
+
+// Reserved words
+inline constexpr Keyword keywords[] = {
+  { "exit", TokenType::exit },
+  { "let", TokenType::let },
+  { "if", TokenType::if_ },
+  { "else", TokenType::else_ },
+  { "true", TokenType::true_ },
+  { "false", TokenType::false_ },
+  { "while", TokenType::while_ },
+  { "for", TokenType::for_ },
+  { "function", TokenType::function },
+  { "return", TokenType::return_ },
+  { "print", TokenType::print },
+};
+
+// Perfect hash over the keywords: (length + 2 * second character) mod 16 gives every keyword its own slot, so recognising a keyword is one
+// table load and one compare against a single candidate. All keywords are 2 to 8 characters long, anything else can't be one.
+inline constexpr size_t keyword_min_len = 2;
+inline constexpr size_t keyword_max_len = 8;
+
+constexpr size_t keyword_hash(std::string_view word)
+{
+  return (word.size() + 2 * static_cast<unsigned char>(word[1])) & 15;
+}
+
+inline constexpr auto keyword_slots = [] {
+  std::array<int8_t, 16> slots {};
+  slots.fill(-1);
+  for (size_t i = 0; i < std::size(keywords); i++) {
+    size_t slot = keyword_hash(keywords[i].spelling);
+    if (slots[slot] != -1) {
+      throw "keyword_hash is no longer perfect for the keyword table"; // fails the constant evaluation
+    }
+    slots[slot] = static_cast<int8_t>(i);
+  }
+  return slots;
+}();
+
+inline std::optional<TokenType> keyword_type(std::string_view word)
+{
+  if (word.size() < keyword_min_len || word.size() > keyword_max_len) {
+    return {};
+  }
+  int8_t index = keyword_slots[keyword_hash(word)];
+  if (index < 0 || keywords[index].spelling != word) {
+    return {};
+  }
+  return keywords[index].type;
+}
+
+// What the tokenizer does with a byte is decided by one lookup in this table instead of a chain of comparisons
+enum class CharClass : uint8_t {
+  invalid,
+  space,
+  alpha,
+  digit,
+  quote,
+  slash,
+  eq,
+  amp,
+  pipe,
+  punct, // a single character token, see `punct_tokens`
+};
+
+inline constexpr auto char_classes = [] {
+  std::array<CharClass, 256> classes {};
+  classes.fill(CharClass::invalid);
+  for (unsigned char c : std::string_view(" \t\n\v\f\r")) {
+    classes[c] = CharClass::space;
+  }
+  for (int c = 'a'; c <= 'z'; c++) {
+    classes[c] = CharClass::alpha;
+    classes[c - 'a' + 'A'] = CharClass::alpha;
+  }
+  for (int c = '0'; c <= '9'; c++) {
+    classes[c] = CharClass::digit;
+  }
+  classes['"'] = CharClass::quote;
+  classes['/'] = CharClass::slash;
+  classes['='] = CharClass::eq;
+  classes['&'] = CharClass::amp;
+  classes['|'] = CharClass::pipe;
+  for (unsigned char c : std::string_view("();+*-{},<>")) {
+    classes[c] = CharClass::punct;
+  }
+  return classes;
+}();
+
+inline constexpr auto punct_tokens = [] {
+  std::array<TokenType, 256> types {};
+  types['('] = TokenType::open_paren;
+  types[')'] = TokenType::close_paren;
+  types[';'] = TokenType::semi;
+  types['+'] = TokenType::plus;
+  types['*'] = TokenType::star;
+  types['-'] = TokenType::minus;
+  types['{'] = TokenType::open_curly;
+  types['}'] = TokenType::close_curly;
+  types[','] = TokenType::comma;
+  types['<'] = TokenType::lt;
+  types['>'] = TokenType::gt;
+  return types;
+}();
+
 class Tokenizer {
 public:
-  inline explicit Tokenizer(std::string src)
-      : m_src(std::move(src))
+  inline explicit Tokenizer(std::string_view src, Interner& interner)
+      : m_src(src)
+      , m_interner(interner)
   {
   }
 
   inline std::vector<Token> tokenize()
-
   {
-    // token array
+    // token array, real programs average well over 4 bytes per token so this is usually the only allocation
     std::vector<Token> tokens;
-    std::string buf;
-    // loop until when we peek there is no more character
-    while (peek().has_value()) {
-      // inside the loop consume the tokens
-
-        // Handle Single-Line Comments
-      if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '/') {
-          consume(); // Consume first '/'
-          consume(); // Consume second '/'
-          while (peek().has_value() && peek().value() != '\n') {
-              consume(); // Consume characters until end of line
-          }
-          continue; // Skip to next iteration after comment
-      }
-      // Handle Block Comments
-      if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '*') {
-          consume(); // Consume '/'
-          consume(); // Consume '*'
-          while (peek().has_value() && !(peek().value() == '*' && peek(1).value() == '/')) {
-              consume(); // Consume characters inside comment block
-          } 
-          if (peek().has_value()) {
-              consume(); // Consume closing '*'
-              consume(); // Consume closing '/'
-          }
-          continue; // Skip to next iteration after comment
-      }
+    tokens.reserve(m_src.size() / 4 + 16);
+    Token token {};
+    while (next(token)) {
+      tokens.push_back(token);
+    }
+    m_index = 0;
+    return tokens;
+  }
 
-      // Check for '==' operator
-      if (peek().value() == '=' && peek(1).value() == '=') {
-          consume(); // Consume first '='
-          consume(); // Consume second '='
-          tokens.push_back({ .type = TokenType::eq_eq });
-          continue;
-      }
+  // Offset of the next byte the tokenizer will look at
+  [[nodiscard]] inline size_t position() const
+  {
+    return m_index;
+  }
+
+  // Lex the next token into `token`, returns false once the end of the source is reached
+  inline bool next(Token& token)
+  {
+    const char* const begin = m_src.data();
+    const char* const end = begin + m_src.size();
+    const char* p = begin + m_index;
 
-      // Check for '&&' operator
-      if (peek().value() == '&' && peek(1).value() == '&') {
-        consume(); // Consume first '&'
-        consume(); // Consume second '&'
-        tokens.push_back({ .type = TokenType::and_and });
+    while (p < end) {
+      const auto c = static_cast<unsigned char>(*p);
+      switch (char_classes[c]) {
+      case CharClass::space:
+        p++;
+        while (p < end && char_classes[static_cast<unsigned char>(*p)] == CharClass::space) {
+          p++;
+        }
         continue;
-      }
-      
-      // Handle string literals
-      if (peek() == '"') {
-          consume(); // Consume the opening quote
-          std::string str_val;
-          bool is_escaped = false; // Track escaped state
-
-          while (peek().has_value()) {
-              char current_char = peek();
-
-              if (is_escaped) {
-                  // Handle various escape sequences
-                  switch (current_char) {
-                      case 'n': str_val.push_back('\n'); break;
-                      case 't': str_val.push_back('\t'); break;
-                      case '"': str_val.push_back('"'); break;
-                      case '\\': str_val.push_back('\\'); break;
-                      // ... other escape sequences as needed ...
-                      default: 
-                          // Handle unknown escape sequences
-                          std::cerr << "Unknown escape sequence: \\" << current_char << std::endl;
-                          exit(EXIT_FAILURE);
-                  }
-                  consume(); // Consume the escaped character
-                  is_escaped = false; // Reset escaped state
-              } else {
-                  if (current_char == '\\') {
-                      is_escaped = true; // Next character is escaped
-                      consume(); // Consume the backslash
-                  } else if (current_char == '"') {
-                      consume(); // Consume the closing quote
-                      break; // End of string literal
-                  } else {
-                      str_val.push_back(current_char); // Add character to string
-                      consume(); // Consume the character
-                  }
-              }
-          }
 
-          if (!peek().has_value() || peek() != '"') {
-              // Handle error: unclosed string literal
-              std::cerr << "Syntax error: unclosed string literal" << std::endl;
-              exit(EXIT_FAILURE);
+      case CharClass::slash:
+        // Handle Single-Line Comments, jump straight to the end of the line
+        if (p + 1 < end && p[1] == '/') {
+          auto newline = static_cast<const char*>(memchr(p + 2, '\n', end - p - 2));
+          p = newline != nullptr ? newline + 1 : end;
+          continue;
+        }
+        // Handle Block Comments, jump from '*' to '*' until one is followed by '/'
+        if (p + 1 < end && p[1] == '*') {
+          const char* q = p + 2;
+          p = end;
+          while (q < end) {
+            auto star = static_cast<const char*>(memchr(q, '*', end - q));
+            if (star == nullptr) {
+              break;
+            }
+            if (star + 1 < end && star[1] == '/') {
+              p = star + 2;
+              break;
+            }
+            q = star + 1;
           }
+          continue;
+        }
+        return emit(token, TokenType::fslash, p + 1);
 
-          tokens.push_back({ .type = TokenType::string_lit, .value = str_val });
+      case CharClass::alpha: {
+        const char* start = p++;
+        // take all letters and digits, the word is a view into the source
+        while (p < end && (char_classes[static_cast<unsigned char>(*p)] == CharClass::alpha
+                           || char_classes[static_cast<unsigned char>(*p)] == CharClass::digit)) {
+          p++;
+        }
+        std::string_view word(start, p - start);
+        if (std::optional<TokenType> keyword = keyword_type(word)) {
+          return emit(token, keyword.value(), p);
+        }
+        // variable name
+        token = { .type = TokenType::ident, .value = word, .symbol = m_interner.intern(word) };
+        m_index = p - begin;
+        return true;
       }
 
-      // Check for '||' operator
-      if (peek().value() == '|' && peek(1).value() == '|') {
-        consume(); // Consume first '|'
-        consume(); // Consume second '|'
-        tokens.push_back({ .type = TokenType::or_or });
-        continue;
+      case CharClass::digit: {
+        const char* start = p++;
+        // take all digits
+        while (p < end && char_classes[static_cast<unsigned char>(*p)] == CharClass::digit) {
+          p++;
+        }
+        token = { .type = TokenType::int_lit, .value = std::string_view(start, p - start) };
+        m_index = p - begin;
+        return true;
       }
 
-      if (std::isalpha(peek().value())) {
-          buf.push_back(consume());
-          // put all letters in buffer
-          while (peek().has_value() && std::isalnum(peek().value())) {
-            buf.push_back(consume());
-          }
-          if (buf == "true") {
-            tokens.push_back({ .type = TokenType::true_ });
-            buf.clear();
-          } 
-          else if (buf == "false") {
-            tokens.push_back({ .type = TokenType::false_ });
-            buf.clear();
-          }
-          else if (buf == "exit") {
-            tokens.push_back({ .type = TokenType::exit });
-            buf.clear();
-          }
-          else if (buf == "let") {
-            tokens.push_back({ .type = TokenType::let });
-            buf.clear();
-          }
-          else if (buf == "if") {
-            tokens.push_back({ .type = TokenType::if_ });
-            buf.clear();
-          }
-          else if (buf == "else") {
-            tokens.push_back({ .type = TokenType::else_ });
-            buf.clear();
-          }
-          else if (buf == "else if") {
-            tokens.push_back({ .type = TokenType::else_if });
-            buf.clear();
-          }
-          else if (buf == "while") {
-            tokens.push_back({ .type = TokenType::while_ });
-            buf.clear();
-          }
-          else if (buf == "for") {
-            tokens.push_back({ .type = TokenType::for_ });
-            buf.clear();
-          }
-          else if (buf == "function") {
-            tokens.push_back({ .type = TokenType::function });
-            buf.clear();
-          }
-          else if (buf == "return") {
-            tokens.push_back({ .type = TokenType::return_ });
-            buf.clear();
-          }
-          else if (buf == "true" || buf == "false") {
-            TokenType type = (buf == "true") ? TokenType::true_ : TokenType::false_;
-            tokens.push_back({ .type = type });
-            buf.clear();
-          }
-          else if (buf == "print") {
-            tokens.push_back({ .type = TokenType::print });
-          }
-          else {
-            // variable name
-            tokens.push_back({ .type = TokenType::ident, .value = buf });
-            buf.clear();
-          }
-      }
-      // if not a letter, check if it is a digit
-      else if (std::isdigit(peek().value())) {
-        buf.push_back(consume());
-        // put all digits in buffer
-        while (peek().has_value() && std::isdigit(peek().value())) {
-          buf.push_back(consume());
+      case CharClass::quote:
+        // Handle string literals. The token keeps the raw text between the quotes (escape sequences included), the generator hands it
+        // to the assembler as-is so we never have to build a decoded copy
+        return lex_string(token, p + 1, end);
+
+      case CharClass::eq:
+        // Check for '==' operator
+        if (p + 1 < end && p[1] == '=') {
+          return emit(token, TokenType::eq_eq, p + 2);
         }
-        tokens.push_back({ .type = TokenType::int_lit, .value = buf });
-        buf.clear();
-      }
-      // if not a digit, check if it is a bracket of type (
-      else if (peek().value() == '(') {
-        consume();
-        tokens.push_back({ .type = TokenType::open_paren });
-      }
-      // if not a (, check if it is a bracket of type )
-      else if (peek().value() == ')') {
-        consume();
-        tokens.push_back({ .type = TokenType::close_paren });
-      }
-      // if not a ), check if it is a ;
-      else if (peek().value() == ';') {
-        consume();
-        tokens.push_back({ .type = TokenType::semi });
-      }
-      // if not a ;, check if it is a =
-      else if (peek().value() == '=') {
-        consume();
-        tokens.push_back({ .type = TokenType::eq });
-      }
-      else if (peek().value() == '+') {
-        consume();
-        tokens.push_back({ .type = TokenType::plus });
-      }
-      else if (peek().value() == '*') {
-        consume();
-        tokens.push_back({ .type = TokenType::star });
-      }
-      else if (peek().value() == '-') {
-        consume();
-        tokens.push_back({ .type = TokenType::minus });
-      }
-      else if (peek().value() == '/') {
-        consume();
-        tokens.push_back({ .type = TokenType::fslash });
-      }
-      else if (peek().value() == '{') {
-        consume();
-        tokens.push_back({ .type = TokenType::open_curly });
-      }
-      else if (peek().value() == '}') {
-        consume();
-        tokens.push_back({ .type = TokenType::close_curly });
-      }
-      else if (peek() == ',') {
-        consume();
-        tokens.push_back({ .type = TokenType::comma });
-      }
-      else if (std::isspace(peek().value())) {
-        consume();
-      } 
-      else {
-        std::cerr << "\033[31mSyntax error\033[0m" << std::endl;
-        exit(EXIT_FAILURE);
+        return emit(token, TokenType::eq, p + 1);
+
+      case CharClass::amp:
+        // Check for '&&' operator
+        if (p + 1 < end && p[1] == '&') {
+          return emit(token, TokenType::and_and, p + 2);
+        }
+        syntax_error();
+
+      case CharClass::pipe:
+        // Check for '||' operator
+        if (p + 1 < end && p[1] == '|') {
+          return emit(token, TokenType::or_or, p + 2);
+        }
+        syntax_error();
+
+      case CharClass::punct:
+        return emit(token, punct_tokens[c], p + 1);
+
+      case CharClass::invalid:
+        syntax_error();
       }
     }
-    m_index = 0;
-    return tokens;
+    m_index = m_src.size();
+    return false;
   }
 
 private:
-    // peak method
-    [[nodiscard]] inline std::optional<char> peek(int offset = 0) const
-    {
-        if (m_index + offset >= m_src.length()) {
-          return {};
+  inline bool emit(Token& token, TokenType type, const char* next)
+  {
+    token = { .type = type };
+    m_index = next - m_src.data();
+    return true;
+  }
+
+  // `p` points just past the opening quote. memchr finds the next quote, a quote only closes the literal if it isn't escaped, so the
+  // backslashes in between are checked (and validated) on the way
+  inline bool lex_string(Token& token, const char* p, const char* end)
+  {
+    const char* start = p;
+    while (true) {
+      auto quote = static_cast<const char*>(memchr(p, '"', end - p));
+      if (quote == nullptr) {
+        // Handle error: unclosed string literal
+        compile_error("Syntax error: unclosed string literal");
+      }
+      bool escaped = false;
+      for (auto slash = static_cast<const char*>(memchr(p, '\\', quote - p)); slash != nullptr;
+           slash = static_cast<const char*>(memchr(p, '\\', quote - p))) {
+        switch (slash[1]) {
+        case 'n':
+        case 't':
+        case '"':
+        case '\\':
+          break;
+        // ... other escape sequences as needed ...
+        default:
+          // Handle unknown escape sequences
+          compile_error("Unknown escape sequence: \\", slash[1]);
         }
-        else {
-          return m_src.at(m_index + offset); // not using [] to get type checking
+        p = slash + 2;
+        if (p > quote) {
+          // the quote we found was the escaped character
+          escaped = true;
+          break;
         }
+      }
+      if (!escaped) {
+        token = { .type = TokenType::string_lit, .value = std::string_view(start, quote - start) };
+        m_index = quote + 1 - m_src.data();
+        return true;
+      }
     }
+  }
 
-    // consume method
-    inline char consume()
-    {
-      return m_src.at(m_index++);
-    }
+  [[noreturn]] inline void syntax_error() const
+  {
+    compile_error("\033[31mSyntax error\033[0m");
+  }
 
-    const std::string m_src;
+    const std::string_view m_src;
+    Interner& m_interner;
     size_t m_index = 0;
-};
\ No newline at end of file
+};
+
+// Pull-based stream of tokens for the parser. Tokens are lexed on demand into a small ring buffer that holds just the lookahead the parser
+// needs, so the full token vector never exists. When the source is a mapped file the stream also keeps
+// the kernel reading ahead of the tokenizer and drops the pages it is done with.
+class TokenStream {
+public:
+  static constexpr size_t lookahead = 4; // power of two, must be more than the largest offset passed to peek() (3)
+
+  inline explicit TokenStream(Tokenizer& tokenizer, const SourceBuffer* source = nullptr)
+    : m_tokenizer(tokenizer)
+    , m_source(source)
+  {
+    if (m_source != nullptr) {
+      m_source->prefetch(0, 2 * window_size);
+    }
+  }
+
+  [[nodiscard]] inline std::optional<Token> peek(size_t offset = 0)
+  {
+    assert(offset < lookahead);
+    fill(offset + 1);
+    if (offset >= m_count) {
+      return {};
+    }
+    return m_ring[(m_head + offset) & (lookahead - 1)];
+  }
+
+  inline Token consume()
+  {
+    fill(1);
+    assert(m_count > 0 && "consume() past the end of the token stream");
+    Token token = m_ring[m_head];
+    m_head = (m_head + 1) & (lookahead - 1);
+    m_count--;
+    return token;
+  }
+
+  // How many tokens the tokenizer has produced so far
+  [[nodiscard]] inline size_t token_count() const
+  {
+    return m_lexed;
+  }
+
+private:
+  // how far the tokenizer gets before the window is moved along
+  static constexpr size_t window_size = 4 * 1024 * 1024;
+
+  inline void fill(size_t count)
+  {
+    while (m_count < count && !m_done) {
+      Token& slot = m_ring[(m_head + m_count) & (lookahead - 1)];
+      if (m_tokenizer.next(slot)) {
+        m_count++;
+        m_lexed++;
+      }
+      else {
+        m_done = true;
+      }
+    }
+    while (m_source != nullptr && m_tokenizer.position() >= m_window_end) {
+      // Everything a window behind is parsed: let go of it and start reading the next window
+      m_source->release_before(m_window_end - window_size);
+      m_source->prefetch(m_window_end + window_size, window_size);
+      m_window_end += window_size;
+    }
+  }
+
+  Tokenizer& m_tokenizer;
+  const SourceBuffer* m_source;
+  std::array<Token, lookahead> m_ring {};
+  size_t m_head = 0;
+  size_t m_count = 0;
+  size_t m_lexed = 0;
+  bool m_done = false;
+  size_t m_window_end = window_size;
+};
@@ -0,0 +1,510 @@
+// This file is the loop vectoriser of the -O2 pipeline, on a function in SSA form after the loop optimisations (loops.hpp).
+// It takes the counted loops that only add things up: a loop of one block (the lowering rotates a for loop into one when its body has no
+// control flow) whose phis are all induction variables or sums, one induction variable stepping by a constant against an invariant
+// bound decides when it ends, and whatever goes into the sums is + - * of the induction variables and invariants. Every sum becomes a
+// vector_sum that the emitter runs over 2 (SSE2) or 4 (AVX2) iterations at a time, the induction variables jump straight to where
+// those iterations leave them, and the loop itself stays as it was to run the rest:
+//   preheader:  br i0 < bound, guard, rest                      (bound < i0 for a loop counting down)
+//   guard:      d = bound - i0, br d > lanes * step * min_vector_trips, vector, rest
+//   vector:     k = (d - 1) / (lanes * step) * lanes, every induction variable += k * its step, every sum = vector_sum(sum, k, ...)
+//   rest:       the phis of the header for the values coming in from the three of them, then jmp header
+// k leaves at least one iteration to the scalar loop. 64-bit arithmetic wraps the same way in every lane and in any order, so the sums
+// come out the same as one element at a time. A vector_sum has no multiply of 64-bit lanes to use (that is AVX-512), the emitter builds
+// one from 32-bit multiplies, and the cost estimate leaves the loops that makes slower than they were as they are.
+
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include "./ir.hpp"
+#include "./loops.hpp"
+
+class LoopVectorizer {
+public:
+  inline LoopVectorizer(IrFunction& fn, VectorIsa isa)
+    : m_fn(fn)
+    , m_isa(isa)
+  {
+  }
+
+  // Returns the number of loops vectorised
+  inline size_t run()
+  {
+    assert(m_fn.ssa);
+    if (m_isa == VectorIsa::none) {
+      return 0;
+    }
+    std::vector<IrLoop> loops = find_loops(m_fn);
+    m_def_block.assign(m_fn.vreg_count, no_block);
+    for (BlockId id = 0; id < m_fn.blocks.size(); id++) {
+      for (const IrInst& inst : m_fn.blocks[id].insts) {
+        if (inst.dst != no_vreg) {
+          m_def_block[inst.dst] = id;
+        }
+      }
+    }
+    size_t vectorized = 0;
+    for (const IrLoop& loop : loops) {
+      if (loop.blocks.size() == 1 && vectorize(loop)) {
+        vectorized++;
+      }
+    }
+    return vectorized;
+  }
+
+private:
+  // The vector loop only runs when it gets to go around at least this many times, below that setting it up costs more than it saves
+  static constexpr int64_t min_vector_trips = 4;
+  // The step of the induction variable that ends the loop, bigger ones could overflow lanes * step * min_vector_trips
+  static constexpr int64_t max_step = int64_t { 1 } << 24;
+  // Bigger loops won't fit in the vector registers anyway, and TermBuilder goes as deep as the chain of instructions it follows
+  static constexpr size_t max_loop_size = 256;
+
+  // A header phi: an induction variable (next = phi + step, step invariant) or a sum (next = phi + the value of the iteration)
+  struct Recurrence {
+    Vreg phi;
+    Vreg next;
+    IrValue init; // from the preheader
+    IrValue step; // inductions: what every iteration adds, negate it for a sub
+    BinOp op; // inductions: add or sub
+    bool induction;
+  };
+
+  [[nodiscard]] inline bool is_invariant(const IrLoop& loop, const IrValue& value) const
+  {
+    if (!value.is_reg()) {
+      return true;
+    }
+    BlockId block = value.reg < m_def_block.size() ? m_def_block[value.reg] : no_block;
+    return block == no_block || block >= loop.contains.size() || loop.contains[block] == 0;
+  }
+
+  inline Vreg new_vreg(BlockId block)
+  {
+    m_def_block.push_back(block);
+    return m_fn.new_vreg();
+  }
+
+  [[nodiscard]] inline const IrInst* definition(const IrLoop& loop, const IrValue& value) const
+  {
+    if (is_invariant(loop, value)) {
+      return nullptr;
+    }
+    for (const IrInst& inst : m_fn.blocks[loop.header].insts) {
+      if (inst.dst == value.reg) {
+        return &inst;
+      }
+    }
+    return nullptr;
+  }
+
+  // What one iteration costs: every instruction but the phis and the moves the register allocator coalesces
+  static inline int64_t scalar_cost(const IrBlock& block)
+  {
+    return std::count_if(block.insts.begin(), block.insts.end(), [](const IrInst& inst) {
+      return inst.op != IrOp::phi && inst.op != IrOp::mov;
+    });
+  }
+
+  // What one trip of the vector loop of `body` costs in instructions, see IrEmitter::emit_vector_sum. SSE2 has to copy the operand it
+  // overwrites first, a multiply of 64-bit lanes is three 32-bit multiplies and the shifts and adds that put them together
+  [[nodiscard]] inline int64_t vector_cost(const IrVectorLoop& body) const
+  {
+    bool sse2 = m_isa == VectorIsa::sse2;
+    int64_t cost = 3; // the sum, the down counter and the branch
+    for (const IrVectorTerm& term : body.terms) {
+      if (term.kind == IrVectorTerm::Kind::induction) {
+        cost += 1;
+      }
+      else if (term.kind == IrVectorTerm::Kind::bin) {
+        int64_t multiply = term.a == term.b ? (sse2 ? 7 : 5) : (sse2 ? 11 : 8); // a square needs one cross product
+        cost += term.bin == BinOp::mul ? multiply : sse2 ? 2 : 1;
+      }
+    }
+    return cost;
+  }
+
+  // The header phis as recurrences: an induction variable when every trip adds (or subtracts) the same invariant, a sum otherwise, which
+  // TermBuilder::sum has the last word on. None if a phi gets the same value on every trip
+  [[nodiscard]] inline std::optional<std::vector<Recurrence>> find_recurrences(const IrLoop& loop, size_t preheader_index) const
+  {
+    std::vector<Recurrence> recurrences;
+    for (const IrInst& phi : m_fn.blocks[loop.header].insts) {
+      if (phi.op != IrOp::phi) {
+        break;
+      }
+      IrValue self = IrValue::of_reg(phi.dst);
+      const IrValue& next = phi.args[1 - preheader_index];
+      if (is_invariant(loop, next)) {
+        return std::nullopt;
+      }
+      Recurrence r {
+        .phi = phi.dst, .next = next.reg, .init = phi.args[preheader_index], .step = {}, .op = BinOp::add, .induction = false
+      };
+      const IrInst* update = definition(loop, next);
+      bool add_or_sub = update != nullptr && update->op == IrOp::bin && (update->bin == BinOp::add || update->bin == BinOp::sub);
+      if (add_or_sub && update->a == self && is_invariant(loop, update->b)) {
+        r = { .phi = r.phi, .next = r.next, .init = r.init, .step = update->b, .op = update->bin, .induction = true };
+      }
+      else if (add_or_sub && update->bin == BinOp::add && update->b == self && is_invariant(loop, update->a)) {
+        r = { .phi = r.phi, .next = r.next, .init = r.init, .step = update->a, .op = BinOp::add, .induction = true };
+      }
+      recurrences.push_back(r);
+    }
+    return recurrences;
+  }
+
+  // Builds the terms of one sum, a loop value at a time. Only + - * of inductions and invariants can be in it, anything else (another
+  // sum, a comparison) fails it
+  class TermBuilder {
+  public:
+    inline TermBuilder(const LoopVectorizer& vectorizer, const IrLoop& loop, const std::vector<Recurrence>& recurrences,
+      const std::vector<IrValue>& steps)
+      : m_vectorizer(vectorizer)
+      , m_loop(loop)
+      , m_recurrences(recurrences)
+      , m_steps(steps)
+    {
+    }
+
+    // The term of `value`, none if it can't be one
+    inline std::optional<uint32_t> term(const IrValue& value)
+    {
+      if (m_vectorizer.is_invariant(m_loop, value)) {
+        return add_term({ .kind = IrVectorTerm::Kind::invariant, .a = arg(value) });
+      }
+      if (auto known = m_terms.find(value.reg); known != m_terms.end()) {
+        return known->second;
+      }
+      // The next value of an induction variable is the add or sub that makes it, like any other one
+      std::optional<uint32_t> result;
+      for (size_t i = 0; i < m_recurrences.size(); i++) {
+        const Recurrence& r = m_recurrences[i];
+        if (!r.induction && (r.phi == value.reg || r.next == value.reg)) {
+          return std::nullopt;
+        }
+        if (r.phi == value.reg) {
+          result = add_term({ .kind = IrVectorTerm::Kind::induction, .a = arg(r.init), .b = arg(m_steps[i]) });
+        }
+      }
+      if (!result.has_value()) {
+        const IrInst* inst = m_vectorizer.definition(m_loop, value);
+        if (inst != nullptr && inst->op == IrOp::mov) {
+          result = term(inst->a);
+        }
+        else if (inst != nullptr && inst->op == IrOp::bin
+          && (inst->bin == BinOp::add || inst->bin == BinOp::sub || inst->bin == BinOp::mul)) {
+          std::optional<uint32_t> lhs = term(inst->a);
+          std::optional<uint32_t> rhs = lhs.has_value() ? term(inst->b) : std::nullopt;
+          if (rhs.has_value()) {
+            result = add_term({ .kind = IrVectorTerm::Kind::bin, .bin = inst->bin, .a = lhs.value(), .b = rhs.value() });
+          }
+        }
+      }
+      if (result.has_value()) {
+        m_terms.emplace(value.reg, result.value());
+      }
+      return result;
+    }
+
+    // What sum `r` adds up: the term of what its update adds to its phi (or subtracts, then the BinOp is sub). The update can be any
+    // chain of adds and subs that the phi is on once and isn't subtracted on, `s = s - a + b` adds b - a
+    inline std::optional<std::pair<uint32_t, BinOp>> sum(const Recurrence& r)
+    {
+      std::optional<Partial> partial = contribution(IrValue::of_reg(r.next), r.phi);
+      if (!partial.has_value() || !partial->term.has_value()) {
+        return std::nullopt;
+      }
+      return std::pair { partial->term.value(), partial->negated ? BinOp::sub : BinOp::add };
+    }
+
+    [[nodiscard]] inline std::vector<IrVectorTerm>& terms()
+    {
+      return m_body;
+    }
+
+    [[nodiscard]] inline std::vector<IrValue>& args()
+    {
+      return m_args;
+    }
+
+  private:
+    // What a value on the chain from the phi of a sum to its update adds to the phi, or subtracts from it when `negated`. The phi itself
+    // adds nothing, it has no term
+    struct Partial {
+      std::optional<uint32_t> term;
+      bool negated;
+    };
+
+    inline std::optional<Partial> contribution(const IrValue& value, Vreg phi)
+    {
+      if (value == IrValue::of_reg(phi)) {
+        return Partial { .term = std::nullopt, .negated = false };
+      }
+      const IrInst* inst = m_vectorizer.definition(m_loop, value);
+      if (inst != nullptr && inst->op == IrOp::mov) {
+        return contribution(inst->a, phi);
+      }
+      if (inst == nullptr || inst->op != IrOp::bin || (inst->bin != BinOp::add && inst->bin != BinOp::sub)) {
+        return std::nullopt;
+      }
+      // The phi on both sides would be added twice, x - phi negates it
+      bool left = reaches(inst->a, phi);
+      bool right = reaches(inst->b, phi);
+      if (left == right || (right && inst->bin == BinOp::sub)) {
+        return std::nullopt;
+      }
+      std::optional<Partial> chain = contribution(left ? inst->a : inst->b, phi);
+      std::optional<uint32_t> other = chain.has_value() ? term(left ? inst->b : inst->a) : std::nullopt;
+      if (!other.has_value()) {
+        return std::nullopt;
+      }
+      bool subtract = inst->bin == BinOp::sub;
+      if (!chain->term.has_value()) {
+        return Partial { .term = other, .negated = subtract };
+      }
+      // x + o, x - o, -x + o = o - x, -x - o = -(x + o)
+      uint32_t so_far = chain->term.value();
+      auto bin = [&](BinOp op, uint32_t a, uint32_t b) { return add_term({ .kind = IrVectorTerm::Kind::bin, .bin = op, .a = a, .b = b }); };
+      if (!chain->negated) {
+        return Partial { .term = bin(subtract ? BinOp::sub : BinOp::add, so_far, other.value()), .negated = false };
+      }
+      if (subtract) {
+        return Partial { .term = bin(BinOp::add, so_far, other.value()), .negated = true };
+      }
+      return Partial { .term = bin(BinOp::sub, other.value(), so_far), .negated = false };
+    }
+
+    // Whether `value` is computed from `phi` inside the loop
+    inline bool reaches(const IrValue& value, Vreg phi)
+    {
+      if (value == IrValue::of_reg(phi)) {
+        return true;
+      }
+      const IrInst* inst = m_vectorizer.definition(m_loop, value);
+      if (inst == nullptr || inst->op == IrOp::phi) {
+        return false;
+      }
+      if (auto known = m_reaches.find(value.reg); known != m_reaches.end()) {
+        return known->second;
+      }
+      bool found = false;
+      inst->for_each_use([&](const IrValue& use) { found = found || reaches(use, phi); });
+      m_reaches.emplace(value.reg, found);
+      return found;
+    }
+
+    inline uint32_t arg(const IrValue& value)
+    {
+      auto it = std::find(m_args.begin(), m_args.end(), value);
+      if (it == m_args.end()) {
+        m_args.push_back(value);
+        return static_cast<uint32_t>(m_args.size() - 1);
+      }
+      return static_cast<uint32_t>(it - m_args.begin());
+    }
+
+    // The same invariant or induction twice is one term
+    inline uint32_t add_term(const IrVectorTerm& term)
+    {
+      if (term.kind != IrVectorTerm::Kind::bin) {
+        for (uint32_t i = 0; i < m_body.size(); i++) {
+          if (m_body[i].kind == term.kind && m_body[i].a == term.a && m_body[i].b == term.b) {
+            return i;
+          }
+        }
+      }
+      m_body.push_back(term);
+      return static_cast<uint32_t>(m_body.size() - 1);
+    }
+
+    const LoopVectorizer& m_vectorizer;
+    const IrLoop& m_loop;
+    const std::vector<Recurrence>& m_recurrences;
+    const std::vector<IrValue>& m_steps;
+    std::unordered_map<Vreg, uint32_t> m_terms {}; // loop values already turned into terms
+    std::unordered_map<Vreg, bool> m_reaches {}; // see reaches, for the sum being built
+    std::vector<IrVectorTerm> m_body {};
+    std::vector<IrValue> m_args {};
+  };
+
+  inline bool vectorize(const IrLoop& loop)
+  {
+    BlockId header_id = loop.header;
+    const IrBlock& header = m_fn.blocks[header_id];
+    const IrInst& branch = header.terminator();
+    if (header.insts.size() > max_loop_size || header.preds.size() != 2 || branch.op != IrOp::br || branch.target[0] != header_id
+      || branch.target[1] == header_id) {
+      return false;
+    }
+    size_t preheader_index = header.preds[0] == loop.preheader ? 0 : 1;
+    // Nothing in it may write anything, fault or call, no iteration the vector loop takes over may be left out of what the program does
+    for (const IrInst& inst : header.insts) {
+      bool pure = inst.op == IrOp::phi || inst.op == IrOp::mov || inst.op == IrOp::br || (inst.op == IrOp::bin && inst.bin != BinOp::div);
+      if (!pure) {
+        return false;
+      }
+    }
+    std::optional<std::vector<Recurrence>> recurrences = find_recurrences(loop, preheader_index);
+    if (!recurrences.has_value()) {
+      return false;
+    }
+
+    // The branch: the counter's next value against the bound, `counter < bound` counting up or `counter > bound` counting down
+    const IrInst* condition = definition(loop, branch.a);
+    if (condition == nullptr || condition->op != IrOp::bin || (condition->bin != BinOp::lt && condition->bin != BinOp::gt)) {
+      return false;
+    }
+    const Recurrence* counter = nullptr;
+    int64_t step = 0;
+    IrValue bound {};
+    for (const Recurrence& r : recurrences.value()) {
+      if (!r.induction || !r.step.is_imm() || std::abs(r.step.imm) >= max_step || r.step.imm == 0) {
+        continue;
+      }
+      int64_t by = r.op == BinOp::add ? r.step.imm : -r.step.imm;
+      bool counter_left = condition->a == IrValue::of_reg(r.next) && is_invariant(loop, condition->b);
+      bool counter_right = condition->b == IrValue::of_reg(r.next) && is_invariant(loop, condition->a);
+      // the loop goes on while the counter is below the bound when counting up, above it when counting down
+      bool below = (condition->bin == BinOp::lt) == counter_left;
+      if ((counter_left || counter_right) && (by > 0) == below) {
+        counter = &r;
+        step = by;
+        bound = counter_left ? condition->b : condition->a;
+        break;
+      }
+    }
+    if (counter == nullptr) {
+      return false;
+    }
+
+    // What every induction variable adds on an iteration, a sub by a register is an add of its negation, computed before the vector loop.
+    // The new blocks go at the end
+    int64_t scalar = scalar_cost(header);
+    BlockId preheader = loop.preheader;
+    BlockId guard = static_cast<BlockId>(m_fn.blocks.size());
+    BlockId vector = guard + 1;
+    BlockId rest = guard + 2;
+    auto emit = [&](BlockId block, IrInst inst) {
+      if (inst.dst != no_vreg) {
+        m_def_block[inst.dst] = block;
+      }
+      m_fn.blocks[block].insts.push_back(std::move(inst));
+    };
+    auto bin = [&](BlockId block, BinOp op, IrValue a, IrValue b) {
+      Vreg dst = new_vreg(block);
+      emit(block, { .op = IrOp::bin, .bin = op, .dst = dst, .a = a, .b = b });
+      return IrValue::of_reg(dst);
+    };
+    std::vector<IrValue> steps;
+    std::vector<IrInst> negations;
+    for (const Recurrence& r : recurrences.value()) {
+      if (!r.induction || r.op == BinOp::add) {
+        steps.push_back(r.step);
+      }
+      else if (r.step.is_imm()) {
+        steps.push_back(IrValue::of_imm(static_cast<int64_t>(0 - static_cast<uint64_t>(r.step.imm))));
+      }
+      else {
+        Vreg negated = new_vreg(vector);
+        negations.push_back({ .op = IrOp::bin, .bin = BinOp::sub, .dst = negated, .a = IrValue::of_imm(0), .b = r.step });
+        steps.push_back(IrValue::of_reg(negated));
+      }
+    }
+
+    // One vector_sum per sum
+    std::vector<IrVectorLoop> bodies;
+    std::vector<std::vector<IrValue>> args;
+    int64_t cost = 0;
+    for (const Recurrence& r : recurrences.value()) {
+      if (r.induction) {
+        continue;
+      }
+      TermBuilder builder(*this, loop, recurrences.value(), steps);
+      std::optional<std::pair<uint32_t, BinOp>> sum = builder.sum(r);
+      if (!sum.has_value()) {
+        break;
+      }
+      bodies.push_back({ .isa = m_isa, .reduce = sum->second, .terms = std::move(builder.terms()), .value = sum->first });
+      args.push_back(std::move(builder.args()));
+      cost += vector_cost(bodies.back());
+    }
+    size_t sums = std::count_if(recurrences->begin(), recurrences->end(), [](const Recurrence& r) { return !r.induction; });
+    int64_t lanes = vector_lanes(m_isa);
+    bool fits = std::all_of(bodies.begin(), bodies.end(), [](const IrVectorLoop& body) { return body.register_count() <= 16; });
+    if (sums == 0 || bodies.size() != sums || !fits || cost >= scalar * lanes) {
+      return false;
+    }
+    m_fn.new_block();
+    m_fn.new_block();
+    m_fn.new_block();
+
+    // preheader: only with the counter on the right side of the bound is the distance between them meaningful
+    const IrValue& start = counter->init;
+    IrBlock& pre = m_fn.blocks[preheader];
+    pre.insts.pop_back();
+    IrValue entered = bin(preheader, step > 0 ? BinOp::lt : BinOp::gt, start, bound);
+    emit(preheader, { .op = IrOp::br, .a = entered, .target = { guard, rest } });
+
+    // guard: far enough from the bound for the vector loop
+    int64_t stride = std::abs(step) * lanes;
+    IrValue distance = step > 0 ? bin(guard, BinOp::sub, bound, start) : bin(guard, BinOp::sub, start, bound);
+    IrValue worth = bin(guard, BinOp::gt, distance, IrValue::of_imm(stride * min_vector_trips));
+    emit(guard, { .op = IrOp::br, .a = worth, .target = { vector, rest } });
+
+    // vector: k iterations, a multiple of the lanes, leaving at least one to the loop
+    IrValue last = bin(vector, BinOp::sub, distance, IrValue::of_imm(1));
+    IrValue trips = bin(vector, BinOp::div, last, IrValue::of_imm(stride));
+    IrValue iterations = bin(vector, BinOp::mul, trips, IrValue::of_imm(lanes));
+    for (IrInst& negation : negations) {
+      emit(vector, std::move(negation));
+    }
+    std::vector<IrValue> results;
+    size_t body = 0;
+    for (size_t i = 0; i < recurrences->size(); i++) {
+      const Recurrence& r = recurrences.value()[i];
+      if (r.induction) {
+        results.push_back(bin(vector, BinOp::add, r.init, bin(vector, BinOp::mul, iterations, steps[i])));
+        continue;
+      }
+      Vreg sum = new_vreg(vector);
+      emit(vector, { .op = IrOp::vector_sum, .dst = sum, .a = r.init, .b = iterations,
+        .index = static_cast<uint32_t>(m_fn.vector_loops.size()), .args = std::move(args[body]) });
+      m_fn.vector_loops.push_back(std::move(bodies[body++]));
+      results.push_back(IrValue::of_reg(sum));
+    }
+    emit(vector, { .op = IrOp::jmp, .target = { rest, no_block } });
+
+    // rest: the loop starts from wherever the vector loop left off, or from the beginning when it didn't run
+    IrBlock& loop_header = m_fn.blocks[header_id];
+    for (size_t i = 0; i < recurrences->size(); i++) {
+      const Recurrence& r = recurrences.value()[i];
+      Vreg value = new_vreg(rest);
+      emit(rest, { .op = IrOp::phi, .dst = value, .args = { r.init, r.init, results[i] } });
+      for (IrInst& phi : loop_header.insts) {
+        if (phi.dst == r.phi) {
+          phi.args[preheader_index] = IrValue::of_reg(value);
+        }
+      }
+    }
+    emit(rest, { .op = IrOp::jmp, .target = { header_id, no_block } });
+    loop_header.preds[preheader_index] = rest;
+    m_fn.blocks[guard].preds = { preheader };
+    m_fn.blocks[vector].preds = { guard };
+    m_fn.blocks[rest].preds = { preheader, guard, vector };
+    return true;
+  }
+
+  IrFunction& m_fn;
+  VectorIsa m_isa;
+  std::vector<BlockId> m_def_block {}; // by vreg, no_block for the ones nothing defines
+};
+
+inline size_t vectorize_loops(IrFunction& fn, VectorIsa isa)
+{
+  return LoopVectorizer(fn, isa).run();
+}
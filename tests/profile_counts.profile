@@ -0,0 +1,6 @@
+site                             calls/entries    iter/false
+_start                                       1             -
+_start loop 1                                1            10
+collatz                                     10             -
+collatz loop 1                              10            67
+collatz if 2                                50            17
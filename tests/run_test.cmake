@@ -0,0 +1,62 @@
+# Compile one program with HYDRO at LEVEL, run it and compare what it prints with the .expected file next to it:
+# cmake -DHYDRO=<hydro> -DSOURCE=<program.hy> -DLEVEL=<-O0|-O1|-O2> -DOUTPUT=<executable> -P run_test.cmake
+# A program can ask for more next to it:
+# - a line `// flags: <hydro options>` in it adds the options to every compile
+# - <name>.profile: it is built with -fprofile as well, and what --show-profile prints (without the cycles, which vary) has to be that
+# - <name>.before: an earlier version of the program, built first into a cache of its own that the program is then built with, at
+#   least one code unit has to be reused from it (the incremental build only generates what changed)
+string(REGEX REPLACE "\\.hy$" "" base ${SOURCE})
+file(STRINGS ${SOURCE} flag_lines REGEX "^// flags: ")
+set(flags "")
+foreach(line ${flag_lines})
+  string(REGEX REPLACE "^// flags: " "" line "${line}")
+  separate_arguments(line_flags UNIX_COMMAND "${line}")
+  list(APPEND flags ${line_flags})
+endforeach()
+
+set(cache_flags --no-cache)
+if(EXISTS ${base}.before)
+  file(REMOVE_RECURSE ${OUTPUT}.cache)
+  set(cache_flags --cache-dir=${OUTPUT}.cache)
+  configure_file(${base}.before ${OUTPUT}.before.hy COPYONLY)
+  execute_process(COMMAND ${HYDRO} ${cache_flags} ${LEVEL} ${flags} -o ${OUTPUT}.before ${OUTPUT}.before.hy
+    RESULT_VARIABLE status ERROR_VARIABLE errors)
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "hydro ${LEVEL} ${base}.before failed (${status}): ${errors}")
+  endif()
+  list(APPEND flags --time-report)
+endif()
+if(EXISTS ${base}.profile)
+  list(APPEND flags -fprofile=${OUTPUT}.prof)
+endif()
+
+execute_process(COMMAND ${HYDRO} ${cache_flags} ${LEVEL} ${flags} -o ${OUTPUT} ${SOURCE} RESULT_VARIABLE status ERROR_VARIABLE errors)
+if(NOT status EQUAL 0)
+  message(FATAL_ERROR "hydro ${LEVEL} ${SOURCE} failed (${status}): ${errors}")
+endif()
+if(EXISTS ${base}.before)
+  if(NOT errors MATCHES ", [1-9][0-9]* of [0-9]+ code units reused")
+    message(FATAL_ERROR "The build of ${SOURCE} after ${base}.before reused no code units:\n${errors}")
+  endif()
+endif()
+execute_process(COMMAND ${OUTPUT} RESULT_VARIABLE status OUTPUT_VARIABLE output)
+if(NOT status EQUAL 0)
+  message(FATAL_ERROR "${OUTPUT} exited with ${status}")
+endif()
+file(READ ${base}.expected expected)
+if(NOT output STREQUAL expected)
+  message(FATAL_ERROR "${OUTPUT} printed\n${output}\ninstead of\n${expected}")
+endif()
+
+if(EXISTS ${base}.profile)
+  execute_process(COMMAND ${HYDRO} --show-profile=${OUTPUT}.prof RESULT_VARIABLE status OUTPUT_VARIABLE profile ERROR_VARIABLE errors)
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "hydro --show-profile=${OUTPUT}.prof failed (${status}): ${errors}")
+  endif()
+  string(REGEX REPLACE " +[0-9-]+\n" "\n" profile "${profile}") # the cycles column
+  string(REGEX REPLACE " +cycles\n" "\n" profile "${profile}")
+  file(READ ${base}.profile expected)
+  if(NOT profile STREQUAL expected)
+    message(FATAL_ERROR "The profile of ${OUTPUT} was\n${profile}\ninstead of\n${expected}")
+  endif()
+endif()